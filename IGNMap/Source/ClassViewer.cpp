@@ -236,6 +236,8 @@ void ClassViewer::actionListenerCallback(const juce::String& message)
 	if (message == "UpdateObjectVisibility") {
 		for (int i = 0; i < T.size(); i++)
 			T[i]->Visible(!T[i]->Visible());
+		if (m_Model.GetClass() != nullptr)
+			m_Model.GetClass()->Modified(XGeoClass::revVisibility);
 		m_Table.repaint();
 		sendActionMessage("UpdateClass");
 		return;
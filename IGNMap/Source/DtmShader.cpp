@@ -9,8 +9,8 @@
 // Date de creation : 19/01/2022
 //-----------------------------------------------------------------------------
 
-#include <cmath>
 #include "DtmShader.h"
+#include "../../XToolImage/XDtmShader.h"
 
 // Preferences d'affichage
 DtmShader::ShaderMode DtmShader::m_Mode = DtmShader::ShaderMode::Shading;
@@ -67,260 +67,10 @@ DtmShader::DtmShader(double gsd)
   }
 }
 
-//-----------------------------------------------------------------------------
-// Fonction d'estompage d'un pixel à partir de l'altitude du pixel, de l'altitude du pixel juste au dessus,
-// de l'altitude du pixel juste à sa droite
-//-----------------------------------------------------------------------------
-double DtmShader::CoefEstompage(float altC, float altH, float altD, float angleH, float angleV)
-{
-  double deltaX = m_dGSD, deltaY = m_dGSD; // angleH = 135, angleV = 45;
-  if (m_dGSD <= 0.)
-    deltaX = deltaY = 25.;
-  if ((m_dGSD > 0.) && (m_dGSD < 0.1))    // Donnees en geographiques
-    deltaX = deltaY = m_dGSD * 111319.49;  // 1 degre a l'Equateur
-
-  // Recherche de la direction de la normale a la surface du mnt
-  double dY[3], dX[3], normale[3];
-
-  // Initialisation des vecteurs de la surface du pixel considéré
-  dY[0] = 0;
-  dY[1] = deltaY;
-  dY[2] = (double)(altH - altC);
-
-  dX[0] = deltaX;
-  dX[1] = 0;
-  dX[2] = (double)(altD - altC);
-
-  // Direction de la normale a la surface
-  normale[0] = -(dY[1] * dX[2]);
-  normale[1] = -(dX[0] * dY[2]);
-  normale[2] = dX[0] * dY[1];
-
-  // Determination de l'angle entre la normale et la direction de la lumière
-  // Modification des teintes en fonction de cet angle
-  double correction;
-  double DirLum[3];
-  
-  // Passage d'une représentation angulaire de la direction de la lumiere en représentation cartésienne
-  DirLum[0] = cos(XPI / 180 * angleV * -1) * sin(XPI / 180 * angleH);
-  DirLum[1] = cos(XPI / 180 * angleV * -1) * cos(XPI / 180 * angleH);
-  DirLum[2] = sin(XPI / 180 * angleV * -1);
-
-  // Correction correspond au cosinus entre la normale et la lumiere
-  double scalaire;
-  scalaire = (normale[0] * DirLum[0]) + (normale[1] * DirLum[1]) + (normale[2] * DirLum[2]);
-
-  double normenormale;
-  double normeDirLum;
-  normenormale = (normale[0] * normale[0]) + (normale[1] * normale[1]) + (normale[2] * normale[2]);
-
-  normeDirLum = (DirLum[0] * DirLum[0]) + (DirLum[1] * DirLum[1]) + (DirLum[2] * DirLum[2]);
-  if ((normenormale * normeDirLum) > 0)
-    correction = scalaire / sqrt(normenormale * normeDirLum);
-  else correction = 0;
-
-  // Traduction de cette correction en correction finale
-  if (correction >= 0)
-    correction = 0;
-  else correction = -correction;
-
-  return correction;
-}
-
-//-----------------------------------------------------------------------------
-// Calcul de la pente
-//-----------------------------------------------------------------------------
-double DtmShader::CoefPente(float altC, float altH, float altD)
-{
-  double d = m_dGSD;
-  if (d <= 0.) d = 25;
-  double costheta = d / sqrt((altD - altC) * (altD - altC) + (altH - altC) * (altH - altC) + d * d);
-  return costheta;
-}
-
-//-----------------------------------------------------------------------------
-// Indique si l'on a une isohypse
-//-----------------------------------------------------------------------------
-int DtmShader::Isohypse(float altC, float altH, float altD)
-{
-  double step = m_dIsoStep;
-  int nb_isoC = (int)ceil(altC / step);
-  int nb_isoH = (int)ceil(altH / step);
-  int nb_isoD = (int)ceil(altD / step);
-  int nb_iso = (int)round(altC / step);
-
-  if (nb_isoC != nb_isoH)
-    return nb_iso;
-  if (nb_isoC != nb_isoD)
-    return nb_iso;
-
-  return -9999;
-}
-
-//-----------------------------------------------------------------------------
-// Calcul de l'estompage sur une ligne
-//-----------------------------------------------------------------------------
-bool DtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W, uint8_t* rgba, uint32_t num)
-{
-  float* ptr = lineS;
-  double coef = 1., r, g, b, a;
-  float val;
-  int index = 0, nb_iso;
-  float angleH = (float)m_dSolarAzimuth, angleV = (float)m_dSolarZenith;
-  if (m_Mode == ShaderMode::Shading) {
-    angleH = 135.; angleV = 45.;
-  }
-  if (m_Mode == ShaderMode::Light_Shading) {
-    angleH = 135.; angleV = 65.;
-  }
-
-  for (uint32_t i = 0; i < W; i++) {
-    val = *ptr;
-    r = g = b = a = 255;
-    uint32_t pix_col = m_Colour[0].getARGB();
-
-    if (val <= m_Z[0]) { // No data
-      ::memcpy(&rgba[4 * i], &pix_col, 4 * sizeof(uint8_t));
-      ptr++;
-      continue;
-    }
-    if (val <= m_Z[1]) { // Sous la mer
-      coef = (m_Z[1] - val);
-      index = 1;
-      r = m_Colour[index].getRed();
-      g = m_Colour[index].getGreen();
-      b = m_Colour[index].getBlue();
-      a = m_Colour[index].getAlpha();
-    }
-
-    for (int j = 2; j < m_Z.size(); j++) {
-      if ((val > m_Z[j - 1]) && (val <= m_Z[j])) {
-        coef = (m_Z[j] - val) / (m_Z[j] - m_Z[j-1]);
-        index = j;
-        r = m_Colour[j].getRed() * coef + m_Colour[j+1].getRed() * (1 - coef);
-        g = m_Colour[j].getGreen() * coef + m_Colour[j+1].getGreen() * (1 - coef);
-        b = m_Colour[j].getBlue() * coef + m_Colour[j+1].getBlue() * (1 - coef);
-        a = m_Colour[j].getAlpha() * coef + m_Colour[j+1].getAlpha() * (1 - coef);
-      }
-    }
-
-    if (val > m_Z[m_Z.size() - 1]) {
-      index = (int)m_Z.size();
-      r = m_Colour[index].getRed();
-      g = m_Colour[index].getGreen();
-      b = m_Colour[index].getBlue();
-      a = m_Colour[index].getAlpha();
-    }
-
-    switch (m_Mode) {
-    case ShaderMode::Altitude: coef = 1.;
-      break;
-
-    case ShaderMode::Shading: // Estompage
-    case ShaderMode::Light_Shading: // Estompage leger
-    case ShaderMode::Free_Shading: // Estompage Libre
-      if (num == 0) {
-        if (i < (W - 1))
-          coef = CoefEstompage(lineT[i], val, lineT[i + 1], angleH, angleV);
-        else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, angleH, angleV);
-      }
-      else {
-        if (i < (W - 1))
-          coef = CoefEstompage(val, lineR[i], lineS[i + 1], angleH, angleV);
-        else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, angleH, angleV);
-      }
-      break;
-
-    case ShaderMode::Slope: // Pente
-      if (num == 0) {
-        if (i < (W - 1))
-          coef = CoefPente(lineT[i], val, lineT[i + 1]);
-        else
-          coef = CoefPente(lineS[i - 1], lineR[i - 1], val);
-      }
-      else {
-        if (i < (W - 1))
-          coef = CoefPente(val, lineR[i], lineS[i + 1]);
-        else
-          coef = CoefPente(lineS[i - 1], lineR[i - 1], val);
-      }
-      break;
-
-    case ShaderMode::Colour: // Aplat de couleurs
-      coef = 1.;
-      r = m_Colour[index].getRed();
-      g = m_Colour[index].getGreen();
-      b = m_Colour[index].getBlue();
-      a = m_Colour[index].getAlpha();
-      break;
-
-    case ShaderMode::Shading_Colour: // Aplat + estompage
-      if (num == 0) {
-        if (i < (W - 1))
-          coef = CoefEstompage(lineT[i], val, lineT[i + 1]);
-        else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val);
-      }
-      else {
-        if (i < (W - 1))
-          coef = CoefEstompage(val, lineR[i], lineS[i + 1]);
-        else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val);
-      }
-      if (index > 0) {
-        r = m_Colour[index].getRed();
-        g = m_Colour[index].getGreen();
-        b = m_Colour[index].getBlue();
-        a = m_Colour[index].getAlpha();
-      }
-      break;
-
-    case ShaderMode::Contour: // Isohypses
-      coef = 1.;
-      a = r = g = b = 0;
-      if (num == 0) {
-        if (i < (W - 1))
-          nb_iso = Isohypse(lineT[i], val, lineT[i + 1]);
-        else
-          nb_iso = Isohypse(lineS[i - 1], lineR[i - 1], val);
-      }
-      else {
-        if (i < (W - 1))
-          nb_iso = Isohypse(val, lineR[i], lineS[i + 1]);
-        else
-          nb_iso = Isohypse(lineS[i - 1], lineR[i - 1], val);
-      }
-
-      if (nb_iso > -9999) {
-        double cote = nb_iso * m_dIsoStep;
-        for (int j = 0; j < m_Z.size(); j++) {
-          index = j;
-          if (cote < m_Z[j])
-            break;
-        }
-        r = m_Colour[index].getRed();
-        g = m_Colour[index].getGreen();
-        b = m_Colour[index].getBlue();
-        a = m_Colour[index].getAlpha();
-      }
-      break;
-
-    }
-
-    pix_col = juce::Colour(juce::Colour::fromRGBA((juce::uint8)round(r* coef), (juce::uint8)round(g* coef), 
-                                                  (juce::uint8)round(b* coef), (juce::uint8)round(a))).getARGB();
-    ::memcpy(&rgba[4 * i], &pix_col, 4 * sizeof(uint8_t));
-    
-    ptr++;
-  }
-
-  return true;
-}
-
 //-----------------------------------------------------------------------------
 // Calcul de l'estompage
+// Le calcul est fait par XDtmShader avec les preferences d'affichage courantes :
+// les pixels ARGB de JUCE sont ranges dans l'ordre B, G, R, A
 //-----------------------------------------------------------------------------
 bool DtmShader::ConvertImage(juce::Image* rawImage, juce::Image* rgbImage)
 {
@@ -331,19 +81,29 @@ bool DtmShader::ConvertImage(juce::Image* rawImage, juce::Image* rgbImage)
   if (rgbImage->getFormat() != juce::Image::PixelFormat::ARGB)
     return false;
   int w = rawImage->getWidth(), h = rawImage->getHeight();
+  if ((w < 1) || (h < 1))
+    return false;
+
+  XDtmShader::Param param;
+  param.Z = m_Z;
+  param.Color.clear();
+  for (size_t i = 0; i < m_Colour.size(); i++)
+    param.Color.push_back(XARGBColor(m_Colour[i].getARGB()));
+  param.Mode = (int)m_Mode;
+  param.IsoStep = m_dIsoStep;
+  param.SolarAzimuth = m_dSolarAzimuth;
+  param.SolarZenith = m_dSolarZenith;
+  param.GSD = m_dGSD;
+  XDtmShader shader(param, true, true);
 
   juce::Image::BitmapData rawData(*rawImage, juce::Image::BitmapData::readOnly);
   juce::Image::BitmapData rgbData(*rgbImage, juce::Image::BitmapData::writeOnly);
+  if ((rawData.pixelStride != 4) || (rgbData.pixelStride != 4))
+    return false;
 
-  EstompLine((float*)rawData.getLinePointer(0), (float*)rawData.getLinePointer(0), (float*)rawData.getLinePointer(1), 
-              w, rgbData.getLinePointer(0), 0);
-  for (int i = 1; i < h - 1; i++) {
-    EstompLine((float*)rawData.getLinePointer(i - 1), (float*)rawData.getLinePointer(i), (float*)rawData.getLinePointer(i + 1), 
-                w, rgbData.getLinePointer(i), i);
-  }
-  EstompLine((float*)rawData.getLinePointer(h - 2), (float*)rawData.getLinePointer(h - 1), (float*)rawData.getLinePointer(h - 1),
-                w, rgbData.getLinePointer(h - 1), h - 1);
-  return true;
+  int nbThread = juce::jlimit(1, 8, juce::SystemStats::getNumCpus());
+  return shader.ConvertArea((float*)rawData.getLinePointer(0), w, h, rgbData.getLinePointer(0),
+                            rawData.lineStride / 4 - w, rgbData.lineStride - 4 * w, nbThread);
 }
 
 //-----------------------------------------------------------------------------
@@ -16,12 +16,6 @@
 
 class DtmShader {
 protected:
-  double CoefEstompage(float altC, float altH, float altD, float angleH = 135., float angleV = 45.);
-  double CoefPente(float altC, float altH, float altD);
-  int Isohypse(float altC, float altH, float altD);
-
-  bool EstompLine(float* lineR, float* lineS, float* lineT, uint32_t w, uint8_t* rgba, uint32_t num);
-
   double  m_dGSD;   // Pas terrain du MNT
 
 public:
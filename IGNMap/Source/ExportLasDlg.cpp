@@ -9,22 +9,296 @@
 // Date de creation : 25/02/2024
 //-----------------------------------------------------------------------------
 
+#include <thread>
 #include "ExportLasDlg.h"
 #include "AppUtil.h"
 #include "LasShader.h"
 #include "../../XTool/XGeoBase.h"
 #include "../../XTool/XGeoClass.h"
 #include "../../XTool/XGeoVector.h"
+#include "../../XToolGeod/XGeoPref.h"
 
 //==============================================================================
 // Methode run du thread
 //==============================================================================
 void LasExportThread::run()
 {
-  if (laszip_create(&m_Writer))  // Impossible de creer le Writer
+  juce::int64 start = juce::Time::currentTimeMillis();
+  m_dDuration = 0.;
+  m_nNbRead = 0;
+  m_Count = 0;
+  if (m_bCopc) {
+    if (!OpenCopc()) {
+      m_Copc.Cancel();
+      return;
+    }
+  }
+  else {
+    if (!OpenWriter()) {
+      if (m_Writer != nullptr)
+        laszip_destroy(m_Writer);
+      m_Writer = nullptr;
+      return;
+    }
+  }
+
+  // Fichiers LAS a exporter
+  std::vector<GeoLAS*> files;
+  for (uint32_t i = 0; i < m_GeoBase->NbClass(); i++) {
+    XGeoClass* C = m_GeoBase->Class(i);
+    if (C == nullptr)
+      continue;
+    if (!C->IsLAS())
+      continue;
+    if (!C->Visible())
+      continue;
+    if (!m_Frame.Intersect(C->Frame()))
+      continue;
+    
+    for (uint32_t j = 0; j < C->NbVector(); j++) {
+      GeoLAS* las = (GeoLAS*)C->Vector(j);
+      XFrame F = las->Frame();
+      if (!m_Frame.Intersect(F))
+        continue;
+      files.push_back(las);
+    }
+  }
+
+  // Lancement des producteurs
+  int nbThread = m_nNbThread;
+  if (nbThread < 1)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+  nbThread = XMin(nbThread, XMax((int)files.size(), 1));
+  std::atomic<size_t> next(0);
+  m_Queue.clear();
+  m_nNbProducer = nbThread;
+  m_bAbort = false;
+  std::vector<std::thread> producers;
+  for (int i = 0; i < nbThread; i++)
+    producers.push_back(std::thread(&LasExportThread::Produce, this, std::cref(files), &next));
+
+  // Ecriture des points, avec sous-echantillonnage eventuel
+  typedef XLasThinner<ExportPoint> Thinner;
+  Thinner thinner;
+  if (m_Thinning == RandomThinning)
+    thinner.Init(Thinner::Random, 1., m_dThinningStep * 0.01);
+  else
+    thinner.Init((Thinner::Mode)m_Thinning, m_dThinningStep);
+  juce::File tmpfolder = juce::File::getSpecialLocation(juce::File::tempDirectory);
+  thinner.SetTmpPrefix(tmpfolder.getNonexistentChildFile("IGNMap_Thinning", "").getFullPathName().toStdString());
+  std::vector<Thinner::Item> kept;
+  bool ok = true;
+  while (true) {
+    Batch batch;
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_NotEmpty.wait(lock, [this] { return (!m_Queue.empty()) || (m_nNbProducer == 0); });
+      if (m_Queue.empty())
+        break;
+      batch.swap(m_Queue.front());
+      m_Queue.pop_front();
+    }
+    m_NotFull.notify_one();
+    if (threadShouldExit() && (!m_bAbort))
+      Abort();
+    if (m_bAbort)
+      continue;   // La file est videe jusqu'a l'arret des producteurs
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (m_Thinning == NoThinning) {
+        if (!WritePoint(batch[i])) {
+          ok = false;
+          break;
+        }
+        continue;
+      }
+      thinner.Add(batch[i], batch[i].X, batch[i].Y, batch[i].Z, kept);
+      if (!WriteKept(kept)) {
+        ok = false;
+        break;
+      }
+    }
+    if (!ok)
+      Abort();
+  }
+  for (size_t i = 0; i < producers.size(); i++)
+    producers[i].join();
+  if (threadShouldExit())
+    ok = false;
+  while (ok && thinner.FlushTile(kept)) {   // Dalles des modes grille, voxel et Poisson
+    if (threadShouldExit() || (!WriteKept(kept)))
+      ok = false;
+  }
+  if (thinner.Error())
+    ok = false;
+
+  if (!CloseOutput(ok))
     return;
+  m_dDuration = (juce::Time::currentTimeMillis() - start) * 0.001;
+}
+
+//==============================================================================
+// Fermeture de la sortie sur tous les chemins : construction de l'octree et ecriture
+// du fichier COPC, ou fermeture du Writer. En cas d'echec, le fichier partiel est supprime
+//==============================================================================
+bool LasExportThread::CloseOutput(bool ok)
+{
+  if (m_bCopc) {
+    if (!ok) {
+      m_Copc.Cancel();
+      m_Count = 0;
+      return false;
+    }
+    if (m_Copc.Close(nullptr, this))  // Close supprime le fichier en cas d'echec
+      return true;
+    m_Count = 0;
+    return false;
+  }
+
+  if (m_Writer == nullptr)
+    return false;
+  if (ok && laszip_get_point_count(m_Writer, &m_Count))
+    ok = false;
+  if (laszip_close_writer(m_Writer))
+    ok = false;
+  if (laszip_destroy(m_Writer))
+    ok = false;
+  m_Writer = nullptr;
+  if (!ok) {
+    juce::File(m_Filename).deleteFile();
+    m_Count = 0;
+  }
+  return ok;
+}
+
+//==============================================================================
+// Producteur : lecture des fichiers LAS attribues a ce thread
+// Chaque producteur ouvre ses propres lecteurs, l'index spatial ou la structure COPC
+// limitent la lecture aux points de l'emprise
+//==============================================================================
+void LasExportThread::Produce(const std::vector<GeoLAS*>& files, std::atomic<size_t>* next)
+{
+  const size_t batchSize = 16384;
+  Batch batch;
+  batch.reserve(batchSize);
+  bool ok = true;
+  for (size_t i = (*next)++; (i < files.size()) && ok; i = (*next)++) {
+    if (m_bAbort)
+      break;
+    XLasFile las;
+    if (!las.Open(files[i]->Filename()))
+      continue;
+    if (!files[i]->IndexFile().empty())
+      las.SetIndexFile(files[i]->IndexFile());
+    if (!las.SetWorld(m_Frame, m_dZmin, m_dZmax))
+      continue;
+    las.SetClassifFilter(m_ClassifVisibility);
+    laszip_point* point = las.GetPoint();
+    ExportPoint P;
+    uint64_t nb_read = 0;
+    while (las.GetNextPoint(&P.X, &P.Y, &P.Z)) {
+      if (m_bAbort) {
+        ok = false;
+        break;
+      }
+      nb_read++;
+      if (!AcceptReturn(point))
+        continue;
+      P.attributes = *point;
+      batch.push_back(P);
+      if (batch.size() < batchSize)
+        continue;
+      if (!Push(batch)) {
+        ok = false;
+        break;
+      }
+    }
+    m_nNbRead += nb_read;
+  }
+  if (ok && (batch.size() > 0))
+    Push(batch);
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_nNbProducer--;
+  m_NotEmpty.notify_all();
+}
+
+//==============================================================================
+// Ajout d'un lot de points dans la file bornee (attente si la file est pleine)
+//==============================================================================
+bool LasExportThread::Push(Batch& batch)
+{
+  const size_t maxQueue = 16;
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (m_Queue.size() >= maxQueue) {
+    if (m_bAbort || threadShouldExit())
+      return false;
+    m_NotFull.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  if (m_bAbort || threadShouldExit())
+    return false;
+  m_Queue.push_back(Batch());
+  m_Queue.back().swap(batch);
+  batch.reserve(m_Queue.back().size());
+  m_NotEmpty.notify_one();
+  return true;
+}
+
+//==============================================================================
+// Arret des producteurs : ils sont reveilles s'ils attendent une place dans la file
+//==============================================================================
+void LasExportThread::Abort()
+{
+  m_bAbort = true;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_NotFull.notify_all();
+  m_NotEmpty.notify_all();
+}
+
+//==============================================================================
+// Filtre sur le numero de retour
+//==============================================================================
+bool LasExportThread::AcceptReturn(const laszip_point* point) const
+{
+  if (m_ReturnFilter == AllReturns)
+    return true;
+  uint8_t num = point->return_number, nb = point->number_of_returns;
+  if ((point->extended_point_type) || (nb == 0)) {
+    num = point->extended_return_number;
+    nb = point->extended_number_of_returns;
+  }
+  if (m_ReturnFilter == FirstReturns)
+    return (num == 1);
+  if (m_ReturnFilter == LastReturns)
+    return (num == nb);
+  return (nb == 1);   // SingleReturns
+}
+
+//==============================================================================
+// Ouverture du fichier COPC : les points sont stockes dans un fichier temporaire
+// puis organises en octree a la fermeture
+//==============================================================================
+bool LasExportThread::OpenCopc()
+{
+  juce::File tmpfolder = juce::File::getSpecialLocation(juce::File::tempDirectory);
+  if (!m_Copc.Open(m_Filename.toStdString(), tmpfolder.getFullPathName().toStdString(),
+                   round(m_Frame.Xmin), round(m_Frame.Ymin), 0., 0.01))
+    return false;
+  m_Copc.SetSoftware("Export LAS IGNMap", "IGNMap v3");
+  XGeoPref pref;
+  m_Copc.SetWkt(XGeoProjection::ShpProjection(pref.Projection()));
+  m_Copc.NbThread(0);
+  m_Count = 0;
+  return true;
+}
+
+//==============================================================================
+// Ouverture du Writer LAS/LAZ
+//==============================================================================
+bool LasExportThread::OpenWriter()
+{
+  if (laszip_create(&m_Writer))  // Impossible de creer le Writer
+    return false;
   if (laszip_get_header_pointer(m_Writer, &m_Header))  // Impossible de recuperer l'entete
-    return;
+    return false;
   // Donnees d'entete
   m_Header->file_source_ID = 0;
   m_Header->global_encoding = (1 << 0) | (1 << 4);     // see LAS specification for details
@@ -89,7 +363,7 @@ void LasExportThread::run()
 
   // add the geokeys (create or replace the appropriate VLR)
   if (laszip_set_geokeys(m_Writer, 5, key_entries))
-    return;
+    return false;
   /*
   if (laszip_add_vlr(m_Writer, "LASF_Projection", 2112, 0, "intentionally empty OGC WKT", 0))
     return;
@@ -106,112 +380,67 @@ void LasExportThread::run()
 
   laszip_preserve_generating_software(m_Writer, 1);
   if (laszip_open_writer(m_Writer, m_Filename.toStdString().c_str(), compress)) // Ouverture du Writer
-    return;
+    return false;
 
   // Pointeur pour ecrire les points
   if (laszip_get_point_pointer(m_Writer, &m_Point))
-    return;
-
-  // Ecriture des points
-  m_Count = 0;
+    return false;
+  return true;
+}
 
-  for (uint32_t i = 0; i < m_GeoBase->NbClass(); i++) {
-    XGeoClass* C = m_GeoBase->Class(i);
-    if (C == nullptr)
-      continue;
-    if (!C->IsLAS())
-      continue;
-    if (!C->Visible())
-      continue;
-    if (!m_Frame.Intersect(C->Frame()))
-      continue;
-    
-    for (uint32_t j = 0; j < C->NbVector(); j++) {
-      GeoLAS* las = (GeoLAS*)C->Vector(j);
-      XFrame F = las->Frame();
-      if (!m_Frame.Intersect(F))
-        continue;
-      ExportLas(las);
-      if (threadShouldExit())
-        return;
-    }
+//==============================================================================
+// Ecriture d'un point dans le fichier LAS/LAZ ou dans le fichier COPC
+//==============================================================================
+bool LasExportThread::WritePoint(const ExportPoint& P)
+{
+  const laszip_point* point = &P.attributes;
+  if (m_bCopc) {
+    if (!m_Copc.AddPoint(point, P.X, P.Y, P.Z))
+      return false;
+    m_Count++;
+    return true;
   }
 
-  // Fermeture du Writer
-  if (laszip_get_point_count(m_Writer, &m_Count))
-    return;
-
-  if (laszip_close_writer(m_Writer))
-    return;
-
-  if (laszip_destroy(m_Writer))
-    return;
-
-
+  laszip_F64 coordinates[3] = { P.X, P.Y, P.Z };
+  if (laszip_set_coordinates(m_Writer, coordinates))
+    return false;
+
+  m_Point->intensity = point->intensity;
+  m_Point->extended_return_number = point->extended_return_number;
+  m_Point->extended_number_of_returns = point->extended_number_of_returns;
+  m_Point->classification = point->classification;                // it must be set because it "fits" in 5 bits
+  m_Point->extended_classification = point->extended_classification;
+  m_Point->extended_scan_angle = point->extended_scan_angle;
+  m_Point->extended_scanner_channel = point->extended_scanner_channel;
+  m_Point->extended_classification_flags = point->extended_classification_flags; // overflag flag is set
+  m_Point->gps_time = point->gps_time;
+
+  if (laszip_write_point(m_Writer))
+    return false;
+  if (laszip_update_inventory(m_Writer))
+    return false;
+  m_Count++;
+  return true;
 }
 
 //==============================================================================
-// Export d'un fichier LAS
+// Ecriture des points retenus par le sous-echantillonnage, aux coordonnees calculees
+// (barycentre en mode voxel)
 //==============================================================================
-void LasExportThread::ExportLas(GeoLAS* las)
+bool LasExportThread::WriteKept(std::vector<XLasThinner<ExportPoint>::Item>& kept)
 {
-  laszip_I64 npoints = las->NbLasPoints();
-  laszip_POINTER reader = las->GetReader();
-  laszip_header* header = las->GetHeader();
-  laszip_point* point = las->GetPoint();
-
-  laszip_seek_point(reader, 0);
-  double Xmin = (m_Frame.Xmin - header->x_offset) / header->x_scale_factor;
-  double Xmax = (m_Frame.Xmax - header->x_offset) / header->x_scale_factor;
-  double Ymin = (m_Frame.Ymin - header->y_offset) / header->y_scale_factor;
-  double Ymax = (m_Frame.Ymax - header->y_offset) / header->y_scale_factor;
-  double Zmin = (LasShader::Zmin() - header->z_offset) / header->z_scale_factor;
-  double Zmax = (LasShader::Zmax() - header->z_offset) / header->z_scale_factor;
-
-  uint8_t classification;
-  bool classif_newtype = true;
-  if (header->version_minor < 4) classif_newtype = false;
-  LasShader shader;
-  laszip_F64 coordinates[3];
-  for (laszip_I64 i = 0; i < npoints; i++) {
-    laszip_read_point(reader);
-    if (classif_newtype)
-      classification = point->extended_classification;
-    else
-      classification = point->classification;
-    if (!shader.ClassificationVisibility(classification)) continue;
-    if (point->X <= Xmin) continue;
-    if (point->X >= Xmax) continue;
-    if (point->Y <= Ymin) continue;
-    if (point->Y >= Ymax) continue;
-    if (point->Z < Zmin) continue;
-    if (point->Z > Zmax) continue;
-
-    coordinates[0] = point->X * header->x_scale_factor + header->x_offset;
-    coordinates[1] = point->Y * header->y_scale_factor + header->y_offset;
-    coordinates[2] = point->Z * header->z_scale_factor + header->z_offset;
-    if (laszip_set_coordinates(m_Writer, coordinates))
-      return;
-
-    m_Point->intensity = point->intensity;
-    m_Point->extended_return_number = point->extended_return_number;
-    m_Point->extended_number_of_returns = point->extended_number_of_returns;
-    m_Point->classification = point->classification;                // it must be set because it "fits" in 5 bits
-    m_Point->extended_classification = point->extended_classification;
-    m_Point->extended_scan_angle = point->extended_scan_angle;
-    m_Point->extended_scanner_channel = point->extended_scanner_channel;
-    m_Point->extended_classification_flags = point->extended_classification_flags; // overflag flag is set
-    m_Point->gps_time = point->gps_time;
-
-    if (laszip_write_point(m_Writer))
-      return;
-    if (laszip_update_inventory(m_Writer))
-      return;
-    m_Count++;
+  bool flag = true;
+  for (size_t i = 0; (i < kept.size()) && flag; i++) {
+    ExportPoint& P = kept[i].point;
+    P.X = kept[i].X;
+    P.Y = kept[i].Y;
+    P.Z = kept[i].Z;
+    flag = WritePoint(P);
   }
+  kept.clear();
+  return flag;
 }
 
-
 //==============================================================================
 // Constructeur
 //==============================================================================
@@ -250,19 +479,46 @@ ExportLasDlg::ExportLasDlg(XGeoBase* base, double xmin, double ymin, double xmax
 
   addAndMakeVisible(m_btnLaz);
   m_btnLaz.setButtonText(juce::translate("LAZ Compression"));
-  m_btnLaz.setBounds(140, 130, 120, 24);
+  m_btnLaz.setBounds(80, 130, 120, 24);
+
+  addAndMakeVisible(m_btnCopc);
+  m_btnCopc.setButtonText(juce::translate("COPC"));
+  m_btnCopc.setBounds(210, 130, 120, 24);
+
+  addAndMakeVisible(m_cbxReturn);
+  m_cbxReturn.addItem(juce::translate("All returns"), 1);  // Les ID ne peuvent pas etre egaux a 0
+  m_cbxReturn.addItem(juce::translate("First returns"), 2);
+  m_cbxReturn.addItem(juce::translate("Last returns"), 3);
+  m_cbxReturn.addItem(juce::translate("Single returns"), 4);
+  m_cbxReturn.setSelectedId(1, juce::NotificationType::dontSendNotification);
+  m_cbxReturn.setBounds(10, 170, 140, 24);
+
+  addAndMakeVisible(m_cbxThinning);
+  m_cbxThinning.addItem(juce::translate("No thinning"), 1);
+  m_cbxThinning.addItem(juce::translate("Random thinning"), 2);
+  m_cbxThinning.addItem(juce::translate("Grid thinning (lowest Z)"), 3);
+  m_cbxThinning.addItem(juce::translate("Voxel thinning (centroid)"), 4);
+  m_cbxThinning.addItem(juce::translate("Poisson disk thinning"), 5);
+  m_cbxThinning.setSelectedId(1, juce::NotificationType::dontSendNotification);
+  m_cbxThinning.setBounds(160, 170, 140, 24);
+  m_cbxThinning.addListener(this);
+
+  addAndMakeVisible(m_edtThinningStep);
+  m_edtThinningStep.setBounds(310, 170, 80, 24);
+  m_edtThinningStep.setText(juce::String(1., 2));
+  m_edtThinningStep.setTooltip(juce::translate("Thinning cell size, or percentage of points kept for random thinning"));
 
   addAndMakeVisible(m_btnExport);
   m_btnExport.setButtonText(juce::translate("Export"));
-  m_btnExport.setBounds(160, 170, 80, 30);
+  m_btnExport.setBounds(160, 210, 80, 30);
   m_btnExport.addListener(this);
 
   m_progressBar = new juce::ProgressBar(m_dProgress);
   addAndMakeVisible(m_progressBar);
-  m_progressBar->setBounds(100, 210, 200, 30);
+  m_progressBar->setBounds(100, 250, 200, 30);
 
   addAndMakeVisible(m_edtFilename);
-  m_edtFilename.setBounds(10, 260, 380, 24);
+  m_edtFilename.setBounds(10, 300, 380, 24);
   m_edtFilename.setText("");
   m_edtFilename.setReadOnly(true);
 }
@@ -277,6 +533,19 @@ ExportLasDlg::~ExportLasDlg()
   m_ExportThread.stopThread(5000);
 }
 
+//==============================================================================
+// Changement du mode de sous-echantillonnage : pas en pourcentage pour le mode aleatoire
+//==============================================================================
+void ExportLasDlg::comboBoxChanged(juce::ComboBox* box)
+{
+  if (box != &m_cbxThinning)
+    return;
+  if (m_cbxThinning.getSelectedId() - 1 == LasExportThread::RandomThinning)
+    m_edtThinningStep.setText(juce::String(100., 2));
+  else
+    m_edtThinningStep.setText(juce::String(1., 2));
+}
+
 //==============================================================================
 // Validation de l'export
 //==============================================================================
@@ -311,6 +580,8 @@ void ExportLasDlg::buttonClicked(juce::Button* button)
   juce::String ext = "*.las";
   if (m_btnLaz.getToggleState())
     ext = "*.laz";
+  if (m_btnCopc.getToggleState())
+    ext = "*.copc.laz";
   m_strFilename = AppUtil::SaveFile("ExportLasFile", juce::translate("File to save"), ext);
   if (m_strFilename.isEmpty())
     return;
@@ -328,6 +599,17 @@ void ExportLasDlg::buttonClicked(juce::Button* button)
   m_ExportThread.SetFilename(m_strFilename);
   if (m_btnLaz.getToggleState())
     m_ExportThread.SetCompression(true);
+  m_ExportThread.SetCopc(m_btnCopc.getToggleState());
+  m_ExportThread.SetZRange(LasShader::Zmin(), LasShader::Zmax());
+  bool visibility[256];
+  for (int i = 0; i < 256; i++)
+    visibility[i] = LasShader::ClassificationVisibility((uint8_t)i);
+  m_ExportThread.SetClassifVisibility(visibility);
+  m_ExportThread.SetReturnFilter((LasExportThread::ReturnFilter)(m_cbxReturn.getSelectedId() - 1));
+  double step = m_edtThinningStep.getText().getDoubleValue();
+  if (step <= 0.)
+    step = 1.;
+  m_ExportThread.SetThinning((LasExportThread::Thinning)(m_cbxThinning.getSelectedId() - 1), step);
   m_ExportThread.startThread();
 
   startTimerHz(10);
@@ -345,6 +627,15 @@ void ExportLasDlg::timerCallback()
   m_dProgress = 1.;
   stopTimer();
   m_btnExport.setButtonText(juce::translate("Export"));
+  double duration = m_ExportThread.Duration();
+  if (duration > 0.) {  // Bilan de l'export
+    juce::File file(m_strFilename);
+    juce::String message = juce::String(m_ExportThread.NbRead()) + juce::translate(" points read, ") +
+      juce::String(m_ExportThread.NbWritten()) + juce::translate(" points written in ") + juce::String(duration, 1) + " s\n" +
+      juce::String(m_ExportThread.NbRead() / duration, 0) + juce::translate(" points/s, ") +
+      juce::String(file.getSize() / (duration * 1024. * 1024.), 1) + juce::translate(" MB/s written");
+    juce::AlertWindow::showMessageBoxAsync(juce::AlertWindow::InfoIcon, juce::translate("Export LAS"), message, "OK");
+  }
   juce::File file(m_strFilename);
   file.revealToUser();
   juce::Component* parent = getParentComponent();
@@ -11,53 +11,111 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "GeoBase.h"
 
 class XGeoBase;
 
 //==============================================================================
 // Thread pour l'export
+// Un producteur par fichier LAS lit les points filtres (emprise, Z, classification,
+// numero de retour) et les place dans une file bornee, videe par un seul ecrivain
 //==============================================================================
-class LasExportThread : public juce::Thread {
+class LasExportThread : public juce::Thread, public XWait {
 public:
-	LasExportThread(const juce::String& threadName, size_t threadStackSize = 0) : juce::Thread(threadName, threadStackSize) { m_GeoBase = nullptr; }
+	LasExportThread(const juce::String& threadName, size_t threadStackSize = 0) : juce::Thread(threadName, threadStackSize)
+		{ m_GeoBase = nullptr; for (int i = 0; i < 256; i++) m_ClassifVisibility[i] = true; }
 	virtual ~LasExportThread() { ; }
 
+	typedef enum { AllReturns = 0, FirstReturns = 1, LastReturns = 2, SingleReturns = 3 } ReturnFilter;
+	typedef enum { NoThinning = 0, RandomThinning = 1, GridThinning = 2, VoxelThinning = 3, PoissonThinning = 4 } Thinning;	// Modes de XLasThinner
+
 	void SetExportFrame(const XFrame& F) { m_Frame = F; }
 	void SetGeoBase(XGeoBase* base) { m_GeoBase = base; }
 	void SetFilename(juce::String name) { m_Filename = name; }
 	void SetCompression(bool compression) { m_Compression = compression; }
+	void SetCopc(bool copc) { m_bCopc = copc; }
+	void SetZRange(double zmin, double zmax) { m_dZmin = zmin; m_dZmax = zmax; }
+	void SetClassifVisibility(const bool* visibility) { memcpy(m_ClassifVisibility, visibility, sizeof(m_ClassifVisibility)); }
+	void SetReturnFilter(ReturnFilter filter) { m_ReturnFilter = filter; }
+	void SetThinning(Thinning thinning, double step) { m_Thinning = thinning; m_dThinningStep = step; }	// Random : step = pourcentage conserve
+	void SetNbThread(int nb) { m_nNbThread = nb; }	// 0 : nombre de coeurs
+
+	// Bilan du dernier export
+	uint64_t NbRead() const { return m_nNbRead; }
+	uint64_t NbWritten() const { return (uint64_t)m_Count; }
+	double Duration() const { return m_dDuration; }	// En secondes
 
 	virtual void 	run() override;
+	virtual bool CheckCancel() override { return threadShouldExit(); }
 
 private:
+	struct ExportPoint {
+		double X, Y, Z;
+		laszip_point attributes;
+	};
+	typedef std::vector<ExportPoint> Batch;
+
 	XGeoBase*			m_GeoBase;
 	XFrame        m_Frame;		// Cadre pour l'export
 	juce::String	m_Filename;
 	bool					m_Compression = false;
+	bool					m_bCopc = false;	// Export au format COPC
+	XCopcWriter	m_Copc;
 	laszip_POINTER	m_Writer = nullptr;
 	laszip_header*	m_Header = nullptr;
 	laszip_point*		m_Point = nullptr;
 	laszip_I64			m_Count = 0;
 
-	void ExportLas(GeoLAS* las);
+	// Filtres et sous-echantillonnage
+	double				m_dZmin = -1e30, m_dZmax = 1e30;
+	bool					m_ClassifVisibility[256];
+	ReturnFilter	m_ReturnFilter = AllReturns;
+	Thinning			m_Thinning = NoThinning;
+	double				m_dThinningStep = 1.;
+	int						m_nNbThread = 0;
+
+	// File bornee entre les producteurs et l'ecrivain
+	std::deque<Batch>				m_Queue;
+	std::mutex							m_Mutex;
+	std::condition_variable	m_NotFull, m_NotEmpty;
+	int											m_nNbProducer = 0;
+	std::atomic<bool>				m_bAbort{ false };	// Arret des producteurs : echec de l'ecriture ou annulation
+	std::atomic<uint64_t>		m_nNbRead{ 0 };
+	double									m_dDuration = 0.;
+
+	bool OpenWriter();
+	bool OpenCopc();
+	bool CloseOutput(bool ok);
+	void Produce(const std::vector<GeoLAS*>& files, std::atomic<size_t>* next);
+	bool Push(Batch& batch);
+	void Abort();
+	bool AcceptReturn(const laszip_point* point) const;
+	bool WritePoint(const ExportPoint& P);
+	bool WriteKept(std::vector<XLasThinner<ExportPoint>::Item>& kept);
 };
 
 //==============================================================================
 // Dialogue pour l'export
 //==============================================================================
-class ExportLasDlg : public juce::Component, public juce::Button::Listener, private juce::Timer {
+class ExportLasDlg : public juce::Component, public juce::Button::Listener, public juce::ComboBox::Listener, private juce::Timer {
 public:
 	ExportLasDlg(XGeoBase* base, double xmin = 0., double ymin = 0., double xmax = 0., double ymax = 0.);
 	virtual ~ExportLasDlg();
 	void buttonClicked(juce::Button*) override;
+	void comboBoxChanged(juce::ComboBox*) override;
 	
 private:
 	XGeoBase* m_Base;
 	juce::TextEditor	m_edtXmin, m_edtYmin, m_edtXmax, m_edtYmax, m_edtFilename;
 	juce::Label m_lblXmin, m_lblYmin, m_lblXmax, m_lblYmax;
 	juce::TextButton m_btnExport;
-	juce::ToggleButton m_btnLaz;
+	juce::ToggleButton m_btnLaz, m_btnCopc;
+	juce::ComboBox m_cbxReturn, m_cbxThinning;
+	juce::TextEditor m_edtThinningStep;
 
 	LasExportThread	m_ExportThread;
 	juce::String m_strFilename;
@@ -263,11 +263,24 @@ juce::Image GeoSentinelImage::GetQuickView()
 	return image;
 }
 
+//-----------------------------------------------------------------------------
+// Nom du cache d'un MNT importe : il est conserve entre les sessions, les caches
+// perimes du meme MNT sont supprimes
+//-----------------------------------------------------------------------------
+std::string GeoDTM::CacheFilename(const juce::File& file)
+{
+	juce::File entry = GeoTools::PersistentCacheEntry("DtmCache", file);
+	return (entry.getFullPathName() + ".tif").toStdString();
+}
+
 //-----------------------------------------------------------------------------
 // Fermeture du MNT
 //-----------------------------------------------------------------------------
 void GeoDTM::Close()
 {
+	GeoDTMCache::Remove(m_strImageName);
+	m_Image.Close();
+	m_Map.reset();
 	m_In.Close();
 	if (m_bTmpFile) {
 		juce::File file(m_strImageName.c_str());
@@ -319,6 +332,212 @@ bool GeoDTM::ReadAll(float* area)
 	return m_Image.GetRawArea(0, 0, m_nW, m_nH, area, &nb_sample);
 }
 
+//-----------------------------------------------------------------------------
+// Lecture d'un bloc de noeuds : projection en memoire du fichier temporaire,
+// ou decodage des seules tuiles / bandes TIFF couvrant le bloc
+//-----------------------------------------------------------------------------
+bool GeoDTM::ReadBlock(float* block, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	if (m_bTmpFile) {
+		if (m_Map.get() == nullptr)
+			m_Map.reset(new juce::MemoryMappedFile(juce::File(m_strImageName.c_str()), juce::MemoryMappedFile::readOnly));
+		size_t size = ((size_t)m_nW * m_nH) * sizeof(float) + m_nOffset;
+		if ((m_Map->getData() == nullptr) || (m_Map->getSize() < size))
+			return XGeoFDtm::ReadBlock(block, x, y, w, h);
+		const float* data = (const float*)((const char*)m_Map->getData() + m_nOffset);
+		for (uint32_t i = 0; i < h; i++)
+			::memcpy(&block[(size_t)i * w], &data[(size_t)(y + i) * m_nW + x], w * sizeof(float));
+		return true;
+	}
+	uint32_t nb_sample;
+	return m_Image.GetRawArea(x, y, w, h, block, &nb_sample);
+}
+
+//-----------------------------------------------------------------------------
+// Ouverture de l'image du MNT pour le dessin (m_BlockMutex doit etre verrouille)
+// L'image reste ouverte : l'entete n'est analyse qu'une fois
+//-----------------------------------------------------------------------------
+bool GeoDTM::OpenImage()
+{
+	if (m_Image.IsValid())
+		return true;
+	if (m_strImageName.empty())
+		return false;
+	return m_Image.AnalyzeImage(m_strImageName);
+}
+
+//-----------------------------------------------------------------------------
+// Preparation du dessin du MNT dans le cadre F
+//-----------------------------------------------------------------------------
+bool GeoDTM::PrepareDraw(XFrame* F, double gsdR, int& U0, int& V0, int& win, int& hin, int& R0, int& S0, int& wout, int& hout)
+{
+	std::lock_guard<std::mutex> lock(m_BlockMutex);
+	if (!OpenImage())
+		return false;
+	if (m_Image.NbSample() != 1)
+		return false;
+	m_Image.SetGeoref(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax + m_dGSD * 0.5, m_dGSD);
+	int nbBand;
+	return m_Image.PrepareRasterDraw(F, gsdR, U0, V0, win, hin, nbBand, R0, S0, wout, hout);
+}
+
+//-----------------------------------------------------------------------------
+// Facteur de sous-echantillonnage pour le dessin (m_BlockMutex ne doit pas etre verrouille)
+// Pour un COG (cache des MNT importes), le facteur est ramene a la puissance de 2
+// inferieure : la lecture se fait alors directement dans l'IFD de sous-resolution
+// correspondant, sans reechantillonnage supplementaire
+//-----------------------------------------------------------------------------
+uint32_t GeoDTM::DrawFactor(uint32_t factor)
+{
+	if (factor < 2)
+		return 1;
+	{
+		std::lock_guard<std::mutex> lock(m_BlockMutex);
+		if (!OpenImage())
+			return factor;
+		if (m_Image.Format() != "COG")
+			return factor;
+	}
+	uint32_t level = 1;
+	while (level * 2 <= factor)
+		level *= 2;
+	return level;
+}
+
+//-----------------------------------------------------------------------------
+// Lecture d'une zone de noeuds sous-echantillonnee (win / factor x hin / factor)
+// Pour un COG, XCogImage lit l'IFD de sous-resolution du facteur demande
+// Si le MNT complet au facteur demande est assez petit, il est lu une fois et
+// conserve dans GeoDTMCache ; sinon la zone est lue directement
+//-----------------------------------------------------------------------------
+bool GeoDTM::GetDrawArea(int U0, int V0, int win, int hin, uint32_t factor, float* area)
+{
+	if (factor < 1)
+		factor = 1;
+	uint32_t wtmp = win / factor, htmp = hin / factor;
+	uint32_t wl = m_nW / factor, hl = m_nH / factor;
+	uint32_t nb_sample;
+	if ((wl == 0) || (hl == 0) || ((size_t)wl * hl > GeoDTMCache::MaxLevelSize())) {
+		std::lock_guard<std::mutex> lock(m_BlockMutex);
+		if (!OpenImage())
+			return false;
+		return m_Image.GetRawArea(U0, V0, win, hin, area, &nb_sample, factor);
+	}
+
+	std::shared_ptr<const GeoDTMCache::Level> level = GeoDTMCache::Find(m_strImageName, factor);
+	if (level.get() == nullptr) {
+		std::shared_ptr<GeoDTMCache::Level> L = std::make_shared<GeoDTMCache::Level>();
+		L->factor = factor;
+		L->w = wl;
+		L->h = hl;
+		L->data.assign((size_t)wl * hl, (float)m_dNoData);
+		{
+			std::lock_guard<std::mutex> lock(m_BlockMutex);
+			if (!OpenImage())
+				return false;
+			if (!m_Image.GetRawArea(0, 0, wl * factor, hl * factor, L->data.data(), &nb_sample, factor))
+				return false;
+		}
+		GeoDTMCache::Insert(m_strImageName, L);
+		level = L;
+	}
+
+	uint32_t u0 = U0 / factor, v0 = V0 / factor;
+	uint32_t nb = (u0 < level->w) ? XMin(wtmp, level->w - u0) : 0;
+	for (uint32_t i = 0; i < htmp; i++) {
+		float* ptr = &area[(size_t)i * wtmp];
+		uint32_t n = (v0 + i < level->h) ? nb : 0;
+		if (n > 0)
+			::memcpy(ptr, &level->data[(size_t)(v0 + i) * level->w + u0], n * sizeof(float));
+		std::fill(ptr + n, ptr + wtmp, (float)m_dNoData);
+	}
+	return true;
+}
+
+//==============================================================================
+// GeoDTMCache : membres statiques
+//==============================================================================
+std::list<GeoDTMCache::Item> GeoDTMCache::m_Items;
+std::unordered_map<std::string, std::list<GeoDTMCache::Item>::iterator> GeoDTMCache::m_Index;
+std::mutex GeoDTMCache::m_Mutex;
+size_t GeoDTMCache::m_nMemory = 0;
+size_t GeoDTMCache::m_nMaxMemory = (size_t)256 << 20;
+
+//==============================================================================
+// GeoDTMCache : recherche d'un niveau, le niveau trouve devient le plus recent
+//==============================================================================
+std::shared_ptr<const GeoDTMCache::Level> GeoDTMCache::Find(const std::string& filename, uint32_t factor)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto iter = m_Index.find(Key(filename, factor));
+	if (iter == m_Index.end())
+		return nullptr;
+	m_Items.splice(m_Items.begin(), m_Items, iter->second);
+	return iter->second->second;
+}
+
+//==============================================================================
+// GeoDTMCache : ajout d'un niveau
+//==============================================================================
+void GeoDTMCache::Insert(const std::string& filename, std::shared_ptr<const Level> level)
+{
+	if (level.get() == nullptr)
+		return;
+	std::string key = Key(filename, level->factor);
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if (m_Index.find(key) != m_Index.end())	// Deja lu par un autre thread
+		return;
+	m_Items.push_front(Item(key, level));
+	m_Index[key] = m_Items.begin();
+	m_nMemory += level->MemorySize();
+	Evict();
+}
+
+//==============================================================================
+// GeoDTMCache : retrait des niveaux d'un MNT
+//==============================================================================
+void GeoDTMCache::Remove(const std::string& filename)
+{
+	std::string prefix = filename + "@";
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	for (auto iter = m_Items.begin(); iter != m_Items.end(); ) {
+		if (iter->first.compare(0, prefix.size(), prefix) != 0) {
+			iter++;
+			continue;
+		}
+		m_nMemory -= iter->second->MemorySize();
+		m_Index.erase(iter->first);
+		iter = m_Items.erase(iter);
+	}
+}
+
+//==============================================================================
+// GeoDTMCache : liberation des niveaux les plus anciens
+//==============================================================================
+void GeoDTMCache::Evict()
+{
+	while ((m_nMemory > m_nMaxMemory) && (m_Items.size() > 1)) {
+		m_nMemory -= m_Items.back().second->MemorySize();
+		m_Index.erase(m_Items.back().first);
+		m_Items.pop_back();
+	}
+}
+
+void GeoDTMCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Items.clear();
+	m_Index.clear();
+	m_nMemory = 0;
+}
+
+void GeoDTMCache::MaxMemory(size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_nMaxMemory = size;
+	Evict();
+}
+
 //-----------------------------------------------------------------------------
 // Ouverture du MNT Tiff
 //-----------------------------------------------------------------------------
@@ -363,8 +582,8 @@ bool GeoDTM::ImportTif(std::string file_tif, std::string file_bin)
 		}
 	}
 
-	if (!xml_file) {
-		// Calcul des statistiques
+	if ((!xml_file) && (m_dZmin <= XGEO_NO_DATA)) {
+		// Calcul des statistiques, sauf si elles viennent deja du cache du MNT
 		if (m_Image.NbSample() < 5) {
 			double minVal[4], maxVal[4], meanVal[4];
 			uint32_t noData[4];
@@ -389,9 +608,63 @@ bool GeoLAS::Open(std::string filename)
 	m_Frame = XFrame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
 	m_ZRange[0] = m_Header->min_z;
 	m_ZRange[1] = m_Header->max_z;
+
+	// Les rasters de synthese et l'index sont conserves entre les sessions, ceux d'une version
+	// precedente du fichier sont supprimes
+	juce::File file(juce::String(filename.c_str()));
+	m_strOverviewPrefix = GeoTools::PersistentCacheEntry("LasOverview", file).getFullPathName().toStdString();
+	if (!m_bCopc) {	// Index spatial pour eviter la lecture de tout le fichier
+		SetIndexFile(m_strOverviewPrefix + ".lxi");
+		LoadIndex();
+	}
 	return true;
 }
 
+//==============================================================================
+// Classe GeoLAS : indique si les rasters de synthese ont ete calcules
+//==============================================================================
+bool GeoLAS::HasOverview() const
+{
+	if (m_strOverviewPrefix.empty())
+		return false;
+	return juce::File(juce::String(OverviewFile(0).c_str())).existsAsFile();
+}
+
+//==============================================================================
+// Classe GeoLAS : indique si l'index spatial doit etre calcule
+//==============================================================================
+bool GeoLAS::NeedIndex() const
+{
+	if (m_bCopc || IndexFile().empty())
+		return false;
+	return !juce::File(juce::String(IndexFile().c_str())).existsAsFile();
+}
+
+//==============================================================================
+// Calcul en tache de fond des index spatiaux et des rasters de synthese des fichiers LAS
+// L'index est calcule en premier : il accelere immediatement l'affichage a grande echelle
+//==============================================================================
+void LasOverviewTask::run()
+{
+	for (size_t i = 0; i < m_Files.size(); i++) {
+		if (threadShouldExit())
+			return;
+		XLasFile las;
+		if (!las.Open(m_Files[i].filename, false))
+			continue;
+		if ((!m_Files[i].index.empty()) && (!juce::File(juce::String(m_Files[i].index.c_str())).existsAsFile()))
+			las.BuildIndex(m_Files[i].index, nullptr, this);
+		if (threadShouldExit())
+			return;
+		bool flag = false;
+		if (!juce::File(juce::String(XLasFile::OverviewFilename(m_Files[i].prefix, 0).c_str())).existsAsFile())
+			flag = las.ComputeOverviews(m_Files[i].prefix, GeoLAS::OverviewGsd(), nullptr, this);
+		las.Close();
+		if (flag)
+			sendActionMessage("UpdateLas");
+	}
+}
+
 //==============================================================================
 // Classe GeoLAS : lecture des attributs du fichier LAS
 //==============================================================================
@@ -693,7 +966,8 @@ XGeoClass* GeoTools::ImportDataFolder(juce::String folderName, XGeoBase* base, X
 				if (type == XGeoVector::DTM) {
 					GeoDTM* dtm = new GeoDTM;
 					juce::File tmpFile = juce::File::createTempFile("tif");
-					if (!dtm->OpenDtm(AppUtil::GetStringFilename((*T)[i].getFullPathName()).c_str(), tmpFile.getFullPathName().toStdString().c_str())) {
+					if (!dtm->OpenDtmCache(AppUtil::GetStringFilename((*T)[i].getFullPathName()).c_str(), GeoDTM::CacheFilename((*T)[i]).c_str(),
+																 tmpFile.getFullPathName().toStdString().c_str())) {
 						delete dtm;
 						continue;
 					}
@@ -787,6 +1061,30 @@ juce::File GeoTools::CreateCacheDir(juce::String name)
 	return cache;
 }
 
+//-----------------------------------------------------------------------------
+// Entree d'un cache conserve entre les sessions, dans IGNMap/folder sous le dossier
+// des donnees de l'application. Le nom (sans extension) depend du chemin, de la taille
+// et de la date du fichier source : les entrees perimees de la meme source sont supprimees
+//-----------------------------------------------------------------------------
+juce::File GeoTools::PersistentCacheEntry(juce::String folder, const juce::File& source)
+{
+	juce::File appDir = juce::File::getSpecialLocation(juce::File::SpecialLocationType::userApplicationDataDirectory);
+	juce::File cache = appDir.getChildFile("IGNMap").getChildFile(folder);
+	cache.createDirectory();
+	juce::String sourceKey = juce::File::createLegalFileName(source.getFileNameWithoutExtension()) + "_" +
+		juce::String::toHexString(source.getFullPathName().hashCode64()) + "_";
+	juce::String name = sourceKey + juce::String::toHexString(source.getSize()) + "_" +
+		juce::String::toHexString(source.getLastModificationTime().toMilliseconds());
+	juce::Array<juce::File> entries = cache.findChildFiles(juce::File::findFiles, false, sourceKey + "*");
+	for (int i = 0; i < entries.size(); i++) {
+		juce::String filename = entries[i].getFileName();
+		if ((filename == name) || filename.startsWith(name + ".") || filename.startsWith(name + "_"))
+			continue;
+		entries[i].deleteFile();
+	}
+	return cache.getChildFile(name);
+}
+
 //-----------------------------------------------------------------------------
 // Changement de projection de la base
 //-----------------------------------------------------------------------------
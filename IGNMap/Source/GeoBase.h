@@ -98,15 +98,59 @@ public:
   virtual ~GeoDTM() { Close(); }
   virtual void Close();
 
+  static std::string CacheFilename(const juce::File& file);  // Cache persistant des MNT importes
+
+  // Dessin : zone de noeuds sous-echantillonnee d'un facteur factor
+  bool PrepareDraw(XFrame* F, double gsdR, int& U0, int& V0, int& win, int& hin, int& R0, int& S0, int& wout, int& hout);
+  uint32_t DrawFactor(uint32_t factor);
+  bool GetDrawArea(int U0, int V0, int win, int hin, uint32_t factor, float* area);
+
   virtual bool StreamReady();
   virtual bool ReadLine(float* line, uint32_t numLine);
   virtual bool ReadNode(float* node, uint32_t x, uint32_t y);
   virtual bool ReadAll(float* area);
+  virtual bool ReadBlock(float* block, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 
   virtual bool ImportTif(std::string file_tif, std::string file_bin);
 
 protected:
   XFileImage     m_Image;
+  std::unique_ptr<juce::MemoryMappedFile> m_Map;  // Projection en memoire du fichier temporaire
+
+  bool OpenImage();
+};
+
+//==============================================================================
+// Cache des MNT sous-echantillonnes pour l'affichage, partage par tous les MNT
+// Un niveau contient tout le MNT pour un facteur donne : les deplacements a
+// echelle constante ne relisent plus le fichier
+//==============================================================================
+class GeoDTMCache {
+public:
+  struct Level {
+    uint32_t factor, w, h;
+    std::vector<float> data;
+    size_t MemorySize() const { return data.size() * sizeof(float) + sizeof(Level); }
+  };
+
+  static std::shared_ptr<const Level> Find(const std::string& filename, uint32_t factor);
+  static void Insert(const std::string& filename, std::shared_ptr<const Level> level);
+  static void Remove(const std::string& filename);
+  static void Clear();
+  static size_t MaxMemory() { return m_nMaxMemory; }
+  static void MaxMemory(size_t size);
+  static size_t MaxLevelSize() { return (size_t)4 << 20; }  // Nombre maximum de noeuds d'un niveau
+
+protected:
+  typedef std::pair<std::string, std::shared_ptr<const Level> > Item;
+  static std::list<Item> m_Items;	// Du plus recent au plus ancien
+  static std::unordered_map<std::string, std::list<Item>::iterator> m_Index;
+  static std::mutex m_Mutex;
+  static size_t m_nMemory;
+  static size_t m_nMaxMemory;
+
+  static std::string Key(const std::string& filename, uint32_t factor) { return filename + "@" + std::to_string(factor); }
+  static void Evict();
 };
 
 //==============================================================================
@@ -126,8 +170,16 @@ public:
   virtual inline double Zmin() const { return m_ZRange[0]; }
   virtual inline double Zmax() const { return m_ZRange[1]; }
 
+  // Rasters de synthese utilises pour l'affichage a petite echelle
+  static double OverviewGsd() { return 4.; }
+  std::string OverviewPrefix() const { return m_strOverviewPrefix; }
+  std::string OverviewFile(int level) const { return OverviewFilename(m_strOverviewPrefix, level); }
+  bool HasOverview() const;
+  bool NeedIndex() const;
+
 protected:
   double m_ZRange[2];
+  std::string m_strOverviewPrefix;
 };
 
 //==============================================================================
@@ -160,6 +212,7 @@ namespace GeoTools {
                       int transparency = 0, uint32_t color = 0xFFFFFFFF, uint32_t fill = 0xFFFFFFFF, uint32_t zorder = 0, uint8_t size = 1);
   void ColorizeClasses(XGeoBase* base);
   juce::File CreateCacheDir(juce::String name);
+  juce::File PersistentCacheEntry(juce::String folder, const juce::File& source);
   void UpdateProjection(XGeoBase* base);
   bool ComputeZGrid(XGeoBase* base, float* grid, uint32_t w, uint32_t h, XFrame* F);
   bool AddImageInObect(XGeoBase* base, int index);
@@ -175,8 +228,29 @@ public:
 	
 	virtual void SetRange(int min, int max) { m_nMin = min ; m_nMax = max;}
 	virtual void SetStep(int step) { m_nStep = step;}
-	virtual void StepIt() { m_nStep++; setProgress((double)(m_nMax - m_nMin) / m_nStep);}
+	virtual void StepIt() { m_nStep++; if (m_nMax > m_nMin) setProgress((double)(m_nStep - m_nMin) / (m_nMax - m_nMin));}
 	virtual void SetStatus(const char* s) {setStatusMessage(s);}
 	virtual void Cancel() { m_bCancel = true; stopThread(100);}
 	virtual bool CheckCancel() { return threadShouldExit();}
 };
+
+//==============================================================================
+// Calcul en tache de fond des index spatiaux et des rasters de synthese des fichiers LAS
+//==============================================================================
+class LasOverviewTask : public juce::Thread, public XWait, public juce::ActionBroadcaster {
+public:
+	LasOverviewTask() : juce::Thread("LasOverview") { ; }
+	virtual ~LasOverviewTask() { stopThread(5000); }
+
+	void AddFile(std::string filename, std::string prefix, std::string index = "") { m_Files.push_back({ filename, prefix, index }); }
+	virtual void run() override;
+	virtual bool CheckCancel() { return threadShouldExit(); }
+
+protected:
+	struct Item {
+		std::string filename;
+		std::string prefix;	// Prefixe des rasters de synthese
+		std::string index;	// Index spatial a calculer (vide pour les fichiers COPC)
+	};
+	std::vector<Item> m_Files;
+};
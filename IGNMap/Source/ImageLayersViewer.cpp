@@ -310,7 +310,7 @@ void ImageLayersViewer::actionListenerCallback(const juce::String& message)
 {
 	if (message == "UpdateFillOpacity") {
 		repaint();
-		sendActionMessage("UpdateRaster");
+		sendActionMessage("UpdateRasterClass");
 		return;
 	}
 	if (message == "NewWindow") {
@@ -319,7 +319,7 @@ void ImageLayersViewer::actionListenerCallback(const juce::String& message)
 		return;
 	}
 	if (message == "UpdateClass") {
-		sendActionMessage("UpdateRaster");
+		sendActionMessage("UpdateRasterClass");
 		return;
 	}
 	
@@ -342,7 +342,7 @@ void ImageLayersViewer::actionListenerCallback(const juce::String& message)
 		for (int i = 0; i < T.size(); i++)
 			T[i]->Visible(!T[i]->Visible());
 		m_Table.repaint();
-		sendActionMessage("UpdateRaster");
+		sendActionMessage("UpdateRasterClass");
 		return;
 	}
 	if (message == "UpdateImageSelectability") {
@@ -390,7 +390,7 @@ void ImageLayersViewer::itemDropped(const SourceDetails& details)
 	}
 	m_Base->SortClass();
 	m_Table.repaint();
-	m_Model.sendActionMessage("UpdateRaster");
+	m_Model.sendActionMessage("UpdateRasterClass");
 }
 
 bool ImageLayersViewer::isInterestedInDragSource(const SourceDetails& details)
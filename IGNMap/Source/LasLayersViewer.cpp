@@ -18,6 +18,7 @@
 #include "GeoBase.h"
 #include "../XTool/XGeoVector.h"
 #include "../XToolAlgo/XLasFile.h"
+#include <map>
 
 //==============================================================================
 // FindLasClass : renvoie la ieme classe LAS de la base ou nullptr sinon
@@ -766,6 +767,10 @@ void LasLayersViewer::ComputeDtm(std::vector<XGeoClass*> T)
 	juce::TextEditor* gsd_editor = asyncAlertWindow->getTextEditor("GSD");
 	gsd_editor->setInputRestrictions(5, "0123456789.");
 	asyncAlertWindow->addComboBox("Algo", { "Z minimum", "Z average", "Z maximum", "StdDev"}, juce::translate("Algorithm:"));
+	asyncAlertWindow->addComboBox("Output", { juce::translate("One file per LAS file"), juce::translate("One file per LAS layer") },
+		juce::translate("Output:"));
+	asyncAlertWindow->addTextEditor("Fill", "0", juce::translate("Gap filling radius (pixels):"));
+	asyncAlertWindow->getTextEditor("Fill")->setInputRestrictions(3, "0123456789");
 	asyncAlertWindow->addButton("OK", 1, juce::KeyPress(juce::KeyPress::returnKey, 0, 0));
 	asyncAlertWindow->addButton("Cancel", 0, juce::KeyPress(juce::KeyPress::escapeKey, 0, 0));
 
@@ -778,6 +783,49 @@ void LasLayersViewer::ComputeDtm(std::vector<XGeoClass*> T)
 	auto algoIndexChosen = asyncAlertWindow->getComboBoxComponent("Algo")->getSelectedItemIndex();
 	auto gsd_text = asyncAlertWindow->getTextEditorContents("GSD");
 	double gsd = gsd_text.getDoubleValue();
+	bool mosaic = (asyncAlertWindow->getComboBoxComponent("Output")->getSelectedItemIndex() == 1);
+	int fill = asyncAlertWindow->getTextEditorContents("Fill").getIntValue();
+
+	if (mosaic) {	// Un seul MNT par couche, calcule en parallele sur tous les fichiers de la couche
+		class MosaicTask : public GeoTask {
+		public:
+			std::vector<XGeoClass*> T;
+			juce::String Foldername;
+			double GSD = 1.;
+			int Fill = 0;
+			XLasFile::AlgoDtm Algo = XLasFile::ZMinimum;
+			bool Result = true;
+			void run() {
+				bool classif_visibility[256];
+				for (int i = 0; i < 256; i++) classif_visibility[i] = LasShader::ClassificationVisibility((uint8_t)i);
+				for (size_t i = 0; i < T.size(); i++) {
+					if (threadShouldExit())
+						return;
+					setStatusMessage(juce::translate("Processing ") + T[i]->Name());
+					XLasDtmBuilder builder;
+					builder.FillRadius((uint32_t)Fill);
+					for (uint32_t j = 0; j < T[i]->NbVector(); j++) {
+						GeoLAS* las = dynamic_cast<GeoLAS*>(T[i]->Vector(j));
+						if (las != nullptr)
+							builder.AddFile(las->Filename(), las->IndexFile());
+					}
+					juce::String file_out = Foldername + juce::File::getSeparatorString() + juce::File::createLegalFileName(T[i]->Name()) + ".tif";
+					Result &= builder.Compute(AppUtil::GetStringFilename(file_out), GSD, Algo, classif_visibility, nullptr, this);
+				}
+			}
+		};
+		MosaicTask task;
+		task.T = T;
+		task.Foldername = foldername;
+		task.GSD = gsd;
+		task.Fill = fill;
+		task.Algo = (XLasFile::AlgoDtm)(algoIndexChosen + 1);
+		task.runThread();
+		if (!task.Result)
+			juce::AlertWindow::showMessageBoxAsync(juce::AlertWindow::WarningIcon, juce::translate("Compute DTM/DSM"),
+				juce::translate("Some DTM/DSM could not be computed"), "OK");
+		return;
+	}
 
 	// Thread de traitement
 	class MyTask : public ThreadClassProcessor {
@@ -798,6 +846,9 @@ void LasLayersViewer::ComputeDtm(std::vector<XGeoClass*> T)
 			XLasFile las;
 			if (!las.Open(V->Filename()))
 				return false;
+			GeoLAS* geolas = dynamic_cast<GeoLAS*>(V);
+			if (geolas != nullptr)
+				las.SetIndexFile(geolas->IndexFile());
 			juce::File file(V->Filename());
 			juce::String file_out = m_strFolderOut + juce::File::getSeparatorString() + file.getFileNameWithoutExtension() + ".tif";
 			setStatusMessage(juce::translate("Processing ") + file.getFileNameWithoutExtension());
@@ -822,13 +873,16 @@ void LasLayersViewer::ComputeStat(std::vector<XGeoClass*> T)
 	if (foldername.isEmpty())
 		return;
 
-	// Thread de traitement
+	// Thread de traitement : les fichiers sont traites en parallele, les statistiques sont
+	// conservees pour ecrire ensuite le MIF/MID et le resume JSON dans un ordre deterministe
 	class MyTask : public ThreadClassProcessor {
 	public:
+		std::mutex m_Mutex;
+		std::map<std::string, XLasStat> m_Stat;
 
 		MyTask() : ThreadClassProcessor(juce::translate("Compute LAS Statistics ..."), true)
 		{
-			
+			m_nNbThread = XMax((int)std::thread::hardware_concurrency(), 1);
 		}
 
 		virtual bool Process(XGeoVector* V)
@@ -836,17 +890,24 @@ void LasLayersViewer::ComputeStat(std::vector<XGeoClass*> T)
 			if (V->TypeVector() != XGeoVector::LAS)
 				return false;
 			XLasFile las;
-			if (!las.Open(V->Filename()))
+			if (!las.Open(V->Filename(), false))
 				return false;
 			juce::File file(V->Filename());
-			juce::String file_out = m_strFolderOut + juce::File::getSeparatorString() + file.getFileNameWithoutExtension() + ".txt";
+			juce::String file_out = m_strFolderOut + juce::File::getSeparatorString() + file.getFileNameWithoutExtension();
 			setStatusMessage(juce::translate("Processing ") + file.getFileNameWithoutExtension());
-			std::ofstream mif, mid;
-			mif.open(m_strMifFile.toStdString(), std::ios::out | std::ios::app);
-			mid.open(m_strMidFile.toStdString(), std::ios::out | std::ios::app);
-			mif.setf(std::ios::fixed); mif.precision(2);
-			mid.setf(std::ios::fixed); mid.precision(2);
-			return las.StatLas(file_out.toStdString(), &mif, &mid);
+			XLasStat stat;
+			if (!las.ComputeStat(stat))
+				return false;
+			las.Close();
+			std::ofstream out;
+			out.open((file_out + ".txt").toStdString());
+			stat.WriteText(&out);
+			out.close();
+			stat.WriteDensity((file_out + "_density.tif").toStdString());
+			stat.density.clear();	// La grille n'est plus utile
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Stat[V->Filename()] = stat;
+			return true;
 		}
 	};
 
@@ -867,6 +928,61 @@ void LasLayersViewer::ComputeStat(std::vector<XGeoClass*> T)
 
 	M.CreateMifMidFile(foldername, juce::String("StatLAS"), Att);
 	M.runThread();
+
+	// Ecriture du MIF/MID et du resume JSON
+	std::ofstream mif, mid, json;
+	mif.open(M.m_strMifFile.toStdString(), std::ios::out | std::ios::app);
+	mid.open(M.m_strMidFile.toStdString(), std::ios::out | std::ios::app);
+	mif.setf(std::ios::fixed); mif.precision(2);
+	mid.setf(std::ios::fixed); mid.precision(2);
+	json.open((foldername + juce::File::getSeparatorString() + "StatLAS.json").toStdString());
+	json.setf(std::ios::fixed); json.precision(3);
+
+	uint64_t nbPoint = 0, classif[256];
+	memset(classif, 0, sizeof(classif));
+	uint32_t nbInconsistent = 0;
+	XFrame F;
+	double gpsMin = 0., gpsMax = 0.;
+	bool firstGps = true;
+	json << "{" << std::endl << "\"files\": [" << std::endl;
+	for (auto iter = M.m_Stat.begin(); iter != M.m_Stat.end(); iter++) {
+		const XLasStat& stat = iter->second;
+		stat.WriteMifMid(&mif, &mid);
+		if (iter != M.m_Stat.begin())
+			json << "," << std::endl;
+		stat.WriteJson(&json);
+		if (stat.nbRead > 0) {
+			if (firstGps) {
+				gpsMin = stat.gpsTimeMin;
+				gpsMax = stat.gpsTimeMax;
+				firstGps = false;
+			}
+			gpsMin = XMin(gpsMin, stat.gpsTimeMin);
+			gpsMax = XMax(gpsMax, stat.gpsTimeMax);
+			F += stat.frame;
+		}
+		nbPoint += stat.nbRead;
+		for (int i = 0; i < 256; i++)
+			classif[i] += stat.classif[i];
+		if (!stat.IsConsistent())
+			nbInconsistent++;
+	}
+	json << std::endl << "]," << std::endl << "\"total\": { \"files\": " << M.m_Stat.size() << ", \"points\": " << nbPoint
+		<< ", \"inconsistent_files\": " << nbInconsistent
+		<< ", \"frame\": [" << F.Xmin << ", " << F.Ymin << ", " << F.Xmax << ", " << F.Ymax << "]"
+		<< ", \"gps_time\": [" << gpsMin << ", " << gpsMax << "], \"classification\": {";
+	bool first = true;
+	for (int i = 0; i < 256; i++) {
+		if (classif[i] == 0)
+			continue;
+		json << (first ? " " : ", ") << "\"" << i << "\": " << classif[i];
+		first = false;
+	}
+	json << " } }" << std::endl << "}" << std::endl;
+	mif.close();
+	mid.close();
+	json.close();
+
 	GeoTools::ImportMifMid(M.m_strMifFile, m_Base);
 	GeoTools::ColorizeClasses(m_Base);
 	sendActionMessage("UpdateVector");
@@ -265,6 +265,9 @@ juce::PopupMenu MainComponent::getMenuForIndex(int menuIndex, const juce::String
 		menu.addSeparator();
 		menu.addCommandItem(&m_CommandManager, CommandIDs::menuGoogle);
 		menu.addCommandItem(&m_CommandManager, CommandIDs::menuBing);
+		menu.addSeparator();
+		menu.addCommandItem(&m_CommandManager, CommandIDs::menuShowProfile);
+		menu.addCommandItem(&m_CommandManager, CommandIDs::menuExportProfile);
 	}
 	else if (menuIndex == 4) // Help
 	{
@@ -308,7 +311,7 @@ void MainComponent::getAllCommands(juce::Array<juce::CommandID>& c)
 		CommandIDs::menuAddGeoportailSCAN50Histo,
 		CommandIDs::menuAddWmtsServer, CommandIDs::menuAddTmsServer, CommandIDs::menuSynchronize,
 		CommandIDs::menuScale1k, CommandIDs::menuScale10k, CommandIDs::menuScale25k, CommandIDs::menuScale100k, CommandIDs::menuScale250k,
-		CommandIDs::menuGoogle, CommandIDs::menuBing,
+		CommandIDs::menuGoogle, CommandIDs::menuBing, CommandIDs::menuShowProfile, CommandIDs::menuExportProfile,
 		CommandIDs::menuToolSentinel,
 		CommandIDs::menuHelp, CommandIDs::menuAbout };
 	c.addArray(commands);
@@ -489,6 +492,14 @@ void MainComponent::getCommandInfo(juce::CommandID commandID, juce::ApplicationC
 	case CommandIDs::menuBing:
 		result.setInfo(juce::translate("Bing Maps"), juce::translate("Bing Maps"), "Menu", 0);
 		break;
+	case CommandIDs::menuShowProfile:
+		result.setInfo(juce::translate("View Rendering Statistics"), juce::translate("View Rendering Statistics"), "Menu", 0);
+		if (m_MapView.get() != nullptr)
+			result.setTicked(m_MapView.get()->IsProfileVisible());
+		break;
+	case CommandIDs::menuExportProfile:
+		result.setInfo(juce::translate("Export Rendering Statistics"), juce::translate("Export Rendering Statistics"), "Menu", 0);
+		break;
 	case CommandIDs::menuHelp:
 		result.setInfo(juce::translate("Help"), juce::translate("Help"), "Menu", 0);
 		break;
@@ -666,6 +677,12 @@ bool MainComponent::perform(const InvocationInfo& info)
 	case CommandIDs::menuBing:
 		juce::URL(XInternetMap::BingMapsUrl(m_MapView.get()->GetTarget(), m_MapView.get()->GetGsd())).launchInDefaultBrowser();
 		break;
+	case CommandIDs::menuShowProfile:
+		m_MapView.get()->ShowProfile(!m_MapView.get()->IsProfileVisible());
+		break;
+	case CommandIDs::menuExportProfile:
+		m_MapView.get()->ExportProfile();
+		break;
 	case CommandIDs::menuHelp:
 		juce::URL("https://github.com/IGNF/IGNMap/blob/master/Documentation/Documentation.md").launchInDefaultBrowser();
 		break;
@@ -697,6 +714,14 @@ void MainComponent::actionListenerCallback(const juce::String& message)
 		m_MapView.get()->RenderMap(false, true, false, false, false, true);
 		return;
 	}
+	if (message == "UpdateVectorClass") {	// Seules les classes modifiees sont redessinees
+		m_MapView.get()->RenderMap(true, false, false, true, false, false, true);
+		return;
+	}
+	if (message == "UpdateRasterClass") {	// Seules les classes modifiees sont redessinees
+		m_MapView.get()->RenderMap(false, true, false, false, false, false, true);
+		return;
+	}
 	if (message == "UpdateDtm") {
 		m_MapView.get()->RenderMap(false, false, true, false, false, true);
 		return;
@@ -922,6 +947,9 @@ void MainComponent::Clear()
 {
 	m_MapView.get()->Clear();
 	m_GeoBase.Clear();
+	XLasNodeCache::Clear();
+	XLasReaderPool::Clear();
+	GeoDTMCache::Clear();
 	m_MapView.get()->SetGeoBase(&m_GeoBase);
 	m_VectorViewer.get()->SetBase(&m_GeoBase);
 	m_ImageViewer.get()->SetBase(&m_GeoBase);
@@ -969,12 +997,14 @@ void MainComponent::RunCommandLine()
 		filesDropped(T, 0, 0);
 	}
 	int index = 0;
+	juce::String benchScript, benchReport;
 	while(index < T.size()) {
 		if (T[index] == "-i") { // Input d'un fichier image
 			index++;
 			if (index >= T.size())	// Nom du fichier image absent
 				break;
 			ImportImageFile(T[index]);
+			index++;
 			continue;
 		}
 		if (T[index] == "-v") { // Input d'un fichier vectoriel
@@ -982,6 +1012,45 @@ void MainComponent::RunCommandLine()
 			if (index >= T.size())	// Nom du fichier vectoriel absent
 				break;
 			ImportVectorFile(T[index]);
+			index++;
+			continue;
+		}
+		if (T[index] == "-d") { // Input d'un fichier MNT
+			index++;
+			if (index >= T.size())	// Nom du fichier MNT absent
+				break;
+			ImportDtmFile(T[index]);
+			index++;
+			continue;
+		}
+		if (T[index] == "-l") { // Input d'un fichier LAS/LAZ
+			index++;
+			if (index >= T.size())	// Nom du fichier LAS absent
+				break;
+			ImportLasFile(T[index]);
+			index++;
+			continue;
+		}
+		if (T[index] == "-bench") { // Benchmark de rendu : -bench script resultat
+			if (index + 2 >= T.size())
+				break;
+			benchScript = T[index + 1];
+			benchReport = T[index + 2];
+			index += 3;
+			continue;
+		}
+		if (T[index] == "-benchdata") { // Jeux de donnees synthetiques pour le benchmark : -benchdata repertoire
+			index++;
+			if (index >= T.size())	// Repertoire absent
+				break;
+			juce::StringArray files;
+			if (MapBenchmark::GenerateDatasets(juce::File(T[index]), files)) {
+				ImportImageFile(files[0]);
+				ImportDtmFile(files[1]);
+				ImportLasFile(files[2]);
+				ImportVectorFile(files[3]);
+			}
+			index++;
 			continue;
 		}
 		if (T[index] == "-r") { // Input d'un fichier image avec rotation
@@ -990,6 +1059,7 @@ void MainComponent::RunCommandLine()
 				break;
 			juce::String filename = T[index];
 			GeoTools::AddRotationImage(&m_GeoBase, filename, -2.78 * 180. / XPI, 739200.24, 6916389.66, 10.14);
+			index++;
 			continue;
 		}
 		break;	// Si on arrive la, c'est qu'il y a un probleme ...
@@ -997,6 +1067,11 @@ void MainComponent::RunCommandLine()
 	ShowHideSidePanel();
 	m_MapView.get()->SetFrame(m_GeoBase.Frame());
 	m_MapView.get()->ZoomWorld();
+	if (benchReport.isNotEmpty()) {	// Le benchmark ferme l'application une fois termine
+		m_MapView.get()->Suspend(true);	// La vue ne doit pas dessiner en meme temps que le benchmark
+		m_Benchmark.reset(new MapBenchmark(&m_GeoBase, benchScript, benchReport, true));
+		m_Benchmark.get()->startThread();
+	}
 }
 
 //==============================================================================
@@ -1170,7 +1245,8 @@ bool MainComponent::ImportDtmFile(juce::String dtmfile)
 
 	GeoDTM* dtm = new GeoDTM;
 	juce::File tmpFile = juce::File::createTempFile("tif");
-	if (!dtm->OpenDtm(AppUtil::GetStringFilename(filename).c_str(), tmpFile.getFullPathName().toStdString().c_str())) {
+	if (!dtm->OpenDtmCache(AppUtil::GetStringFilename(filename).c_str(), GeoDTM::CacheFilename(file).c_str(),
+												 tmpFile.getFullPathName().toStdString().c_str())) {
 		delete dtm;
 		tmpFile.deleteFile();
 		juce::AlertWindow::showMessageBoxAsync(juce::AlertWindow::WarningIcon, "IGNMap",
@@ -1212,6 +1288,7 @@ void MainComponent::ImportLasFolder()
 	if(ImportDataFolder(folderName, XGeoVector::LAS) != nullptr) {
 		m_LasViewer.get()->SetBase(&m_GeoBase); // Le LasViewer appele la mise a jour de la vue
 		m_MapView.get()->RenderMap(false, false, false, false, true, true);
+		ComputeLasOverviews();
 	}
 }
 
@@ -1245,10 +1322,43 @@ bool MainComponent::ImportLasFile(juce::String lasfile)
 	m_LasViewer.get()->SetBase(&m_GeoBase); // Le LasViewer appele la mise a jour de la vue
 	m_MapView.get()->SetFrame(m_GeoBase.Frame());
 	m_MapView.get()->RenderMap(false, false, false, false, true, true);
+	ComputeLasOverviews();
 
 	return true;
 }
 
+//==============================================================================
+// Calcul en tache de fond des index spatiaux et des rasters de synthese des fichiers LAS
+//==============================================================================
+void MainComponent::ComputeLasOverviews()
+{
+	std::unique_ptr<LasOverviewTask> task(new LasOverviewTask);
+	int nb_file = 0;
+	for (uint32_t i = 0; i < m_GeoBase.NbClass(); i++) {
+		XGeoClass* C = m_GeoBase.Class(i);
+		if (!C->IsLAS())
+			continue;
+		for (uint32_t j = 0; j < C->NbVector(); j++) {
+			GeoLAS* las = dynamic_cast<GeoLAS*>(C->Vector(j));
+			if (las == nullptr)
+				continue;
+			if (las->OverviewPrefix().empty())
+				continue;
+			bool index = las->NeedIndex();
+			if (las->HasOverview() && (!index))
+				continue;
+			task.get()->AddFile(las->Filename(), las->OverviewPrefix(), index ? las->IndexFile() : "");
+			nb_file++;
+		}
+	}
+	if (nb_file == 0)
+		return;
+	m_LasOverviewTask.reset(); // La tache precedente est arretee, les fichiers restants sont repris
+	m_LasOverviewTask = std::move(task);
+	m_LasOverviewTask.get()->addActionListener(this);
+	m_LasOverviewTask.get()->startThread();
+}
+
 //==============================================================================
 // Ajout d'une couche TMS OSM
 //==============================================================================
@@ -1396,7 +1506,7 @@ bool MainComponent::ExportLas()
 	juce::DialogWindow::LaunchOptions options;
 	options.content.setOwned(dlg);
 
-	juce::Rectangle<int> area(0, 0, 410, 300);
+	juce::Rectangle<int> area(0, 0, 410, 340);
 
 	options.content->setSize(area.getWidth(), area.getHeight());
 	options.dialogTitle = juce::translate("Export LAS");
@@ -60,7 +60,7 @@ public:
     menuAddGeoportailOrthophoto, menuAddGeoportailOrthophotoIRC, menuAddGeoportailOrthohisto, menuAddGeoportailSatellite,
     menuAddGeoportailCartes, menuAddGeoportailPlanIGN, menuAddGeoportailParcelExpress, menuAddGeoportailSCAN50Histo,
     menuMove, menuSelect, menuZoom,
-    menuSynchronize, menuGoogle, menuBing,
+    menuSynchronize, menuGoogle, menuBing, menuShowProfile, menuExportProfile,
     menuToolSentinel,
     menuHelp, menuAbout
   };
@@ -120,6 +120,8 @@ private:
   MainComponentToolbarFactory m_ToolbarFactory;
 
   XGeoBase m_GeoBase;
+  std::unique_ptr<MapBenchmark> m_Benchmark; // Benchmark de rendu lance en ligne de commande
+  std::unique_ptr<LasOverviewTask> m_LasOverviewTask; // Calcul des rasters de synthese LAS
   std::vector<GeoSearch*> m_Search;   // Recherche effectuees pendant la session
   std::vector<ToolWindow*> m_ToolWindows;
 
@@ -147,6 +149,7 @@ private:
   bool ImportImageFile(juce::String rasterfile = "");
   bool ImportDtmFile(juce::String dtmfile = "");
   bool ImportLasFile(juce::String lasfile = "");
+  void ComputeLasOverviews();
 
   bool ExportVector(); 
   bool ExportImage();
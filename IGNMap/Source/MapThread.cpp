@@ -16,8 +16,11 @@
 #include "../../XTool/XGeoPoint.h"
 #include "../../XTool/XGeoLine.h"
 #include "../../XTool/XGeoPoly.h"
+#include "../../XToolImage/XTiffWriter.h"
 #include "DtmShader.h"
 #include "LasShader.h"
+#include <thread>
+#include <atomic>
 
 //==============================================================================
 // Constructeur
@@ -31,6 +34,13 @@ MapThread::MapThread(const juce::String& threadName, size_t threadStackSize) : j
 	m_dX0 = m_dY0 = 0.;
 	m_dGsd = 1.0;
 	m_bRaster = m_bVector = m_bOverlay = m_bDtm = m_bLas = m_bRasterDone = m_bFirstRaster = false;
+	m_bModifiedOnly = false;
+	m_nFrameNum = 0;
+	m_Profile = FrameProfile();
+	m_NullLayer = LayerProfile();
+	m_CurLayer = &m_NullLayer;
+	m_dLayerStart = 0.;
+	m_nLayerBytes = m_nLayerRead = 0;
 }
 
 //==============================================================================
@@ -67,13 +77,91 @@ void MapThread::SetDimension(const int& w, const int& h)
 //==============================================================================
 // Indique quels elements sont a mettre  jour
 //==============================================================================
-void MapThread::SetUpdate(bool overlay, bool raster, bool dtm, bool vector, bool las)
+void MapThread::SetUpdate(bool overlay, bool raster, bool dtm, bool vector, bool las, bool modifiedOnly)
 {
 	m_bRaster = raster;
 	m_bVector = vector;
 	m_bOverlay = overlay;
 	m_bDtm = dtm;
 	m_bLas = las;
+	m_bModifiedOnly = modifiedOnly;
+}
+
+//==============================================================================
+// Rectangle pixel correspondant a une emprise terrain, limite a la vue
+//==============================================================================
+juce::Rectangle<int> MapThread::PixelFrame(const XFrame& F, int margin)
+{
+	double W = m_Vector.getWidth(), H = m_Vector.getHeight();
+	double x0 = XMax(floor((F.Xmin - m_dX0) / m_dGsd) - margin, -1.), y0 = XMax(floor((m_dY0 - F.Ymax) / m_dGsd) - margin, -1.);
+	double x1 = XMin(ceil((F.Xmax - m_dX0) / m_dGsd) + margin, W + 1.), y1 = XMin(ceil((m_dY0 - F.Ymin) / m_dGsd) + margin, H + 1.);
+	if ((x1 <= x0) || (y1 <= y0))
+		return juce::Rectangle<int>();
+	return juce::Rectangle<int>((int)x0, (int)y0, (int)(x1 - x0), (int)(y1 - y0)).getIntersection(m_Vector.getBounds());
+}
+
+//==============================================================================
+// Memorise l'etat des classes raster ou vecteur et calcule les zones a redessiner
+//==============================================================================
+void MapThread::UpdateClassState(bool raster, juce::RectangleList<int>* dirty)
+{
+	if (m_GeoBase == nullptr)
+		return;
+	int margin = 1;
+	if (!raster)
+		margin = 32;	// Symboles, epaisseurs de trait et textes debordent de l'emprise des objets
+	std::map<XGeoClass*, ClassState> newState;
+	uint32_t order = 0;
+	for (uint32_t i = 0; i < m_GeoBase->NbClass(); i++) {
+		XGeoClass* C = m_GeoBase->Class(i);
+		if (C == nullptr)
+			continue;
+		if ((raster) && (!C->IsRaster()))
+			continue;
+		if ((!raster) && (!C->IsVector()))
+			continue;
+		ClassState state;
+		state.raster = raster;
+		state.visible = C->Visible();
+		state.order = order++;
+		state.revVisibility = C->Revision(XGeoClass::revVisibility);
+		state.revStyle = C->Revision(XGeoClass::revStyle);
+		state.revData = C->Revision(XGeoClass::revData);
+		state.repres = *C->Repres();
+		state.frame = C->Frame();
+
+		auto iter = m_ClassState.find(C);
+		if (iter == m_ClassState.end()) {	// Nouvelle classe
+			if ((dirty != nullptr) && (state.visible))
+				dirty->add(PixelFrame(state.frame, margin));
+		}
+		else {
+			const ClassState& old = iter->second;
+			bool modified = (old.visible != state.visible) || (old.order != state.order) ||
+				(old.revVisibility != state.revVisibility) || (old.revStyle != state.revStyle) ||
+				(old.revData != state.revData) || (old.repres != state.repres) || (old.frame != state.frame);
+			if ((dirty != nullptr) && (modified)) {
+				if (old.visible)
+					dirty->add(PixelFrame(old.frame, margin));
+				if (state.visible)
+					dirty->add(PixelFrame(state.frame, margin));
+			}
+			m_ClassState.erase(iter);
+		}
+		newState[C] = state;
+	}
+
+	for (auto iter = m_ClassState.begin(); iter != m_ClassState.end(); iter++) {
+		if (iter->second.raster != raster) {	// Classes de l'autre type : l'etat est conserve
+			newState[iter->first] = iter->second;
+			continue;
+		}
+		if ((dirty != nullptr) && (iter->second.visible))	// Classes supprimees
+			dirty->add(PixelFrame(iter->second.frame, margin));
+	}
+	m_ClassState.swap(newState);
+	if (dirty != nullptr)
+		dirty->consolidate();
 }
 
 //==============================================================================
@@ -83,7 +171,15 @@ void MapThread::PrepareImages(bool totalUpdate, int dX, int dY)
 {
 	if (m_bRaster) {
 		m_ClipRaster = juce::Rectangle<int>();
-		if (totalUpdate) {
+		m_DirtyRaster.clear();
+		if (m_bModifiedOnly) {	// Seules les zones des classes modifiees sont effacees
+			UpdateClassState(true, &m_DirtyRaster);
+			for (const auto& R : m_DirtyRaster)
+				m_Raster.clear(R, juce::Colour(0xFFFFFFFF));
+			if (m_DirtyRaster.isEmpty())
+				m_bRaster = false;
+		}
+		else if (totalUpdate) {
 			m_Raster.clear(m_Raster.getBounds(), juce::Colour(0xFFFFFFFF));
 			//m_Raster.clear(m_Raster.getBounds());
 			m_bRasterDone = false;
@@ -97,6 +193,8 @@ void MapThread::PrepareImages(bool totalUpdate, int dX, int dY)
 			m_Raster = tmpImage;
 			m_ClipRaster = juce::Rectangle<int>(dX, dY, m_Raster.getWidth(), m_Raster.getHeight());
 		}
+		if (!m_bModifiedOnly)
+			UpdateClassState(true, nullptr);
 	}
 	if (m_bDtm) {
 		m_Dtm.clear(m_Dtm.getBounds());// , juce::Colour(0xFFFFFFFF));
@@ -120,7 +218,15 @@ void MapThread::PrepareImages(bool totalUpdate, int dX, int dY)
 
 	if (m_bVector) {
 		m_ClipVector = juce::Rectangle<int>();
-		if (totalUpdate)
+		m_DirtyVector.clear();
+		if (m_bModifiedOnly) {	// Seules les zones des classes modifiees sont effacees
+			UpdateClassState(false, &m_DirtyVector);
+			for (const auto& R : m_DirtyVector)
+				m_Vector.clear(R);
+			if (m_DirtyVector.isEmpty())
+				m_bVector = false;
+		}
+		else if (totalUpdate)
 			m_Vector.clear(m_Vector.getBounds());
 		else {
 			juce::Image tmpImage = juce::Image(juce::Image::PixelFormat::ARGB, m_Vector.getWidth(), m_Vector.getHeight(), true);
@@ -129,6 +235,8 @@ void MapThread::PrepareImages(bool totalUpdate, int dX, int dY)
 			m_Vector = tmpImage;
 			m_ClipVector = juce::Rectangle<int>(dX, dY, m_Vector.getWidth(), m_Vector.getHeight());
 		}
+		if (!m_bModifiedOnly)
+			UpdateClassState(false, nullptr);
 	}
 }
 
@@ -140,6 +248,9 @@ void MapThread::SetWorld(const double& X0, const double& Y0, const double& gsd,
 	bool totalUpdate = force_vector;
 	if (gsd != m_dGsd) totalUpdate = true;
 	if ((W != m_Vector.getWidth()) || (H != m_Vector.getHeight())) totalUpdate = true;
+	// Le mode incremental n'est possible que si la vue n'a pas bouge
+	if ((totalUpdate) || (X0 != m_dX0) || (Y0 != m_dY0))
+		m_bModifiedOnly = false;
 	int dX = (int)round((m_dX0 - X0) / m_dGsd), dY = (int)round((Y0 - m_dY0) / m_dGsd);
 	PrepareImages(totalUpdate, dX, dY);
 
@@ -153,6 +264,99 @@ void MapThread::SetWorld(const double& X0, const double& Y0, const double& gsd,
 	m_Path.clear();
 }
 
+//==============================================================================
+// Debut du profilage d'une classe
+//==============================================================================
+void MapThread::BeginLayer(XGeoClass* C, const char* type)
+{
+	LayerProfile layer = LayerProfile();
+	if (C != nullptr)
+		layer.name = C->Name();
+	layer.type = type;
+	m_Profile.layers.push_back(layer);
+	m_CurLayer = &m_Profile.layers.back();
+	m_dLayerStart = ProfileTime();
+	m_nLayerBytes = XFile::ThreadBytesRead();
+	m_nLayerRead = XFile::ThreadNbRead();
+}
+
+//==============================================================================
+// Fin du profilage d'une classe
+//==============================================================================
+void MapThread::EndLayer()
+{
+	m_CurLayer->totalTime = ProfileTime() - m_dLayerStart;
+	m_CurLayer->bytesRead = XFile::ThreadBytesRead() - m_nLayerBytes;
+	m_CurLayer->nbReads += XFile::ThreadNbRead() - m_nLayerRead;	// Les noeuds LAS decodes sont deja comptes
+	m_CurLayer = &m_NullLayer;
+}
+
+//==============================================================================
+// Profil de la derniere image dessinee
+//==============================================================================
+MapThread::FrameProfile MapThread::LastProfile()
+{
+	const juce::ScopedLock lock(m_ProfileLock);
+	if (m_Trace.size() < 1)
+		return FrameProfile();
+	return m_Trace.back();
+}
+
+//==============================================================================
+// Suppression de l'historique des profils
+//==============================================================================
+void MapThread::ClearProfile()
+{
+	const juce::ScopedLock lock(m_ProfileLock);
+	m_Trace.clear();
+}
+
+//==============================================================================
+// Ecriture de l'historique des profils au format CSV (tabulations) ou JSON
+//==============================================================================
+bool MapThread::WriteProfile(std::ostream* out, bool json)
+{
+	const juce::ScopedLock lock(m_ProfileLock);
+	out->setf(std::ios::fixed);
+	out->precision(3);
+	if (!json) {
+		*out << "frame\tgsd\tframe_ms\tinterrupted\tlayer\ttype\ttotal_ms\tdecode_ms\tconvert_ms\tdraw_ms"
+			<< "\tbytes_read\treads\tpoints\tobjects\tculled" << std::endl;
+		for (const FrameProfile& frame : m_Trace) {
+			for (const LayerProfile& layer : frame.layers) {
+				*out << frame.num << "\t" << frame.gsd << "\t" << frame.totalTime << "\t" << frame.interrupted << "\t"
+					<< layer.name << "\t" << layer.type << "\t" << layer.totalTime << "\t" << layer.decodeTime << "\t"
+					<< layer.convertTime << "\t" << layer.drawTime << "\t" << layer.bytesRead << "\t" << layer.nbReads << "\t"
+					<< layer.nbPoints << "\t" << layer.nbObjects << "\t" << layer.nbCulled << std::endl;
+			}
+		}
+		return out->good();
+	}
+
+	*out << "{ \"frames\": [" << std::endl;
+	for (size_t i = 0; i < m_Trace.size(); i++) {
+		const FrameProfile& frame = m_Trace[i];
+		*out << "  { \"frame\": " << frame.num << ", \"gsd\": " << frame.gsd << ", \"frame_ms\": " << frame.totalTime
+			<< ", \"interrupted\": " << (frame.interrupted ? "true" : "false") << ", \"layers\": [" << std::endl;
+		for (size_t j = 0; j < frame.layers.size(); j++) {
+			const LayerProfile& layer = frame.layers[j];
+			*out << "    { \"layer\": " << juce::JSON::toString(juce::var(juce::String(layer.name))).toStdString()
+				<< ", \"type\": \"" << layer.type << "\", \"total_ms\": " << layer.totalTime
+				<< ", \"decode_ms\": " << layer.decodeTime << ", \"convert_ms\": " << layer.convertTime
+				<< ", \"draw_ms\": " << layer.drawTime << ", \"bytes_read\": " << layer.bytesRead
+				<< ", \"reads\": " << layer.nbReads << ", \"points\": " << layer.nbPoints
+				<< ", \"objects\": " << layer.nbObjects << ", \"culled\": " << layer.nbCulled << " }";
+			if (j + 1 < frame.layers.size()) *out << ",";
+			*out << std::endl;
+		}
+		*out << "  ] }";
+		if (i + 1 < m_Trace.size()) *out << ",";
+		*out << std::endl;
+	}
+	*out << "] }" << std::endl;
+	return out->good();
+}
+
 //==============================================================================
 // Methode run du thread
 //==============================================================================
@@ -161,6 +365,10 @@ void MapThread::run()
 	m_nNumObjects = 0;
 	if (m_GeoBase == nullptr)
 		return;
+	double frameStart = ProfileTime();
+	m_Profile = FrameProfile();
+	m_Profile.num = ++m_nFrameNum;
+	m_Profile.gsd = m_dGsd;
 	// Affichage des couches raster
 	if (m_bRaster) {
 		m_bRasterDone = false;
@@ -171,8 +379,11 @@ void MapThread::run()
 				continue;
 			if (!C->IsRaster())
 				continue;
-			if (C->Visible())
-				DrawRasterClass(C);
+			if (!C->Visible())
+				continue;
+			BeginLayer(C, "raster");
+			DrawRasterClass(C);
+			EndLayer();
 		}
 	}
 	// Affichage des couches MNT
@@ -185,12 +396,19 @@ void MapThread::run()
 				continue;
 			if (!C->IsDTM())
 				continue;
-			if (C->Visible())
-				flag |= DrawDtmClass(C);
+			if (!C->Visible())
+				continue;
+			BeginLayer(C, "dtm");
+			flag |= DrawDtmClass(C);
+			EndLayer();
 		}
 		if (flag) {
+			BeginLayer(nullptr, "shader");
+			m_CurLayer->name = "DtmShader";
 			DtmShader shader(m_dGsd);
 			shader.ConvertImage(&m_RawDtm, &m_Dtm);
+			m_CurLayer->convertTime = ProfileTime() - m_dLayerStart;
+			EndLayer();
 		}
 	}
 	m_bRasterDone = true;
@@ -202,8 +420,11 @@ void MapThread::run()
 				continue;
 			if (!C->IsLAS())
 				continue;
-			if (C->Visible())
-				DrawLasClass(C);
+			if (!C->Visible())
+				continue;
+			BeginLayer(C, "las");
+			DrawLasClass(C);
+			EndLayer();
 		}
 	}
 	// Affichage des couches vectorielles
@@ -217,13 +438,26 @@ void MapThread::run()
 				continue;
 			if (!C->Visible())
 				continue;
+			BeginLayer(C, "vector");
 			DrawVectorClass(C);
+			m_CurLayer->drawTime = ProfileTime() - m_dLayerStart;
+			EndLayer();
 		}
 	}
 	// Affichage de la selection
 	if (m_bOverlay)
 		DrawSelection();
-	m_bRaster = m_bVector = m_bOverlay = false;
+	if (threadShouldExit())	// Dessin interrompu : l'etat des classes n'est plus fiable
+		m_ClassState.clear();
+	m_bRaster = m_bVector = m_bOverlay = m_bModifiedOnly = false;
+
+	// Historique des profils
+	m_Profile.totalTime = ProfileTime() - frameStart;
+	m_Profile.interrupted = threadShouldExit();
+	const juce::ScopedLock lock(m_ProfileLock);
+	m_Trace.push_back(m_Profile);
+	while (m_Trace.size() > 1000)
+		m_Trace.pop_front();
 }
 
 bool MapThread::Draw(juce::Graphics& g, int x0, int y0, bool overlay)
@@ -252,13 +486,18 @@ void MapThread::DrawVectorClass(XGeoClass* C)
 {
 	if (!m_Frame.Intersect(C->Frame()))
 		return;
+	if ((m_bModifiedOnly) && (!m_DirtyVector.intersectsRectangle(PixelFrame(C->Frame(), 32))))
+		return;
 	int index = 0;
 	do {
 		const juce::MessageManagerLock mml(Thread::getCurrentThread());
 		if (!mml.lockWasGained())  // if something is trying to kill this job, the lock
 			return;
 		juce::Graphics g(m_Vector);
-		g.excludeClipRegion(m_ClipVector);
+		if (m_bModifiedOnly)
+			g.reduceClipRegion(m_DirtyVector);
+		else
+			g.excludeClipRegion(m_ClipVector);
 
 		for (int i = 0; i < 1000; i++) {
 			if (threadShouldExit())
@@ -270,8 +509,10 @@ void MapThread::DrawVectorClass(XGeoClass* C)
 			if (!V->Visible())
 				continue;
 			XFrame F = V->Frame();
-			if (!m_Frame.Intersect(F))
+			if (!m_Frame.Intersect(F)) {
+				m_CurLayer->nbCulled++;
 				continue;
+			}
 			XGeoRepres* R = V->Repres();
 			if (R == nullptr)
 				continue;
@@ -285,7 +526,10 @@ void MapThread::DrawVectorClass(XGeoClass* C)
 
 			juce::Rectangle<int> frame = juce::Rectangle<int>((int)round((F.Xmin - m_dX0) / m_dGsd), (int)round((m_dY0 - F.Ymax) / m_dGsd),
 				(int)round(F.Width() / m_dGsd), (int)round(F.Height() / m_dGsd));
-			if (!m_ClipVector.contains(frame)) {
+			bool needDraw = !m_ClipVector.contains(frame);
+			if (m_bModifiedOnly)
+				needDraw = m_DirtyVector.intersectsRectangle(frame.expanded(32));
+			if (needDraw) {
 				if ((frame.getWidth() < 2) && (frame.getHeight() < 2) && (V->NbPt() > 1)) {
 					g.drawRect(frame, 2);
 				}
@@ -300,7 +544,10 @@ void MapThread::DrawVectorClass(XGeoClass* C)
 					m_Path.clear();
 					DrawText(&g, V);
 				}
+				m_CurLayer->nbObjects++;
 			}
+			else
+				m_CurLayer->nbCulled++;
 
 			m_nNumObjects++;
 		}
@@ -639,6 +886,8 @@ bool MapThread::DrawRasterClass(XGeoClass* C)
 {
 	if (!m_Frame.Intersect(C->Frame()))
 		return false;
+	if ((m_bModifiedOnly) && (!m_DirtyRaster.intersectsRectangle(PixelFrame(C->Frame(), 1))))
+		return false;
 	bool flag = false;
 	for (uint32_t i = 0; i < C->NbVector(); i++) {
 		if (threadShouldExit())
@@ -648,8 +897,10 @@ bool MapThread::DrawRasterClass(XGeoClass* C)
 			continue;
 		if (!image->Visible())
 			continue;
-		if (!m_Frame.Intersect(image->Frame()))
+		if (!m_Frame.Intersect(image->Frame())) {
+			m_CurLayer->nbCulled++;
 			continue;
+		}
 		const juce::MessageManagerLock mml(Thread::getCurrentThread());
 		if (!mml.lockWasGained())  // if something is trying to kill this job, the lock
 			continue;
@@ -672,8 +923,14 @@ bool MapThread::DrawFileRaster(XFileImage* image, XGeoRepres* repres)
 	if (!image->PrepareRasterDraw(&m_Frame, m_Frame.Width() / m_Raster.getWidth(), U0, V0, win, hin, nbBand, R0, S0, wout, hout))
 		return false;
 	juce::Rectangle<int> destRect(R0, S0, wout, hout);
-	if (m_ClipRaster.contains(destRect))
+	if (m_ClipRaster.contains(destRect)) {
+		m_CurLayer->nbCulled++;
 		return true;
+	}
+	if ((m_bModifiedOnly) && (!m_DirtyRaster.intersectsRectangle(destRect))) {
+		m_CurLayer->nbCulled++;
+		return true;
+	}
 
 	int factor = win / wout;
 	if (factor < 1)
@@ -695,10 +952,13 @@ bool MapThread::DrawFileRaster(XFileImage* image, XGeoRepres* repres)
 		juce::Image::BitmapData bitmap(tmpImage, juce::Image::BitmapData::readWrite);
 		format = bitmap.pixelFormat;	// Sur Mac, on obtient toujours ARGB meme en demandant RGB !
 
+		double t0 = ProfileTime();
 		if (factor == 1)
 			image->GetArea(U0, V0, win, hin, bitmap.data);
 		else
 			image->GetZoomArea(U0, V0, win, hin, bitmap.data, factor);
+		double t1 = ProfileTime();
+		m_CurLayer->decodeTime += (t1 - t0);
 
 		if (format == juce::Image::PixelFormat::RGB) {
 			if (nbBand == 1)
@@ -714,6 +974,7 @@ bool MapThread::DrawFileRaster(XFileImage* image, XGeoRepres* repres)
 				XBaseImage::RGB2BGRA(bitmap.data, wtmp * htmp, r, g, b, alpha);
 			XBaseImage::OffsetArea(bitmap.data, wtmp * 4, bitmap.height, bitmap.lineStride);
 		}
+		m_CurLayer->convertTime += (ProfileTime() - t1);
 	}
 
 	if (m_bFirstRaster) {	// Nettoyage pour la premiere couche raster a afficher
@@ -721,8 +982,13 @@ bool MapThread::DrawFileRaster(XFileImage* image, XGeoRepres* repres)
 		m_bFirstRaster = false;
 	}
 	juce::Graphics graphic(m_Raster);
+	if (m_bModifiedOnly)
+		graphic.reduceClipRegion(m_DirtyRaster);
 	graphic.setOpacity(opacity);
+	double t0 = ProfileTime();
 	graphic.drawImage(tmpImage, R0, S0, wout, hout, 0, 0, wtmp, htmp);
+	m_CurLayer->drawTime += (ProfileTime() - t0);
+	m_CurLayer->nbObjects++;
 	m_nNumObjects++;
 	return true;
 }
@@ -732,7 +998,9 @@ bool MapThread::DrawFileRaster(XFileImage* image, XGeoRepres* repres)
 //==============================================================================
 bool MapThread::DrawInternetRaster(GeoInternetImage* image)
 {
+	double t0 = ProfileTime();
 	juce::Image tmpImage = image->GetAreaImage(m_Frame, m_dGsd);
+	m_CurLayer->decodeTime += (ProfileTime() - t0);
 	if (tmpImage.isNull())
 		return false;
 	float opacity = 1.0f;
@@ -740,99 +1008,434 @@ bool MapThread::DrawInternetRaster(GeoInternetImage* image)
 	if (repres != nullptr)
 		opacity = 1.0f - repres->Transparency() / 100.0f;
 
-	if (m_bFirstRaster) { // Nettoyage pour la premiere couche raster a afficher
+	if ((m_bFirstRaster) && (!m_bModifiedOnly)) { // Nettoyage pour la premiere couche raster a afficher
 		m_Raster.clear(m_Raster.getBounds(), juce::Colour(0xFFFFFFFF));
 		m_bFirstRaster = false;
 	}
 	juce::Graphics graphic(m_Raster);
+	if (m_bModifiedOnly)
+		graphic.reduceClipRegion(m_DirtyRaster);
 	graphic.setOpacity(opacity);
+	t0 = ProfileTime();
 	graphic.drawImageAt(tmpImage, 0, 0);
+	m_CurLayer->drawTime += (ProfileTime() - t0);
+	m_CurLayer->nbObjects++;
 	m_nNumObjects++;
 	return true;
 }
 
+//==============================================================================
+// MNT a dessiner : zone de l'image couverte et altitudes reechantillonnees
+//==============================================================================
+struct DtmDrawJob {
+	GeoDTM*		dtm;
+	int				R0, S0, wout, hout;
+	std::vector<float> data;
+	bool			ok;
+};
+
+//==============================================================================
+// Lecture et reechantillonnage d'un MNT, appele par les threads de DrawDtmClass
+//==============================================================================
+static void DecodeDtm(DtmDrawJob& job, XFrame* frame, double gsdR)
+{
+	job.ok = false;
+	int U0, V0, win, hin;
+	if (!job.dtm->PrepareDraw(frame, gsdR, U0, V0, win, hin, job.R0, job.S0, job.wout, job.hout))
+		return;
+	int factor = (int)job.dtm->DrawFactor((uint32_t)XMax(win / job.wout, 1));
+	int wtmp = win / factor, htmp = hin / factor;
+	if ((wtmp == 0) || (htmp == 0))
+		return;
+	std::vector<float> area((size_t)wtmp * htmp);
+	if (!job.dtm->GetDrawArea(U0, V0, win, hin, factor, area.data()))
+		return;
+	job.data.resize((size_t)job.wout * job.hout);
+	XBaseImage::FastZoomBil(area.data(), wtmp, htmp, job.data.data(), job.wout, job.hout);
+	job.ok = true;
+}
+
 //==============================================================================
 // Dessin des classes MNT
+// Les MNT sont lus en parallele, puis copies dans l'ordre de la classe
 //==============================================================================
 bool MapThread::DrawDtmClass(XGeoClass* C)
 {
 	if (!m_Frame.Intersect(C->Frame()))
 		return false;
+	double t0 = ProfileTime();
+	std::vector<DtmDrawJob> jobs;
+	for (uint32_t i = 0; i < C->NbVector(); i++) {
+		GeoDTM* dtm = dynamic_cast<GeoDTM*>(C->Vector(i));
+		if (dtm == nullptr)
+			continue;
+		if (!dtm->Visible())
+			continue;
+		if (!m_Frame.Intersect(dtm->Frame())) {
+			m_CurLayer->nbCulled++;
+			continue;
+		}
+		DtmDrawJob job;
+		job.dtm = dtm;
+		job.ok = false;
+		jobs.push_back(job);
+	}
+	if (jobs.size() < 1)
+		return false;
+
+	double gsdR = m_Frame.Width() / m_Raster.getWidth();
+	int nbThread = juce::jlimit(1, 8, juce::SystemStats::getNumCpus());
+	nbThread = (int)XMin((size_t)nbThread, jobs.size());
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < jobs.size(); i = next++) {
+			if (threadShouldExit())
+				return;
+			DecodeDtm(jobs[i], &m_Frame, gsdR);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 1; i < nbThread; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	double t1 = ProfileTime();
+	m_CurLayer->decodeTime += (t1 - t0);
+	if (threadShouldExit())
+		return false;
+
 	const juce::MessageManagerLock mml(Thread::getCurrentThread());
 	if (!mml.lockWasGained())  // if something is trying to kill this job, the lock
 		return false;
 	bool flag = false;
-	for (uint32_t i = 0; i < C->NbVector(); i++) {
-		GeoDTM* dtm = (GeoDTM*)C->Vector(i);
-		if (!dtm->Visible())
-			continue;
-		if (m_Frame.Intersect(dtm->Frame()))
-			flag |= DrawDtm(dtm);
-		if (threadShouldExit())
-			return false;
+	{
+		juce::Image::BitmapData bitmap(m_RawDtm, juce::Image::BitmapData::readWrite);
+		for (size_t k = 0; k < jobs.size(); k++) {
+			DtmDrawJob& job = jobs[k];
+			if (!job.ok)
+				continue;
+			int u0 = XMax(job.R0, 0), u1 = XMin(job.R0 + job.wout, bitmap.width);
+			int v0 = XMax(job.S0, 0), v1 = XMin(job.S0 + job.hout, bitmap.height);
+			for (int v = v0; (v < v1) && (u0 < u1); v++)
+				::memcpy(bitmap.getPixelPointer(u0, v), &job.data[(size_t)(v - job.S0) * job.wout + (u0 - job.R0)],
+									(u1 - u0) * sizeof(float));
+			flag = true;
+			m_CurLayer->nbObjects++;
+			m_nNumObjects++;
+		}
 	}
+	m_CurLayer->drawTime += (ProfileTime() - t1);
 	return flag;
 }
 
 //==============================================================================
-// Dessin d'un MNT
+// Recupere le Z a une position image
 //==============================================================================
-bool MapThread::DrawDtm(GeoDTM* dtm)
+float MapThread::GetZ(int u, int v)
 {
+	if ((u < 0) || (v < 0))
+		return 0.;
+	if ((u >= m_RawDtm.getWidth()) || (v >= m_RawDtm.getHeight()))
+		return 0.;
+	juce::Image::BitmapData bitmap(m_RawDtm, juce::Image::BitmapData::readOnly);
+	float* z = (float*)&bitmap.data[v * bitmap.lineStride + u * bitmap.pixelStride];
+	if (z == nullptr)
+		return 0.;
+	return *z;
+}
+
+//==============================================================================
+// Parametres de dessin des points LAS, partages par les threads de DrawLas
+//==============================================================================
+struct LasSplatContext {
+	double		X0, Y0, gsd;					// Transformation terrain -> pixel
+	XFrame		frame;								// Emprise a dessiner
+	int				x0, y0, w, h;					// Zone de l'image couverte par les buffers
+	juce::Rectangle<int> clip;			// Zone deja dessinee
+	double		Z0, deltaZ;						// Normalisation des altitudes sur [0; 255]
+	double		Zmin, Zmax;						// Filtre sur les altitudes
+	double		xScale, yScale, zScale, xOffset, yOffset, zOffset;	// Entete du fichier LAS
+	double		intensityGain;
+	std::string filename;
+	bool			cache;								// Les noeuds decodes sont conserves dans XLasNodeCache
+	bool			visibility[256];
+	uint32_t	altiColor[256];
+	uint32_t	classifColor[256];
+};
+
+struct LasSplatBuffer {	// Couleur et altitude du point le plus haut de chaque pixel
+	std::vector<uint32_t> color;
+	std::vector<float>		depth;
+	uint64_t	nbPoint;
+	uint64_t	nbDecoded;						// Noeuds decodes (absents du cache)
+};
+
+//==============================================================================
+// Couleur d'un point LAS : le mode est fixe a la compilation
+//==============================================================================
+template<LasShader::ShaderMode mode, class Points>	// Points : XLasNode ou XLasBlock
+static inline uint32_t LasPointColor(const Points& node, size_t k, double Z, const LasSplatContext& ctx)
+{
+	uint8_t data[4] = { 0, 0, 0, 255 };
+	uint32_t color;
+	double val;
+	switch (mode) {
+	case LasShader::ShaderMode::Altitude:
+		return ctx.altiColor[(uint8_t)((Z - ctx.Z0) * ctx.deltaZ)];
+	case LasShader::ShaderMode::RGB:
+		data[0] = (uint8_t)(node.B[k] / 256);
+		data[1] = (uint8_t)(node.G[k] / 256);
+		data[2] = (uint8_t)(node.R[k] / 256);
+		break;
+	case LasShader::ShaderMode::IRC:
+		data[0] = (uint8_t)(node.G[k] / 256);
+		data[1] = (uint8_t)(node.R[k] / 256);
+		data[2] = (uint8_t)(node.Nir[k] / 256);
+		break;
+	case LasShader::ShaderMode::Classification:
+		return ctx.classifColor[node.Classification[k]];
+	case LasShader::ShaderMode::Intensity:	// L'intensite est normalisee sur 16 bits
+		val = node.Intensity[k] / ctx.intensityGain;
+		if (val > 255.) val = 255.;
+		return ctx.altiColor[(uint8_t)val];
+	case LasShader::ShaderMode::Angle:
+		if (node.ScanAngle[k] < 0) 	// Angle en degree = extended_scan_angle * 0.006
+			data[2] = (uint8_t)(255 - node.ScanAngle[k] * (-0.0085));	 // Normalise sur [0; 255]
+		else
+			data[1] = (uint8_t)(255 - node.ScanAngle[k] * (0.0085));	 // Normalise sur [0; 255]
+		break;
+	default: ;
+	}
+	memcpy(&color, data, sizeof(uint32_t));
+	return color;
+}
+
+//==============================================================================
+// Dessin d'un fichier LAS a petite echelle a partir de ses rasters de synthese
+//==============================================================================
+bool MapThread::DrawLasOverview(GeoLAS* las)
+{
+	if (las->OverviewPrefix().empty())
+		return false;
+	double t0 = ProfileTime();
+	// Niveau le plus grossier dont la resolution reste inferieure a celle de la vue
+	int level = 0;
+	while (GeoLAS::OverviewGsd() * pow(2., level + 1) <= m_dGsd)
+		level++;
 	XFileImage image;
-	if (!image.AnalyzeImage(dtm->ImageName()))
+	for (; level >= 0; level--) {
+		if (image.AnalyzeImage(las->OverviewFile(level)))
+			break;
+	}
+	if (level < 0)
 		return false;
-	if (image.NbSample() != 1)
+	if (image.NbSample() != XLasFile::OverviewNbBand)
 		return false;
-	double gsd = dtm->Resolution();
-	image.SetGeoref(dtm->Frame().Xmin - gsd * 0.5, dtm->Frame().Ymax + gsd * 0.5, gsd);
-	int U0, V0, win, hin, R0, S0, wout, hout, nbBand;
-	if (!image.PrepareRasterDraw(&m_Frame, m_Frame.Width() / m_Raster.getWidth(), U0, V0, win, hin, nbBand, R0, S0, wout, hout))
+	double xmin, ymax, gsd;
+	if (!image.GetGeoref(&xmin, &ymax, &gsd))
 		return false;
-	
+
+	int U0, V0, win, hin, R0, S0, wout, hout, nbBand;
+	if (!image.PrepareRasterDraw(&m_Frame, m_dGsd, U0, V0, win, hin, nbBand, R0, S0, wout, hout))
+		return true;	// Le fichier est hors de la vue
 	int factor = win / wout;
 	if (factor < 1)
 		factor = 1;
 	int wtmp = win / factor, htmp = hin / factor;
 	if ((wtmp == 0) || (htmp == 0))
 		return true;
-	
-	float* area = new float[wtmp * htmp];
-	if (area == nullptr)
+	std::vector<float> area((size_t)wtmp * htmp * XLasFile::OverviewNbBand);
+	uint32_t nb_sample = 0;
+	if (!image.GetRawArea(U0, V0, win, hin, area.data(), &nb_sample, factor))
 		return false;
-	uint32_t nb_sample;
-	image.GetRawArea(U0, V0, win, hin, area, &nb_sample, factor);
-	juce::Image tmpImage(m_RawDtm.getFormat(), wout, hout, true);
-	{ // Necessaire pour que bitmap soit detruit avant l'appel a drawImageAt
-		juce::Image::BitmapData bitmap(tmpImage, juce::Image::BitmapData::readWrite);
-		XBaseImage::FastZoomBil(area, wtmp, htmp, (float*)bitmap.data, wout, hout);
-		delete[] area;
-		XBaseImage::OffsetArea(bitmap.data, wout * 4, bitmap.height, bitmap.lineStride);
-	}
+	double t1 = ProfileTime();
+	m_CurLayer->decodeTime += (t1 - t0);
 
-	m_RawDtm.clear(juce::Rectangle<int>(R0, S0, wout, hout));
-	juce::Graphics g(m_RawDtm);
-	g.setOpacity(1.f);
-	g.drawImageAt(tmpImage, R0, S0);
+	double Z0 = LasShader::Zmin();
+	double deltaZ = LasShader::Zmax() - Z0;
+	if (deltaZ <= 0) deltaZ = 1.;	// Pour eviter les divisions par 0
+	deltaZ = (255. / deltaZ);
+	LasShader::ShaderMode mode = LasShader::Mode();
 
+	juce::Image tmpImage(juce::Image::PixelFormat::ARGB, wtmp, htmp, true);
+	{ // Necessaire pour que bitmap soit detruit avant l'appel a drawImage
+		juce::Image::BitmapData bitmap(tmpImage, juce::Image::BitmapData::writeOnly);
+		for (int j = 0; j < htmp; j++) {
+			uint32_t* line = (uint32_t*)bitmap.getLinePointer(j);
+			const float* pix = &area[(size_t)j * wtmp * XLasFile::OverviewNbBand];
+			for (int i = 0; i < wtmp; i++, pix += XLasFile::OverviewNbBand) {
+				if (pix[XLasFile::OverviewDensity] <= 0.f)	// Cellule vide : transparente
+					continue;
+				double Z = pix[XLasFile::OverviewZ];
+				if ((Z < LasShader::Zmin()) || (Z > LasShader::Zmax()))
+					continue;
+				uint8_t classification = (uint8_t)pix[XLasFile::OverviewClass];
+				if (!LasShader::ClassificationVisibility(classification))
+					continue;
+				double val;
+				switch (mode) {
+				case LasShader::ShaderMode::Altitude:
+					line[i] = LasShader::AltiColorARGB((uint8_t)((Z - Z0) * deltaZ));
+					break;
+				case LasShader::ShaderMode::RGB:
+					line[i] = juce::Colour((uint8_t)pix[XLasFile::OverviewR], (uint8_t)pix[XLasFile::OverviewG], (uint8_t)pix[XLasFile::OverviewB]).getARGB();
+					break;
+				case LasShader::ShaderMode::IRC:
+					line[i] = juce::Colour((uint8_t)pix[XLasFile::OverviewNir], (uint8_t)pix[XLasFile::OverviewR], (uint8_t)pix[XLasFile::OverviewG]).getARGB();
+					break;
+				case LasShader::ShaderMode::Classification:
+					line[i] = LasShader::ClassificationColor(classification).getARGB();
+					break;
+				case LasShader::ShaderMode::Intensity:
+					val = XMin((double)pix[XLasFile::OverviewIntensity] / LasShader::IntensityGain(), 255.);
+					line[i] = LasShader::AltiColorARGB((uint8_t)val);
+					break;
+				default:	// Densite de points en echelle logarithmique
+					val = XMin(log2(1. + (double)pix[XLasFile::OverviewDensity]) * 32., 255.);
+					line[i] = LasShader::AltiColorARGB((uint8_t)val);
+				}
+			}
+		}
+	}
+	double t2 = ProfileTime();
+	m_CurLayer->convertTime += (t2 - t1);
+
+	juce::Graphics g(m_Las);
+	g.setImageResamplingQuality(juce::Graphics::lowResamplingQuality);
+	g.drawImage(tmpImage, R0, S0, wout, hout, 0, 0, wtmp, htmp);
+	m_CurLayer->drawTime += (ProfileTime() - t2);
+	m_CurLayer->nbObjects++;
 	m_nNumObjects++;
 	return true;
 }
 
 //==============================================================================
-// Recupere le Z a une position image
+// Dessin des points d'un noeud decode dans un buffer avec test de profondeur
 //==============================================================================
-float MapThread::GetZ(int u, int v)
+template<LasShader::ShaderMode mode>
+static void SplatLasNode(const XLasNode& node, const LasSplatContext& ctx, LasSplatBuffer& buffer)
 {
-	if ((u < 0) || (v < 0))
-		return 0.;
-	if ((u >= m_RawDtm.getWidth()) || (v >= m_RawDtm.getHeight()))
-		return 0.;
-	juce::Image::BitmapData bitmap(m_RawDtm, juce::Image::BitmapData::readOnly);
-	float* z = (float*)&bitmap.data[v * bitmap.lineStride + u * bitmap.pixelStride];
-	if (z == nullptr)
-		return 0.;
-	return *z;
+	for (size_t k = 0; k < node.Size(); k++) {
+		if (!ctx.visibility[node.Classification[k]])
+			continue;
+		double Z = node.Z[k] * ctx.zScale + ctx.zOffset;
+		if ((Z < ctx.Zmin) || (Z > ctx.Zmax))
+			continue;
+		double X = node.X[k] * ctx.xScale + ctx.xOffset;
+		double Y = node.Y[k] * ctx.yScale + ctx.yOffset;
+		int u = (int)floor((X - ctx.X0) / ctx.gsd), v = (int)floor((ctx.Y0 - Y) / ctx.gsd);
+		if (ctx.clip.contains(u, v))
+			continue;
+		u -= ctx.x0;
+		v -= ctx.y0;
+		if ((u < 0) || (v < 0) || (u >= ctx.w) || (v >= ctx.h))
+			continue;
+		buffer.nbPoint++;
+		size_t index = (size_t)v * ctx.w + u;
+		if ((float)Z < buffer.depth[index])
+			continue;
+		buffer.depth[index] = (float)Z;
+		buffer.color[index] = LasPointColor<mode>(node, k, Z, ctx);
+	}
+}
+
+//==============================================================================
+// Dessin d'un bloc de points deja filtres, relatifs a l'origine (X0, Y0) de l'image
+//==============================================================================
+template<LasShader::ShaderMode mode>
+static void SplatLasBlock(const XLasBlock& block, uint32_t nb, const LasSplatContext& ctx, LasSplatBuffer& buffer)
+{
+	float gsd = (float)ctx.gsd;
+	for (uint32_t k = 0; k < nb; k++) {
+		int u = (int)floor(block.X[k] / gsd), v = (int)floor(-block.Y[k] / gsd);
+		if (ctx.clip.contains(u, v))
+			continue;
+		u -= ctx.x0;
+		v -= ctx.y0;
+		if ((u < 0) || (v < 0) || (u >= ctx.w) || (v >= ctx.h))
+			continue;
+		buffer.nbPoint++;
+		size_t index = (size_t)v * ctx.w + u;
+		float Z = block.Z[k];
+		if (Z < buffer.depth[index])
+			continue;
+		buffer.depth[index] = Z;
+		buffer.color[index] = LasPointColor<mode>(block, k, Z, ctx);
+	}
+}
+
+//==============================================================================
+// Dessin des plages de points LAS dans un buffer
+// Les plages sont distribuees entre les threads par le compteur next.
+// Si las est nul, un lecteur du pool n'est pris qu'au premier noeud absent du cache
+// Sans cache, les points sont lus par blocs avec les filtres d'emprise, de Z et de classification
+//==============================================================================
+template<LasShader::ShaderMode mode>
+static void SplatLasRanges(XLasFile* las, const std::vector<XLasFile::PointRange>& ranges, std::atomic<size_t>& next,
+													 const LasSplatContext& ctx, LasSplatBuffer& buffer, const juce::Thread* thread)
+{
+	std::shared_ptr<XLasFile> local;	// Rendu au pool a la sortie
+	XLasFile* reader = las;
+	if (!ctx.cache) {
+		XLasBlock block(65536, ctx.X0, ctx.Y0, 0.);
+		for (size_t i = next++; i < ranges.size(); i = next++) {
+			if (thread->threadShouldExit())
+				break;
+			if (reader == nullptr) {
+				local = XLasReaderPool::Take(ctx.filename);
+				if (local.get() == nullptr)
+					return;
+				if (!local->SetWorld(ctx.frame, ctx.Zmin, ctx.Zmax, ctx.gsd))
+					return;
+				reader = local.get();
+			}
+			reader->SetClassifFilter(ctx.visibility);
+			if (!reader->SetRange(ranges[i]))
+				continue;
+			buffer.nbDecoded++;
+			uint32_t nb;
+			while ((nb = reader->GetNextRangeBlock(&block)) > 0)
+				SplatLasBlock<mode>(block, nb, ctx, buffer);
+		}
+		if (reader != nullptr)
+			reader->SetClassifFilter(nullptr);
+		return;
+	}
+	for (size_t i = next++; i < ranges.size(); i = next++) {
+		if (thread->threadShouldExit())
+			return;
+		std::shared_ptr<const XLasNode> node;
+		if (ctx.cache)
+			node = XLasNodeCache::Find(XLasFile::NodeKey(ctx.filename, ranges[i]));
+		if (node.get() == nullptr) {
+			if (reader == nullptr) {
+				local = XLasReaderPool::Take(ctx.filename);
+				if (local.get() == nullptr)
+					return;
+				reader = local.get();
+			}
+			node = reader->GetNode(ranges[i], ctx.cache);
+			buffer.nbDecoded++;
+			if (node.get() == nullptr)
+				continue;
+		}
+		SplatLasNode<mode>(*node, ctx, buffer);
+	}
+}
+
+static void SplatLas(LasShader::ShaderMode mode, XLasFile* las, const std::vector<XLasFile::PointRange>& ranges, std::atomic<size_t>& next,
+										 const LasSplatContext& ctx, LasSplatBuffer& buffer, const juce::Thread* thread)
+{
+	switch (mode) {
+	case LasShader::ShaderMode::Altitude: SplatLasRanges<LasShader::ShaderMode::Altitude>(las, ranges, next, ctx, buffer, thread); break;
+	case LasShader::ShaderMode::RGB: SplatLasRanges<LasShader::ShaderMode::RGB>(las, ranges, next, ctx, buffer, thread); break;
+	case LasShader::ShaderMode::IRC: SplatLasRanges<LasShader::ShaderMode::IRC>(las, ranges, next, ctx, buffer, thread); break;
+	case LasShader::ShaderMode::Classification: SplatLasRanges<LasShader::ShaderMode::Classification>(las, ranges, next, ctx, buffer, thread); break;
+	case LasShader::ShaderMode::Intensity: SplatLasRanges<LasShader::ShaderMode::Intensity>(las, ranges, next, ctx, buffer, thread); break;
+	case LasShader::ShaderMode::Angle: SplatLasRanges<LasShader::ShaderMode::Angle>(las, ranges, next, ctx, buffer, thread); break;
+	default: SplatLasRanges<LasShader::ShaderMode::Null>(las, ranges, next, ctx, buffer, thread);
+	}
 }
 
 //==============================================================================
@@ -851,12 +1454,16 @@ bool MapThread::DrawLasClass(XGeoClass* C)
 		if (!las->Visible())
 			continue;
 		XFrame F = las->Frame();
-		if (!m_Frame.Intersect(F))
+		if (!m_Frame.Intersect(F)) {
+			m_CurLayer->nbCulled++;
 			continue;
+		}
 		juce::Rectangle<int> frame = juce::Rectangle<int>((int)round((F.Xmin - m_dX0) / m_dGsd), (int)round((m_dY0 - F.Ymax) / m_dGsd),
 			(int)round(F.Width() / m_dGsd), (int)round(F.Height() / m_dGsd));
 		if (!m_ClipLas.contains(frame))
 			flag |= DrawLas(las);
+		else
+			m_CurLayer->nbCulled++;
 		if (threadShouldExit())
 			return false;
 	}
@@ -873,7 +1480,10 @@ bool MapThread::DrawLas(GeoLAS* las)
 	if (deltaZ <= 0) deltaZ = 1.;	// Pour eviter les divisions par 0
 	deltaZ = (255. / deltaZ);
 
+	double t0 = ProfileTime();
 	if (m_dGsd > LasShader::MaxGsd()) {
+		if (DrawLasOverview(las))	// Rasters de synthese deja calcules
+			return true;
 		XFrame F = las->Frame();
 		float W = (float)round(F.Width() / m_dGsd);
 		float H = (float)round(F.Height() / m_dGsd);
@@ -888,85 +1498,431 @@ bool MapThread::DrawLas(GeoLAS* las)
 		g.fillRect(x1, y1, W, H);
 		g.setColour(juce::Colours::mediumvioletred);
 		g.drawRect(x1, y1, W, H);
+		m_CurLayer->drawTime += (ProfileTime() - t0);
+		m_CurLayer->nbObjects++;
 		m_nNumObjects++;
 		return true;
 	}
 
-	juce::Image::BitmapData bitmap(m_Las, juce::Image::BitmapData::readWrite);
-
 	if (!las->ReOpen())
 		return false;
 	if (!las->SetWorld(m_Frame, LasShader::Zmin(), LasShader::Zmax(), m_dGsd))
 		return false;
-	laszip_point* point = las->GetPoint();
+	std::vector<XLasFile::PointRange> ranges;
+	las->GetRanges(ranges);
+	juce::Rectangle<int> R = PixelFrame(las->Frame(), 1);	// Zone de l'image couverte par le fichier
+	if ((ranges.size() < 1) || (R.isEmpty())) {
+		las->CloseIfNeeded();
+		return true;
+	}
 
-	double X, Y, Z;
-	juce::Colour col = juce::Colours::orchid;
-	uint8_t data[4] = { 0, 0, 0, 255 };
-	uint32_t* data_ptr = (uint32_t*)&data;
-	uint8_t* ptr = nullptr;
-	uint8_t classification;
-	bool classif_newtype = las->IsNewClassification();
-
-	while(las->GetNextPoint(&X, &Y, &Z)) {
-		if (classif_newtype)
-			classification = point->extended_classification;
-		else
-			classification = point->classification;
-		if (!LasShader::ClassificationVisibility(classification)) continue;
-		X = (X - m_dX0) / m_dGsd;
-		Y = (m_dY0 - Y) / m_dGsd;
-		if (m_ClipLas.contains((int)X, (int)Y))
-			continue;
-		switch (LasShader::Mode()) {
-		case LasShader::ShaderMode::Altitude:
-			*data_ptr = LasShader::AltiColorARGB((uint8_t)((Z - Z0) * deltaZ));
-			break;
-		case LasShader::ShaderMode::RGB:
-			data[0] = (uint8_t)(point->rgb[2] / 256);
-			data[1] = (uint8_t)(point->rgb[1] / 256);
-			data[2] = (uint8_t)(point->rgb[0] / 256);
-			// data[3] = 255; // deja fixe dans l'initialisation de data
-			break;
-		case LasShader::ShaderMode::IRC:
-			data[0] = (uint8_t)(point->rgb[1] / 256);
-			data[1] = (uint8_t)(point->rgb[0] / 256);
-			data[2] = (uint8_t)(point->rgb[3] / 256);
-			// data[3] = 255; // deja fixe dans l'initialisation de data
-			break;
-		case LasShader::ShaderMode::Classification:
-			col = LasShader::ClassificationColor(classification);
-			*data_ptr = (uint32_t)col.getARGB();
-			break;
-		case LasShader::ShaderMode::Intensity:
-			//data[0] = point->intensity;	// L'intensite est normalisee sur 16 bits
-			//memcpy(data, &point->intensity, 2 * sizeof(uint8_t));
-			*data_ptr = LasShader::IntensityColorARGB(point->intensity);
-			break;
-		case LasShader::ShaderMode::Angle:
-			if (point->extended_scan_angle < 0) {	// Angle en degree = extended_scan_angle * 0.006
-				data[2] = (uint8_t)(255 - point->extended_scan_angle * (-0.0085));	 // Normalise sur [0; 255]
-				data[1] = 0;
-				data[0] = 0; // (uint8_t)(255 - data[2]);
-			}
-			else {
-				data[2] = 0;
-				data[1] = (uint8_t)(255 - point->extended_scan_angle * (0.0085));	 // Normalise sur [0; 255]
-				data[0] = 0; // (uint8_t)(255 - data[1]);
+	LasSplatContext ctx;
+	ctx.X0 = m_dX0;
+	ctx.Y0 = m_dY0;
+	ctx.gsd = m_dGsd;
+	ctx.frame = m_Frame;
+	ctx.x0 = R.getX();
+	ctx.y0 = R.getY();
+	ctx.w = R.getWidth();
+	ctx.h = R.getHeight();
+	ctx.clip = m_ClipLas;
+	ctx.Z0 = Z0;
+	ctx.deltaZ = deltaZ;
+	ctx.Zmin = LasShader::Zmin();
+	ctx.Zmax = LasShader::Zmax();
+	laszip_header* header = las->GetHeader();
+	ctx.xScale = header->x_scale_factor;
+	ctx.yScale = header->y_scale_factor;
+	ctx.zScale = header->z_scale_factor;
+	ctx.xOffset = header->x_offset;
+	ctx.yOffset = header->y_offset;
+	ctx.zOffset = header->z_offset;
+	ctx.intensityGain = LasShader::IntensityGain();
+	ctx.filename = las->Filename();
+	ctx.cache = las->IsCopcFile();	// En COPC, un noeud est reutilise d'une vue a l'autre
+	for (int i = 0; i < 256; i++) {
+		ctx.visibility[i] = LasShader::ClassificationVisibility((uint8_t)i);
+		ctx.altiColor[i] = LasShader::AltiColorARGB((uint8_t)i);
+		ctx.classifColor[i] = LasShader::ClassificationColor((uint8_t)i).getARGB();
+	}
+
+	// Un buffer couleur + altitude par thread, dans la limite de 128 Mo
+	size_t nbPixel = (size_t)ctx.w * ctx.h;
+	int nbThread = juce::jlimit(1, 8, juce::SystemStats::getNumCpus());
+	nbThread = (int)XMin((size_t)nbThread, ranges.size());
+	nbThread = (int)XMin((size_t)nbThread, XMax((size_t)1, ((size_t)128 << 20) / (nbPixel * 8)));
+	std::vector<LasSplatBuffer> buffers(nbThread);
+	for (int i = 0; i < nbThread; i++) {
+		buffers[i].color.assign(nbPixel, 0);
+		buffers[i].depth.assign(nbPixel, std::numeric_limits<float>::lowest());
+		buffers[i].nbPoint = 0;
+		buffers[i].nbDecoded = 0;
+	}
+	double t2 = ProfileTime();
+	m_CurLayer->decodeTime += (t2 - t0);
+
+	// Decompression et dessin des noeuds en parallele, chaque thread a son propre lecteur
+	LasShader::ShaderMode mode = LasShader::Mode();
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for (int i = 1; i < nbThread; i++)
+		threads.emplace_back([&, i]() { SplatLas(mode, nullptr, ranges, next, ctx, buffers[i], this); });
+	SplatLas(mode, las, ranges, next, ctx, buffers[0], this);
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	// Fusion des buffers : on conserve le point le plus haut
+	{
+		juce::Image::BitmapData bitmap(m_Las, juce::Image::BitmapData::readWrite);
+		for (int v = 0; v < ctx.h; v++) {
+			for (int u = 0; u < ctx.w; u++) {
+				size_t index = (size_t)v * ctx.w + u;
+				int best = -1;
+				float bestZ = std::numeric_limits<float>::lowest();
+				for (int i = 0; i < nbThread; i++) {
+					if (buffers[i].depth[index] > bestZ) {
+						bestZ = buffers[i].depth[index];
+						best = i;
+					}
+				}
+				if (best >= 0)
+					memcpy(bitmap.getPixelPointer(ctx.x0 + u, ctx.y0 + v), &buffers[best].color[index], sizeof(uint32_t));
 			}
-			break;
-		default: ;
 		}
+	}
+	for (int i = 0; i < nbThread; i++) {
+		m_CurLayer->nbPoints += buffers[i].nbPoint;
+		m_CurLayer->nbReads += buffers[i].nbDecoded;
+	}
+	m_CurLayer->drawTime += (ProfileTime() - t2);
+
+	m_CurLayer->nbObjects++;
+	m_nNumObjects++;
+	las->CloseIfNeeded();
+
+	return true;
+}
+
+//==============================================================================
+// MapBenchmark : constructeur
+//==============================================================================
+MapBenchmark::MapBenchmark(XGeoBase* base, const juce::String& script, const juce::String& report, bool quit)
+	: juce::Thread("MapBenchmark"), m_MapThread("BenchmarkMapThread")
+{
+	m_GeoBase = base;
+	m_strScript = script;
+	m_strReport = report;
+	m_bQuit = quit;
+	m_dXc = m_dYc = 0.;
+	m_dGsd = 1.;
+	m_nW = 1024;
+	m_nH = 768;
+}
 
-		ptr = bitmap.getPixelPointer((int)X, (int)Y);
-		memcpy(ptr, &data, sizeof(uint32_t));
-		//bitmap.setPixelColour(X, Y, col);
-		//g.drawRect((float)X-1.f, (float)Y-1.f, 2.f, 2.f);
+//==============================================================================
+// MapBenchmark : dessin de la vue courante et memorisation des temps
+//==============================================================================
+bool MapBenchmark::RenderView(bool force)
+{
+	m_MapThread.SetGeoBase(m_GeoBase);
+	m_MapThread.SetUpdate(true, true, true, true, true);
+	m_MapThread.SetWorld(m_dXc - m_nW * m_dGsd * 0.5, m_dYc + m_nH * m_dGsd * 0.5, m_dGsd, m_nW, m_nH, force);
+	m_MapThread.startThread();
+	while (!m_MapThread.waitForThreadToExit(100)) {
+		if (threadShouldExit()) {
+			m_MapThread.stopThread(-1);
+			return false;
+		}
+	}
+	MapThread::FrameProfile profile = m_MapThread.LastProfile();
+	if (profile.interrupted)
+		return false;
+	std::map<std::string, double> times;
+	for (const MapThread::LayerProfile& layer : profile.layers)
+		times[layer.type] += layer.totalTime;
+	for (auto iter = times.begin(); iter != times.end(); iter++)
+		m_Times[iter->first].push_back(iter->second);
+	m_Times["frame"].push_back(profile.totalTime);
+	return true;
+}
+
+//==============================================================================
+// MapBenchmark : execution du fichier de commandes
+//==============================================================================
+void MapBenchmark::run()
+{
+	if (m_GeoBase == nullptr)
+		return;
+	m_Times.clear();
+	XFrame F = m_GeoBase->Frame();
+	juce::StringArray lines;
+	juce::File script(m_strScript);
+	if (script.existsAsFile())
+		script.readLines(lines);
+	else	// Sequence par defaut : vue globale, zooms avant, deplacements, zooms arriere
+		lines.addArray({ "world", "zoom 0.5 5", "pan 100 0 10", "pan 0 100 10", "zoom 2 5" });
+
+	for (int i = 0; i < lines.size(); i++) {
 		if (threadShouldExit())
-			break;
+			return;
+		juce::StringArray T = juce::StringArray::fromTokens(lines[i], true);
+		if ((T.size() < 1) || (T[0].startsWith("#")))
+			continue;
+		if (T[0] == "size") {	// size W H
+			m_nW = XMax(T[1].getIntValue(), 1);
+			m_nH = XMax(T[2].getIntValue(), 1);
+			continue;
+		}
+		if (T[0] == "world") {	// world : vue sur l'emprise des donnees
+			m_dGsd = XMax(F.Width() / m_nW, F.Height() / m_nH);
+			if (m_dGsd <= 0.)
+				m_dGsd = 1.;
+			m_dXc = F.Center().X;
+			m_dYc = F.Center().Y;
+			RenderView(true);
+			continue;
+		}
+		if (T[0] == "center") {	// center X Y [gsd]
+			m_dXc = T[1].getDoubleValue();
+			m_dYc = T[2].getDoubleValue();
+			if (T.size() > 3)
+				m_dGsd = T[3].getDoubleValue();
+			RenderView(true);
+			continue;
+		}
+		int nb = 1;
+		if (T[0] == "pan") {	// pan dX dY [nb] : deplacement en pixels
+			if (T.size() > 3)
+				nb = T[3].getIntValue();
+			for (int j = 0; j < nb; j++) {
+				m_dXc += T[1].getDoubleValue() * m_dGsd;
+				m_dYc -= T[2].getDoubleValue() * m_dGsd;
+				if (!RenderView(false))
+					break;
+			}
+			continue;
+		}
+		if (T[0] == "zoom") {	// zoom factor [nb] : multiplication du GSD
+			if (T.size() > 2)
+				nb = T[2].getIntValue();
+			for (int j = 0; j < nb; j++) {
+				m_dGsd *= T[1].getDoubleValue();
+				if (!RenderView(true))
+					break;
+			}
+			continue;
+		}
+		if (T[0] == "redraw") {	// redraw [nb] : dessin complet de la meme vue
+			if (T.size() > 1)
+				nb = T[1].getIntValue();
+			for (int j = 0; j < nb; j++)
+				if (!RenderView(true))
+					break;
+			continue;
+		}
 	}
-	m_nNumObjects++;
-	las->CloseIfNeeded(1);
+	WriteReport();
+	if (m_bQuit)
+		juce::MessageManager::callAsync([]() { juce::JUCEApplication::quit(); });
+}
+
+//==============================================================================
+// MapBenchmark : percentile d'une serie de temps
+//==============================================================================
+double MapBenchmark::Percentile(const std::vector<double>& T, double p)
+{
+	if (T.size() < 1)
+		return 0.;
+	std::vector<double> S = T;
+	std::sort(S.begin(), S.end());
+	size_t index = (size_t)ceil(p * S.size());
+	if (index > 0)
+		index--;
+	return S[XMin(index, S.size() - 1)];
+}
 
+//==============================================================================
+// MapBenchmark : ecriture des resultats
+//==============================================================================
+bool MapBenchmark::WriteReport()
+{
+	std::ofstream out(m_strReport.toStdString());
+	if (!out.good())
+		return false;
+	out.setf(std::ios::fixed);
+	out.precision(3);
+	out << "layer\tframes\tmean_ms\tp50_ms\tp90_ms\tp99_ms\tmax_ms" << std::endl;
+	for (auto iter = m_Times.begin(); iter != m_Times.end(); iter++) {
+		const std::vector<double>& T = iter->second;
+		double mean = 0.;
+		for (size_t i = 0; i < T.size(); i++)
+			mean += T[i];
+		if (T.size() > 0)
+			mean /= T.size();
+		out << iter->first << "\t" << T.size() << "\t" << mean << "\t" << Percentile(T, 0.5) << "\t"
+			<< Percentile(T, 0.9) << "\t" << Percentile(T, 0.99) << "\t" << Percentile(T, 1.) << std::endl;
+	}
+	// Historique complet des images dessinees
+	std::ofstream trace(juce::File(m_strReport).withFileExtension("trace.csv").getFullPathName().toStdString());
+	if (trace.good())
+		m_MapThread.WriteProfile(&trace, false);
+	return out.good();
+}
+
+//==============================================================================
+// MapBenchmark : relief des jeux de donnees synthetiques
+//==============================================================================
+static double BenchmarkZ(double x, double y)
+{
+	return 100. + 30. * sin(x / 300.) * cos(y / 250.) + 5. * sin(x / 37. + y / 53.);
+}
+
+//==============================================================================
+// MapBenchmark : generation des jeux de donnees synthetiques sur une emprise de size metres
+// Dans l'ordre : image RVB (0.5 m), MNT (1 m), nuage LAS (1 point / m2), vecteur GeoJSON
+// Les fichiers deja presents dans le repertoire sont reutilises
+//==============================================================================
+bool MapBenchmark::GenerateDatasets(const juce::File& folder, juce::StringArray& files, double size)
+{
+	const double X0 = 650000., Y0 = 6860000.;	// Coin bas gauche, en Lambert 93
+	const uint32_t T = 256;
+	if (folder.createDirectory().failed())
+		return false;
+	files.clear();
+	files.add(folder.getChildFile("bench_image.tif").getFullPathName());
+	files.add(folder.getChildFile("bench_dtm.tif").getFullPathName());
+	files.add(folder.getChildFile("bench_las.laz").getFullPathName());
+	files.add(folder.getChildFile("bench_vector.json").getFullPathName());
+
+	// Image RVB : teinte selon l'altitude, avec un damier de parcelles
+	if (!juce::File(files[0]).existsAsFile()) {
+		double gsd = 0.5;
+		uint32_t W = (uint32_t)(size / gsd), nbTileW = (W + T - 1) / T;
+		XTiffWriter writer;
+		writer.SetGeoTiff(X0, Y0 + size, gsd);
+		if (!writer.BeginTiled(files[0].toStdString().c_str(), W, W, 3, 8, 0, T, T, 8))
+			return false;
+		std::vector<uint8_t> tile(T * T * 3);
+		for (uint32_t ty = 0; ty < nbTileW; ty++)
+			for (uint32_t tx = 0; tx < nbTileW; tx++) {
+				for (uint32_t j = 0; j < T; j++)
+					for (uint32_t i = 0; i < T; i++) {
+						double x = ((double)tx * T + i) * gsd, y = size - ((double)ty * T + j) * gsd;
+						uint8_t val = (uint8_t)XMin(XMax((BenchmarkZ(x, y) - 60.) * 3., 0.), 255.);
+						bool parcel = ((((int)(x / 64.)) + ((int)(y / 64.))) % 2) == 0;
+						uint8_t* pix = &tile[(j * T + i) * 3];
+						pix[0] = parcel ? val : (uint8_t)(val / 2);
+						pix[1] = (uint8_t)(255 - val / 2);
+						pix[2] = parcel ? (uint8_t)(val / 3) : val;
+					}
+				if (!writer.WriteTile(ty * nbTileW + tx, tile.data()))
+					return false;
+			}
+		if (!writer.EndTiled())
+			return false;
+	}
+
+	// MNT en flottant
+	if (!juce::File(files[1]).existsAsFile()) {
+		double gsd = 1.;
+		uint32_t W = (uint32_t)(size / gsd), nbTileW = (W + T - 1) / T;
+		XTiffWriter writer;
+		writer.SetGeoTiff(X0, Y0 + size, gsd);
+		if (!writer.BeginTiled(files[1].toStdString().c_str(), W, W, 1, 32, 3, T, T, 8, 3))
+			return false;
+		std::vector<float> tile(T * T);
+		for (uint32_t ty = 0; ty < nbTileW; ty++)
+			for (uint32_t tx = 0; tx < nbTileW; tx++) {
+				for (uint32_t j = 0; j < T; j++)
+					for (uint32_t i = 0; i < T; i++)
+						tile[j * T + i] = (float)BenchmarkZ(((double)tx * T + i + 0.5) * gsd, size - ((double)ty * T + j + 0.5) * gsd);
+				if (!writer.WriteTile(ty * nbTileW + tx, (uint8_t*)tile.data()))
+					return false;
+			}
+		if (!writer.EndTiled())
+			return false;
+	}
+
+	// Nuage LAS : sol, vegetation et batiments sur une grille perturbee
+	if (!juce::File(files[2]).existsAsFile()) {
+		laszip_POINTER writer = nullptr;
+		laszip_header* header = nullptr;
+		laszip_point* point = nullptr;
+		if (laszip_create(&writer))
+			return false;
+		bool flag = false;
+		if (!laszip_get_header_pointer(writer, &header)) {
+			header->version_major = 1;
+			header->version_minor = 4;
+			header->header_size = 375;
+			header->offset_to_point_data = 375;
+			header->point_data_format = 7;
+			header->point_data_record_length = 36;
+			header->x_scale_factor = header->y_scale_factor = header->z_scale_factor = 0.01;
+			header->x_offset = X0;
+			header->y_offset = Y0;
+			header->z_offset = 0.;
+			strncpy(header->generating_software, "IGNMap benchmark", 32);
+			flag = (!laszip_open_writer(writer, files[2].toStdString().c_str(), 1)) && (!laszip_get_point_pointer(writer, &point));
+		}
+		uint64_t seed = 0x9E3779B97F4A7C15ULL;
+		auto random = [&seed]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return (double)(seed >> 11) * (1. / 9007199254740992.); };
+		uint32_t nb = (uint32_t)size;
+		for (uint32_t j = 0; (j < nb) && flag; j++)
+			for (uint32_t i = 0; (i < nb) && flag; i++) {
+				double x = i + random(), y = j + random(), z = BenchmarkZ(x, y);
+				uint8_t classif = 2;	// Sol
+				bool parcel = ((((int)(x / 64.)) + ((int)(y / 64.))) % 2) == 0;
+				if ((fmod(x, 64.) > 16.) && (fmod(x, 64.) < 48.) && (fmod(y, 64.) > 16.) && (fmod(y, 64.) < 48.)) {
+					classif = parcel ? 6 : 5;	// Batiment ou vegetation
+					z += parcel ? 8. : 2. + 10. * random();
+				}
+				laszip_F64 coordinates[3] = { X0 + x, Y0 + y, z };
+				point->classification = classif;
+				point->extended_classification = classif;
+				point->extended_return_number = 1;
+				point->extended_number_of_returns = 1;
+				point->intensity = (laszip_U16)(random() * 65535.);
+				point->rgb[0] = (laszip_U16)(classif == 6 ? 50000 : 20000);
+				point->rgb[1] = (laszip_U16)(classif == 5 ? 50000 : 30000);
+				point->rgb[2] = (laszip_U16)(z * 200.);
+				point->gps_time = (double)j * nb + i;
+				flag = (!laszip_set_coordinates(writer, coordinates)) && (!laszip_write_point(writer)) && (!laszip_update_inventory(writer));
+			}
+		if (point != nullptr)
+			flag &= (!laszip_close_writer(writer));
+		laszip_destroy(writer);
+		if (!flag) {
+			juce::File(files[2]).deleteFile();
+			return false;
+		}
+	}
+
+	// Vecteur : contours des parcelles et routes
+	if (!juce::File(files[3]).existsAsFile()) {
+		std::ofstream out(files[3].toStdString());
+		if (!out.good())
+			return false;
+		out.setf(std::ios::fixed);
+		out.precision(2);
+		out << "{\"type\": \"FeatureCollection\", \"features\": [" << std::endl;
+		int nb = (int)(size / 64.);
+		bool first = true;
+		for (int j = 0; j < nb; j++)
+			for (int i = 0; i < nb; i++) {
+				double x0 = X0 + i * 64. + 16., y0 = Y0 + j * 64. + 16., x1 = x0 + 32., y1 = y0 + 32.;
+				out << (first ? "" : ",\n") << "{\"type\": \"Feature\", \"properties\": {\"id\": " << j * nb + i
+					<< "}, \"geometry\": {\"type\": \"Polygon\", \"coordinates\": [[[" << x0 << ", " << y0 << "], [" << x1 << ", " << y0
+					<< "], [" << x1 << ", " << y1 << "], [" << x0 << ", " << y1 << "], [" << x0 << ", " << y0 << "]]]}}";
+				first = false;
+			}
+		for (int j = 0; j <= nb; j++)
+			out << ",\n{\"type\": \"Feature\", \"properties\": {\"id\": " << nb * nb + j
+				<< "}, \"geometry\": {\"type\": \"LineString\", \"coordinates\": [[" << X0 << ", " << Y0 + j * 64. << "], ["
+				<< X0 + size << ", " << Y0 + j * 64. << "]]}}";
+		out << "\n]}" << std::endl;
+		if (!out.good())
+			return false;
+	}
 	return true;
 }
@@ -12,6 +12,7 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <deque>
 #include "GeoBase.h"
 
 class XGeoBase;
@@ -25,7 +26,7 @@ public:
 
   void SetWorld(const double& X0, const double& Y0, const double& gsd, const int& W, const int& H, bool force_vector);
   void SetGeoBase(XGeoBase* base) { m_GeoBase = base; }
-  void SetUpdate(bool overlay, bool raster, bool dtm, bool vector, bool las);
+  void SetUpdate(bool overlay, bool raster, bool dtm, bool vector, bool las, bool modifiedOnly = false);
   bool NeedUpdate() const { return m_bRaster; }
 
   juce::int64 NumObjects() const { return m_nNumObjects; }
@@ -34,6 +35,27 @@ public:
   uint32_t ImageWidth() { return m_Raster.getWidth(); }
   uint32_t ImageHeight() { return m_Raster.getHeight(); }
 
+  struct LayerProfile {   // Statistiques de dessin d'une classe
+    std::string name;
+    std::string type;       // raster, dtm, shader, las, vector
+    double      totalTime, decodeTime, convertTime, drawTime;  // Temps en millisecondes
+    uint64_t    bytesRead;  // Octets lus dans les fichiers
+    uint64_t    nbReads;    // Nombre de lectures dans les fichiers et de noeuds LAS decodes
+    uint64_t    nbPoints;   // Nombre de points LAS lus
+    uint64_t    nbObjects;  // Nombre d'objets dessines
+    uint64_t    nbCulled;   // Nombre d'objets ecartes (hors vue ou deja dessines)
+  };
+  struct FrameProfile {   // Statistiques de dessin d'une image de la carte
+    uint64_t    num;
+    double      gsd;
+    double      totalTime;
+    bool        interrupted;
+    std::vector<LayerProfile> layers;
+  };
+  FrameProfile LastProfile();
+  void ClearProfile();
+  bool WriteProfile(std::ostream* out, bool json);
+
   virtual void 	run() override;
   bool Draw(juce::Graphics& g, int x0 = 0, int y0 = 0, bool overlay = true);
   juce::Image GetRaster(juce::Rectangle<int> R) { if (m_bRasterDone) return m_Raster.getClippedImage(R); return juce::Image(); }
@@ -57,10 +79,38 @@ private:
   juce::Rectangle<int>  m_ClipVector;
   juce::Rectangle<int>  m_ClipRaster;
   juce::Rectangle<int>  m_ClipLas;
+  bool          m_bModifiedOnly;  // Seules les classes modifiees depuis le dernier dessin sont redessinees
+  juce::RectangleList<int>  m_DirtyVector;  // Zones a redessiner en mode m_bModifiedOnly
+  juce::RectangleList<int>  m_DirtyRaster;
+
+  struct ClassState {   // Etat d'une classe lors de son dernier dessin
+    bool        raster;
+    bool        visible;
+    uint32_t    order;    // Position dans l'ordre d'affichage
+    uint32_t    revVisibility, revStyle, revData;
+    XGeoRepres  repres;
+    XFrame      frame;
+  };
+  std::map<XGeoClass*, ClassState> m_ClassState;
+
+  FrameProfile  m_Profile;        // Profil de l'image en cours de dessin
+  std::deque<FrameProfile> m_Trace; // Profils des dernieres images dessinees
+  juce::CriticalSection m_ProfileLock;
+  uint64_t      m_nFrameNum;
+  LayerProfile* m_CurLayer;       // Classe en cours de dessin
+  LayerProfile  m_NullLayer;      // Recoit les statistiques hors classe
+  double        m_dLayerStart;
+  uint64_t      m_nLayerBytes, m_nLayerRead;
 
   bool AllocPoints(int numPt);
   void SetDimension(const int& w, const int& h);
   void PrepareImages(bool totalUpdate, int dX = 0, int dY = 0);
+  juce::Rectangle<int> PixelFrame(const XFrame& F, int margin = 0);
+  void UpdateClassState(bool raster, juce::RectangleList<int>* dirty);
+
+  static double ProfileTime() { return juce::Time::getMillisecondCounterHiRes(); }
+  void BeginLayer(XGeoClass* C, const char* type);
+  void EndLayer();
 
   void DrawVectorClass(XGeoClass* C);
   bool DrawGeometry(XGeoVector* V);
@@ -77,10 +127,38 @@ private:
   bool DrawFileRaster(XFileImage* image, XGeoRepres* repres = nullptr);
   bool DrawInternetRaster(GeoInternetImage* image);
   bool DrawDtmClass(XGeoClass* C);
-  bool DrawDtm(GeoDTM* poDataset);
 
   bool DrawLasClass(XGeoClass* C);
   bool DrawLas(GeoLAS* las);
+  bool DrawLasOverview(GeoLAS* las);
 
   void DrawSelection();
+};
+
+//==============================================================================
+// MapBenchmark : rejoue une sequence de vues sur un MapThread hors ecran
+//==============================================================================
+class MapBenchmark : public juce::Thread {
+public:
+  MapBenchmark(XGeoBase* base, const juce::String& script, const juce::String& report, bool quit = false);
+  virtual ~MapBenchmark() { stopThread(-1); }
+
+  virtual void 	run() override;
+
+  // Jeux de donnees synthetiques : image, MNT, LAS et vecteur sur une meme emprise
+  static bool GenerateDatasets(const juce::File& folder, juce::StringArray& files, double size = 2048.);
+
+private:
+  MapThread     m_MapThread;
+  XGeoBase*     m_GeoBase;
+  juce::String  m_strScript;  // Fichier de commandes (size, world, center, pan, zoom, redraw)
+  juce::String  m_strReport;  // Fichier de resultats
+  bool          m_bQuit;      // Fermeture de l'application a la fin du benchmark
+  double        m_dXc, m_dYc, m_dGsd;
+  int           m_nW, m_nH;
+  std::map<std::string, std::vector<double>> m_Times; // Temps de dessin par type de couche
+
+  bool RenderView(bool force);
+  bool WriteReport();
+  static double Percentile(const std::vector<double>& T, double p);
 };
\ No newline at end of file
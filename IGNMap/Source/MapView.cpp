@@ -17,6 +17,8 @@
 MapView::MapView(juce::String name) : m_MapThread(name)
 {
 	m_strName = name;
+	m_bShowProfile = false;
+	m_bSuspended = false;
 	Clear();
 	setOpaque(true);
 	startTimerHz(10);
@@ -72,6 +74,8 @@ void MapView::paint(juce::Graphics& g)
 	DrawFrames(g);
 	DrawTarget(g);
 	DrawDecoration(g);
+	if (m_bShowProfile)
+		DrawProfile(g);
 }
 
 void MapView::resized()
@@ -118,11 +122,66 @@ void MapView::DrawDecoration(juce::Graphics& g, float deltaX, float deltaY)
 	g.drawText(juce::String(m_MapThread.NumObjects()), R, juce::Justification::centred);
 }
 
+//==============================================================================
+// Affichage des statistiques de dessin de la derniere image
+//==============================================================================
+void MapView::DrawProfile(juce::Graphics& g)
+{
+	MapThread::FrameProfile profile = m_MapThread.LastProfile();
+	size_t nbLine = XMin(profile.layers.size(), (size_t)30);
+	juce::Rectangle<int> R(5, 20, 560, (int)(nbLine + 2) * 12 + 4);
+	g.setColour(juce::Colours::black);
+	g.setOpacity(0.6f);
+	g.fillRect(R);
+	g.setOpacity(1.f);
+	g.setColour(juce::Colours::white);
+	g.setFont(juce::Font(juce::Font::getDefaultMonospacedFontName(), 10.0f, juce::Font::plain));
+	R.reduce(4, 2);
+
+	juce::String text = juce::translate("Frame") + " " + juce::String((juce::int64)profile.num) + " : " + juce::String(profile.totalTime, 1) + " ms";
+	if (profile.interrupted)
+		text += " (" + juce::translate("interrupted") + ")";
+	g.drawText(text, R.removeFromTop(12), juce::Justification::centredLeft);
+	text = juce::String("Layer").paddedRight(' ', 24) + juce::String("total").paddedLeft(' ', 8) + juce::String("decode").paddedLeft(' ', 8)
+		+ juce::String("conv.").paddedLeft(' ', 8) + juce::String("draw").paddedLeft(' ', 8) + juce::String("MB").paddedLeft(' ', 8)
+		+ juce::String("reads").paddedLeft(' ', 7) + juce::String("obj.").paddedLeft(' ', 7) + juce::String("culled").paddedLeft(' ', 7);
+	g.drawText(text, R.removeFromTop(12), juce::Justification::centredLeft);
+	for (size_t i = 0; i < nbLine; i++) {
+		const MapThread::LayerProfile& layer = profile.layers[i];
+		juce::String name = juce::String(layer.name).substring(0, 23);
+		juce::int64 nbObjects = (juce::int64)layer.nbObjects;
+		if (layer.nbPoints > 0)
+			nbObjects = (juce::int64)layer.nbPoints;
+		text = name.paddedRight(' ', 24) + juce::String(layer.totalTime, 1).paddedLeft(' ', 8)
+			+ juce::String(layer.decodeTime, 1).paddedLeft(' ', 8) + juce::String(layer.convertTime, 1).paddedLeft(' ', 8)
+			+ juce::String(layer.drawTime, 1).paddedLeft(' ', 8) + juce::String(layer.bytesRead / 1048576., 1).paddedLeft(' ', 8)
+			+ juce::String((juce::int64)layer.nbReads).paddedLeft(' ', 7) + juce::String(nbObjects).paddedLeft(' ', 7)
+			+ juce::String((juce::int64)layer.nbCulled).paddedLeft(' ', 7);
+		g.drawText(text, R.removeFromTop(12), juce::Justification::centredLeft);
+	}
+}
+
+//==============================================================================
+// Export de l'historique des statistiques de dessin
+//==============================================================================
+void MapView::ExportProfile()
+{
+	juce::String filename = AppUtil::SaveFile("ProfilePath", juce::translate("Save profiling trace"), "*.csv;*.json");
+	if (filename.isEmpty())
+		return;
+	std::ofstream out(AppUtil::GetStringFilename(filename));
+	if (!out.good())
+		return;
+	m_MapThread.WriteProfile(&out, filename.endsWithIgnoreCase(".json"));
+}
+
 //==============================================================================
 // Lancement du thread de dessin des donnees
 //==============================================================================
-void MapView::RenderMap(bool overlay, bool raster, bool dtm, bool vector, bool las, bool totalUpdate)
+void MapView::RenderMap(bool overlay, bool raster, bool dtm, bool vector, bool las, bool totalUpdate, bool modifiedOnly)
 {
+	if (m_bSuspended)
+		return;
 	if (totalUpdate) {
 		m_DragPt = juce::Point<float>(0.f, 0.f);
 		SaveImage();
@@ -138,7 +197,7 @@ void MapView::RenderMap(bool overlay, bool raster, bool dtm, bool vector, bool l
 
 	auto b = getLocalBounds();
 	m_MapThread.SetGeoBase(m_GeoBase);
-	m_MapThread.SetUpdate(overlay, raster, dtm, vector, las);
+	m_MapThread.SetUpdate(overlay, raster, dtm, vector, las, modifiedOnly);
 	m_MapThread.SetWorld(m_dX0, m_dY0, m_dScale, b.getWidth(), b.getHeight(), updateMode);
 
 	m_MapThread.startThread();
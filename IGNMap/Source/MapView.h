@@ -39,7 +39,9 @@ public:
   XFrame Pixel2Ground(const double& Xcenter, const double& Ycenter, const double& nbpix);
   void SetGeoBase(XGeoBase* base) { m_MapThread.stopThread(-1); m_GeoBase = base; resized(); }
   void StopThread() { m_MapThread.signalThreadShouldExit(); if (m_MapThread.isThreadRunning()) m_MapThread.stopThread(-1);}
-  void RenderMap(bool overlay = true, bool raster = true, bool dtm = true, bool vector = true, bool las = true, bool totalUpdate = false);
+  void Suspend(bool flag) { m_bSuspended = flag; if (flag) StopThread(); }  // Plus aucun dessin, pendant un benchmark
+  void RenderMap(bool overlay = true, bool raster = true, bool dtm = true, bool vector = true, bool las = true, bool totalUpdate = false,
+                 bool modifiedOnly = false);
   void SelectFeatures(juce::Point<int>);
   void SelectFeatures(const double& X0, const double& Y0, const double& X1, const double& Y1);
   void Update3DView(const double& X0, const double& Y0, const double& X1, const double& Y1);
@@ -51,6 +53,10 @@ public:
   XPt3D GetTarget() const { return m_Target; }
   void DrawTarget(juce::Graphics&, float deltaX = 0.f, float deltaY = 0.f);
   void DrawFrames(juce::Graphics&, int deltaX = 0, int deltaY = 0);
+  void DrawProfile(juce::Graphics&);
+  void ShowProfile(bool flag) { m_bShowProfile = flag; repaint(); }
+  bool IsProfileVisible() const { return m_bShowProfile; }
+  void ExportProfile();
   XFrame GetFrame() const { return m_Frame; }
   XFrame GetSelectionFrame() const { return m_SelectionFrame; }
   XFrame GetViewFrame() const { return m_MapThread.Frame();}
@@ -99,6 +105,8 @@ private:
   XFrame        m_SelectionFrame;  // Rectangle de selection
   XFrame        m_3DFrame;         // Rectangle de vue 3D
   uint64_t      m_nFrameCounter;
+  bool          m_bShowProfile;   // Affichage des statistiques de dessin
+  bool          m_bSuspended;     // Dessin suspendu
 
   void timerCallback() override { repaint(); }
 
@@ -43,11 +43,11 @@ OGLWidget::OGLWidget()
   fragmentShader = nullptr;
   m_nNbLasVertex = m_nNbPolyVertex = m_nNbLineVertex = m_nNbDtmVertex = 0;
   m_nNbPoly = m_nNbLine = 0;
-  m_LasBufferID = m_RepereID = m_PtBufferID = m_TargetID = 0;
+  m_RepereID = m_PtBufferID = m_TargetID = 0;
   m_DtmBufferID = m_DtmVertexArrayID = m_DtmElementID = 0;
   m_PolyBufferID = m_PolyVertexArrayID = m_PolyElementID = 0;
   m_LineBufferID = m_LineVertexArrayID = m_LineElementID = 0;
-  m_nMaxLasPt = 2000000;
+  m_nMaxLasPt = 8000000;
   m_nMaxPolyPt = m_nMaxLinePt = 10000;
   m_bNeedUpdate = m_bNeedLasPoint = m_bAutoRotation = m_bSaveImage = m_bNeedTarget = m_bUpdateTarget = false;
   m_bDtmTriangle = m_bDtmFill = true;
@@ -74,10 +74,11 @@ void OGLWidget::initialise()
  
   CreateShaders();
 
-  // Creation du buffer des points LAS
-  openGLContext.extensions.glGenBuffers(1, &m_LasBufferID);
-  openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_LasBufferID);
-  openGLContext.extensions.glBufferData(GL_ARRAY_BUFFER, m_nMaxLasPt * sizeof(Vertex), nullptr, GL_DYNAMIC_DRAW);
+  // Threads de chargement des noeuds LAS
+  m_bLasStop = false;
+  int nbWorker = juce::jlimit(1, 4, juce::SystemStats::getNumCpus() - 1);
+  for (int i = 0; i < nbWorker; i++)
+    m_LasWorkers.emplace_back(&OGLWidget::LasWorker, this);
 
   // Creation du buffer des points DTM
   openGLContext.extensions.glGenBuffers(1, &m_DtmVertexArrayID);
@@ -148,7 +149,15 @@ void OGLWidget::initialise()
 //==============================================================================
 void OGLWidget::shutdown()
 {
-  openGLContext.extensions.glDeleteBuffers(1, &m_LasBufferID);
+  {
+    std::lock_guard<std::mutex> lock(m_LasMutex);
+    m_bLasStop = true;
+  }
+  m_LasCondition.notify_all();
+  for (size_t i = 0; i < m_LasWorkers.size(); i++)
+    m_LasWorkers[i].join();
+  m_LasWorkers.clear();
+  ClearLasNodes();
   openGLContext.extensions.glDeleteBuffers(1, &m_DtmBufferID);
   openGLContext.extensions.glDeleteBuffers(1, &m_DtmElementID);
   openGLContext.extensions.glDeleteBuffers(1, &m_DtmVertexArrayID);
@@ -354,19 +363,19 @@ void OGLWidget::render()
 
   m_Shader->use();
 
+  juce::Matrix3D<float> projection = getProjectionMatrix(), view = getViewMatrix();
   if (m_Uniforms->projectionMatrix != nullptr)
-    m_Uniforms->projectionMatrix->setMatrix4(getProjectionMatrix().mat, 1, false);
+    m_Uniforms->projectionMatrix->setMatrix4(projection.mat, 1, false);
 
   if (m_Uniforms->viewMatrix != nullptr)
-    m_Uniforms->viewMatrix->setMatrix4(getViewMatrix().mat, 1, false);
+    m_Uniforms->viewMatrix->setMatrix4(view.mat, 1, false);
 
-  // Dessin des LAS
-  if ((m_nNbLasVertex > 0) && (!m_bNeedUpdate) && (m_bViewLas)) {
-    openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_LasBufferID);
-    m_Attributes->enable();
+  // Dessin des LAS : selection des noeuds selon la vue, chargement et envoi au GPU
+  if ((m_LasNodes.size() > 0) && (!m_bNeedUpdate) && (m_bViewLas)) {
+    UploadLasNodes();
+    UpdateLasLod(view, projection);
     glPointSize(m_LasPointSize);
-    glDrawArrays(GL_POINTS, 0, m_nNbLasVertex);
-    m_Attributes->disable();
+    DrawLasNodes();
   }
 
   // Dessin des MNT
@@ -678,12 +687,35 @@ void OGLWidget::UpdateBase()
   m_nNbDtmVertex = 0;
   m_nNbPolyVertex = m_nNbLineVertex = 0;
   m_nNbPoly = m_nNbLine = 0;
+  ClearLasNodes();
   ReinitDtm();
   if (m_Base == nullptr)
     return;
   const juce::ScopedLock lock(m_Mutex);
   //openGLContext.setContinuousRepainting(false);
   FindZminLas();
+
+  // Parametres communs a tous les noeuds LAS
+  if (m_dZ0 <= XGEO_NO_DATA)
+    m_dZ0 = LasShader::Zmin();
+  std::shared_ptr<LasLodContext> ctx = std::make_shared<LasLodContext>();
+  ctx->X0 = m_dX0;
+  ctx->Y0 = m_dY0;
+  ctx->Z0 = m_dZ0;
+  ctx->gsd = m_dGsd;
+  ctx->frame = m_Frame;
+  ctx->Zmin = LasShader::Zmin();
+  ctx->Zmax = LasShader::Zmax();
+  ctx->Z0Color = LasShader::Zmin();
+  ctx->deltaZ = LasShader::Zmax() - ctx->Z0Color;
+  if (ctx->deltaZ <= 0) ctx->deltaZ = 1.;	// Pour eviter les divisions par 0
+  ctx->mode = (int)LasShader::Mode();
+  for (int i = 0; i < 256; i++) {
+    ctx->visibility[i] = LasShader::ClassificationVisibility((uint8_t)i);
+    ctx->altiColor[i] = LasShader::AltiColorARGB((uint8_t)i);
+    ctx->classifColor[i] = LasShader::ClassificationColor((uint8_t)i).getARGB();
+  }
+  m_LasContext = ctx;
   for (uint32_t i = 0; i < m_Base->NbClass(); i++) {
     XGeoClass* C = m_Base->Class(i);
     if (C == nullptr)
@@ -694,6 +726,15 @@ void OGLWidget::UpdateBase()
       LoadVectorClass(C);
   }
   DrawDtm();
+  // Recentrage en Z sur le centre des noeuds LAS, les points seront charges a la demande
+  double sumZ = 0., sumCount = 0.;
+  for (size_t i = 0; i < m_LasNodes.size(); i++) {
+    const XLasFile::LodNode& node = m_LasNodes[i]->node;
+    sumZ += ((node.zmin + node.zmax) * 0.5 - m_dZ0) / m_dGsd * (double)node.count;
+    sumCount += (double)node.count;
+  }
+  if (sumCount > 0.)
+    m_dDeltaZ = -(sumZ / sumCount);
   if (m_dDeltaZ != 0.)
     MoveZ((float)m_dDeltaZ);
   m_dDeltaZ = 0.;
@@ -740,107 +781,340 @@ void OGLWidget::LoadLasClass(XGeoClass* C)
     XFrame F = las->Frame();
     if (!m_Frame.Intersect(F))
       continue;
-    DrawLas(las);
+    LoadLasNodes(las);
   }
 }
 
 //==============================================================================
-// Dessin d'un fichier LAS
+// Creation des noeuds LAS d'un fichier : noeuds COPC, cellules de l'index ou plages
+// Les points ne sont charges qu'a l'affichage, selon le niveau de detail requis
 //==============================================================================
-void OGLWidget::DrawLas(GeoLAS* las)
+void OGLWidget::LoadLasNodes(GeoLAS* las)
 {
-  const juce::ScopedLock lock(m_Mutex);
-  using namespace ::juce::gl;
   if (!las->ReOpen())
     return;
-  if (!las->SetWorld(m_Frame, LasShader::Zmin(), LasShader::Zmax()))
-    return;
-  laszip_point* point = las->GetPoint();
+  std::vector<XLasFile::LodNode> nodes;
+  if (las->GetLodNodes(nodes, m_Frame)) {
+    bool copc = las->IsCopcFile();
+    for (size_t i = 0; i < nodes.size(); i++) {
+      std::shared_ptr<LasLodNode> node = std::make_shared<LasLodNode>();
+      node->filename = las->Filename();
+      node->node = nodes[i];
+      node->cache = copc;
+      node->clip = (!copc) && las->HasIndex();
+      node->ctx = m_LasContext;
+      m_LasNodes.push_back(node);
+    }
+  }
+  las->CloseIfNeeded();
+}
 
-  openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_LasBufferID);
-  Vertex* ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-  ptr_vertex += m_nNbLasVertex;
+//==============================================================================
+// Suppression des noeuds LAS et de leurs VBO
+//==============================================================================
+void OGLWidget::ClearLasNodes()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_LasMutex);
+    for (size_t i = 0; i < m_LasQueue.size(); i++)
+      m_LasQueue[i]->queued = false;
+    m_LasQueue.clear();
+  }
+  for (size_t i = 0; i < m_LasNodes.size(); i++) {
+    if (m_LasNodes[i]->buffer != 0)
+      openGLContext.extensions.glDeleteBuffers(1, &m_LasNodes[i]->buffer);
+    m_LasNodes[i]->buffer = 0;
+  }
+  m_LasNodes.clear();   // Les noeuds en cours de chargement sont liberes par les threads
+  m_nLasLoaded = 0;
+  m_nNbLasVertex = 0;
+}
 
-  double Z0 = LasShader::Zmin();
-  double deltaZ = LasShader::Zmax() - Z0;
-  if (deltaZ <= 0) deltaZ = 1.;	// Pour eviter les divisions par 0
-  if (m_dZ0 <= XGEO_NO_DATA)
-    m_dZ0 = LasShader::Zmin();
+//==============================================================================
+// Thread de chargement des noeuds LAS
+//==============================================================================
+void OGLWidget::LasWorker()
+{
+  while (true) {
+    std::shared_ptr<LasLodNode> node;
+    uint32_t stride;
+    {
+      std::unique_lock<std::mutex> lock(m_LasMutex);
+      m_LasCondition.wait(lock, [this] { return m_bLasStop || (!m_LasQueue.empty()); });
+      if (m_bLasStop)
+        return;
+      node = m_LasQueue.front();
+      m_LasQueue.pop_front();
+      node->queued = false;
+      node->loading = true;
+      stride = node->requestStride;
+    }
+    std::vector<Vertex> vertices;
+    bool ok = BuildLasNode(node.get(), stride, vertices);
+    std::lock_guard<std::mutex> lock(m_LasMutex);
+    node->loading = false;
+    if (!ok)
+      continue;
+    node->vertices.swap(vertices);
+    node->builtStride = stride;
+    node->ready = true;
+  }
+}
 
-  double X, Y, Z;
+//==============================================================================
+// Construction des points d'un noeud LAS, un point sur stride est conserve en moyenne
+// (tirage aleatoire, pour eviter les motifs des lignes de balayage)
+// Les positions sont celles de la scene, sans le decalage en Z (ajoute a l'envoi au GPU)
+//==============================================================================
+bool OGLWidget::BuildLasNode(LasLodNode* node, uint32_t stride, std::vector<Vertex>& vertices)
+{
+  const LasLodContext& ctx = *node->ctx;
+  std::shared_ptr<XLasFile> las = XLasReaderPool::Take(node->filename);
+  if (las.get() == nullptr)
+    return false;
+  laszip_header* header = las->GetHeader();
+  const XFrame& cell = node->node.frame;
+  const XFrame& F = ctx.frame;
+  double gsd = ctx.gsd;
+  LasShader shader;
   juce::Colour col = juce::Colours::orchid;
   uint8_t data[4] = { 0, 0, 0, 255 };
   uint32_t* data_ptr = (uint32_t*)&data;
-  uint8_t classification;
-  bool classif_newtype = las->IsNewClassification();
-
-  LasShader shader;
-  while (las->GetNextPoint(&X, &Y, &Z)) {
-    if (classif_newtype)
-      classification = point->extended_classification;
-    else
-      classification = point->classification;
-    if (!shader.ClassificationVisibility(classification)) continue;
-    
-    ptr_vertex->position[0] = (float) ((X - m_dX0) / m_dGsd);
-    ptr_vertex->position[1] = (float) ((Y - m_dY0) / m_dGsd);
-    ptr_vertex->position[2] = (float) ((Z - m_dZ0) / m_dGsd);
-    m_dDeltaZ += ptr_vertex->position[2];
-
-    switch (shader.Mode()) {
-    case LasShader::ShaderMode::Altitude:
-      *data_ptr = shader.AltiColorARGB((uint8_t)((Z - Z0) * 255 / deltaZ));
-      break;
-    case LasShader::ShaderMode::RGB:
-      data[0] = (uint8_t)(point->rgb[2] / 256);
-      data[1] = (uint8_t)(point->rgb[1] / 256);
-      data[2] = (uint8_t)(point->rgb[0] / 256);
-      // data[3] = 255; // deja fixe dans l'initialisation de data
-      break;
-    case LasShader::ShaderMode::IRC:
-      data[0] = (uint8_t)(point->rgb[1] / 256);
-      data[1] = (uint8_t)(point->rgb[0] / 256);
-      data[2] = (uint8_t)(point->rgb[3] / 256);
-      // data[3] = 255; // deja fixe dans l'initialisation de data
-      break;
-    case LasShader::ShaderMode::Classification:
-      col = shader.ClassificationColor(classification);
-      *data_ptr = (uint32_t)col.getARGB();
-      break;
-    case LasShader::ShaderMode::Intensity:
-      //data[0] = point->intensity;	// L'intensite est normalisee sur 16 bits
-      //memcpy(data, &point->intensity, 2 * sizeof(uint8_t));
-      *data_ptr = shader.IntensityColorARGB(point->intensity);
-      break;
-    case LasShader::ShaderMode::Angle:
-      if (point->extended_scan_angle < 0) {	// Angle en degree = extended_scan_angle * 0.006
-        data[2] = (uint8_t)(255 - point->extended_scan_angle * (-0.0085));	 // Normalise sur [0; 255]
-        data[1] = 0;
-        data[0] = 0; // 255 - data[2];
+  XLasThinner<uint32_t> thinner((stride > 1) ? XLasThinner<uint32_t>::Random : XLasThinner<uint32_t>::NoThinning, 1., 1. / stride);
+  if (node->node.ranges.size() > 0)
+    thinner.Seed(node->node.ranges[0].start);  // Meme tirage a chaque rechargement du noeud
+  vertices.reserve((size_t)(node->node.count / stride + 1));
+
+  for (size_t r = 0; r < node->node.ranges.size(); r++) {
+    std::shared_ptr<const XLasNode> points = las->GetNode(node->node.ranges[r], node->cache);
+    if (points.get() == nullptr)
+      continue;
+    const XLasNode& P = *points;
+    for (size_t k = 0; k < P.Size(); k++) {
+      if ((stride > 1) && (!thinner.Keep(0., 0., 0.)))
+        continue;
+      if (!ctx.visibility[P.Classification[k]])
+        continue;
+      double X = P.X[k] * header->x_scale_factor + header->x_offset;
+      double Y = P.Y[k] * header->y_scale_factor + header->y_offset;
+      double Z = P.Z[k] * header->z_scale_factor + header->z_offset;
+      if ((X <= F.Xmin) || (X >= F.Xmax) || (Y <= F.Ymin) || (Y >= F.Ymax) || (Z < ctx.Zmin) || (Z > ctx.Zmax))
+        continue;
+      if ((node->clip) && ((X < cell.Xmin) || (X >= cell.Xmax) || (Y <= cell.Ymin) || (Y > cell.Ymax)))
+        continue;   // Point d'une autre cellule de l'index, inclus dans les plages
+      Vertex V;
+      V.position[0] = (float)((X - ctx.X0) / gsd);
+      V.position[1] = (float)((Y - ctx.Y0) / gsd);
+      V.position[2] = (float)((Z - ctx.Z0) / gsd);
+
+      switch ((LasShader::ShaderMode)ctx.mode) {
+      case LasShader::ShaderMode::Altitude:
+        *data_ptr = ctx.altiColor[(uint8_t)((Z - ctx.Z0Color) * 255 / ctx.deltaZ)];
+        break;
+      case LasShader::ShaderMode::RGB:
+        data[0] = (uint8_t)(P.B[k] / 256);
+        data[1] = (uint8_t)(P.G[k] / 256);
+        data[2] = (uint8_t)(P.R[k] / 256);
+        // data[3] = 255; // deja fixe dans l'initialisation de data
+        break;
+      case LasShader::ShaderMode::IRC:
+        data[0] = (uint8_t)(P.G[k] / 256);
+        data[1] = (uint8_t)(P.R[k] / 256);
+        data[2] = (uint8_t)(P.Nir[k] / 256);
+        // data[3] = 255; // deja fixe dans l'initialisation de data
+        break;
+      case LasShader::ShaderMode::Classification:
+        *data_ptr = ctx.classifColor[P.Classification[k]];
+        break;
+      case LasShader::ShaderMode::Intensity:	// L'intensite est normalisee sur 16 bits
+        *data_ptr = shader.IntensityColorARGB(P.Intensity[k]);
+        break;
+      case LasShader::ShaderMode::Angle:
+        if (P.ScanAngle[k] < 0) {	// Angle en degree = extended_scan_angle * 0.006
+          data[2] = (uint8_t)(255 - P.ScanAngle[k] * (-0.0085));	 // Normalise sur [0; 255]
+          data[1] = 0;
+          data[0] = 0;
+        }
+        else {
+          data[2] = 0;
+          data[1] = (uint8_t)(255 - P.ScanAngle[k] * (0.0085));	 // Normalise sur [0; 255]
+          data[0] = 0;
+        }
+        break;
+      default:
+        *data_ptr = (uint32_t)col.getARGB();
       }
-      else {
-        data[2] = 0;
-        data[1] = (uint8_t)(255 - point->extended_scan_angle * (0.0085));	 // Normalise sur [0; 255]
-        data[0] = 0; // 255 - data[1];
+      V.colour[0] = (float)data[2] / 255.f;
+      V.colour[1] = (float)data[1] / 255.f;
+      V.colour[2] = (float)data[0] / 255.f;
+      V.colour[3] = (float)data[3] / 255.f;
+      vertices.push_back(V);
+    }
+  }
+  return true;
+}
+
+//==============================================================================
+// Envoi au GPU des noeuds LAS charges par les threads
+//==============================================================================
+void OGLWidget::UploadLasNodes()
+{
+  using namespace ::juce::gl;
+  const uint64_t maxUpload = 2000000;   // Points envoyes par image, pour garder l'affichage fluide
+  uint64_t nbUpload = 0;
+  for (size_t i = 0; (i < m_LasNodes.size()) && (nbUpload < maxUpload); i++) {
+    LasLodNode* node = m_LasNodes[i].get();
+    std::vector<Vertex> vertices;
+    {
+      std::lock_guard<std::mutex> lock(m_LasMutex);
+      if (!node->ready)
+        continue;
+      node->ready = false;
+      vertices.swap(node->vertices);
+      node->stride = node->builtStride;
+    }
+    for (size_t k = 0; k < vertices.size(); k++)
+      vertices[k].position[2] += (float)m_dOffsetZ;
+    if ((m_bRasterLas) || (m_bZLocalRange))
+      RecolorLas(vertices.data(), (uint32_t)vertices.size());
+    if (node->buffer == 0)
+      openGLContext.extensions.glGenBuffers(1, &node->buffer);
+    openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, node->buffer);
+    openGLContext.extensions.glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    m_nLasLoaded = m_nLasLoaded - node->nbVertex + vertices.size();
+    node->nbVertex = (uint32_t)vertices.size();
+    nbUpload += vertices.size();
+  }
+}
+
+//==============================================================================
+// Selection des noeuds LAS selon la vue
+// Un noeud est ecarte s'il est hors du champ de vision. En COPC, un noeud n'est affiche que si
+// l'espacement des points de son parent, projete a l'ecran, depasse la taille des points.
+// Hors COPC, les points d'un noeud sont sous-echantillonnes selon leur espacement a l'ecran
+//==============================================================================
+void OGLWidget::UpdateLasLod(const juce::Matrix3D<float>& V, const juce::Matrix3D<float>& P)
+{
+  m_nLodFrame++;
+  float mvp[16];
+  juce::Matrix3D<float> view = V, projection = P;
+  MultiplyMatrices4by4OpenGL_FLOAT(mvp, projection.mat, view.mat);
+  float viewportH = (float)openGLContext.getRenderingScale() * (float)m_Bounds.getHeight();
+  double pixelScale = projection.mat[5] * viewportH * 0.5 * m_S.X;  // Pixels par unite de la scene a une distance de 1
+  double threshold = XMax(1.f, m_LasPointSize);
+
+  struct Candidate { size_t index; int level; double pixels; };
+  std::vector<Candidate> wanted;
+  uint64_t nbVisible = 0;
+  for (size_t i = 0; i < m_LasNodes.size(); i++) {
+    LasLodNode* node = m_LasNodes[i].get();
+    const XLasFile::LodNode& N = node->node;
+    node->visible = false;
+    double box[6] = { (N.frame.Xmin - m_dX0) / m_dGsd, (N.frame.Xmax - m_dX0) / m_dGsd,
+                      (N.frame.Ymin - m_dY0) / m_dGsd, (N.frame.Ymax - m_dY0) / m_dGsd,
+                      (N.zmin - m_dZ0) / m_dGsd + m_dOffsetZ, (N.zmax - m_dZ0) / m_dGsd + m_dOffsetZ };
+    // Test des 8 coins dans l'espace de decoupage
+    int outside[6] = { 0, 0, 0, 0, 0, 0 };
+    for (int c = 0; c < 8; c++) {
+      float x = (float)box[c & 1], y = (float)box[2 + ((c >> 1) & 1)], z = (float)box[4 + ((c >> 2) & 1)];
+      float clip[4];
+      for (int r = 0; r < 4; r++)
+        clip[r] = mvp[r] * x + mvp[4 + r] * y + mvp[8 + r] * z + mvp[12 + r];
+      for (int r = 0; r < 3; r++) {
+        if (clip[r] < -clip[3]) outside[2 * r]++;
+        if (clip[r] > clip[3]) outside[2 * r + 1]++;
       }
-      break;
-			default:;
     }
-    ptr_vertex->colour[0] = (float)data[2] / 255.f;
-    ptr_vertex->colour[1] = (float)data[1] / 255.f;
-    ptr_vertex->colour[2] = (float)data[0] / 255.f;
-    ptr_vertex->colour[3] = (float)data[3] / 255.f;
+    bool culled = false;
+    for (int r = 0; r < 6; r++)
+      if (outside[r] == 8)
+        culled = true;
+    if (culled)
+      continue;
+    // Distance a la camera du centre du noeud et espacement des points a l'ecran
+    float cx = (float)((box[0] + box[1]) * 0.5), cy = (float)((box[2] + box[3]) * 0.5), cz = (float)((box[4] + box[5]) * 0.5);
+    double dist = mvp[3] * cx + mvp[7] * cy + mvp[11] * cz + mvp[15];
+    double radius = 0.5 * sqrt((box[1] - box[0]) * (box[1] - box[0]) + (box[3] - box[2]) * (box[3] - box[2]) +
+                               (box[5] - box[4]) * (box[5] - box[4])) * m_S.X;
+    dist = XMax(dist - radius, 0.1);   // Distance au point le plus proche du noeud
+    double pixels = (N.spacing / m_dGsd) * pixelScale / dist;
+    if ((N.level > 0) && (2. * pixels < threshold))
+      continue; // Le parent est assez dense a cette distance
+    uint32_t stride = 1;
+    if (!node->cache) {
+      double k = (threshold / XMax(pixels, 1e-6)) * (threshold / XMax(pixels, 1e-6));
+      while ((stride * 2 <= k) && (stride < 256))
+        stride *= 2;
+    }
+    node->visible = true;
+    node->lastUsed = m_nLodFrame;
+    node->wantedStride = stride;
+    if ((node->buffer != 0) && (stride >= node->stride) && (stride < 4 * node->stride)) {
+      nbVisible += node->nbVertex;
+      continue;
+    }
+    Candidate C = { i, N.level, pixels };
+    wanted.push_back(C);
+  }
 
-    //memcpy(&ptr_vertex[(0+m_nNbVertex) * 7], vertex, sizeof(vertex));
-    //openGLContext.extensions.glBufferSubData(GL_ARRAY_BUFFER, (6 + m_nNbVertex) * 7 * sizeof(float), sizeof(vertex), vertex);
-    ptr_vertex++;
-    m_nNbLasVertex++;
-    if (m_nNbLasVertex >= m_nMaxLasPt)
-      break;
+  // File des noeuds a charger : les plus grossiers et les plus proches d'abord, dans la limite du budget
+  std::sort(wanted.begin(), wanted.end(), [](const Candidate& A, const Candidate& B) {
+    if (A.level != B.level) return A.level < B.level;
+    return A.pixels > B.pixels;
+    });
+  {
+    std::lock_guard<std::mutex> lock(m_LasMutex);
+    for (size_t i = 0; i < m_LasQueue.size(); i++)
+      m_LasQueue[i]->queued = false;
+    m_LasQueue.clear();
+    for (size_t i = 0; i < wanted.size(); i++) {
+      LasLodNode* node = m_LasNodes[wanted[i].index].get();
+      nbVisible += node->node.count / node->wantedStride;
+      if (nbVisible > m_nMaxLasPt)
+        break;
+      if ((node->loading) || (node->ready))
+        continue;
+      node->requestStride = node->wantedStride;
+      node->queued = true;
+      m_LasQueue.push_back(m_LasNodes[wanted[i].index]);
+    }
+  }
+  m_LasCondition.notify_all();
+
+  // Liberation des noeuds non affiches les plus anciens si le budget est depasse
+  if (m_nLasLoaded <= m_nMaxLasPt)
+    return;
+  std::vector<LasLodNode*> loaded;
+  for (size_t i = 0; i < m_LasNodes.size(); i++)
+    if ((m_LasNodes[i]->buffer != 0) && (!m_LasNodes[i]->visible))
+      loaded.push_back(m_LasNodes[i].get());
+  std::sort(loaded.begin(), loaded.end(), [](const LasLodNode* A, const LasLodNode* B) { return A->lastUsed < B->lastUsed; });
+  for (size_t i = 0; (i < loaded.size()) && (m_nLasLoaded > m_nMaxLasPt); i++) {
+    openGLContext.extensions.glDeleteBuffers(1, &loaded[i]->buffer);
+    loaded[i]->buffer = 0;
+    m_nLasLoaded -= loaded[i]->nbVertex;
+    loaded[i]->nbVertex = 0;
+    loaded[i]->stride = 0;
+  }
+}
+
+//==============================================================================
+// Dessin des noeuds LAS visibles deja envoyes au GPU
+//==============================================================================
+void OGLWidget::DrawLasNodes()
+{
+  using namespace ::juce::gl;
+  m_nNbLasVertex = 0;
+  for (size_t i = 0; i < m_LasNodes.size(); i++) {
+    LasLodNode* node = m_LasNodes[i].get();
+    if ((!node->visible) || (node->buffer == 0) || (node->nbVertex == 0))
+      continue;
+    openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, node->buffer);
+    m_Attributes->enable();
+    glDrawArrays(GL_POINTS, 0, node->nbVertex);
+    m_Attributes->disable();
+    m_nNbLasVertex += node->nbVertex;
   }
-  las->CloseIfNeeded(1);
-  glUnmapBuffer(GL_ARRAY_BUFFER);
-  m_dDeltaZ = -(m_dDeltaZ / m_nNbLasVertex);
 }
 
 //==============================================================================
@@ -967,14 +1241,22 @@ void OGLWidget::MoveZ(float dZ)
   //openGLContext.setContinuousRepainting(false);
   using namespace ::juce::gl;
   m_dOffsetZ += dZ;
+  Vertex* ptr_vertex = nullptr;
   // Points LAS
-  openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_LasBufferID);
-  Vertex* ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
-  for (uint32_t i = 0; i < m_nNbLasVertex; i++) {
-    ptr_vertex->position[2] += dZ;
-    ptr_vertex++;
+  for (size_t k = 0; k < m_LasNodes.size(); k++) {
+    LasLodNode* node = m_LasNodes[k].get();
+    if (node->buffer == 0)
+      continue;
+    openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, node->buffer);
+    ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+    if (ptr_vertex == nullptr)
+      continue;
+    for (uint32_t i = 0; i < node->nbVertex; i++) {
+      ptr_vertex->position[2] += dZ;
+      ptr_vertex++;
+    }
+    glUnmapBuffer(GL_ARRAY_BUFFER);
   }
-  glUnmapBuffer(GL_ARRAY_BUFFER);
   // Points MNT
   openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_DtmBufferID);
   ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
@@ -1028,29 +1310,60 @@ void OGLWidget::ChangeLasColor()
 {
   m_bNeedUpdate = false;
   m_bUpdateLasColor = false;
-  if (m_nNbLasVertex < 1)
+  if (m_nLasLoaded < 1)
     return;
   LasShader shader;
   if ((shader.Mode() != LasShader::ShaderMode::Altitude)&&(!m_bRasterLas))
     return;
   const juce::ScopedLock lock(m_Mutex);
   using namespace ::juce::gl;
-  openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, m_LasBufferID);
-  Vertex* ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
-  if (ptr_vertex == nullptr)
-    return;
   m_bZLocalRange = !m_bZLocalRange;
-  float zmin = (float)LasShader::Zmin(), zmax = (float)LasShader::Zmax();
-  if (!m_bRasterLas) {  // Si on n'utilise pas le fond raster, on utilise une palette
-    if (m_bZLocalRange) { // Recherche du Zmin et du Zmax local des points LAS charges
-			zmin = ptr_vertex[0].position[2];
-			zmax = ptr_vertex[0].position[2];
-      for (uint32_t i = 1; i < m_nNbLasVertex; i++) {
-        zmin = XMin(zmin, ptr_vertex[i].position[2]);
-        zmax = XMax(zmax, ptr_vertex[i].position[2]);
+  if ((!m_bRasterLas)&&(m_bZLocalRange)) { // Recherche du Zmin et du Zmax local des points LAS charges
+    bool first = true;
+    for (size_t k = 0; k < m_LasNodes.size(); k++) {
+      LasLodNode* node = m_LasNodes[k].get();
+      if ((node->buffer == 0) || (node->nbVertex == 0))
+        continue;
+      openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, node->buffer);
+      Vertex* ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_ONLY);
+      if (ptr_vertex == nullptr)
+        continue;
+      if (first) {
+        m_LasZmin = m_LasZmax = ptr_vertex[0].position[2];
+        first = false;
       }
+      for (uint32_t i = 0; i < node->nbVertex; i++) {
+        m_LasZmin = XMin(m_LasZmin, ptr_vertex[i].position[2]);
+        m_LasZmax = XMax(m_LasZmax, ptr_vertex[i].position[2]);
+      }
+      glUnmapBuffer(GL_ARRAY_BUFFER);
     }
   }
+  for (size_t k = 0; k < m_LasNodes.size(); k++) {
+    LasLodNode* node = m_LasNodes[k].get();
+    if ((node->buffer == 0) || (node->nbVertex == 0))
+      continue;
+    openGLContext.extensions.glBindBuffer(GL_ARRAY_BUFFER, node->buffer);
+    Vertex* ptr_vertex = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+    if (ptr_vertex == nullptr)
+      continue;
+    RecolorLas(ptr_vertex, node->nbVertex);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  openGLContext.triggerRepaint();
+}
+
+//==============================================================================
+// Colorisation de points LAS avec le fond raster ou la palette altimetrique
+//==============================================================================
+void OGLWidget::RecolorLas(Vertex* ptr_vertex, uint32_t nb)
+{
+  LasShader shader;
+  float zmin = (float)LasShader::Zmin(), zmax = (float)LasShader::Zmax();
+  if ((!m_bRasterLas) && (m_bZLocalRange)) {
+    zmin = m_LasZmin;
+    zmax = m_LasZmax;
+  }
   float deltaZ = zmax - zmin;
   if (deltaZ <= 0) deltaZ = 1.f;	// Pour eviter les divisions par 0
 
@@ -1059,7 +1372,7 @@ void OGLWidget::ChangeLasColor()
   uint32_t* data_ptr = (uint32_t*)&data;
   juce::Image::BitmapData bitmap(m_QuickLook, juce::Image::BitmapData::readOnly);
   int x, y;
-  for (uint32_t i = 0; i < m_nNbLasVertex; i++) {
+  for (uint32_t i = 0; i < nb; i++) {
     if (m_bRasterLas) { // Affichage avec le raster
       x = (int)(bitmap.width * 0.5 + ptr_vertex->position[0] / 2. * (bitmap.width * 0.5));
       y = (int)(bitmap.height * 0.5 - ptr_vertex->position[1] / 2. * (bitmap.height * 0.5));
@@ -1080,8 +1393,6 @@ void OGLWidget::ChangeLasColor()
     ptr_vertex->colour[3] = (float)data[3] / 255.f;
     ptr_vertex++;
   }
-  glUnmapBuffer(GL_ARRAY_BUFFER);
-  openGLContext.triggerRepaint();
 }
 
 //==============================================================================
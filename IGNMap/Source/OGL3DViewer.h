@@ -12,9 +12,14 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "../../XTool/XFrame.h"
 #include "../../XTool/XPt2D.h"
 #include "../../XTool/XPt3D.h"
+#include "../../XToolAlgo/XLasFile.h"
 
 class XGeoBase;
 class XGeoClass;
@@ -58,7 +63,12 @@ protected:
   void MoveZ(float dZ);
   void ChangeLasColor();
   void ChangeDtmColor();
-  void DrawLas(GeoLAS* las);
+  void LoadLasNodes(GeoLAS* las);
+  void ClearLasNodes();
+  void UpdateLasLod(const juce::Matrix3D<float>& V, const juce::Matrix3D<float>& P);
+  void UploadLasNodes();
+  void DrawLasNodes();
+  void LasWorker();
   void DrawDtm();
   void DrawPolyVector(XGeoVector* V);
   void DrawLineVector(XGeoVector* V);
@@ -77,6 +87,39 @@ private:
     uint32_t num[3];
   };
 
+  struct LasLodContext {  // Parametres de construction des points, fixes au chargement des objets
+    double    X0, Y0, Z0, gsd;  // Transformation terrain -> scene
+    XFrame    frame;
+    double    Zmin, Zmax;       // Filtre sur les altitudes
+    double    Z0Color, deltaZ;  // Normalisation des altitudes pour la palette
+    int       mode;             // LasShader::ShaderMode
+    bool      visibility[256];
+    uint32_t  altiColor[256];
+    uint32_t  classifColor[256];
+  };
+
+  struct LasLodNode { // Noeud LAS affiche par niveau de detail, avec son propre VBO
+    std::string           filename;
+    XLasFile::LodNode     node;
+    bool                  cache;        // Noeuds COPC : passage par XLasNodeCache
+    bool                  clip;         // Cellules d'index : les plages peuvent deborder de la cellule
+    std::shared_ptr<const LasLodContext> ctx;
+    // Etat partage avec les threads de chargement (protege par m_LasMutex)
+    bool                  queued = false, loading = false, ready = false;
+    uint32_t              requestStride = 1, builtStride = 1;
+    std::vector<Vertex>   vertices;     // Points construits en attente d'envoi au GPU
+    // Etat du thread OpenGL
+    GLuint                buffer = 0;
+    uint32_t              nbVertex = 0;
+    uint32_t              stride = 0;   // Pas de sous-echantillonnage des points charges
+    uint32_t              wantedStride = 1;
+    uint64_t              lastUsed = 0; // Derniere image ou le noeud est affiche (LRU)
+    bool                  visible = false;
+  };
+
+  static bool BuildLasNode(LasLodNode* node, uint32_t stride, std::vector<Vertex>& vertices);
+  void RecolorLas(Vertex* ptr_vertex, uint32_t nb);
+
   XPt3D			m_T;						// Translation
   XPt3D			m_R;						// Rotation
   XPt3D     m_S;            // Facteurs d'echelle
@@ -87,17 +130,16 @@ private:
   juce::Image   m_QuickLook;
   juce::String  m_strFileSave;
 
-  uint32_t  m_nMaxLasPt;        // Nombre maximum de points LAS
+  uint32_t  m_nMaxLasPt;        // Nombre maximum de points LAS charges dans le GPU
   uint32_t  m_nMaxPolyPt;        // Nombre maximum de points polygone
   uint32_t  m_nMaxLinePt;        // Nombre maximum de points polyligne
-  uint32_t  m_nNbLasVertex;     // Nombre de points LAS
+  uint32_t  m_nNbLasVertex;     // Nombre de points LAS affiches
   uint32_t  m_nNbPolyVertex;    // Nombre de points polygone
   uint32_t  m_nNbLineVertex;    // Nombre de points polyligne
   uint32_t  m_nNbDtmVertex;     // Nombre de points DTM
   uint32_t  m_nNbPoly;          // Nombre de polygones
   uint32_t  m_nNbLine;          // Nombre de polylignes
 
-  GLuint    m_LasBufferID;      // Points LAS
   GLuint    m_DtmBufferID;      // Points des MNT
   GLuint    m_DtmVertexArrayID;
   GLuint    m_DtmElementID;
@@ -230,6 +272,18 @@ private:
   juce::Rectangle<int> m_Bounds;
   juce::CriticalSection m_Mutex;
 
+  // Points LAS par niveau de detail : noeuds charges par des threads, un VBO par noeud
+  std::vector<std::shared_ptr<LasLodNode> > m_LasNodes;
+  std::shared_ptr<const LasLodContext>  m_LasContext;
+  std::deque<std::shared_ptr<LasLodNode> > m_LasQueue;  // Noeuds a charger, par priorite
+  std::vector<std::thread>  m_LasWorkers;
+  std::mutex                m_LasMutex;
+  std::condition_variable   m_LasCondition;
+  bool                      m_bLasStop = false;
+  uint64_t                  m_nLasLoaded = 0;   // Nombre de points LAS dans le GPU
+  uint64_t                  m_nLodFrame = 0;
+  float                     m_LasZmin = 0.f, m_LasZmax = 0.f; // Plage de Z de la palette locale
+
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(OGLWidget)
 };
 
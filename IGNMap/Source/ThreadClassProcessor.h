@@ -12,6 +12,8 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <thread>
+#include <atomic>
 #include "../../XTool/XGeoClass.h"
 #include "../../XTool/XGeoVector.h"
 #include "../../XToolGeod/XGeoPref.h"
@@ -24,10 +26,12 @@ public:
 	juce::String m_strFileExtension;	// Extension des fichiers de sortie
 	juce::String m_strMifFile;				// Nom du fichier MIF eventuellement cree par le traitement
 	juce::String m_strMidFile;				// Nom du fichier MID eventuellement cree par le traitement
+	int m_nNbThread;									// Nombre de threads : si > 1, Process doit etre thread-safe
 
 	ThreadClassProcessor(juce::String windowTitle, bool onlyVisible) : ThreadWithProgressWindow(juce::translate(windowTitle), true, true)
 	{
 		m_bOnlyVisible = onlyVisible;
+		m_nNbThread = 1;
 	}
 
 	// Methode virtuelle a implementer pour realiser le traitement
@@ -36,31 +40,53 @@ public:
 	// Methode run du thread
 	void run()
 	{
-		uint32_t nb_file = 0, count = 0;
+		std::vector<XGeoVector*> V;
 		for (int i = 0; i < m_T.size(); i++) {
 			if ((m_bOnlyVisible) && (!m_T[i]->Visible()))
 				continue;
-			nb_file += m_T[i]->NbVector();
+			for (uint32_t j = 0; j < m_T[i]->NbVector(); j++) {
+				XGeoVector* vector = m_T[i]->Vector(j);
+				if ((m_bOnlyVisible) && (!vector->Visible()))
+					continue;
+				V.push_back(vector);
+			}
 		}
-		if (nb_file == 0)
+		if (V.size() == 0)
 			return;
 
-		for (int i = 0; i < m_T.size(); i++) {
-			if (threadShouldExit())
-				break;
-			if ((m_bOnlyVisible)&&(!m_T[i]->Visible()))
-				continue;
-			for (uint32_t j = 0; j < m_T[i]->NbVector(); j++) {
+		if (m_nNbThread <= 1) {
+			for (size_t i = 0; i < V.size(); i++) {
 				if (threadShouldExit())
 					break;
-				setProgress((double)count / (double)nb_file);
-				count++;
-				XGeoVector* V = m_T[i]->Vector(j);
-				if ((m_bOnlyVisible) && (!V->Visible()))
-					continue;
-				Process(V);
+				setProgress((double)i / (double)V.size());
+				Process(V[i]);
+			}
+			return;
+		}
+
+		// Traitement parallele : chaque thread prend le prochain vecteur libre
+		std::atomic<size_t> next(0), done(0);
+		auto worker = [&]() {
+			while (!threadShouldExit()) {
+				size_t i = next++;
+				if (i >= V.size())
+					break;
+				Process(V[i]);
+				done++;
 			}
+			};
+		size_t nbThread = XMin((size_t)m_nNbThread, V.size());
+		std::vector<std::thread> T;
+		for (size_t i = 0; i < nbThread; i++)
+			T.push_back(std::thread(worker));
+		while (done < V.size()) {
+			setProgress((double)done / (double)V.size());
+			if (threadShouldExit())
+				break;
+			wait(100);
 		}
+		for (size_t i = 0; i < T.size(); i++)
+			T[i].join();
 	}
 
 	// Creation d'un fichier MIF/MID pour exposer les resultats du traitement
@@ -369,12 +369,12 @@ void VectorLayersViewer::actionListenerCallback(const juce::String& message)
 		return;
 	}
 	if (message == "UpdateClass") {
-		sendActionMessage("UpdateVector");
+		sendActionMessage("UpdateVectorClass");
 		return;
 	}
 	if (message == "UpdateVectorRepres") {
 		m_Table.repaint();
-		sendActionMessage("UpdateVector");
+		sendActionMessage("UpdateVectorClass");
 		return;
 	}
 
@@ -397,7 +397,7 @@ void VectorLayersViewer::actionListenerCallback(const juce::String& message)
 		for (int i = 0; i < T.size(); i++)
 			T[i]->Visible(!T[i]->Visible());
 		m_Table.repaint();
-		sendActionMessage("UpdateVector");
+		sendActionMessage("UpdateVectorClass");
 		return;
 	}
 	if (message == "UpdateVectorSelectability") {
@@ -452,7 +452,7 @@ void VectorLayersViewer::itemDropped(const SourceDetails& details)
 	}
 	m_Base->SortClass();
 	m_Table.repaint();
-	m_Model.sendActionMessage("UpdateVector");
+	m_Model.sendActionMessage("UpdateVectorClass");
 }
 
 bool VectorLayersViewer::isInterestedInDragSource(const SourceDetails& details)
@@ -0,0 +1,409 @@
+//-----------------------------------------------------------------------------
+//								XHydroBench.cpp
+//								===============
+//
+// Controle et mesure de la chaine hydrologique par dalles (XHydroChain) sur des
+// MNT synthetiques : relief sinusoidal bruite, plats quantifies, lac plat et trous.
+// Pour plusieurs tailles de dalles, en D8 et en D-infini :
+//  - le comblement doit etre identique a un Priority-Flood sur le MNT complet
+//  - les directions D8 ne montent jamais, sans cycle, et ne s'arretent qu'aux exutoires
+//  - l'accumulation doit etre celle du MNT complet sur les memes directions, et conservee
+//  - les thalwegs doivent etre ceux du trace sur le MNT complet
+//
+// Usage : XHydroBench [largeur hauteur graine dossier_temporaire]
+// Compilation avec les sources de XTool, XToolImage, XToolGeod et XToolVector/XDBase.cpp,
+// et les bibliotheques zlib, libjpeg et libwebp
+//
+// Auteur : F.Becirspahic - IGN / DSI / SIMV
+// License : GNU AFFERO GENERAL PUBLIC LICENSE v3
+//-----------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <queue>
+#include <algorithm>
+#include "../XGeoFDtm.h"
+#include "../XHydroChain.h"
+
+static const float NoData = -9999.f;
+
+//-----------------------------------------------------------------------------
+// Resultats de la chaine par dalles : grilles completes, thalwegs et temps de calcul
+//-----------------------------------------------------------------------------
+struct BenchResult {
+  std::vector<float> Fill, P, A;
+  std::vector<uint8_t> D, D8;
+  std::vector<std::vector<XPt2D> > Thalweg;
+  std::vector<double> Area;
+  double Time[4];   // Comblement, directions, accumulation, thalwegs (ms)
+};
+
+//-----------------------------------------------------------------------------
+// Comblement de reference : Priority-Flood sur le MNT complet
+//-----------------------------------------------------------------------------
+static void RefFill(std::vector<float>& Z, int W, int H)
+{
+  typedef std::pair<float, size_t> Node;
+  std::priority_queue<Node, std::vector<Node>, std::greater<Node> > open;
+  std::queue<size_t> pit;
+  std::vector<uint8_t> closed(Z.size(), 0);
+  for (int i = 0; i < H; i++) {
+    for (int j = 0; j < W; j++) {
+      size_t index = (size_t)i * W + j;
+      if (Z[index] <= NoData) {
+        closed[index] = 1;
+        continue;
+      }
+      bool edge = (i == 0) || (j == 0) || (i == H - 1) || (j == W - 1);
+      for (int k = 0; (k < 8) && (!edge); k++)
+        if (Z[(size_t)(i + HydroDy[k]) * W + j + HydroDx[k]] <= NoData)
+          edge = true;
+      if (edge) {
+        closed[index] = 1;
+        open.push(Node(Z[index], index));
+      }
+    }
+  }
+  while ((open.size() > 0) || (pit.size() > 0)) {
+    size_t index;
+    if (pit.size() > 0) {
+      index = pit.front();
+      pit.pop();
+    }
+    else {
+      index = open.top().second;
+      open.pop();
+    }
+    int x = (int)(index % W), y = (int)(index / W);
+    for (int k = 0; k < 8; k++) {
+      int u = x + HydroDx[k], v = y + HydroDy[k];
+      if ((u < 0) || (v < 0) || (u >= W) || (v >= H))
+        continue;
+      size_t n = (size_t)v * W + u;
+      if (closed[n])
+        continue;
+      closed[n] = 1;
+      if (Z[n] <= Z[index]) {
+        Z[n] = Z[index];
+        pit.push(n);
+      }
+      else
+        open.push(Node(Z[n], n));
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Execution de la chaine par dalles
+//-----------------------------------------------------------------------------
+static bool Run(XGeoFDtm* dtm, uint32_t tile, bool dinf, float threshold, std::string folder, BenchResult& R)
+{
+  XHydroChain chain(dtm, tile, 0, dinf, folder + "/bench_hydro");
+  auto t0 = std::chrono::steady_clock::now();
+  auto lap = [&](int k) {
+    auto t1 = std::chrono::steady_clock::now();
+    R.Time[k] = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    t0 = t1;
+    };
+  if (!chain.FillDepressions())
+    return false;
+  lap(0);
+  if (!chain.FlowDirection())
+    return false;
+  lap(1);
+  std::string tiffile = folder + "/bench_acc.tif";
+  bool flag = chain.FlowAccumulation(tiffile);
+  std::remove(tiffile.c_str());
+  if (!flag)
+    return false;
+  lap(2);
+  if (!chain.Thalweg(threshold, R.Thalweg, R.Area))
+    return false;
+  lap(3);
+  if (!chain.ReadGrid("fill", R.Fill) || !chain.ReadGrid("dir", R.D) || !chain.ReadGrid("acc", R.A))
+    return false;
+  if (!dinf) {
+    R.D8 = R.D;
+    return true;
+  }
+  return chain.ReadGrid("prop", R.P) && chain.ReadGrid("d8", R.D8);
+}
+
+//-----------------------------------------------------------------------------
+// Controle des resultats par rapport aux calculs sur le MNT complet
+//-----------------------------------------------------------------------------
+static int Check(const std::vector<float>& Zin, const BenchResult& R, int W, int H, bool dinf, float threshold,
+                 double X0, double Y0)
+{
+  int nbError = 0;
+  size_t nbNode = Zin.size();
+
+  // Comblement
+  std::vector<float> Z = Zin;
+  RefFill(Z, W, H);
+  size_t nbFill = 0;
+  for (size_t i = 0; i < nbNode; i++)
+    if (((Z[i] <= NoData) ? NoData : Z[i]) != R.Fill[i])
+      nbFill++;
+  if (nbFill > 0) {
+    printf("  comblement different sur %zu noeuds\n", nbFill);
+    nbError++;
+  }
+
+  // Directions D8 : pas de montee, pas de cycle, arret uniquement sur un exutoire
+  auto next = [&](size_t i, uint8_t d) { return (size_t)((i / W) + HydroDy[d]) * W + (i % W) + HydroDx[d]; };
+  auto outlet = [&](int x, int y) {
+    for (int k = 0; k < 8; k++) {
+      int u = x + HydroDx[k], v = y + HydroDy[k];
+      if ((u < 0) || (v < 0) || (u >= W) || (v >= H) || (Z[(size_t)v * W + u] <= NoData))
+        return true;
+    }
+    return false;
+    };
+  size_t nbTerminal = 0, nbUp = 0, nbLoop = 0;
+  for (int i = 0; i < H; i++) {
+    for (int j = 0; j < W; j++) {
+      size_t index = (size_t)i * W + j;
+      uint8_t d = R.D8[index];
+      if (Z[index] <= NoData) {
+        if (d != 255) nbTerminal++;
+        continue;
+      }
+      if (d == 8) {
+        if (!outlet(j, i)) nbTerminal++;
+        continue;
+      }
+      size_t n = next(index, d);
+      if ((R.Fill[n] > R.Fill[index]) || (R.Fill[n] <= NoData))
+        nbUp++;
+    }
+  }
+  std::vector<uint8_t> state(nbNode, 0);
+  std::vector<size_t> path;
+  for (size_t s = 0; s < nbNode; s++) {
+    path.clear();
+    for (size_t c = s; (state[c] != 2) && (R.D8[c] < 8); c = next(c, R.D8[c])) {
+      if (state[c] == 1) {
+        nbLoop++;
+        break;
+      }
+      state[c] = 1;
+      path.push_back(c);
+    }
+    for (size_t k = 0; k < path.size(); k++)
+      state[path[k]] = 2;
+  }
+  if ((nbTerminal > 0) || (nbUp > 0) || (nbLoop > 0)) {
+    printf("  D8 : %zu arrets hors exutoire, %zu montees, %zu cycles\n", nbTerminal, nbUp, nbLoop);
+    nbError++;
+  }
+
+  // Accumulation de reference sur les memes directions, dans l'ordre topologique
+  auto receivers = [&](size_t i, size_t* rec, double* weight) {
+    uint8_t d = R.D[i];
+    if (d > 7)
+      return 0;
+    float p = dinf ? R.P[i] : 0.f;
+    int nb = 0;
+    for (int k = 0; k < 2; k++) {
+      float w = (k == 0) ? 1.f - p : p;
+      if (w <= 0.f)
+        continue;
+      rec[nb] = next(i, (uint8_t)((d + k) % 8));
+      weight[nb++] = w;
+    }
+    return nb;
+    };
+  std::vector<double> A(nbNode, 0.);
+  std::vector<int> nbIn(nbNode, 0);
+  size_t rec[2];
+  double weight[2];
+  for (size_t i = 0; i < nbNode; i++) {
+    if (R.D[i] == 255)
+      continue;
+    A[i] = 1.;
+    int nb = receivers(i, rec, weight);
+    for (int k = 0; k < nb; k++)
+      nbIn[rec[k]]++;
+  }
+  std::vector<size_t> stack;
+  for (size_t i = 0; i < nbNode; i++)
+    if ((R.D[i] != 255) && (nbIn[i] == 0))
+      stack.push_back(i);
+  size_t nbDone = 0, nbValid = 0;
+  while (stack.size() > 0) {
+    size_t i = stack.back();
+    stack.pop_back();
+    nbDone++;
+    int nb = receivers(i, rec, weight);
+    for (int k = 0; k < nb; k++) {
+      A[rec[k]] += A[i] * weight[k];
+      if (--nbIn[rec[k]] == 0)
+        stack.push_back(rec[k]);
+    }
+  }
+  double errMax = 0., outflow = 0.;
+  for (size_t i = 0; i < nbNode; i++) {
+    if (R.D[i] == 255)
+      continue;
+    nbValid++;
+    errMax = std::max(errMax, fabs(A[i] - R.A[i]) / std::max(1., A[i]));
+    if (R.D[i] == 8)
+      outflow += R.A[i];
+  }
+  if (nbDone != nbValid) {
+    printf("  accumulation : cycle dans les directions (%zu / %zu)\n", nbDone, nbValid);
+    nbError++;
+  }
+  if (errMax > 1e-4) {
+    printf("  accumulation : ecart relatif maximal %g\n", errMax);
+    nbError++;
+  }
+  if (fabs(outflow - nbValid) > 1e-4 * nbValid) {
+    printf("  accumulation : %f sortent pour %zu noeuds\n", outflow, nbValid);
+    nbError++;
+  }
+
+  // Thalwegs de reference : trace sur le MNT complet
+  auto down = [&](size_t i) -> int64_t {
+    if (R.D8[i] > 7)
+      return -1;
+    size_t n = next(i, R.D8[i]);
+    if (R.A[n] < threshold)
+      return -1;
+    return (int64_t)n;
+    };
+  std::vector<uint8_t> nbUpstream(nbNode, 0);
+  for (size_t i = 0; i < nbNode; i++) {
+    if (R.A[i] < threshold)
+      continue;
+    int64_t n = down(i);
+    if ((n >= 0) && (nbUpstream[n] < 255))
+      nbUpstream[n]++;
+  }
+  std::vector<std::vector<size_t> > L;
+  std::vector<double> S;
+  for (size_t i = 0; i < nbNode; i++) {
+    if ((R.A[i] < threshold) || (nbUpstream[i] == 1))
+      continue;
+    std::vector<size_t> T(1, i);
+    size_t index = i;
+    for (int64_t n = down(index); n >= 0; n = down(index)) {
+      index = (size_t)n;
+      T.push_back(index);
+      if (nbUpstream[index] != 1)
+        break;
+    }
+    if (T.size() < 2)
+      continue;
+    L.push_back(T);
+    S.push_back(R.A[index]);
+  }
+  if (L.size() != R.Thalweg.size()) {
+    printf("  %zu thalwegs au lieu de %zu\n", R.Thalweg.size(), L.size());
+    nbError++;
+  }
+  else {
+    size_t nbDiff = 0;
+    for (size_t i = 0; i < L.size(); i++) {
+      bool same = (L[i].size() == R.Thalweg[i].size()) && (fabs(S[i] - R.Area[i]) < 1e-3);
+      for (size_t k = 0; same && (k < L[i].size()); k++)
+        same = (fabs(R.Thalweg[i][k].X - X0 - (double)(L[i][k] % W)) < 1e-6) &&
+               (fabs(Y0 - R.Thalweg[i][k].Y - (double)(L[i][k] / W)) < 1e-6);
+      if (!same)
+        nbDiff++;
+    }
+    if (nbDiff > 0) {
+      printf("  %zu thalwegs differents\n", nbDiff);
+      nbError++;
+    }
+  }
+  return nbError;
+}
+
+//-----------------------------------------------------------------------------
+// MNT synthetique
+//-----------------------------------------------------------------------------
+static void Synthetic(std::vector<float>& Z, int W, int H, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> U(0., 1.);
+  Z.resize((size_t)W * H);
+  double a1 = U(rng) * 0.05, a2 = U(rng) * 0.05;
+  for (int i = 0; i < H; i++) {
+    for (int j = 0; j < W; j++) {
+      double z = 200. + 30. * sin(j * (0.011 + a1)) * cos(i * (0.013 + a2)) + 8. * sin((i + j) * 0.05) + 0.02 * j - 0.01 * i + 3. * U(rng);
+      if ((j / 97 + i / 83) % 5 == 0)   // Plats
+        z = floor(z / 4.) * 4.;
+      if (((i - H / 3) * (i - H / 3) + (j - W / 2) * (j - W / 2)) < 900)  // Lac plat
+        z = 150.;
+      Z[(size_t)i * W + j] = (float)z;
+    }
+  }
+  for (int n = 0; n < 6; n++) {   // Trous
+    int ci = (int)(U(rng) * H), cj = (int)(U(rng) * W), r = 3 + (int)(U(rng) * 20);
+    for (int i = std::max(0, ci - r); i < std::min(H, ci + r); i++)
+      for (int j = std::max(0, cj - r); j < std::min(W, cj + r); j++)
+        Z[(size_t)i * W + j] = NoData;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int W = (argc > 1) ? atoi(argv[1]) : 701;
+  int H = (argc > 2) ? atoi(argv[2]) : 533;
+  int seed = (argc > 3) ? atoi(argv[3]) : 1;
+  std::string folder = (argc > 4) ? argv[4] : ".";
+  if ((W < 3) || (H < 3))
+    return 1;
+
+  // Ecriture du MNT synthetique au format ASC, puis ouverture
+  std::vector<float> Z;
+  Synthetic(Z, W, H, seed);
+  std::string ascfile = folder + "/bench_dtm.asc", binfile = folder + "/bench_dtm.bin";
+  FILE* file = fopen(ascfile.c_str(), "w");
+  if (file == nullptr)
+    return 1;
+  fprintf(file, "ncols %d\nnrows %d\nxllcorner 0\nyllcorner %f\ncellsize 1\nNODATA_value -9999\n", W, H, -(double)H + 0.5);
+  for (int i = 0; i < H; i++) {
+    for (int j = 0; j < W; j++)
+      fprintf(file, "%.9g ", Z[(size_t)i * W + j]);
+    fprintf(file, "\n");
+  }
+  fclose(file);
+  int nbError = 0;
+  {
+    XGeoFDtm dtm;
+    if (!dtm.OpenDtm(ascfile.c_str(), binfile.c_str())) {
+      std::remove(ascfile.c_str());
+      return 1;
+    }
+    dtm.StreamReady();
+    dtm.ReadBlock(Z.data(), 0, 0, W, H);   // Valeurs effectivement lues
+    double X0 = dtm.Frame().Xmin, Y0 = dtm.Frame().Ymax;
+    printf("MNT %d x %d\n", W, H);
+
+    const float threshold = 300.f;
+    const uint32_t tiles[4] = { 64, 80, 256, 100000 };  // 100000 : une seule dalle
+    for (int dinf = 0; dinf < 2; dinf++) {
+      for (int t = 0; t < 4; t++) {
+        BenchResult R;
+        if (!Run(&dtm, tiles[t], dinf != 0, threshold, folder, R)) {
+          printf("%s dalle %u : echec\n", dinf ? "Dinf" : "D8", tiles[t]);
+          nbError++;
+          continue;
+        }
+        printf("%s dalle %u : comblement %.0f ms, directions %.0f ms, accumulation %.0f ms, thalwegs %.0f ms\n",
+               dinf ? "Dinf" : "D8", tiles[t], R.Time[0], R.Time[1], R.Time[2], R.Time[3]);
+        nbError += Check(Z, R, W, H, dinf != 0, threshold, X0, Y0);
+      }
+    }
+    dtm.Close();
+  }
+  std::remove(ascfile.c_str());
+  std::remove(binfile.c_str());
+  printf(nbError ? "ECHEC : %d erreurs\n" : "OK\n", nbError);
+  return nbError;
+}
@@ -11,6 +11,9 @@
 
 XFileManager gFileManager;
 
+thread_local uint64_t XFile::m_nThreadBytesRead = 0;
+thread_local uint64_t XFile::m_nThreadNbRead = 0;
+
 //-----------------------------------------------------------------------------
 // Deplacement dans un fichier -> executable 32 bits sous Windows
 //-----------------------------------------------------------------------------
@@ -149,7 +152,10 @@ unsigned int XFile::Read(char* data, unsigned int maxSize)
   if (IStream() == NULL)
     return 0;
   m_In->read(data, maxSize);
-  return (unsigned int)m_In->gcount();
+  unsigned int nbRead = (unsigned int)m_In->gcount();
+  m_nThreadBytesRead += nbRead;
+  m_nThreadNbRead++;
+  return nbRead;
 }
 
 //-----------------------------------------------------------------------------
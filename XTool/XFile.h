@@ -14,6 +14,7 @@
 #include <iostream>
 #include <fstream>
 #include <list>
+#include <cstdint>
 
 //-----------------------------------------------------------------------------
 // Classe XFile
@@ -24,6 +25,9 @@ protected:
   std::ifstream*            m_In;
   std::ios_base::openmode   m_Mode;
 
+  static thread_local uint64_t  m_nThreadBytesRead; // Octets lus par le thread courant (profilage)
+  static thread_local uint64_t  m_nThreadNbRead;    // Nombre de lectures du thread courant
+
 public:
   XFile();
   XFile(const char *filename, std::ios_base::openmode mode);
@@ -38,6 +42,8 @@ public:
   unsigned int Read(char* data, unsigned int maxSize);
 
   static void Seek(std::istream* in, std::streampos pos);
+  static uint64_t ThreadBytesRead() { return m_nThreadBytesRead; }
+  static uint64_t ThreadNbRead() { return m_nThreadNbRead; }
 
   friend class XFileManager;
 };
@@ -10,6 +10,7 @@
 #include "XGeoBase.h"
 #include "XGeoLayer.h"
 #include "XGeoMap.h"
+#include "XGeoFDtm.h"
 #include <algorithm>
 
 
@@ -834,20 +835,48 @@ double XGeoBase::ZLas(const XPt2D& P)
 
 //-----------------------------------------------------------------------------
 // Recuperation des Z sur une zone avec un pas donne
+// Les MNT sont parcourus dans le meme ordre de priorite que Z(P) : chaque MNT
+// dont l'emprise touche la grille ne complete que les cellules encore vides
 //-----------------------------------------------------------------------------
 bool XGeoBase::Z(const XPt2D& TL, float* T, double delta, uint32_t w, uint32_t h)
 {
   XGeoLayer* layer = Layer("DTM");
   if (layer == NULL)
     return false;
-  float* ptr = T;
+  for (size_t k = 0; k < (size_t)w * h; k++)
+    T[k] = (float)XGEO_NO_DATA;
+  if ((w == 0) || (h == 0))
+    return true;
+  XFrame F(TL.X, TL.Y - (h - 1) * delta, TL.X + (w - 1) * delta, TL.Y);
+  XGeoVector* V;
   XPt2D P;
-  for (uint32_t i = 0; i < h; i ++) {
-    P.Y = TL.Y - i * delta;
-    for (uint32_t j = 0; j < w; j ++) {
-      P.X = TL.X + j * delta;
-      *ptr = Z(P);
-      ptr++;
+  for (uint32_t i = 0; i < layer->NbClass(); i++) {
+    XGeoClass* C = layer->Class(i);
+    for (uint32_t j = 0; j < C->NbVector(); j++) {
+      V = C->Vector(j);
+      if (!V->Visible())
+        continue;
+      if (V->TypeVector() != XGeoVector::DTM)
+        continue;
+      XFrame G = V->Frame();
+      G += V->Resolution() * 0.5;
+      if (!F.Intersect(G))
+        continue;
+      XGeoFDtm* dtm = dynamic_cast<XGeoFDtm*>(V);
+      if (dtm != nullptr) {
+        dtm->ZGrid(TL, delta, w, h, T);
+        continue;
+      }
+      float* ptr = T;
+      for (uint32_t r = 0; r < h; r++) {
+        P.Y = TL.Y - r * delta;
+        for (uint32_t c = 0; c < w; c++) {
+          P.X = TL.X + c * delta;
+          if (*ptr <= (float)XGEO_NO_DATA)
+            *ptr = (float)V->Z(P);
+          ptr++;
+        }
+      }
     }
   }
   return true;
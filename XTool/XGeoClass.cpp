@@ -258,6 +258,7 @@ bool XGeoClass::Vector(XGeoVector* V)
 	*/
 	m_Vector.push_back(V);
 	m_Frame += V->Frame();
+	m_nRevision[revData]++;
 	return true;
 }
 
@@ -270,6 +271,7 @@ bool XGeoClass::RemoveVector(XGeoVector* V)
 	for (iter = m_Vector.begin(); iter != m_Vector.end(); iter++)
 		if (*iter == V) {
 			m_Vector.erase(iter);
+			m_nRevision[revData]++;
 			return true;
 		}
 	return false;
@@ -281,6 +283,7 @@ bool XGeoClass::RemoveVector(XGeoVector* V)
 bool XGeoClass::RemoveAllVectors()
 {
 	m_Vector.clear();
+	m_nRevision[revData]++;
 	return true;
 }
 
@@ -292,6 +295,7 @@ bool XGeoClass::UpdateFrame()
 	m_Frame = XFrame();
 	for (uint32_t i = 0; i < m_Vector.size(); i++)
 			m_Frame += m_Vector[i]->Frame();
+	m_nRevision[revData]++;
 	return true;
 }
 
@@ -309,6 +313,7 @@ bool VectorLength(XGeoVector* A, XGeoVector* B)
 bool XGeoClass::Sort()
 {
 	std::stable_sort(m_Vector.begin(), m_Vector.end(), VectorLength);
+	m_nRevision[revData]++;
 	return true;
 }
 
@@ -326,9 +331,20 @@ bool VectorFrameLength(XGeoVector* A, XGeoVector* B)
 bool XGeoClass::QuickSort()
 {
   std::stable_sort(m_Vector.begin(), m_Vector.end(), VectorFrameLength);
+  m_nRevision[revData]++;
   return true;
 }
 
+//-----------------------------------------------------------------------------
+// Numero de version de la classe : le style inclut celui de la representation
+//-----------------------------------------------------------------------------
+uint32_t XGeoClass::Revision(eRevision rev) const
+{
+	if (rev == revStyle)
+		return m_nRevision[revStyle] + m_Repres.Revision();
+	return m_nRevision[rev];
+}
+
 //-----------------------------------------------------------------------------
 // Recherche des objets proches d'un point
 //-----------------------------------------------------------------------------
@@ -95,13 +95,23 @@ protected:
 	XGeoSchema		m_Schema;
 	XGeoVector*		m_Mask;
 	std::vector<XGeoVector*>	m_Vector;
+	uint32_t		m_nRevision[3];	// Numeros de version : visibilite, style, donnees
 
 public:
-	XGeoClass() {m_Layer = NULL; m_Mask = NULL;}
-	XGeoClass(const char* name, XGeoLayer* layer = NULL) { m_strName = name; m_Layer = layer; m_Mask = NULL;}
+	enum eRevision { revVisibility = 0, revStyle = 1, revData = 2 };
+
+	XGeoClass() {m_Layer = NULL; m_Mask = NULL; m_nRevision[0] = m_nRevision[1] = m_nRevision[2] = 0;}
+	XGeoClass(const char* name, XGeoLayer* layer = NULL) { m_strName = name; m_Layer = layer; m_Mask = NULL;
+																													m_nRevision[0] = m_nRevision[1] = m_nRevision[2] = 0;}
 	virtual ~XGeoClass() {;}
 
 	virtual inline eType Type() const { return Class;}
+	using XGeoObject::Visible;
+	virtual void Visible(bool flag) { if (flag != Visible()) m_nRevision[revVisibility]++; XGeoObject::Visible(flag);}
+
+	// Gestion des versions : permet de savoir si la classe doit etre redessinee
+	uint32_t Revision(eRevision rev) const;
+	void Modified(eRevision rev = revData) { m_nRevision[rev]++;}
 	std::string Description() const { return m_strDescription;}
 	void Description(const char* desc) { m_strDescription = desc;}
   bool IsRaster();
@@ -9,14 +9,22 @@
 
 #include <cstring>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <cfloat>
 
 #include "XGeoFDtm.h"
+#include "XHydroChain.h"
 #include "XPath.h"
 #include "XParserXML.h"
 #include "../XToolGeod/XGeodConverter.h"
 #include "../XToolImage/XTiffWriter.h"
+#include "../XToolImage/XDtmShader.h"
 #include "XPath.h"
 #include "XInterpol.h"
+#include "XEndian.h"
+#include "../XToolVector/XDBase.h"
 
 
 //-----------------------------------------------------------------------------
@@ -29,6 +37,8 @@ bool XGeoFDtm::OpenDtm(const char* filename, const char* tmpname)
   std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   bool flag = false;
   m_bTmpFile = false;
+  m_dZmin = m_dZmax = XGEO_NO_DATA;
+  ClearCache();
   if (ext == ".asc")
     flag = ImportAsc(filename, tmpname);
   if (ext == ".xyz")
@@ -69,6 +79,7 @@ void XGeoFDtm::Close()
 	m_bValid = false;
   m_In.Close();
   m_ActiveStream = NULL;
+  ClearCache();
 }
 
 //-----------------------------------------------------------------------------
@@ -112,6 +123,89 @@ bool XGeoFDtm::ReadAll(float* area)
   return true;
 }
 
+//-----------------------------------------------------------------------------
+// Lecture d'un bloc de noeuds, une lecture par ligne du bloc
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ReadBlock(float* block, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+  for (uint32_t i = 0; i < h; i++) {
+    m_ActiveStream->seekg(((y + i) * m_nW + x) * sizeof(float) + m_nOffset, std::ios::beg);
+    m_ActiveStream->read((char*)&block[i * w], w * sizeof(float));
+  }
+  return m_ActiveStream->good();
+}
+
+//-----------------------------------------------------------------------------
+// Vidage du cache de blocs
+//-----------------------------------------------------------------------------
+void XGeoFDtm::ClearCache()
+{
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
+  m_Blocks.clear();
+  m_BlockLru.clear();
+  m_LastBlock = nullptr;
+}
+
+void XGeoFDtm::MaxCache(size_t nbBlock)
+{
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
+  m_nMaxBlock = XMax(nbBlock, (size_t)1);
+  while (m_Blocks.size() > m_nMaxBlock) {
+    m_Blocks.erase(m_BlockLru.back());
+    m_BlockLru.pop_back();
+  }
+  m_LastBlock = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// Bloc de noeuds du cache, lu si necessaire (m_BlockMutex doit etre verrouille)
+// Les blocs en bord de MNT sont completes par des noeuds NoData
+//-----------------------------------------------------------------------------
+const float* XGeoFDtm::Block(uint32_t bx, uint32_t by)
+{
+  uint64_t key = ((uint64_t)by << 32) | bx;
+  if ((m_LastBlock != nullptr) && (key == m_nLastBlock))
+    return m_LastBlock;
+  auto iter = m_Blocks.find(key);
+  if (iter != m_Blocks.end()) {
+    m_BlockLru.splice(m_BlockLru.begin(), m_BlockLru, iter->second.lru);
+    m_nLastBlock = key;
+    m_LastBlock = iter->second.data.data();
+    return m_LastBlock;
+  }
+  if (!StreamReady())
+    return nullptr;
+  uint32_t x0 = bx * BlockSize, y0 = by * BlockSize;
+  uint32_t w = XMin(BlockSize, m_nW - x0), h = XMin(BlockSize, m_nH - y0);
+  std::vector<float> area((size_t)w * h);
+  if (!ReadBlock(area.data(), x0, y0, w, h))
+    return nullptr;
+  while (m_Blocks.size() >= m_nMaxBlock) {
+    m_Blocks.erase(m_BlockLru.back());
+    m_BlockLru.pop_back();
+  }
+  m_BlockLru.push_front(key);
+  DtmBlock& block = m_Blocks[key];
+  block.lru = m_BlockLru.begin();
+  block.data.assign((size_t)BlockSize * BlockSize, (float)m_dNoData);
+  for (uint32_t i = 0; i < h; i++)
+    ::memcpy(&block.data[(size_t)i * BlockSize], &area[(size_t)i * w], w * sizeof(float));
+  m_nLastBlock = key;
+  m_LastBlock = block.data.data();
+  return m_LastBlock;
+}
+
+//-----------------------------------------------------------------------------
+// Noeud de la grille lu dans le cache (m_BlockMutex doit etre verrouille)
+//-----------------------------------------------------------------------------
+float XGeoFDtm::Node(uint32_t x, uint32_t y)
+{
+  const float* block = Block(x / BlockSize, y / BlockSize);
+  if (block == nullptr)
+    return (float)m_dNoData;
+  return block[(y % BlockSize) * BlockSize + (x % BlockSize)];
+}
+
 //-----------------------------------------------------------------------------
 // Renvoi un noeud de la grille
 //-----------------------------------------------------------------------------
@@ -121,12 +215,10 @@ double XGeoFDtm::Z(uint32_t x, uint32_t y)
 		return 0;
 	if ((x >= m_nW)||(y >= m_nH))
 		return 0;
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
   if (!StreamReady())
     return m_dNoData;
-	float val;
-  ReadNode(&val, x, y);
-
-	return (double)val;
+	return (double)Node(x, y);
 }
 
 //-----------------------------------------------------------------------------
@@ -151,46 +243,94 @@ double XGeoFDtm::Z(const XPt2D& P)
 {
 	if (!m_bValid)
     return XGEO_NO_DATA;
-  if (P.X < (m_Frame.Xmin - m_dGSD * 0.5)) return XGEO_NO_DATA;
-  if (P.X > (m_Frame.Xmax + m_dGSD * 0.5)) return XGEO_NO_DATA;
-  if (P.Y < (m_Frame.Ymin - m_dGSD * 0.5)) return XGEO_NO_DATA;
-  if (P.Y > (m_Frame.Ymax + m_dGSD * 0.5)) return XGEO_NO_DATA;
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
+  return Interpol(P);
+}
+
+//-----------------------------------------------------------------------------
+// Calcul des Z d'un ensemble de points, en un seul verrouillage du cache
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::Z(const XPt2D* P, double* Z, uint32_t nb)
+{
+  if (!m_bValid) {
+    for (uint32_t i = 0; i < nb; i++)
+      Z[i] = XGEO_NO_DATA;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
+  for (uint32_t i = 0; i < nb; i++)
+    Z[i] = Interpol(P[i]);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Noeud en haut a gauche de la maille contenant P
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::Locate(const XPt2D& P, int& nbx, int& nby)
+{
+  if (P.X < (m_Frame.Xmin - m_dGSD * 0.5)) return false;
+  if (P.X > (m_Frame.Xmax + m_dGSD * 0.5)) return false;
+  if (P.Y < (m_Frame.Ymin - m_dGSD * 0.5)) return false;
+  if (P.Y > (m_Frame.Ymax + m_dGSD * 0.5)) return false;
 
 	double dx = (P.X - m_Frame.Xmin) / m_dGSD;
 	double dy = (m_Frame.Ymax - P.Y) / m_dGSD;
-	int nbx = (int)floor(dx);
-	int nby = (int)floor(dy);
+	nbx = (int)floor(dx);
+	nby = (int)floor(dy);
 
 	if ((nbx < -1)||(nby < -1))
-    return XGEO_NO_DATA; // m_dNoData;
+    return false;
 	if ((nbx >= (int)m_nW)||(nby >= (int)m_nH))
-    return XGEO_NO_DATA; // m_dNoData;
+    return false;
+  return true;
+}
 
+//-----------------------------------------------------------------------------
+// Interpolation en inverse de la distance sur les 4 noeuds voisins (m_BlockMutex doit etre verrouille)
+//-----------------------------------------------------------------------------
+double XGeoFDtm::Interpol(const XPt2D& P)
+{
+  int nbx, nby;
+  if (!Locate(P, nbx, nby))
+    return XGEO_NO_DATA; // m_dNoData;
   if (!StreamReady())
     return m_dNoData;
-  float val[4], w[4];
-	float *ptr = val, *wptr = w;
+  float val[4];
+  float* ptr = val;
+	for (int i = nby; i < (nby+2); i++) {
+		for (int j = nbx; j < (nbx+2); j++) {
+			if ( (j >= 0) && (j < (int)m_nW) && (i >= 0) && (i < (int)m_nH))
+        *ptr = Node(j, i);
+      else
+        *ptr = (float)m_dNoData;
+      ptr++;
+    }
+  }
+  return Idw(P, nbx, nby, val);
+}
+
+//-----------------------------------------------------------------------------
+// Ponderation en inverse de la distance des 4 noeuds de la maille (nbx, nby)
+//-----------------------------------------------------------------------------
+double XGeoFDtm::Idw(const XPt2D& P, int nbx, int nby, const float* val)
+{
+  float w[4];
+  float *wptr = w;
+  const float* ptr = val;
 	double distance;
 	XPt2D M;
 	for (int i = nby; i < (nby+2); i++) {
 		for (int j = nbx; j < (nbx+2); j++) {
-			if ( (j >= 0) && (j < (int)m_nW) && (i >= 0) && (i < (int)m_nH)) {
-        ReadNode(ptr, j, i);
-				if (*ptr <= m_dNoData)
-					*wptr = 0.;
-				else {
-					M.X = m_Frame.Xmin + j * m_dGSD;
-					M.Y = m_Frame.Ymax - i * m_dGSD;
-					distance = dist2(P, M);
-					if (distance < 1.e-6)
-						return *ptr;
-					*wptr = (float)(1. / distance);
-				}
-			} else {
-				*ptr = (float)m_dNoData;
+			if (*ptr <= m_dNoData)
 				*wptr = 0.;
+			else {
+				M.X = m_Frame.Xmin + j * m_dGSD;
+				M.Y = m_Frame.Ymax - i * m_dGSD;
+				distance = dist2(P, M);
+				if (distance < 1.e-6)
+					return *ptr;
+				*wptr = (float)(1. / distance);
 			}
-
 			ptr++;
 			wptr++;
 		}	// endfor j
@@ -203,6 +343,117 @@ double XGeoFDtm::Z(const XPt2D& P)
 	return (w[0]*val[0] + w[1]*val[1] + w[2]*val[2] + w[3]*val[3]) / sumw;
 }
 
+//-----------------------------------------------------------------------------
+// Calcul des Z d'une grille (TL : centre de la premiere cellule, delta : pas)
+// Seules les cellules encore a XGEO_NO_DATA sont calculees : on peut ainsi
+// enchainer plusieurs MNT par ordre de priorite sur la meme grille.
+// La fenetre de noeuds couvrant la grille est lue une seule fois par bande,
+// puis l'interpolation est repartie sur nbThread threads.
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ZGrid(const XPt2D& TL, double delta, uint32_t w, uint32_t h, float* T, int nbThread)
+{
+  if ((!m_bValid) || (delta <= 0.) || (w == 0) || (h == 0))
+    return false;
+
+  // Cellules de la grille dans l'emprise du MNT
+  double half = m_dGSD * 0.5;
+  double c0 = ceil((m_Frame.Xmin - half - TL.X) / delta), c1 = floor((m_Frame.Xmax + half - TL.X) / delta);
+  double r0 = ceil((TL.Y - m_Frame.Ymax - half) / delta), r1 = floor((TL.Y - m_Frame.Ymin + half) / delta);
+  if ((c1 < 0.) || (r1 < 0.) || (c0 >= (double)w) || (r0 >= (double)h) || (c0 > c1) || (r0 > r1))
+    return true;
+  uint32_t col0 = (uint32_t)XMax(c0, 0.), col1 = (uint32_t)XMin(c1, (double)(w - 1));
+  uint32_t row0 = (uint32_t)XMax(r0, 0.), row1 = (uint32_t)XMin(r1, (double)(h - 1));
+
+  // Grille beaucoup moins resolue que le MNT : on passe par le cache de blocs
+  if (delta > 4. * m_dGSD) {
+    std::lock_guard<std::mutex> lock(m_BlockMutex);
+    if (!StreamReady())
+      return false;
+    XPt2D P;
+    for (uint32_t i = row0; i <= row1; i++) {
+      P.Y = TL.Y - i * delta;
+      float* ptr = &T[(size_t)i * w];
+      for (uint32_t j = col0; j <= col1; j++) {
+        if (ptr[j] > (float)XGEO_NO_DATA)
+          continue;
+        P.X = TL.X + j * delta;
+        ptr[j] = (float)Interpol(P);
+      }
+    }
+    return true;
+  }
+
+  if (nbThread < 1)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+
+  // Colonnes de noeuds couvrant la grille
+  int x0 = XMax((int)floor((TL.X + col0 * delta - m_Frame.Xmin) / m_dGSD), 0);
+  int x1 = XMin((int)floor((TL.X + col1 * delta - m_Frame.Xmin) / m_dGSD) + 1, (int)m_nW - 1);
+  if (x1 < x0)
+    return true;
+  uint32_t nx = (uint32_t)(x1 - x0 + 1);
+  // Bandes de lignes de la grille, limitees a environ 4M noeuds lus
+  uint32_t nbRow = (uint32_t)XMax((double)(4 * 1024 * 1024 / nx) * m_dGSD / delta - 2., 1.);
+  std::vector<float> area;
+
+  for (uint32_t rs = row0; rs <= row1; rs += nbRow) {
+    uint32_t re = XMin(rs + nbRow - 1, row1);
+    int y0 = XMax((int)floor((m_Frame.Ymax - (TL.Y - rs * delta)) / m_dGSD), 0);
+    int y1 = XMin((int)floor((m_Frame.Ymax - (TL.Y - re * delta)) / m_dGSD) + 1, (int)m_nH - 1);
+    if (y1 < y0)
+      continue;
+    uint32_t ny = (uint32_t)(y1 - y0 + 1);
+    area.resize((size_t)nx * ny);
+    {
+      std::lock_guard<std::mutex> lock(m_BlockMutex);
+      if (!StreamReady())
+        return false;
+      if (!ReadBlock(area.data(), x0, y0, nx, ny))
+        return false;
+    }
+
+    auto worker = [&](uint32_t first, uint32_t step) {
+      float val[4];
+      XPt2D P;
+      int nbx, nby;
+      for (uint32_t i = first; i <= re; i += step) {
+        P.Y = TL.Y - i * delta;
+        float* ptr = &T[(size_t)i * w];
+        for (uint32_t j = col0; j <= col1; j++) {
+          if (ptr[j] > (float)XGEO_NO_DATA)
+            continue;
+          P.X = TL.X + j * delta;
+          if (!Locate(P, nbx, nby))
+            continue;
+          float* vptr = val;
+          for (int k = nby; k < (nby + 2); k++) {
+            for (int l = nbx; l < (nbx + 2); l++) {
+              if ((l >= x0) && (l <= x1) && (k >= y0) && (k <= y1))
+                *vptr = area[(size_t)(k - y0) * nx + (l - x0)];
+              else
+                *vptr = (float)m_dNoData;
+              vptr++;
+            }
+          }
+          ptr[j] = (float)Idw(P, nbx, nby, val);
+        }
+      }
+    };
+
+    uint32_t nbWorker = XMin((uint32_t)nbThread, re - rs + 1);
+    if ((nbWorker < 2) || ((size_t)(re - rs + 1) * (col1 - col0 + 1) < 4096)) {
+      worker(rs, 1);
+      continue;
+    }
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < nbWorker; t++)
+      threads.push_back(std::thread(worker, rs + t, nbWorker));
+    for (auto& th : threads)
+      th.join();
+  }
+  return true;
+}
+
 //-----------------------------------------------------------------------------
 // Donne le ZMax, ZMin, ZMean sur un cadre et renvoie le nombre de noeuds
 //-----------------------------------------------------------------------------
@@ -221,6 +472,7 @@ uint32_t XGeoFDtm::ZFrame(const XFrame &F, double* zmax, double* zmin, double* z
   if (F.Ymin > m_Frame.Ymin)
     endY = (uint32_t)floor(( m_Frame.Ymax - F.Ymin)/m_dGSD);
 
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
   if (!StreamReady())
     return 0;
   float z;
@@ -231,7 +483,7 @@ uint32_t XGeoFDtm::ZFrame(const XFrame &F, double* zmax, double* zmin, double* z
   *zmax = -1e31;
   for (uint32_t i = startY; i <= endY; i++) {
     for (uint32_t j = startX; j <= endX; j++) {
-      ReadNode(&z, j, i);
+      z = Node(j, i);
       if (z > m_dNoData) {
         newZ = z;
         nbz++;
@@ -340,59 +592,158 @@ bool XGeoFDtm::WriteAscHeader(std::ostream* out)
 }
 
 //-----------------------------------------------------------------------------
-// Import d'un fichier ASC
+// Lecture rapide des valeurs d'un fichier texte, par blocs
+// Les nombres decimaux simples sont convertis directement, les autres formes
+// (nan, inf ...) passent par strtod
 //-----------------------------------------------------------------------------
-bool XGeoFDtm::ImportAsc(std::string file_asc, std::string file_bin)
-{
-  Close();
-  // Ouverture du fichier ASC
-  std::ifstream in;
-  in.open(file_asc.c_str(), std::ios_base::in| std::ios_base::binary);
-  if (!in.good())
-    return false;
+class XDtmTextReader {
+protected:
+  std::istream*     m_In;
+  std::vector<char> m_Buf;
+  size_t            m_nPos, m_nLen;
+
+  bool Fill()
+  {
+    if (!m_In->good())
+      return false;
+    if (m_nPos > 0) {
+      std::memmove(m_Buf.data(), m_Buf.data() + m_nPos, m_nLen - m_nPos);
+      m_nLen -= m_nPos;
+      m_nPos = 0;
+    }
+    if (m_nLen >= m_Buf.size() - 1)
+      return false;
+    m_In->read(m_Buf.data() + m_nLen, m_Buf.size() - 1 - m_nLen);
+    size_t nb = (size_t)m_In->gcount();
+    m_nLen += nb;
+    return (nb > 0);
+  }
 
-  // Recuperation des caracteristiques du MNT
-  char buf[1024], token[1024];
-  std::string keyword;
+  static bool Convert(const char* p, const char* e, double& v)
+  {
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char* start = p;
+    bool neg = false;
+    if ((*p == '-') || (*p == '+')) { neg = (*p == '-'); p++; }
+    uint64_t mant = 0;
+    int nbDigit = 0, exp10 = 0;
+    bool digit = false;
+    for (; (p < e) && (*p >= '0') && (*p <= '9'); p++, digit = true)
+      if (nbDigit < 18) { mant = mant * 10 + (*p - '0'); if (mant > 0) nbDigit++; } else exp10++;
+    if ((p < e) && (*p == '.'))
+      for (p++; (p < e) && (*p >= '0') && (*p <= '9'); p++, digit = true)
+        if (nbDigit < 18) { mant = mant * 10 + (*p - '0'); if (mant > 0) nbDigit++; exp10--; }
+    if ((p < e) && digit && ((*p == 'e') || (*p == 'E'))) {
+      const char* q = p + 1;
+      bool negExp = false;
+      if ((q < e) && ((*q == '-') || (*q == '+'))) { negExp = (*q == '-'); q++; }
+      int n = 0;
+      bool expDigit = false;
+      for (; (q < e) && (*q >= '0') && (*q <= '9'); q++, expDigit = true)
+        if (n < 10000) n = n * 10 + (*q - '0');
+      if (expDigit) {
+        exp10 += negExp ? -n : n;
+        p = q;
+      }
+    }
+    if ((p != e) || (!digit)) {  // Forme non geree : conversion standard
+      std::string token(start, e);
+      char* end = nullptr;
+      v = strtod(token.c_str(), &end);
+      return (end != token.c_str());
+    }
+    v = (double)mant;
+    if ((exp10 >= -22) && (exp10 <= 22))
+      v = (exp10 < 0) ? v / pow10[-exp10] : v * pow10[exp10];
+    else
+      v *= pow(10., exp10);
+    if (neg) v = -v;
+    return true;
+  }
+
+public:
+  XDtmTextReader(std::istream* in, size_t size = 1 << 20) : m_In(in), m_Buf(size), m_nPos(0), m_nLen(0) { ; }
+
+  // Valeur suivante, les separateurs sont les blancs et les fins de ligne
+  bool Next(double& v)
+  {
+    for (;;) {
+      while ((m_nPos < m_nLen) && ((unsigned char)m_Buf[m_nPos] <= ' '))
+        m_nPos++;
+      if (m_nPos < m_nLen)
+        break;
+      m_nPos = m_nLen = 0;
+      if (!Fill())
+        return false;
+    }
+    size_t end = m_nPos;
+    for (;;) {
+      while ((end < m_nLen) && ((unsigned char)m_Buf[end] > ' '))
+        end++;
+      if (end < m_nLen)
+        break;
+      size_t offset = end - m_nPos;
+      if (!Fill())
+        break;            // Dernier nombre du fichier
+      end = m_nPos + offset;
+    }
+    bool flag = Convert(&m_Buf[m_nPos], m_Buf.data() + end, v);
+    m_nPos = end;
+    return flag;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Lecture de l'entete d'un fichier ASC
+//-----------------------------------------------------------------------------
+struct XAscHeader {
   uint32_t w, h;
   double x, y, step, no_data;
-  bool flag_center = false;
+  bool flag_center;
+};
+
+static bool ReadAscHeader(std::istream& in, XAscHeader& H)
+{
+  char buf[1024], token[1024];
+  std::string keyword;
+  H.flag_center = false;
 
   in.getline(buf, 1024);  // Nombre de colonnes
-  std::ignore = sscanf(buf, "%s %u", token, &w);
+  std::ignore = sscanf(buf, "%s %u", token, &H.w);
   keyword = token;
   std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   if (keyword != "ncols")
     return false;
 
   in.getline(buf, 1024);  // Nombre de lignes
-  std::ignore = sscanf(buf, "%s %u", token, &h);
+  std::ignore = sscanf(buf, "%s %u", token, &H.h);
   keyword = token;
   std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   if (keyword != "nrows")
     return false;
 
   in.getline(buf, 1024);  // Origine X
-  std::ignore = sscanf(buf, "%s %lf", token, &x);
+  std::ignore = sscanf(buf, "%s %lf", token, &H.x);
   keyword = token;
   std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   if (keyword != "xllcorner") {
     if (keyword != "xllcenter")
       return false;
-    flag_center = true;
+    H.flag_center = true;
   }
 
   in.getline(buf, 1024);  // Origine Y
-  std::ignore = sscanf(buf, "%s %lf", token, &y);
+  std::ignore = sscanf(buf, "%s %lf", token, &H.y);
   keyword = token;
   std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   if (keyword != "yllcorner") {
-    if ( (!flag_center) || (keyword != "yllcenter") )
+    if ( (!H.flag_center) || (keyword != "yllcenter") )
       return false;
   }
 
   in.getline(buf, 1024);  // GSD
-  std::ignore = sscanf(buf, "%s %lf", token, &step);
+  std::ignore = sscanf(buf, "%s %lf", token, &H.step);
   keyword = token;
   std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
   if (keyword != "cellsize")
@@ -401,13 +752,52 @@ bool XGeoFDtm::ImportAsc(std::string file_asc, std::string file_bin)
   char c = (char)in.peek();
   if ((c == 'n')||(c == 'N')) {
     in.getline(buf, 1024);  // NODATA
-    std::ignore = sscanf(buf, "%s %lf", token, &no_data);
+    std::ignore = sscanf(buf, "%s %lf", token, &H.no_data);
     keyword = token;
     std::transform(keyword.begin(), keyword.end(), keyword.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
     if (keyword != "nodata_value")
       return false;
   } else
-    no_data = -9999;
+    H.no_data = -9999;
+  return in.good();
+}
+
+//-----------------------------------------------------------------------------
+// Georeferencement d'un MNT a partir d'une entete ASC
+//-----------------------------------------------------------------------------
+void XGeoFDtm::SetAscGeoref(const XAscHeader& H)
+{
+  m_nH = H.h;
+  m_nW = H.w;
+  m_dGSD = H.step;
+  m_dNoData = H.no_data;
+  m_Frame.Xmin = H.x + H.step * 0.5;
+  m_Frame.Ymin = H.y + H.step * 0.5;
+  if (H.flag_center) {
+    m_Frame.Xmin = H.x;
+    m_Frame.Ymin = H.y;
+  }
+  m_Frame.Xmax = m_Frame.Xmin + H.step * (m_nW - 1);
+  m_Frame.Ymax = m_Frame.Ymin + H.step * (m_nH - 1);
+}
+
+//-----------------------------------------------------------------------------
+// Import d'un fichier ASC
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ImportAsc(std::string file_asc, std::string file_bin)
+{
+  Close();
+  // Ouverture du fichier ASC
+  std::ifstream in;
+  in.open(file_asc.c_str(), std::ios_base::in| std::ios_base::binary);
+  if (!in.good())
+    return false;
+
+  // Recuperation des caracteristiques du MNT
+  XAscHeader H;
+  if (!ReadAscHeader(in, H))
+    return false;
+  uint32_t w = H.w, h = H.h;
 
   // Ouverture du fichier de sortie
   XTiffWriter tiff;
@@ -427,17 +817,15 @@ bool XGeoFDtm::ImportAsc(std::string file_asc, std::string file_bin)
     return false;
   float zmax = -9e9, zmin = 9e9;
   m_nNbNoZ = 0;
+  XDtmTextReader reader(&in);
+  double z;
   for (uint32_t i = 0; i < h; i++) {
     ptr = line;
     for (uint32_t j = 0; j < w; j++) {
-      if (j < (w-1)) {
-        in.getline(buf, 1024, ' ');
-        while((strlen(buf)<1)&&(in.good()))
-          in.getline(buf, 1024, ' ');
-      } else
-        in.getline(buf, 1024);
-      std::ignore = sscanf(buf,"%f", ptr);
-      if (*ptr > no_data) {
+      if (!reader.Next(z))
+        z = H.no_data;
+      *ptr = (float)z;
+      if (*ptr > H.no_data) {
         zmax = XMax(zmax, *ptr);
         zmin = XMin(zmin, *ptr);
       } else
@@ -451,22 +839,11 @@ bool XGeoFDtm::ImportAsc(std::string file_asc, std::string file_bin)
   in.close();
 
   // Affectation des parametres
-  m_nH = h;
-  m_nW = w;
-  m_dGSD = step;
-  m_dNoData = no_data;
+  SetAscGeoref(H);
   m_strFilename = file_bin;
   XPath P;
   m_strPath = P.Path(file_asc.c_str());
   m_strName = P.Name(file_asc.c_str());
-  m_Frame.Xmin = x + step * 0.5;
-  m_Frame.Ymin = y + step * 0.5;
-  if (flag_center) {
-    m_Frame.Xmin = x;
-    m_Frame.Ymin = y;
-  }
-  m_Frame.Xmax = m_Frame.Xmin + step * (m_nW - 1);
-  m_Frame.Ymax = m_Frame.Ymin + step * (m_nH - 1);
   m_dZmax = zmax;
   m_dZmin = zmin;
   if (zmin >= 9e9) {  // MNT vide ?
@@ -591,13 +968,14 @@ bool XGeoFDtm::ImportXyz(std::string file_asc, std::string file_bin)
 
 	// Recuperation des caracteristiques du MNT
 	double x, y, z, xmin, xmax, ymin, ymax, zmin, zmax, lastx, lasty, stepx, stepy;
-	in >> x >> y >> z;
+	XDtmTextReader reader(&in);
+	if ((!reader.Next(x)) || (!reader.Next(y)) || (!reader.Next(z)))
+		return false;
 	xmin = xmax = lastx = x;
 	ymin = ymax = lasty = y;
 	zmin = zmax = z;
 	stepx = stepy = 1e100;
-	while(!in.eof()) {
-		in >> x >> y >> z;
+	while(reader.Next(x) && reader.Next(y) && reader.Next(z)) {
 		xmin = XMin(x, xmin);
 		xmax = XMax(x, xmax);
 		ymin = XMin(y, ymin);
@@ -648,8 +1026,8 @@ bool XGeoFDtm::ImportXyz(std::string file_asc, std::string file_bin)
 		area[k] = m_dNoData;
   m_nNbNoZ = m_nW * m_nH;
 	uint32_t i, j;
-	while(!in.eof()) {
-		in >> x >> y >> z;
+	XDtmTextReader reader2(&in);
+	while(reader2.Next(x) && reader2.Next(y) && reader2.Next(z)) {
 		i = XRint((x - m_Frame.Xmin) / stepx);
 		j = XRint((m_Frame.Ymax - y) / stepx);
 		area[j * m_nW + i] = z;
@@ -825,6 +1203,245 @@ bool XGeoFDtm::ImportHdr(std::string file_hdr, std::string file_bin)
   return m_bValid;
 }
 
+//-----------------------------------------------------------------------------
+// Ecriture du cache d'un MNT importe : GeoTIFF flottant dalle, compresse en
+// Deflate, avec des sous-resolutions successives de facteur 2 (comme un COG).
+// Les lignes sont fournies dans l'ordre par reader et ne sont jamais toutes en
+// memoire : chaque niveau garde une bande de dalles et la ligne en attente de
+// reduction. Les noeuds sans valeur sont codes a -9999.
+// Les statistiques sont ecrites dans un fichier XML a cote du cache.
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::WriteCache(std::string file_tif, const std::function<bool(uint32_t, float*)>& reader, int nbThread)
+{
+  if ((m_nW == 0) || (m_nH == 0) || (m_dGSD <= 0.))
+    return false;
+  const uint32_t T = 256;
+  const float nodata = -9999.f;
+  struct Level {
+    uint32_t w, h, stride, nbRow, numStrip;
+    std::vector<float> strip, pending, input;
+    bool hasPending;
+  };
+  std::vector<Level> L;
+  uint32_t w = m_nW, h = m_nH;
+  for (;;) {
+    Level level;
+    level.w = w;
+    level.h = h;
+    level.stride = ((w + T - 1) / T) * T;
+    level.nbRow = level.numStrip = 0;
+    level.strip.assign((size_t)level.stride * T, nodata);
+    level.input.resize(w);
+    level.hasPending = false;
+    L.push_back(level);
+    if ((w <= T) && (h <= T))
+      break;
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+  }
+
+  XTiffWriter writer;
+  writer.SetGeoTiff(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax + m_dGSD * 0.5, m_dGSD);
+  if (!writer.BeginTiled(file_tif.c_str(), m_nW, m_nH, 1, 32, 3, T, T, 8, 3))
+    return false;
+  for (size_t l = 1; l < L.size(); l++)
+    if (!writer.AddSubResolution(L[l].w, L[l].h))
+      return false;
+  if (nbThread <= 0)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+
+  // Ecriture d'une bande de dalles, le codage est reparti sur les threads
+  std::vector<std::vector<uint8_t> > encoded;
+  auto flush = [&](Level& level, uint32_t num) -> bool {
+    if (level.nbRow == 0)
+      return true;
+    uint32_t nbTileW = level.stride / T;
+    encoded.resize(nbTileW);
+    std::atomic<uint32_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+      std::vector<float> tile((size_t)T * T);
+      for (uint32_t k = next++; k < nbTileW; k = next++) {
+        for (uint32_t i = 0; i < T; i++)
+          ::memcpy(&tile[(size_t)i * T], &level.strip[(size_t)i * level.stride + k * T], T * sizeof(float));
+        if (!writer.EncodeTile((uint8_t*)tile.data(), encoded[k]))
+          failed = true;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < XMin(nbThread, (int)nbTileW); i++)
+      threads.emplace_back(worker);
+    worker();
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+    if (failed)
+      return false;
+    for (uint32_t k = 0; k < nbTileW; k++)
+      if (!writer.WriteEncodedTile(level.numStrip * nbTileW + k, encoded[k], num))
+        return false;
+    std::fill(level.strip.begin(), level.strip.end(), nodata);
+    level.nbRow = 0;
+    level.numStrip++;
+    return true;
+  };
+
+  // Reduction de deux lignes (ou d'une seule en fin de niveau) : moyenne des noeuds valides
+  auto reduce = [&](const Level& level, const float* lineA, const float* lineB, float* out) {
+    for (uint32_t k = 0; k < (level.w + 1) / 2; k++) {
+      double sum = 0.;
+      int nb = 0;
+      for (uint32_t j = 2 * k; j < XMin(2 * k + 2, level.w); j++) {
+        if (lineA[j] > nodata) { sum += lineA[j]; nb++; }
+        if ((lineB != nullptr) && (lineB[j] > nodata)) { sum += lineB[j]; nb++; }
+      }
+      out[k] = (nb > 0) ? (float)(sum / nb) : nodata;
+    }
+  };
+
+  // Ajout d'une ligne a un niveau, puis aux niveaux suivants
+  auto push = [&](size_t l, const float* row) -> bool {
+    for (; l < L.size(); l++) {
+      Level& level = L[l];
+      ::memcpy(&level.strip[(size_t)level.nbRow * level.stride], row, level.w * sizeof(float));
+      level.nbRow++;
+      if ((level.nbRow == T) && (!flush(level, (uint32_t)l)))
+        return false;
+      if (l + 1 >= L.size())
+        break;
+      if (!level.hasPending) {
+        level.pending.assign(row, row + level.w);
+        level.hasPending = true;
+        break;
+      }
+      reduce(level, level.pending.data(), row, L[l + 1].input.data());
+      level.hasPending = false;
+      row = L[l + 1].input.data();
+    }
+    return true;
+  };
+
+  std::vector<float> line(m_nW);
+  float zmax = -9e9f, zmin = 9e9f;
+  m_nNbNoZ = 0;
+  bool flag = true;
+  for (uint32_t i = 0; (i < m_nH) && flag; i++) {
+    if (!reader(i, line.data())) {
+      flag = false;
+      break;
+    }
+    for (uint32_t j = 0; j < m_nW; j++) {
+      if (line[j] > m_dNoData) {
+        zmax = XMax(zmax, line[j]);
+        zmin = XMin(zmin, line[j]);
+      } else {
+        line[j] = nodata;
+        m_nNbNoZ++;
+      }
+    }
+    flag = push(0, line.data());
+  }
+  for (size_t l = 0; (l < L.size()) && flag; l++) {
+    if (L[l].hasPending) {  // Nombre impair de lignes
+      reduce(L[l], L[l].pending.data(), nullptr, L[l + 1].input.data());
+      L[l].hasPending = false;
+      flag = push(l + 1, L[l + 1].input.data());
+    }
+    if (flag)
+      flag = flush(L[l], (uint32_t)l);
+  }
+  if (!writer.EndTiled())
+    flag = false;
+  if (!flag) {
+    std::remove(file_tif.c_str());
+    return false;
+  }
+
+  m_dNoData = nodata;
+  m_dZmax = zmax;
+  m_dZmin = zmin;
+  if (zmin >= 9e9f) {  // MNT vide ?
+    m_dZmax = m_dNoData;
+    m_dZmin = m_dNoData;
+  }
+  XPath P;
+  std::ofstream xml;
+  xml.open((P.PathName(file_tif.c_str()) + ".xml").c_str());
+  if (!xml.good())
+    return false;
+  xml.precision(10);
+  xml << "<xgeofdtm_cache>" << std::endl;
+  xml << "<zmin> " << m_dZmin << " </zmin>" << std::endl;
+  xml << "<zmax> " << m_dZmax << " </zmax>" << std::endl;
+  xml << "<nb_noz> " << m_nNbNoZ << " </nb_noz>" << std::endl;
+  xml << "</xgeofdtm_cache>" << std::endl;
+  return xml.good();
+}
+
+//-----------------------------------------------------------------------------
+// Ouverture d'un MNT texte (ASC, XYZ) ou HDR avec un cache persistant
+// cachefile est le nom du GeoTIFF de cache : l'appelant y code la date et la taille
+// du fichier source, un cache existant est donc toujours a jour. Le cache n'est
+// relu que par ImportTif : sans lecteur TIFF, on revient a l'import dans tmpname.
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::OpenDtmCache(const char* filename, const char* cachefile, const char* tmpname, int nbThread)
+{
+  XPath P;
+  std::string ext = P.Ext(filename);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) {return static_cast<char>(std::tolower(c));});
+  if ((ext != ".asc") && (ext != ".xyz") && (ext != ".hdr"))
+    return OpenDtm(filename, tmpname);
+  std::string xmlfile = P.PathName(cachefile) + ".xml";
+
+  // Creation du cache
+  XParserXML parser;
+  bool ready = false;
+  if (parser.Parse(xmlfile)) {
+    std::ifstream tif(cachefile, std::ios_base::in | std::ios_base::binary);
+    ready = tif.good();
+  }
+  if (!ready) {
+    bool flag = false;
+    Close();
+    if (ext == ".asc") {  // Conversion directe, sans fichier temporaire
+      std::ifstream in;
+      in.open(filename, std::ios_base::in | std::ios_base::binary);
+      XAscHeader H;
+      if ((!in.good()) || (!ReadAscHeader(in, H)))
+        return false;
+      SetAscGeoref(H);
+      XDtmTextReader reader(&in);
+      flag = WriteCache(cachefile, [&](uint32_t, float* line) {
+        double z;
+        for (uint32_t j = 0; j < m_nW; j++)
+          line[j] = reader.Next(z) ? (float)z : (float)H.no_data;
+        return true; }, nbThread);
+    } else {
+      if (!OpenDtm(filename, tmpname))
+        return false;
+      if (StreamReady())
+        flag = WriteCache(cachefile, [&](uint32_t num, float* line) { return ReadLine(line, num); }, nbThread);
+      Close();
+      std::remove(tmpname);
+    }
+    if ((!flag) || (!parser.Parse(xmlfile)))
+      return OpenDtm(filename, tmpname);
+  }
+
+  // Lecture du cache : les statistiques sont deja connues
+  Close();
+  m_dZmin = parser.ReadNodeAsDouble("/xgeofdtm_cache/zmin");
+  m_dZmax = parser.ReadNodeAsDouble("/xgeofdtm_cache/zmax");
+  m_nNbNoZ = parser.ReadNodeAsUInt32("/xgeofdtm_cache/nb_noz");
+  if (!ImportTif(cachefile, "")) {
+    Close();
+    return OpenDtm(filename, tmpname);
+  }
+  m_strPath = P.Path(filename);
+  m_strName = P.Name(filename);
+  m_bTmpFile = false;
+  return true;
+}
+
 //-----------------------------------------------------------------------------
 // Export binaire natif du MNT
 //-----------------------------------------------------------------------------
@@ -929,6 +1546,48 @@ bool XGeoFDtm::ExportTiff16(std::string filename)
   return true;
 }
 
+//-----------------------------------------------------------------------------
+// Export de l'estompage en TIFF RGB
+// Le MNT est lu et estompe par bandes de lignes : la memoire utilisee ne depend
+// que de la largeur du MNT
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ExportShading(std::string filename, const XDtmShader* shader)
+{
+  if ((!m_bValid) || (shader == NULL))
+    return false;
+
+  XPath P;
+  std::string tifffile = P.PathName(filename.c_str()) + ".tif";
+
+  // Ouverture du fichier de sortie
+  uint32_t nbByte = shader->NbByte();
+  XTiffWriter tiff;
+  tiff.SetGeoTiff(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax  + m_dGSD * 0.5, m_dGSD);
+  if (!tiff.Write(tifffile.c_str(), m_nW, m_nH, nbByte, 8))
+    return false;
+  std::ofstream out;
+  out.open(tifffile.c_str(), std::ios_base::out| std::ios_base::binary| std::ios_base::app);
+  if (!out.good())
+    return false;
+  out.seekp(0, std::ios_base::end);
+
+  // Ecriture des donnees
+  if (!StreamReady())
+    return false;
+  auto reader = [&](uint32_t num, float* line) {
+    std::lock_guard<std::mutex> lock(m_BlockMutex);
+    return ReadLine(line, num);
+  };
+  auto writer = [&](uint32_t, const uint8_t* pixels) {
+    out.write((const char*)pixels, m_nW * nbByte);
+    return out.good();
+  };
+  bool flag = shader->ConvertStream(m_nW, m_nH, reader, writer);
+  out.close();
+
+  return flag;
+}
+
 //-----------------------------------------------------------------------------
 // Export au format ASC
 //-----------------------------------------------------------------------------
@@ -1168,83 +1827,372 @@ bool XGeoFDtm::WriteHtml(std::ostream* out)
 }
 
 //-----------------------------------------------------------------------------
-// Export sous forme de courbes de niveaux
+// Troncon de courbe de niveau. Les extremites d'un troncon ouvert sont reperees
+// par l'arete de maille qu'elles coupent : deux troncons d'un meme niveau qui
+// partagent une arete se raccordent.
+//-----------------------------------------------------------------------------
+struct XContourChain {
+  int       Level;        // Altitude de la courbe : Level * equi
+  uint64_t  Start, End;   // Aretes des extremites
+  bool      Closed;
+  std::vector<XPt2D> Pt;
+};
+
+//-----------------------------------------------------------------------------
+// Raccordement des troncons : les troncons fermes et ceux qui ne peuvent plus
+// etre prolonges sont ajoutes a out
 //-----------------------------------------------------------------------------
-bool XGeoFDtm::ExportContour(std::string filename, double equi, double resol)
+static void StitchContour(std::vector<XContourChain>& in, std::vector<XContourChain>& out)
 {
-  if (!m_bValid)
-    return false;
-  if (resol <= 0.)
-    resol = m_dGSD * 0.1;
+  std::unordered_map<uint64_t, std::vector<uint32_t> > ends;
+  std::vector<bool> used(in.size(), false);
+  for (uint32_t i = 0; i < in.size(); i++) {
+    if (in[i].Closed)
+      continue;
+    ends[in[i].Start].push_back(i);
+    ends[in[i].End].push_back(i);
+  }
 
-  int factor = XRint(m_dGSD / resol);
+  auto next = [&](uint64_t key, int level) -> int {
+    auto iter = ends.find(key);
+    if (iter == ends.end())
+      return -1;
+    for (uint32_t k : iter->second)
+      if ((!used[k]) && (in[k].Level == level))
+        return (int)k;
+    return -1;
+  };
+
+  for (uint32_t i = 0; i < in.size(); i++) {
+    if (used[i])
+      continue;
+    used[i] = true;
+    XContourChain C = std::move(in[i]);
+    // Prolongement par la fin, puis par le debut en retournant le troncon
+    for (int pass = 0; (pass < 2) && (!C.Closed); pass++) {
+      if (pass == 1) {
+        std::reverse(C.Pt.begin(), C.Pt.end());
+        std::swap(C.Start, C.End);
+      }
+      int k;
+      while ((k = next(C.End, C.Level)) >= 0) {
+        used[k] = true;
+        XContourChain& D = in[k];
+        if (D.Start == C.End) {
+          C.Pt.insert(C.Pt.end(), D.Pt.begin() + 1, D.Pt.end());
+          C.End = D.End;
+        } else {
+          C.Pt.insert(C.Pt.end(), D.Pt.rbegin() + 1, D.Pt.rend());
+          C.End = D.Start;
+        }
+        std::vector<XPt2D>().swap(D.Pt);
+        if (C.End == C.Start) {
+          C.Closed = true;
+          break;
+        }
+      }
+    }
+    out.push_back(std::move(C));
+  }
+  in.clear();
+}
 
-  // Ouverture du fichier de sortie
-  std::string tifffile = filename;
-  XTiffWriter tiff;
-  tiff.SetGeoTiff(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax + m_dGSD * 0.5, resol);
-  if (!tiff.Write(tifffile.c_str(), m_nW * factor, m_nH * factor, 1, 8))
+//-----------------------------------------------------------------------------
+// Lissage de Chaikin : les extremites des courbes ouvertes sont conservees
+//-----------------------------------------------------------------------------
+static void SmoothContour(std::vector<XPt2D>& T, bool closed)
+{
+  if (T.size() < 3)
+    return;
+  std::vector<XPt2D> S;
+  S.reserve(T.size() * 2);
+  if (!closed)
+    S.push_back(T[0]);
+  for (size_t i = 0; i < T.size() - 1; i++) {
+    S.push_back(XPt2D(0.75 * T[i].X + 0.25 * T[i + 1].X, 0.75 * T[i].Y + 0.25 * T[i + 1].Y));
+    S.push_back(XPt2D(0.25 * T[i].X + 0.75 * T[i + 1].X, 0.25 * T[i].Y + 0.75 * T[i + 1].Y));
+  }
+  if (closed)
+    S.push_back(S[0]);
+  else
+    S.push_back(T[T.size() - 1]);
+  T.swap(S);
+}
+
+//-----------------------------------------------------------------------------
+// Distance d'un point a un segment
+//-----------------------------------------------------------------------------
+static double DistSegment(const XPt2D& P, const XPt2D& A, const XPt2D& B)
+{
+  double dx = B.X - A.X, dy = B.Y - A.Y;
+  double l2 = dx * dx + dy * dy;
+  double t = 0.;
+  if (l2 > 0.)
+    t = XMax(0., XMin(1., ((P.X - A.X) * dx + (P.Y - A.Y) * dy) / l2));
+  double x = A.X + t * dx - P.X, y = A.Y + t * dy - P.Y;
+  return sqrt(x * x + y * y);
+}
+
+//-----------------------------------------------------------------------------
+// Simplification de Douglas-Peucker avec une tolerance en unite terrain
+//-----------------------------------------------------------------------------
+static void SimplifyContour(std::vector<XPt2D>& T, double tolerance)
+{
+  if (T.size() < 3)
+    return;
+  std::vector<bool> keep(T.size(), false);
+  keep[0] = keep[T.size() - 1] = true;
+  std::vector<std::pair<size_t, size_t> > stack;
+  stack.push_back(std::make_pair((size_t)0, T.size() - 1));
+  while (stack.size() > 0) {
+    size_t first = stack.back().first, last = stack.back().second;
+    stack.pop_back();
+    double dmax = -1.;
+    size_t index = first;
+    for (size_t i = first + 1; i < last; i++) {
+      double d = DistSegment(T[i], T[first], T[last]);
+      if (d > dmax) {
+        dmax = d;
+        index = i;
+      }
+    }
+    // Courbe fermee : le premier decoupage se fait toujours au point le plus eloigne
+    if ((dmax > tolerance) || ((first == 0) && (last == T.size() - 1) && (T[first] == T[last]) && (index > first))) {
+      keep[index] = true;
+      if (index - first > 1) stack.push_back(std::make_pair(first, index));
+      if (last - index > 1) stack.push_back(std::make_pair(index, last));
+    }
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < T.size(); i++)
+    if (keep[i])
+      T[n++] = T[i];
+  T.resize(n);
+}
+
+//-----------------------------------------------------------------------------
+// Ecriture de lignes dans un Shapefile PolyLine, avec un attribut numerique dans le DBF
+//-----------------------------------------------------------------------------
+static bool WritePolyLineShapefile(std::string filename, const std::vector<const std::vector<XPt2D>*>& L,
+                                   const char* field, const std::vector<double>& value)
+{
+  std::ofstream shp, shx;
+  shp.open((filename + ".shp").c_str(), std::ios_base::out | std::ios_base::binary);
+  shx.open((filename + ".shx").c_str(), std::ios_base::out | std::ios_base::binary);
+  if ((!shp.good()) || (!shx.good()))
     return false;
-  std::ofstream out;
-  out.open(tifffile.c_str(), std::ios_base::out| std::ios_base::binary| std::ios_base::app);
-  if (!out.good())
+
+  XFrame F;
+  uint32_t length = 100;
+  for (size_t i = 0; i < L.size(); i++) {
+    length += 8 + 48 + 16 * (uint32_t)(*L[i]).size();
+    for (size_t j = 0; j < (*L[i]).size(); j++)
+      F += (*L[i])[j];
+  }
+
+  XEndian endian;
+  int code = 9994, unused = 0, version = 1000, type = 3, nbPart = 1, part = 0, nbPt;
+  double zero = 0.;
+  auto header = [&](std::ofstream* out, int fileLength) {
+    endian.Write(out, false, &code, 4);
+    for (int i = 0; i < 5; i++)
+      endian.Write(out, false, &unused, 4);
+    endian.Write(out, false, &fileLength, 4);
+    endian.Write(out, true, &version, 4);
+    endian.Write(out, true, &type, 4);
+    endian.Write(out, true, &F.Xmin, 8);
+    endian.Write(out, true, &F.Ymin, 8);
+    endian.Write(out, true, &F.Xmax, 8);
+    endian.Write(out, true, &F.Ymax, 8);
+    for (int i = 0; i < 4; i++)
+      endian.Write(out, true, &zero, 8);
+  };
+  header(&shp, (int)(length / 2));
+  header(&shx, (int)(50 + L.size() * 4));
+
+  int offset = 50;
+  for (size_t i = 0; i < L.size(); i++) {
+    XFrame B;
+    for (size_t j = 0; j < (*L[i]).size(); j++)
+      B += (*L[i])[j];
+    int num = (int)(i + 1);
+    nbPt = (int)(*L[i]).size();
+    int size = (48 + 16 * nbPt) / 2;
+    endian.Write(&shx, false, &offset, 4);
+    endian.Write(&shx, false, &size, 4);
+    endian.Write(&shp, false, &num, 4);
+    endian.Write(&shp, false, &size, 4);
+    endian.Write(&shp, true, &type, 4);
+    endian.Write(&shp, true, &B.Xmin, 8);
+    endian.Write(&shp, true, &B.Ymin, 8);
+    endian.Write(&shp, true, &B.Xmax, 8);
+    endian.Write(&shp, true, &B.Ymax, 8);
+    endian.Write(&shp, true, &nbPart, 4);
+    endian.Write(&shp, true, &nbPt, 4);
+    endian.Write(&shp, true, &part, 4);
+    for (int j = 0; j < nbPt; j++) {
+      XPt2D P = (*L[i])[j];
+      endian.Write(&shp, true, &P.X, 8);
+      endian.Write(&shp, true, &P.Y, 8);
+    }
+    offset += 4 + size;
+  }
+  if ((!shp.good()) || (!shx.good()))
     return false;
-  out.seekp(0, std::ios_base::end);
 
-  if (!StreamReady())
+  XDBaseFile dbase;
+  dbase.AddField(field, 'N', 16, 3);
+  dbase.SetNbRecord((uint32_t)L.size());
+  if (!dbase.WriteHeader((filename + ".dbf").c_str()))
     return false;
-  // Ecriture des donnees
-  float* lineT = new float[m_nW];
-  float* lineB = new float[m_nW];
-  uint8_t* pix = new uint8_t[m_nW * factor * factor];
-  int* Z = new int[factor * factor];
-  if ((lineB == NULL)||(lineT == NULL||(pix == NULL)||(Z == NULL))) {
-    delete[] lineB;
-    delete[] lineT;
-    delete[] pix;
-    delete[] Z;
-    return false;
-  }
-  double N[4];
-  XInterLin interpol;
-
-  ReadLine(lineT, 0);
-  for (uint32_t i = 1; i < m_nH; i++) {
-    ReadLine(lineB, i);
-    ::memset(pix, 255, m_nW * factor * factor);
-    for (uint32_t j = 0; j < m_nW - 1; j++) {
-      N[0] = lineT[j];
-      N[1] = lineT[j+1];
-      N[2] = lineB[j];
-      N[3] = lineB[j+1];
-      for (uint32_t y = 0; y < factor; y++)
-        for (uint32_t x = 0; x < factor; x++) {
-          Z[y * factor + x] = floor(interpol.BiCompute(N, x, y, factor, factor) / equi);
-         // pix[y * m_nW * factor + x + j * factor] = Z[y * factor + x];
-        }
+  std::vector<std::string> V(2);
+  char buf[64];
+  V[0] = field;
+  for (size_t i = 0; i < L.size(); i++) {
+    snprintf(buf, 64, "%16.3lf", value[i]);
+    V[1] = buf;
+    if (!dbase.WriteRecord(V))
+      return false;
+  }
+  return true;
+}
 
-      for (uint32_t y = 0; y < factor - 1; y++)
-        for (uint32_t x = 0; x < factor - 1; x++) {
-          if (Z[y * factor + x] != Z[y * factor + x + 1])
-            pix[y * m_nW * factor + x + j * factor] = 0;
-          if (Z[y * factor + x] != Z[(y + 1) * factor + x])
-            pix[y * m_nW * factor + x + j * factor] = 0;
-      }
+//-----------------------------------------------------------------------------
+// Export sous forme de courbes de niveaux (Shapefile PolyLine)
+// Les mailles sont traitees par marching squares, par bandes de lignes reparties
+// sur nbThread threads. Les troncons sont raccordes dans chaque bande, puis entre
+// les bandes. nbSmooth : nombre d'iterations de lissage, tolerance : tolerance de
+// simplification en unite terrain (0 : pas de simplification).
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ExportContour(std::string filename, double equi, double tolerance, int nbSmooth, int nbThread)
+{
+  if ((!m_bValid) || (equi <= 0.) || (m_nW < 2) || (m_nH < 2))
+    return false;
+  if (nbThread < 1)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+
+  XPath P;
+  std::string shpfile = P.PathName(filename.c_str());
+
+  {
+    std::lock_guard<std::mutex> lock(m_BlockMutex);
+    if (!StreamReady())
+      return false;
+  }
 
+  // Bandes de mailles, limitees a environ 4M noeuds lus
+  uint32_t nbCellRow = m_nH - 1;
+  uint32_t nbLine = XMax(XMin((uint32_t)(4 * 1024 * 1024) / m_nW, (nbCellRow + nbThread - 1) / nbThread), (uint32_t)1);
+  uint32_t nbBand = (nbCellRow + nbLine - 1) / nbLine;
+  std::vector<std::vector<XContourChain> > band(nbBand);
+  std::atomic<uint32_t> nextBand(0);
+  std::atomic<bool> error(false);
+
+  // Segments d'une maille : aretes 0 (haut), 1 (droite), 2 (bas), 3 (gauche)
+  static const int segment[16][4] = {
+    {-1, -1, -1, -1}, {3, 2, -1, -1}, {2, 1, -1, -1}, {3, 1, -1, -1},
+    {0, 1, -1, -1}, {3, 0, 1, 2}, {0, 2, -1, -1}, {3, 0, -1, -1},
+    {3, 0, -1, -1}, {0, 2, -1, -1}, {0, 1, 3, 2}, {0, 1, -1, -1},
+    {3, 1, -1, -1}, {2, 1, -1, -1}, {3, 2, -1, -1}, {-1, -1, -1, -1} };
+
+  auto worker = [&]() {
+    std::vector<float> area;
+    std::vector<XContourChain> seg;
+    uint32_t b;
+    while (((b = nextBand++) < nbBand) && (!error)) {
+      uint32_t r0 = b * nbLine, r1 = XMin(r0 + nbLine, nbCellRow);  // Mailles [r0; r1[
+      area.resize((size_t)(r1 - r0 + 1) * m_nW);
+      {
+        std::lock_guard<std::mutex> lock(m_BlockMutex);
+        if (!ReadBlock(area.data(), 0, r0, m_nW, r1 - r0 + 1)) {
+          error = true;
+          break;
+        }
+      }
+      for (uint32_t i = r0; i < r1; i++) {
+        const float* top = &area[(size_t)(i - r0) * m_nW];
+        const float* bot = top + m_nW;
+        for (uint32_t j = 0; j < m_nW - 1; j++) {
+          float z[4] = { top[j], top[j + 1], bot[j + 1], bot[j] };  // TL, TR, BR, BL
+          if ((z[0] <= m_dNoData) || (z[1] <= m_dNoData) || (z[2] <= m_dNoData) || (z[3] <= m_dNoData))
+            continue;
+          float zmin = XMin(XMin(z[0], z[1]), XMin(z[2], z[3]));
+          float zmax = XMax(XMax(z[0], z[1]), XMax(z[2], z[3]));
+          int kmin = (int)floor(zmin / equi), kmax = (int)floor(zmax / equi) + 1;
+          // Aretes de la maille : noeud de depart, noeud d'arrivee, cle
+          uint64_t key[4] = { 2 * ((uint64_t)i * m_nW + j), 2 * ((uint64_t)i * m_nW + j + 1) + 1,
+                              2 * ((uint64_t)(i + 1) * m_nW + j), 2 * ((uint64_t)i * m_nW + j) + 1 };
+          for (int k = kmin; k <= kmax; k++) {
+            double level = k * equi;
+            int index = ((z[0] >= level) ? 8 : 0) | ((z[1] >= level) ? 4 : 0) | ((z[2] >= level) ? 2 : 0) | ((z[3] >= level) ? 1 : 0);
+            if ((index == 0) || (index == 15))
+              continue;
+            const int* s = segment[index];
+            if ((index == 5) || (index == 10)) { // Point selle : on tranche avec la moyenne de la maille
+              bool center = ((z[0] + z[1] + z[2] + z[3]) * 0.25 >= level);
+              if (!center)
+                s = segment[(index == 5) ? 10 : 5];
+            }
+            for (int n = 0; (n < 4) && (s[n] >= 0); n += 2) {
+              XContourChain C;
+              C.Level = k;
+              C.Closed = false;
+              C.Start = key[s[n]];
+              C.End = key[s[n + 1]];
+              for (int e = 0; e < 2; e++) {
+                // Les coordonnees ne dependent que de l'arete : elles sont identiques dans les deux mailles
+                int edge = s[n + e];
+                if ((edge == 0) || (edge == 2)) {
+                  const float* line = (edge == 0) ? top : bot;
+                  double t = (level - line[j]) / (line[j + 1] - line[j]);
+                  C.Pt.push_back(XPt2D(m_Frame.Xmin + (j + t) * m_dGSD, m_Frame.Ymax - (i + edge / 2) * m_dGSD));
+                } else {
+                  uint32_t col = (edge == 1) ? j + 1 : j;
+                  double t = (level - top[col]) / (bot[col] - top[col]);
+                  C.Pt.push_back(XPt2D(m_Frame.Xmin + col * m_dGSD, m_Frame.Ymax - (i + t) * m_dGSD));
+                }
+              }
+              seg.push_back(std::move(C));
+            }
+          }
+        }
+      }
+      StitchContour(seg, band[b]);
     }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < XMin(nbThread, (int)nbBand); t++)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto& th : threads)
+    th.join();
+  if (error)
+    return false;
 
-    out.write((char*)pix, m_nW * factor * factor * sizeof(uint8_t));
+  // Raccordement entre les bandes
+  std::vector<XContourChain> all, contour;
+  for (uint32_t b = 0; b < nbBand; b++) {
+    for (auto& C : band[b])
+      all.push_back(std::move(C));
+    std::vector<XContourChain>().swap(band[b]);
+  }
+  StitchContour(all, contour);
 
-    float* swap = lineT;
-    lineT = lineB;
-    lineB = swap;
+  for (auto& C : contour) {
+    for (int i = 0; i < nbSmooth; i++)
+      SmoothContour(C.Pt, C.Closed);
+    if (tolerance > 0.)
+      SimplifyContour(C.Pt, tolerance);
   }
-  out.close();
-  delete[] lineB;
-  delete[] lineT;
-  delete[] pix;
-  delete[] Z;
-  return out.good();
+
+  std::vector<const std::vector<XPt2D>*> line;
+  std::vector<double> altitude;
+  for (auto& C : contour) {
+    line.push_back(&C.Pt);
+    altitude.push_back(C.Level * equi);
+  }
+  return WritePolyLineShapefile(shpfile, line, "ALTITUDE", altitude);
 }
 
 //-----------------------------------------------------------------------------
@@ -1274,13 +2222,64 @@ bool predXPt2DSort(XPt2D A, XPt2D B)
 }
 
 //-----------------------------------------------------------------------------
-// Export d'une image d'inondation
+// Masque d'inondation par tuiles de 256 x 256 noeuds, allouees a la demande :
+// seules les zones atteintes par l'inondation occupent de la memoire
+//-----------------------------------------------------------------------------
+class XFloodMask {
+protected:
+  uint32_t  m_nTW;
+  std::vector<std::vector<uint8_t> > m_Tile;
+public:
+  XFloodMask(uint32_t w, uint32_t h) { m_nTW = (w + 255) / 256; m_Tile.resize((size_t)m_nTW * ((h + 255) / 256)); }
+  inline uint8_t Get(uint32_t x, uint32_t y) const
+    { const std::vector<uint8_t>& t = m_Tile[(size_t)(y >> 8) * m_nTW + (x >> 8)];
+      return t.empty() ? 0 : t[((y & 255) << 8) | (x & 255)]; }
+  inline void Set(uint32_t x, uint32_t y, uint8_t val)
+    { std::vector<uint8_t>& t = m_Tile[(size_t)(y >> 8) * m_nTW + (x >> 8)];
+      if (t.empty()) t.assign(256 * 256, 0);
+      t[((y & 255) << 8) | (x & 255)] = val; }
+};
+
+//-----------------------------------------------------------------------------
+// Export d'une image d'inondation pour un seul niveau d'eau
 //-----------------------------------------------------------------------------
 int XGeoFDtm::ExportFlood(std::string filename, double Z0, std::vector<XPt2D>& P,
                           int nb_seed, std::vector<XGeoVector*> *V)
 {
-  if (m_dZmin > Z0)
-    return false;
+  std::vector<double> level(1, Z0);
+  std::vector<XPt3D> seed;
+  for (uint32_t i = 0; i < P.size(); i++)
+    seed.push_back(XPt3D(P[i].X, P[i].Y, XGEO_NO_DATA));
+  int nb = ExportFlood(filename, level, seed, nb_seed, V);
+  P.clear();
+  for (uint32_t i = 0; i < seed.size(); i++)
+    P.push_back(XPt2D(seed[i].X, seed[i].Y));
+  return nb;
+}
+
+//-----------------------------------------------------------------------------
+// Export d'une image d'inondation pour plusieurs niveaux d'eau en une passe
+// Un noeud est inonde au niveau Z0[k] s'il est sous Z0[k] et relie aux points de
+// depart par des noeuds sous Z0[k]. Les niveaux sont traites par ordre croissant :
+// les noeuds qui bloquent l'inondation a un niveau sont mis en attente pour le premier
+// niveau qui les submerge, chaque noeud n'est donc rempli qu'une fois.
+// Le remplissage se fait par segments de ligne avec une pile explicite, les altitudes
+// sont lues par le cache de blocs.
+// Image : numero (1..n) du premier niveau qui inonde le noeud, 200 pour un noeud
+// sous le plus haut niveau non relie aux points de depart, 0 sinon.
+// P : points de depart ; P[i].Z est le niveau a partir duquel le point est inonde
+// (XGEO_NO_DATA : tous les niveaux). Les noeuds inondes du bord du MNT sont ajoutes a P.
+//-----------------------------------------------------------------------------
+int XGeoFDtm::ExportFlood(std::string filename, std::vector<double> Z0, std::vector<XPt3D>& P,
+                          int nb_seed, std::vector<XGeoVector*> *V)
+{
+  if ((!m_bValid) || (Z0.size() < 1) || (Z0.size() > 199))
+    return 0;
+  std::sort(Z0.begin(), Z0.end());
+  Z0.erase(std::unique(Z0.begin(), Z0.end()), Z0.end());
+  uint32_t nbLevel = (uint32_t)Z0.size();
+  if (m_dZmin > Z0[nbLevel - 1])
+    return 0;
   // Test si les points de depart concernent ce MNT
   XFrame frame = m_Frame;
   frame.Xmin -= m_dGSD;
@@ -1290,7 +2289,7 @@ int XGeoFDtm::ExportFlood(std::string filename, double Z0, std::vector<XPt2D>& P
 
   int inside_pt = 0;
   for (uint32_t i = 0; i < P.size(); i++) {
-    if (frame.IsIn(P[i])) {
+    if (frame.IsIn(XPt2D(P[i].X, P[i].Y))) {
       inside_pt++;
     }
   }
@@ -1299,145 +2298,170 @@ int XGeoFDtm::ExportFlood(std::string filename, double Z0, std::vector<XPt2D>& P
   if (inside_pt <= nb_seed)
     return nb_seed;
 
-  uint8_t* T = new uint8_t[m_nW * m_nH];
-  ::memset(T, 0, m_nW * m_nH * sizeof(uint8_t));
-
-  // Detection des noeuds sous le niveau Z0
-  std::vector<int> line;
-  double z;
-  for (uint32_t i = 0; i < m_nH; i++) {
-    bool flag = false;
-    for (uint32_t j = 0; j < m_nW; j++) {
-      z = Z(j, i);
-      if ((z < Z0)&&(z > XGEO_NO_DATA)) {
-        T[i * m_nW + j] = 200;
-        flag = true;
-      }
-    }
-    if (flag) line.push_back(i);
-  }
+  const uint8_t barrier = 255;
+  XFloodMask mask(m_nW, m_nH);
   if (V != NULL) {
     for (uint32_t i = 0; i < V->size(); i++)
-      InjectVector((*V)[i], T, 0);
+      InjectVector((*V)[i], [&](uint32_t u, uint32_t v) { mask.Set(u, v, barrier); });
   }
 
+  std::lock_guard<std::mutex> lock(m_BlockMutex);
+  if (!StreamReady())
+    return 0;
+  // Le cache doit contenir au moins trois lignes de blocs pour le remplissage par segments
+  size_t oldMaxBlock = m_nMaxBlock;
+  m_nMaxBlock = XMax(m_nMaxBlock, (size_t)(4 * ((m_nW + BlockSize - 1) / BlockSize)));
+
+  // Premier niveau qui submerge un noeud (nbLevel : jamais, ou noeud bloque)
+  auto levelOf = [&](uint32_t x, uint32_t y) -> uint32_t {
+    if (mask.Get(x, y) != 0)
+      return nbLevel;
+    float z = Node(x, y);
+    if (z <= m_dNoData)
+      return nbLevel;
+    return (uint32_t)(std::upper_bound(Z0.begin(), Z0.end(), (double)z) - Z0.begin());
+  };
+
   // Creation des points de depart
+  std::vector<std::vector<std::pair<uint32_t, uint32_t> > > pending(nbLevel);
   int u, v, nb_start_pt = 0;
   for (uint32_t i = 0; i < P.size(); i++) {
-    if (!frame.IsIn(P[i]))
+    if (!frame.IsIn(XPt2D(P[i].X, P[i].Y)))
       continue;
     u = XRint((P[i].X - m_Frame.Xmin) / m_dGSD);
     v = XRint((m_Frame.Ymax - P[i].Y) / m_dGSD);
     if (u < 0) u = 0;
     if (v < 0) v = 0;
-    if (u >= m_nW) u = m_nW - 1;
-    if (v >= m_nH) v = m_nH - 1;
-    if (T[v * m_nW + u] > 0) {
-      T[v * m_nW + u] = 66;
+    if (u >= (int)m_nW) u = m_nW - 1;
+    if (v >= (int)m_nH) v = m_nH - 1;
+    uint32_t k = XMax(levelOf(u, v), (uint32_t)(std::lower_bound(Z0.begin(), Z0.end(), P[i].Z) - Z0.begin()));
+    if (k < nbLevel) {
+      pending[k].push_back(std::make_pair((uint32_t)u, (uint32_t)v));
       nb_start_pt++;
     }
   }
   if (nb_start_pt < 1) {
-    delete[] T;
+    m_nMaxBlock = oldMaxBlock;
     return inside_pt;
   }
 
-  // Propagation dans le MNT
-  uint32_t nb_changed = 1000;
-  uint32_t num_line;
-  bool next_line = false, prev_line = false;
-  while (nb_changed > 0) {
-    nb_changed = 0;
-    for (int i = 0; i < line.size(); i++) {
-      num_line = line[i];
-      next_line = false;
-      prev_line = false;
-      if (i < line.size() - 1) {
-        if ((line[i+1] - num_line) == 1) next_line = true;
-      }
-      if (i > 0) {
-        if (num_line - line[i-1] == 1) prev_line = true;
-      }
-
-      for (int j = 0; j < m_nW; j++) {
-        if (T[num_line * m_nW + j] == 0)
+  // Propagation dans le MNT, niveau par niveau
+  for (uint32_t k = 0; k < nbLevel; k++) {
+    std::vector<std::pair<uint32_t, uint32_t> > stack;
+    stack.swap(pending[k]);
+    // Un noeud qui bloque au niveau k est mis en attente pour le niveau qui le submerge
+    auto test = [&](uint32_t x, uint32_t y) -> bool {
+      uint32_t n = levelOf(x, y);
+      if (n <= k)
+        return true;
+      if (n < nbLevel)
+        pending[n].push_back(std::make_pair(x, y));
+      return false;
+    };
+    while (stack.size() > 0) {
+      uint32_t x = stack.back().first, y = stack.back().second;
+      stack.pop_back();
+      if (mask.Get(x, y) != 0)
+        continue;
+      uint32_t xl = x, xr = x;
+      while ((xl > 0) && test(xl - 1, y))
+        xl--;
+      while ((xr < m_nW - 1) && test(xr + 1, y))
+        xr++;
+      for (uint32_t j = xl; j <= xr; j++)
+        mask.Set(j, y, (uint8_t)(k + 1));
+      // Lignes voisines : un point de depart par segment
+      for (int dy = -1; dy <= 1; dy += 2) {
+        if (((dy < 0) && (y == 0)) || ((dy > 0) && (y == m_nH - 1)))
           continue;
-        if (T[num_line * m_nW + j] == 66) { // On inonde les noeuds voisins
-          for (int k = 1; k <= j; k++) { // Inondation a gauche
-            if (T[num_line * m_nW + j - k] > 66)
-              { T[num_line * m_nW + j - k] = 66; nb_changed++;}
-            else
-              break;
-          }
-
-          for (int k = 1; k <= (m_nW - j - 1); k++) { // Inondation a droite
-            if (T[num_line * m_nW + j + k] > 66)
-              { T[num_line * m_nW + j + k] = 66; nb_changed++;}
-            else
-              break;
-          }
-
-         if (prev_line)
-           if (T[(num_line-1) * m_nW + j] > 66) { T[(num_line-1) * m_nW + j] = 66; nb_changed++;}
-         if (next_line)
-           if (T[(num_line+1) * m_nW + j] > 66) { T[(num_line+1) * m_nW + j] = 66; nb_changed++;}
-
-        } // endif
-
-      } // endfor j
-    } // endfor i
-  } // endwhile
+        uint32_t ny = y + dy;
+        bool inSpan = false;
+        for (uint32_t j = xl; j <= xr; j++) {
+          if (test(j, ny)) {
+            if (!inSpan)
+              stack.push_back(std::make_pair(j, ny));
+            inSpan = true;
+          } else
+            inSpan = false;
+        }
+      }
+    }
+  }
 
   // Mise a jour des points de depart
   for (uint32_t i = 0; i < m_nW; i++) {
-    if (T[i] == 66) P.push_back(XPt2D(m_Frame.Xmin + i * m_dGSD, m_Frame.Ymax + m_dGSD * 0.5));
-    if (T[(m_nH-1)*m_nW +i] == 66) P.push_back(XPt2D(m_Frame.Xmin + i * m_dGSD, m_Frame.Ymin - m_dGSD * 0.5));
+    uint8_t c = mask.Get(i, 0);
+    if ((c > 0) && (c != barrier)) P.push_back(XPt3D(m_Frame.Xmin + i * m_dGSD, m_Frame.Ymax + m_dGSD * 0.5, Z0[c - 1]));
+    c = mask.Get(i, m_nH - 1);
+    if ((c > 0) && (c != barrier)) P.push_back(XPt3D(m_Frame.Xmin + i * m_dGSD, m_Frame.Ymin - m_dGSD * 0.5, Z0[c - 1]));
   }
   for (uint32_t i = 0; i < m_nH; i++) {
-    if (T[i * m_nH] == 66) P.push_back(XPt2D(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax - i * m_dGSD));
-    if (T[i * m_nH + m_nW - 1] == 66) P.push_back(XPt2D(m_Frame.Xmax + m_dGSD * 0.5, m_Frame.Ymax - i * m_dGSD));
+    uint8_t c = mask.Get(0, i);
+    if ((c > 0) && (c != barrier)) P.push_back(XPt3D(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax - i * m_dGSD, Z0[c - 1]));
+    c = mask.Get(m_nW - 1, i);
+    if ((c > 0) && (c != barrier)) P.push_back(XPt3D(m_Frame.Xmax + m_dGSD * 0.5, m_Frame.Ymax - i * m_dGSD, Z0[c - 1]));
   }
-  std::sort(P.begin(), P.end(), predXPt2DSort);
-  std::vector<XPt2D>::iterator iter = std::unique(P.begin(), P.end(), predXPt2DNear);
+  std::sort(P.begin(), P.end(), [](const XPt3D& A, const XPt3D& B) {
+    if (A.X != B.X) return A.X > B.X;
+    if (A.Y != B.Y) return A.Y > B.Y;
+    return A.Z < B.Z; });
+  auto iter = std::unique(P.begin(), P.end(), [](const XPt3D& A, const XPt3D& B) {
+    return predXPt2DNear(XPt2D(A.X, A.Y), XPt2D(B.X, B.Y)); });
   P.resize(iter - P.begin());
+  m_nMaxBlock = oldMaxBlock;
 
-  // Ouverture du fichier de sortie
+  // Ecriture de l'image ligne par ligne et calcul des statistiques
   std::string tifffile = filename;
   XTiffWriter tiff;
   tiff.SetGeoTiff(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax + m_dGSD * 0.5, m_dGSD);
-  bool tiff_flag = tiff.Write(tifffile.c_str(), m_nW, m_nH, 1, 8, T);
+  if (!tiff.Write(tifffile.c_str(), m_nW, m_nH, 1, 8))
+    return inside_pt;
+  std::ofstream out;
+  out.open(tifffile.c_str(), std::ios_base::out| std::ios_base::binary| std::ios_base::app);
+  if (!out.good())
+    return inside_pt;
+  out.seekp(0, std::ios_base::end);
 
-  // Calcul des statistiques
-  uint32_t nb_0 = 0, nb_66 = 0, nb_200 = 0;
-  double volume = 0;
+  uint32_t nb_0 = 0, nb_200 = 0;
+  std::vector<uint32_t> nb_flood(nbLevel, 0);
+  std::vector<double> volume(nbLevel, 0.);
+  std::vector<float> line(m_nW);
+  std::vector<uint8_t> pix(m_nW);
   for (uint32_t i = 0; i < m_nH; i++) {
+    ReadLine(line.data(), i);
     for (uint32_t j = 0; j < m_nW; j++) {
-      if (T[i * m_nW + j] == 0) {
-        nb_0++;
+      uint8_t c = mask.Get(j, i);
+      if ((c > 0) && (c != barrier)) {
+        for (uint32_t k = c - 1; k < nbLevel; k++) {
+          nb_flood[k]++;
+          volume[k] += (Z0[k] - line[j]);
+        }
+        pix[j] = c;
         continue;
       }
-      if (T[i * m_nW + j] == 200) {
+      if ((c != barrier) && (line[j] > m_dNoData) && (line[j] < Z0[nbLevel - 1])) {
+        pix[j] = 200;
         nb_200++;
         continue;
       }
-      if (T[i * m_nW + j] == 66) {
-        nb_66++;
-        z = Z(j, i);
-        volume += (Z0 - z);
-        continue;
-      }
+      pix[j] = 0;
+      nb_0++;
     }
+    out.write((char*)pix.data(), m_nW);
+  }
+  out.close();
+
+  std::ofstream info((filename + ".info").c_str());
+  info << "Nom du fichier :\t" << filename << std::endl;
+  info << "Nombre de noeuds :\t" << m_nW * m_nH << std::endl;
+  info << "Noeuds non inondes (Z > " << Z0[nbLevel - 1] << ") :\t" << nb_0 << std::endl;
+  info << "Noeuds non inondes (Z < " << Z0[nbLevel - 1] << ") :\t" << nb_200 << std::endl;
+  for (uint32_t k = 0; k < nbLevel; k++) {
+    info << "Altitude d'inondation (niveau " << k + 1 << ") :\t" << Z0[k] << std::endl;
+    info << "Noeuds inondes :\t" << nb_flood[k] << std::endl;
+    info << "Volume d'inondation (m3) :\t" << volume[k] * m_dGSD * m_dGSD << std::endl;
   }
-  std::ofstream out((filename + ".info").c_str());
-  out << "Nom du fichier :\t" << filename << std::endl;
-  out << "Altitude d'inondation :\t" << Z0 << std::endl;
-  out << "Nombre de noeuds :\t" << m_nW * m_nH << std::endl;
-  out << "Noeuds non inondes (Z > " << Z0 << ") :\t" << nb_0 << std::endl;
-  out << "Noeuds non inondes (Z < " << Z0 << ") :\t" << nb_200 << std::endl;
-  out << "Noeuds inondes :\t" << nb_66 << std::endl;
-  out << "Volume d'inondation (m3) :\t" << volume * m_dGSD * m_dGSD << std::endl;
 
-  delete[] T;
   return inside_pt;
 }
 /*
@@ -1623,6 +2647,295 @@ bool XGeoFDtm::ExportDiff(std::string filename, XGeoFDtm* dtm)
   return flag;
 }
 
+//-----------------------------------------------------------------------------
+// Zone de calcul des volumes : aretes du polygone, pour un remplissage par
+// balayage de lignes sans recharger la geometrie dans les threads
+//-----------------------------------------------------------------------------
+struct XDiffZone {
+  XFrame  F;
+  std::vector<XPt2D> A, B;  // Extremites des aretes
+};
+
+static bool LoadDiffZone(XGeoVector* V, XDiffZone& zone)
+{
+  if (!V->IsClosed())
+    return false;
+  if (!V->LoadGeom2D())
+    return false;
+  zone.F = V->Frame();
+  uint32_t nbPart = XMax(V->NbPart(), (uint32_t)1);
+  for (uint32_t i = 0; i < nbPart; i++) {
+    uint32_t first = (V->NbPart() > 0) ? V->Part(i) : 0;
+    uint32_t last = (i + 1 < V->NbPart()) ? V->Part(i + 1) : V->NbPt();
+    if (last < first + 2)
+      continue;
+    for (uint32_t j = first; j < last; j++) {
+      XPt2D P = V->Pt(j), Q = V->Pt((j + 1 < last) ? j + 1 : first);
+      if (P.Y == Q.Y)
+        continue;
+      zone.A.push_back(P);
+      zone.B.push_back(Q);
+    }
+  }
+  V->Unload();
+  return (zone.A.size() > 0);
+}
+
+//-----------------------------------------------------------------------------
+// Cumul d'un ecart dans les statistiques d'une zone
+//-----------------------------------------------------------------------------
+XGeoFDtm::DiffStat::DiffStat(uint32_t nbClass)
+{
+  Cut = Fill = 0.;
+  DzMin = 1e31;
+  DzMax = -1e31;
+  NbNode = NbNoData = 0;
+  Histo.assign(nbClass, 0);
+}
+
+static void AddDiffStat(XGeoFDtm::DiffStat& S, float dz, const std::vector<double>& P)
+{
+  if (dz <= XGeoFDtm::DiffNoData) {
+    S.NbNoData++;
+    return;
+  }
+  S.NbNode++;
+  if (dz > 0.f)
+    S.Fill += dz;
+  else
+    S.Cut -= dz;
+  if (dz < S.DzMin) S.DzMin = dz;
+  if (dz > S.DzMax) S.DzMax = dz;
+  size_t k = std::upper_bound(P.begin(), P.end(), (double)dz) - P.begin();
+  S.Histo[k]++;
+}
+
+static void MergeDiffStat(XGeoFDtm::DiffStat& S, const XGeoFDtm::DiffStat& T)
+{
+  S.Cut += T.Cut;
+  S.Fill += T.Fill;
+  S.DzMin = XMin(S.DzMin, T.DzMin);
+  S.DzMax = XMax(S.DzMax, T.DzMax);
+  S.NbNode += T.NbNode;
+  S.NbNoData += T.NbNoData;
+  for (size_t k = 0; k < S.Histo.size(); k++)
+    S.Histo[k] += T.Histo[k];
+}
+
+//-----------------------------------------------------------------------------
+// Liste et emprise des MNT d'une classe
+//-----------------------------------------------------------------------------
+static bool CollectDiffDtm(XGeoClass* C, std::vector<XGeoFDtm*>& L, XFrame& F)
+{
+  L.clear();
+  if (C == NULL)
+    return false;
+  for (uint32_t i = 0; i < C->NbVector(); i++) {
+    XGeoVector* V = C->Vector(i);
+    if (V->TypeVector() != XGeoVector::DTM)
+      continue;
+    XGeoFDtm* dtm = dynamic_cast<XGeoFDtm*>(V);
+    if (dtm == nullptr)
+      continue;
+    if (L.size() == 0)
+      F = dtm->Frame();
+    else
+      F += dtm->Frame();
+    L.push_back(dtm);
+  }
+  return (L.size() > 0);
+}
+
+//-----------------------------------------------------------------------------
+// Difference de deux classes de MNT (A - B) sur une grille commune de pas gsd
+// Les MNT peuvent avoir des dallages et des resolutions differents : chaque
+// dalle de sortie est reechantillonnee a la volee par ZGrid, les dalles sont
+// traitees en parallele et ecrites dans un GeoTIFF tuile compresse (Deflate).
+// S[0] contient les statistiques sur toute la grille, S[k+1] celles du k-ieme
+// polygone de la classe zone. Les volumes sont en m3, l'histogramme compte les
+// noeuds par plage d'ecart definie par P (P.size() + 1 plages).
+// Un rapport texte est ecrit a cote du GeoTIFF.
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::ExportDiff(std::string filename, XGeoClass* A, XGeoClass* B, double gsd, const std::vector<double>& P,
+                          std::vector<DiffStat>& S, XGeoClass* zone, int nbThread)
+{
+  S.clear();
+  if (gsd <= 0.)
+    return false;
+  if (!std::is_sorted(P.begin(), P.end()))
+    return false;
+  std::vector<XGeoFDtm*> LA, LB;
+  XFrame FA, FB;
+  if ((!CollectDiffDtm(A, LA, FA)) || (!CollectDiffDtm(B, LB, FB)))
+    return false;
+
+  // Grille des noeuds communs, calee sur les noeuds du premier MNT de A
+  XFrame F(XMax(FA.Xmin, FB.Xmin), XMax(FA.Ymin, FB.Ymin), XMin(FA.Xmax, FB.Xmax), XMin(FA.Ymax, FB.Ymax));
+  XPt2D O(LA[0]->Frame().Xmin, LA[0]->Frame().Ymax);
+  F.Xmin = O.X + gsd * ceil((F.Xmin - O.X) / gsd - 1e-6);
+  F.Ymin = O.Y + gsd * ceil((F.Ymin - O.Y) / gsd - 1e-6);
+  F.Xmax = O.X + gsd * floor((F.Xmax - O.X) / gsd + 1e-6);
+  F.Ymax = O.Y + gsd * floor((F.Ymax - O.Y) / gsd + 1e-6);
+  if ((F.Xmax < F.Xmin) || (F.Ymax < F.Ymin))
+    return false;
+  uint32_t W = (uint32_t)XRint(F.Width() / gsd) + 1;
+  uint32_t H = (uint32_t)XRint(F.Height() / gsd) + 1;
+
+  // Zones de calcul des volumes
+  std::vector<XDiffZone> Z;
+  if (zone != NULL) {
+    Z.resize(zone->NbVector());
+    for (uint32_t i = 0; i < zone->NbVector(); i++)
+      LoadDiffZone(zone->Vector(i), Z[i]);
+  }
+  S.assign(Z.size() + 1, DiffStat((uint32_t)P.size() + 1));
+
+  XPath path;
+  std::string tifffile = path.PathName(filename.c_str()) + ".tif";
+  std::string txtfile = path.PathName(filename.c_str()) + ".txt";
+  const uint32_t T = 256;
+  XTiffWriter writer;
+  writer.SetGeoTiff(F.Xmin - gsd * 0.5, F.Ymax + gsd * 0.5, gsd);
+  if (!writer.BeginTiled(tifffile.c_str(), W, H, 1, 32, 3, T, T, 8, 3))
+    return false;
+
+  uint32_t nbTileW = (W + T - 1) / T, nbTileH = (H + T - 1) / T;
+  uint32_t nbTile = nbTileW * nbTileH;
+  if (nbThread <= 0)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+  nbThread = (int)XMin((uint32_t)nbThread, nbTile);
+
+  std::atomic<uint32_t> next(0);
+  std::atomic<bool> failed(false);
+  std::mutex mutex;   // Protege writer et S
+
+  auto worker = [&]() {
+    std::vector<DiffStat> stat(S.size(), DiffStat((uint32_t)P.size() + 1));
+    std::vector<float> za((size_t)T * T), zb((size_t)T * T), tile((size_t)T * T);
+    std::vector<uint8_t> encoded;
+    std::vector<double> inter;
+    for (uint32_t t = next++; t < nbTile; t = next++) {
+      if (failed)
+        return;
+      uint32_t tx = (t % nbTileW) * T, ty = (t / nbTileW) * T;
+      uint32_t w = XMin(T, W - tx), h = XMin(T, H - ty);
+      XPt2D TL(F.Xmin + tx * gsd, F.Ymax - ty * gsd);
+      XFrame Ft(TL.X, TL.Y - (h - 1) * gsd, TL.X + (w - 1) * gsd, TL.Y);
+
+      // Reechantillonnage des deux classes, par ordre de priorite
+      std::fill(za.begin(), za.begin() + (size_t)w * h, (float)XGEO_NO_DATA);
+      std::fill(zb.begin(), zb.begin() + (size_t)w * h, (float)XGEO_NO_DATA);
+      for (size_t k = 0; k < LA.size() + LB.size(); k++) {
+        XGeoFDtm* dtm = (k < LA.size()) ? LA[k] : LB[k - LA.size()];
+        XFrame G = dtm->Frame();
+        G += dtm->Resolution() * 0.5;
+        if (G.Intersect(Ft))
+          dtm->ZGrid(TL, gsd, w, h, (k < LA.size()) ? za.data() : zb.data(), 1);
+      }
+
+      // Difference et statistiques globales
+      std::fill(tile.begin(), tile.end(), DiffNoData);
+      for (uint32_t i = 0; i < h; i++) {
+        for (uint32_t j = 0; j < w; j++) {
+          float a = za[(size_t)i * w + j], b = zb[(size_t)i * w + j];
+          float dz = DiffNoData;
+          if ((a > (float)XGEO_NO_DATA) && (b > (float)XGEO_NO_DATA))
+            dz = a - b;
+          tile[(size_t)i * T + j] = dz;
+          AddDiffStat(stat[0], dz, P);
+        }
+      }
+
+      // Statistiques par zone : remplissage des lignes de la dalle par balayage
+      for (size_t k = 0; k < Z.size(); k++) {
+        if (Z[k].A.size() < 1)
+          continue;
+        if (!Z[k].F.Intersect(Ft))
+          continue;
+        for (uint32_t i = 0; i < h; i++) {
+          double y = TL.Y - i * gsd;
+          if ((y < Z[k].F.Ymin) || (y > Z[k].F.Ymax))
+            continue;
+          inter.clear();
+          for (size_t e = 0; e < Z[k].A.size(); e++) {
+            const XPt2D& M = Z[k].A[e];
+            const XPt2D& N = Z[k].B[e];
+            if ((M.Y <= y) == (N.Y <= y))
+              continue;
+            inter.push_back(M.X + (y - M.Y) * (N.X - M.X) / (N.Y - M.Y));
+          }
+          std::sort(inter.begin(), inter.end());
+          for (size_t e = 0; e + 1 < inter.size(); e += 2) {
+            double j0 = XMax(ceil((inter[e] - TL.X) / gsd), 0.);
+            double j1 = XMin(ceil((inter[e + 1] - TL.X) / gsd), (double)w);
+            for (uint32_t j = (uint32_t)j0; (double)j < j1; j++)
+              AddDiffStat(stat[k + 1], tile[(size_t)i * T + j], P);
+          }
+        }
+      }
+
+      if (!writer.EncodeTile((uint8_t*)tile.data(), encoded)) {
+        failed = true;
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!writer.WriteEncodedTile(t, encoded)) {
+        failed = true;
+        return;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t k = 0; k < S.size(); k++)
+      MergeDiffStat(S[k], stat[k]);
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < nbThread; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  bool flag = writer.EndTiled();
+  if (failed) {
+    std::remove(tifffile.c_str());
+    return false;
+  }
+  if (!flag)
+    return false;
+
+  // Passage en volumes et rapport
+  double surf = gsd * gsd;
+  std::ofstream out;
+  out.open(txtfile.c_str());
+  if (out.good()) {
+    out << "Grille :\t" << W << " x " << H << "\tPas : " << gsd << std::endl;
+    out << "Zone\tNoeuds\tSans valeur\tDeblai (m3)\tRemblai (m3)\tBilan (m3)\tDz min\tDz max";
+    for (size_t k = 0; k <= P.size(); k++)
+      out << "\t" << ((k == 0) ? "-inf" : std::to_string(P[k - 1])) << " / " << ((k == P.size()) ? "+inf" : std::to_string(P[k]));
+    out << std::endl;
+  }
+  for (size_t k = 0; k < S.size(); k++) {
+    S[k].Cut *= surf;
+    S[k].Fill *= surf;
+    if (!out.good())
+      continue;
+    if (k == 0)
+      out << "Total";
+    else
+      out << k;
+    out << "\t" << S[k].NbNode << "\t" << S[k].NbNoData << "\t" << S[k].Cut << "\t" << S[k].Fill << "\t" << S[k].Fill - S[k].Cut;
+    if (S[k].NbNode > 0)
+      out << "\t" << S[k].DzMin << "\t" << S[k].DzMax;
+    else
+      out << "\t\t";
+    for (size_t i = 0; i < S[k].Histo.size(); i++)
+      out << "\t" << S[k].Histo[i];
+    out << std::endl;
+  }
+  return out.good();
+}
+
 //-----------------------------------------------------------------------------
 // Recherche des ecarts importants (DZ entre noeuds voisins)
 //-----------------------------------------------------------------------------
@@ -1728,377 +3041,1162 @@ bool XGeoFDtm::FindContourLine(double Z0, uint8_t* area)
 
 }
 
+XHydroChain::XHydroChain(XGeoFDtm* dtm, uint32_t tile, int nbThread, bool dinf, std::string tmp)
+{
+  m_Dtm = dtm;
+  m_nW = dtm->m_nW;
+  m_nH = dtm->m_nH;
+  tile = XMin(XMax(tile, (uint32_t)64), XMax(m_nW, m_nH));
+  m_nTile = ((tile + 15) / 16) * 16;  // Multiple de 16 pour les dalles TIFF
+  m_nTx = (m_nW + m_nTile - 1) / m_nTile;
+  m_nTy = (m_nH + m_nTile - 1) / m_nTile;
+  m_nNbThread = (nbThread < 1) ? XMax((int)std::thread::hardware_concurrency(), 1) : nbThread;
+  m_bDinf = dinf;
+  m_NoData = (float)dtm->m_dNoData;
+  m_strTmp = tmp;
+  m_Tile.resize((size_t)m_nTx * m_nTy);
+  for (uint32_t i = 0; i < m_nTy; i++) {
+    for (uint32_t j = 0; j < m_nTx; j++) {
+      Tile& T = m_Tile[(size_t)i * m_nTx + j];
+      T.X0 = j * m_nTile;
+      T.Y0 = i * m_nTile;
+      T.W = XMin(m_nTile, m_nW - T.X0);
+      T.H = XMin(m_nTile, m_nH - T.Y0);
+      T.NbLabel = T.FirstLabel = 0;
+    }
+  }
+}
+
+XHydroChain::~XHydroChain()
+{
+  for (size_t i = 0; i < m_TmpFile.size(); i++)
+    remove(m_TmpFile[i].c_str());
+}
+
 //-----------------------------------------------------------------------------
-// Recherche des thalwegs
+// Traitement des dalles en parallele
 //-----------------------------------------------------------------------------
-bool XGeoFDtm::FindThalweg(std::string filename)
+bool XHydroChain::ForEachTile(const std::function<bool(Tile&)>& f)
 {
-  if (!m_bValid)
-    return false;
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    size_t t;
+    while ((ok) && ((t = next++) < m_Tile.size()))
+      if (!f(m_Tile[t]))
+        ok = false;
+  };
+  size_t nbWorker = XMin((size_t)m_nNbThread, m_Tile.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nbWorker; i++)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto& th : threads)
+    th.join();
+  return ok;
+}
 
-  XPath P;
-  std::string tifffile = P.PathName(filename.c_str()) + ".tif";
+//-----------------------------------------------------------------------------
+// Lecture d'une dalle avec un bord d'un noeud, les noeuds hors du MNT sont sans donnees
+//-----------------------------------------------------------------------------
+bool XHydroChain::ReadZ(const Tile& T, std::vector<float>& Z)
+{
+  uint32_t zw = T.W + 2;
+  Z.assign((size_t)zw * (T.H + 2), m_NoData);
+  uint32_t x0 = (T.X0 > 0) ? T.X0 - 1 : 0, y0 = (T.Y0 > 0) ? T.Y0 - 1 : 0;
+  uint32_t x1 = XMin(T.X0 + T.W + 1, m_nW), y1 = XMin(T.Y0 + T.H + 1, m_nH);
+  std::vector<float> block((size_t)(x1 - x0) * (y1 - y0));
+  {
+    std::lock_guard<std::mutex> lock(m_Dtm->m_BlockMutex);
+    if (!m_Dtm->StreamReady())
+      return false;
+    if (!m_Dtm->ReadBlock(block.data(), x0, y0, x1 - x0, y1 - y0))
+      return false;
+  }
+  for (uint32_t i = y0; i < y1; i++)
+    ::memcpy(&Z[(size_t)(i + 1 - T.Y0) * zw + x0 + 1 - T.X0], &block[(size_t)(i - y0) * (x1 - x0)], (x1 - x0) * sizeof(float));
+  return true;
+}
 
-  // Ouverture du fichier de sortie
-  XTiffWriter tiff;
-  tiff.SetGeoTiff(m_Frame.Xmin - m_dGSD * 0.5, m_Frame.Ymax + m_dGSD * 0.5, m_dGSD);
-  if (!tiff.Write(tifffile.c_str(), m_nW, m_nH, 1, 16))
-    return false;
-  std::ofstream out;
-  out.open(tifffile.c_str(), std::ios_base::out| std::ios_base::binary| std::ios_base::app);
+//-----------------------------------------------------------------------------
+// Fichiers temporaires : une dalle par enregistrement de Tile x Tile valeurs
+//-----------------------------------------------------------------------------
+bool XHydroChain::CreateTmp(std::string name)
+{
+  std::string filename = m_strTmp + "_" + name + ".tmp";
+  std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
   if (!out.good())
     return false;
-  out.seekp(0, std::ios_base::end);
-  //uint32_t offset = out.tellp();
+  m_TmpFile.push_back(filename);
+  return true;
+}
 
-  // Ecriture des donnees
-  if (!StreamReady())
-    return false;
-  float* mnt = new float[m_nW*m_nH];
-  if (mnt == NULL)
-    return false;
-  uint16_t* thal = new uint16_t[m_nW*m_nH];
-  if (thal == NULL) {
-    delete[] mnt;
+bool XHydroChain::ReadTile(std::string name, const Tile& T, void* data, size_t size)
+{
+  std::ifstream in((m_strTmp + "_" + name + ".tmp").c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!in.good())
     return false;
-  }
-  uint8_t* water = new uint8_t[m_nW*m_nH];
-  if (water == NULL) {
-    delete[] mnt;
-    delete[] thal;
+  uint64_t index = (uint64_t)(T.Y0 / m_nTile) * m_nTx + T.X0 / m_nTile;
+  in.seekg(index * m_nTile * m_nTile * size, std::ios_base::beg);
+  in.read((char*)data, (size_t)T.W * T.H * size);
+  return in.good();
+}
+
+bool XHydroChain::WriteTile(std::string name, const Tile& T, const void* data, size_t size)
+{
+  std::fstream out((m_strTmp + "_" + name + ".tmp").c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+  if (!out.good())
     return false;
+  uint64_t index = (uint64_t)(T.Y0 / m_nTile) * m_nTx + T.X0 / m_nTile;
+  out.seekp(index * m_nTile * m_nTile * size, std::ios_base::beg);
+  out.write((const char*)data, (size_t)T.W * T.H * size);
+  return out.good();
+}
+
+//-----------------------------------------------------------------------------
+// Bord d'un noeud autour d'une dalle, lu sur les bords des dalles voisines
+//-----------------------------------------------------------------------------
+template<class V> void XHydroChain::Halo(const Tile& T, std::vector<V> Tile::* border, V outside, std::vector<V>& buf)
+{
+  uint32_t zw = T.W + 2;
+  buf.resize((size_t)zw * (T.H + 2));
+  T.ForRing([&](uint32_t j, uint32_t i) {
+    int64_t x = (int64_t)T.X0 + j - 1, y = (int64_t)T.Y0 + i - 1;
+    if ((x < 0) || (y < 0) || (x >= m_nW) || (y >= m_nH)) {
+      buf[(size_t)i * zw + j] = outside;
+      return;
+    }
+    const Tile& N = TileOf((uint32_t)x, (uint32_t)y);
+    buf[(size_t)i * zw + j] = (N.*border)[N.Border((uint32_t)x - N.X0, (uint32_t)y - N.Y0)];
+  });
+}
+
+//-----------------------------------------------------------------------------
+// Priority-Flood etiquete d'une dalle (Barnes 2016)
+// Z : dalle avec un bord d'un noeud. Les noeuds du bord de la dalle et les exutoires (voisins
+// d'un noeud sans donnees ou hors du MNT) sont les points de depart. Une nouvelle etiquette
+// est creee pour chaque point de depart du bord non encore atteint, les exutoires ont
+// l'etiquette 1. fill : altitude comblee dans la dalle seule, spill : altitude minimale de
+// debordement entre deux etiquettes
+//-----------------------------------------------------------------------------
+void XHydroChain::Flood(const Tile& T, const std::vector<float>& Z, std::vector<uint32_t>& label, std::vector<float>& fill,
+                        std::map<std::pair<uint32_t, uint32_t>, float>* spill, uint32_t* nbLabel)
+{
+  uint32_t w = T.W, h = T.H, zw = w + 2;
+  size_t nbNode = (size_t)w * h;
+  label.assign(nbNode, 0);
+  fill.assign(nbNode, m_NoData);
+  std::vector<uint8_t> closed(nbNode, 0);
+  typedef std::pair<float, uint32_t> HydroNode;
+  std::priority_queue<HydroNode, std::vector<HydroNode>, std::greater<HydroNode> > open;
+  std::queue<uint32_t> pit;
+
+  for (uint32_t i = 0; i < h; i++) {
+    for (uint32_t j = 0; j < w; j++) {
+      uint32_t index = i * w + j;
+      float z = Z[(size_t)(i + 1) * zw + j + 1];
+      if (z <= m_NoData) {
+        closed[index] = 1;
+        continue;
+      }
+      bool outlet = false;
+      for (int k = 0; (k < 8) && (!outlet); k++)
+        if (Z[(size_t)(i + 1 + HydroDy[k]) * zw + j + 1 + HydroDx[k]] <= m_NoData)
+          outlet = true;
+      if ((!outlet) && (i > 0) && (j > 0) && (i < h - 1) && (j < w - 1))
+        continue;
+      closed[index] = 1;
+      fill[index] = z;
+      if (outlet)
+        label[index] = 1;
+      open.push(HydroNode(z, index));
+    }
   }
-  uint8_t* volume = new uint8_t[m_nW*m_nH];
-  if (volume == NULL){
-    delete[] mnt;
-    delete[] thal;
-    delete[] water;
-    return false;
+
+  uint32_t nb = 1;
+  while ((open.size() > 0) || (pit.size() > 0)) {
+    uint32_t index;
+    if (pit.size() > 0) {
+      index = pit.front();
+      pit.pop();
+    } else {
+      index = open.top().second;
+      open.pop();
+    }
+    if (label[index] == 0)
+      label[index] = ++nb;
+    uint32_t x = index % w, y = index / w;
+    for (int k = 0; k < 8; k++) {
+      int u = (int)x + HydroDx[k], v = (int)y + HydroDy[k];
+      if ((u < 0) || (v < 0) || (u >= (int)w) || (v >= (int)h))
+        continue;
+      uint32_t n = (uint32_t)v * w + u;
+      if (closed[n]) {
+        if ((spill != NULL) && (label[n] != 0) && (label[n] != label[index])) {
+          std::pair<uint32_t, uint32_t> key(XMin(label[n], label[index]), XMax(label[n], label[index]));
+          float z = XMax(fill[n], fill[index]);
+          auto iter = spill->find(key);
+          if (iter == spill->end())
+            (*spill)[key] = z;
+          else if (z < iter->second)
+            iter->second = z;
+        }
+        continue;
+      }
+      closed[n] = 1;
+      label[n] = label[index];
+      float z = Z[(size_t)(v + 1) * zw + u + 1];
+      if (z <= fill[index]) {
+        fill[n] = fill[index];
+        pit.push(n);
+      } else {
+        fill[n] = z;
+        open.push(HydroNode(z, n));
+      }
+    }
   }
+  if (nbLabel != NULL)
+    *nbLabel = nb;
+}
 
-  for (uint32_t i = 0; i < m_nH; i++)
-    for (uint32_t j = 0; j < m_nW; j++) {
-      thal[i*m_nW + j] = 0;
-      water[i*m_nW + j] = 1;
-      volume[i*m_nW + j] = 0;
+//-----------------------------------------------------------------------------
+// Comblement des cuvettes
+// Chaque noeud est remonte au niveau minimal qui lui donne un chemin non montant vers le
+// bord du MNT ou vers une zone sans donnees. Le MNT comble est ecrit dans le fichier
+// temporaire "fill", son bord dans Tile::Fill
+//-----------------------------------------------------------------------------
+bool XHydroChain::FillDepressions()
+{
+  // Etiquettes et debordements de chaque dalle
+  bool flag = ForEachTile([&](Tile& T) -> bool {
+    std::vector<float> Z, fill;
+    std::vector<uint32_t> label;
+    std::map<std::pair<uint32_t, uint32_t>, float> spill;
+    if (!ReadZ(T, Z))
+      return false;
+    Flood(T, Z, label, fill, &spill, &T.NbLabel);
+    T.Z.assign(T.NbBorder(), m_NoData);
+    T.Label.assign(T.NbBorder(), 0);
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t b = T.Border(x, y);
+      T.Z[b] = Z[(size_t)(y + 1) * (T.W + 2) + x + 1];
+      T.Label[b] = label[(size_t)y * T.W + x];
+    });
+    T.Spill.clear();
+    for (auto iter = spill.begin(); iter != spill.end(); iter++) {
+      Edge e = { iter->first.first, iter->first.second, iter->second };
+      T.Spill.push_back(e);
     }
+    return true;
+  });
+  if (!flag)
+    return false;
 
-  ReadAll(mnt);
+  // Graphe des debordements : dans les dalles, puis entre noeuds voisins de deux dalles
+  uint32_t nbLabel = 1;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    m_Tile[t].FirstLabel = nbLabel;
+    nbLabel += m_Tile[t].NbLabel - 1;
+  }
+  std::vector<Edge> edge;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    Tile& T = m_Tile[t];
+    for (size_t i = 0; i < T.Spill.size(); i++) {
+      Edge e = { Global(T, T.Spill[i].A), Global(T, T.Spill[i].B), T.Spill[i].Z };
+      if (e.A != e.B)
+        edge.push_back(e);
+    }
+    std::vector<Edge>().swap(T.Spill);
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t b = T.Border(x, y);
+      if (T.Label[b] == 0)
+        return;
+      for (int k = 0; k < 8; k++) {
+        int64_t u = (int64_t)T.X0 + x + HydroDx[k], v = (int64_t)T.Y0 + y + HydroDy[k];
+        if ((u < 0) || (v < 0) || (u >= m_nW) || (v >= m_nH))
+          continue;
+        Tile& N = TileOf((uint32_t)u, (uint32_t)v);
+        if (&N <= &T)   // Chaque paire de noeuds une seule fois
+          continue;
+        uint32_t n = N.Border((uint32_t)u - N.X0, (uint32_t)v - N.Y0);
+        if (N.Label[n] == 0)
+          continue;
+        Edge e = { Global(T, T.Label[b]), Global(N, N.Label[n]), XMax(T.Z[b], N.Z[n]) };
+        if (e.A != e.B)
+          edge.push_back(e);
+      }
+    });
+  }
+  std::vector<uint32_t> first(nbLabel + 1, 0);
+  for (size_t i = 0; i < edge.size(); i++) {
+    first[edge[i].A + 1]++;
+    first[edge[i].B + 1]++;
+  }
+  for (uint32_t i = 0; i < nbLabel; i++)
+    first[i + 1] += first[i];
+  std::vector<std::pair<uint32_t, float> > adj(first[nbLabel]);
+  std::vector<uint32_t> pos(first.begin(), first.end() - 1);
+  for (size_t i = 0; i < edge.size(); i++) {
+    adj[pos[edge[i].A]++] = std::pair<uint32_t, float>(edge[i].B, edge[i].Z);
+    adj[pos[edge[i].B]++] = std::pair<uint32_t, float>(edge[i].A, edge[i].Z);
+  }
+  std::vector<Edge>().swap(edge);
+
+  // Resolution du graphe par Priority-Flood a partir des exutoires
+  typedef std::pair<float, uint32_t> HydroNode;
+  std::priority_queue<HydroNode, std::vector<HydroNode>, std::greater<HydroNode> > open;
+  m_Level.assign(nbLabel, FLT_MAX);
+  m_Level[0] = -FLT_MAX;
+  open.push(HydroNode(-FLT_MAX, 0));
+  while (open.size() > 0) {
+    HydroNode node = open.top();
+    open.pop();
+    if (node.first > m_Level[node.second])
+      continue;
+    for (uint32_t i = first[node.second]; i < first[node.second + 1]; i++) {
+      float z = XMax(node.first, adj[i].second);
+      if (z < m_Level[adj[i].first]) {
+        m_Level[adj[i].first] = z;
+        open.push(HydroNode(z, adj[i].first));
+      }
+    }
+  }
+  for (size_t i = 0; i < m_Level.size(); i++)
+    if (m_Level[i] == FLT_MAX)  // Etiquette isolee : le comblement dans la dalle suffit
+      m_Level[i] = -FLT_MAX;
+  std::vector<std::pair<uint32_t, float> >().swap(adj);
+
+  // Bords des dalles comblees, utilises comme voisinage des dalles
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    Tile& T = m_Tile[t];
+    T.Fill.assign(T.NbBorder(), m_NoData);
+    for (uint32_t b = 0; b < T.NbBorder(); b++)
+      if (T.Label[b] != 0)
+        T.Fill[b] = XMax(T.Z[b], m_Level[Global(T, T.Label[b])]);
+  }
 
-  int iter = 0;
-  while(true) {
-    iter++;
-    for (uint32_t i = 1; i < m_nH - 1; i++) {
-      for (uint32_t j = 1; j < m_nW - 1; j++) {
+  // Comblement de chaque dalle et plats touchant son bord
+  if (!CreateTmp("fill"))
+    return false;
+  flag = ForEachTile([&](Tile& T) -> bool {
+    std::vector<float> Z, fill;
+    std::vector<uint32_t> label;
+    if (!ReadZ(T, Z))
+      return false;
+    Flood(T, Z, label, fill, NULL, NULL);
+    for (size_t i = 0; i < fill.size(); i++)
+      if (label[i] != 0)
+        fill[i] = XMax(fill[i], m_Level[Global(T, label[i])]);
+    if (!WriteTile("fill", T, fill.data(), sizeof(float)))
+      return false;
 
-        if (water[(i - 1) * m_nW + j - 1] > 0) {  // Z11
-          if (mnt[(i - 1) * m_nW + j - 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i - 1) * m_nW + j - 1];
+    uint32_t zw = T.W + 2;
+    Halo(T, &Tile::Fill, m_NoData, Z);
+    for (uint32_t i = 0; i < T.H; i++)
+      ::memcpy(&Z[(size_t)(i + 1) * zw + 1], &fill[(size_t)i * T.W], T.W * sizeof(float));
+    std::vector<int32_t> flat(fill.size(), -1);
+    std::vector<uint32_t> stack;
+    T.Drained.clear();
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t index = y * T.W + x;
+      if ((fill[index] <= m_NoData) || (flat[index] >= 0))
+        return;
+      int32_t num = (int32_t)T.Drained.size();
+      uint8_t drained = 0;
+      flat[index] = num;
+      stack.push_back(index);
+      while (stack.size() > 0) {
+        uint32_t c = stack.back();
+        stack.pop_back();
+        uint32_t cx = c % T.W, cy = c / T.W;
+        for (int k = 0; k < 8; k++) {
+          float z = Z[(size_t)(cy + 1 + HydroDy[k]) * zw + cx + 1 + HydroDx[k]];
+          if ((z <= m_NoData) || (z < fill[c]))
+            drained = 1;
+          int u = (int)cx + HydroDx[k], v = (int)cy + HydroDy[k];
+          if ((u < 0) || (v < 0) || (u >= (int)T.W) || (v >= (int)T.H))
+            continue;
+          uint32_t n = (uint32_t)v * T.W + u;
+          if ((flat[n] < 0) && (fill[n] == fill[c])) {
+            flat[n] = num;
+            stack.push_back(n);
           }
         }
-        if (water[(i - 1) * m_nW + j] > 0) {  // Z12
-          if (mnt[(i - 1) * m_nW + j] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i - 1) * m_nW + j];
-          }
-        }
-        if (water[(i - 1) * m_nW + j + 1] > 0) {  // Z13
-          if (mnt[(i - 1) * m_nW + j + 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i - 1) * m_nW + j + 1];
-          }
+      }
+      T.Drained.push_back(drained);
+    });
+    T.Flat.assign(T.NbBorder(), -1);
+    T.ForBorder([&](uint32_t x, uint32_t y) { T.Flat[T.Border(x, y)] = flat[(size_t)y * T.W + x]; });
+    return true;
+  });
+  if (!flag)
+    return false;
+  std::vector<float>().swap(m_Level);
+
+  // Plats sans noeud draine dans leur dalle : parcours en largeur a partir des plats draines,
+  // un plat sort par ses noeuds voisins d'un plat de meme altitude atteint avant lui
+  struct FlatEdge { uint32_t To, Tile, Exit; };
+  std::vector<uint32_t> base(m_Tile.size() + 1, 0);
+  for (size_t t = 0; t < m_Tile.size(); t++)
+    base[t + 1] = base[t] + (uint32_t)m_Tile[t].Drained.size();
+  uint32_t nbFlat = base.back();
+  auto forEdge = [&](const std::function<void(uint32_t, const FlatEdge&)>& f) {
+    for (size_t t = 0; t < m_Tile.size(); t++) {
+      Tile& T = m_Tile[t];
+      T.ForBorder([&](uint32_t x, uint32_t y) {
+        uint32_t b = T.Border(x, y);
+        if ((T.Flat[b] < 0) || (T.Drained[T.Flat[b]]))
+          return;
+        for (int k = 0; k < 8; k++) {
+          int64_t u = (int64_t)T.X0 + x + HydroDx[k], v = (int64_t)T.Y0 + y + HydroDy[k];
+          if ((u < 0) || (v < 0) || (u >= m_nW) || (v >= m_nH))
+            continue;
+          Tile& N = TileOf((uint32_t)u, (uint32_t)v);
+          if (&N == &T)
+            continue;
+          uint32_t n = N.Border((uint32_t)u - N.X0, (uint32_t)v - N.Y0);
+          if ((N.Flat[n] < 0) || (N.Fill[n] != T.Fill[b]))
+            continue;
+          FlatEdge e = { base[t] + T.Flat[b], (uint32_t)t, (y * T.W + x) * 8 + k };
+          f(base[&N - m_Tile.data()] + N.Flat[n], e);
         }
+      });
+    }
+  };
+  std::vector<uint32_t> efirst(nbFlat + 1, 0);
+  forEdge([&](uint32_t from, const FlatEdge&) { efirst[from + 1]++; });
+  for (uint32_t i = 0; i < nbFlat; i++)
+    efirst[i + 1] += efirst[i];
+  std::vector<FlatEdge> fedge(efirst[nbFlat]);
+  std::vector<uint32_t> epos(efirst.begin(), efirst.end() - 1);
+  forEdge([&](uint32_t from, const FlatEdge& e) { fedge[epos[from]++] = e; });
+
+  std::vector<uint32_t> depth(nbFlat, 0xFFFFFFFF);
+  std::queue<uint32_t> Q;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    for (uint32_t i = 0; i < m_Tile[t].Drained.size(); i++) {
+      if (m_Tile[t].Drained[i]) {
+        depth[base[t] + i] = 0;
+        Q.push(base[t] + i);
+      }
+    }
+  }
+  while (Q.size() > 0) {
+    uint32_t from = Q.front();
+    Q.pop();
+    for (uint32_t i = efirst[from]; i < efirst[from + 1]; i++) {
+      if (depth[fedge[i].To] == 0xFFFFFFFF) {
+        depth[fedge[i].To] = depth[from] + 1;
+        Q.push(fedge[i].To);
+      }
+    }
+  }
+  for (size_t t = 0; t < m_Tile.size(); t++)
+    m_Tile[t].Exit.clear();
+  for (uint32_t from = 0; from < nbFlat; from++)
+    for (uint32_t i = efirst[from]; i < efirst[from + 1]; i++)
+      if (depth[from] < depth[fedge[i].To])
+        m_Tile[fedge[i].Tile].Exit.push_back(fedge[i].Exit);
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    Tile& T = m_Tile[t];
+    std::vector<float>().swap(T.Z);
+    std::vector<uint32_t>().swap(T.Label);
+    std::vector<int32_t>().swap(T.Flat);
+    std::vector<uint8_t>().swap(T.Drained);
+  }
+  return true;
+}
 
-        if (water[i * m_nW + j - 1] > 0) {  // Z21
-          if (mnt[i * m_nW + j - 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[i * m_nW + j - 1];
-          }
-        }
-        if (water[i * m_nW + j + 1] > 0) {  // Z23
-          if (mnt[i * m_nW + j + 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[i * m_nW + j + 1];
-          }
-        }
+//-----------------------------------------------------------------------------
+// Directions d'ecoulement sur le MNT comble
+// D8 : D = voisin de plus grande pente (0 a 7)
+// D-infini (Tarboton 1997) : l'ecoulement se partage entre les voisins D et D+1, P etant
+// la part du voisin D+1 ; les directions D8 sont aussi calculees pour les thalwegs
+// D = 8 : exutoire (pas de voisin plus bas), D = 255 : pas de donnees
+// Les noeuds des plats s'ecoulent vers le voisin de meme altitude par lequel un parcours
+// en largeur, parti des noeuds draines et des sorties de plats, les a atteints
+//-----------------------------------------------------------------------------
+bool XHydroChain::FlowDirection()
+{
+  const double gsd = m_Dtm->m_dGSD, quarter = XPI / 4.;
+  double dist[8];
+  for (int k = 0; k < 8; k++)
+    dist[k] = ((k % 2) == 0) ? gsd : gsd * sqrt(2.);
+  if (!CreateTmp("dir"))
+    return false;
+  if (m_bDinf) {
+    if ((!CreateTmp("prop")) || (!CreateTmp("d8")))
+      return false;
+  }
 
-        if (water[(i + 1) * m_nW + j - 1] > 0) {  // Z31
-          if (mnt[(i + 1) * m_nW + j - 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i + 1) * m_nW + j - 1];
-          }
+  bool flag = ForEachTile([&](Tile& T) -> bool {
+    size_t nbNode = (size_t)T.W * T.H;
+    uint32_t zw = T.W + 2;
+    std::vector<float> fill(nbNode), Z, P;
+    if (!ReadTile("fill", T, fill.data(), sizeof(float)))
+      return false;
+    Halo(T, &Tile::Fill, m_NoData, Z);
+    for (uint32_t i = 0; i < T.H; i++)
+      ::memcpy(&Z[(size_t)(i + 1) * zw + 1], &fill[(size_t)i * T.W], T.W * sizeof(float));
+    std::vector<uint8_t> D8(nbNode, 255), D, flat(nbNode, 0);
+    if (m_bDinf) {
+      D.assign(nbNode, 255);
+      P.assign(nbNode, 0.f);
+    }
+    std::queue<uint32_t> Q;
+
+    float zn[8];
+    for (uint32_t i = 0; i < T.H; i++) {
+      for (uint32_t j = 0; j < T.W; j++) {
+        uint32_t index = i * T.W + j;
+        double z = fill[index];
+        if (z <= m_NoData)
+          continue;
+        bool outlet = false;
+        for (int k = 0; k < 8; k++) {
+          zn[k] = Z[(size_t)(i + 1 + HydroDy[k]) * zw + j + 1 + HydroDx[k]];
+          if (zn[k] <= m_NoData)
+            outlet = true;
         }
-        if (water[(i + 1) * m_nW + j] > 0) {  // Z32
-          if (mnt[(i + 1) * m_nW + j] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i + 1) * m_nW + j];
+        uint8_t best = 8;
+        double smax = 0.;
+        for (int k = 0; k < 8; k++) {
+          if (zn[k] <= m_NoData)
+            continue;
+          double s = (z - zn[k]) / dist[k];
+          if (s > smax) {
+            smax = s;
+            best = (uint8_t)k;
           }
         }
-        if (water[(i + 1) * m_nW + j + 1] > 0) {  // Z33
-          if (mnt[(i + 1) * m_nW + j + 1] > mnt[i * m_nW + j]) {
-            volume[i * m_nW + j] += water[(i + 1) * m_nW + j + 1];
+        D8[index] = best;
+        if ((best == 8) && (!outlet)) {
+          flat[index] = 1;
+          if (m_bDinf)
+            D[index] = 8;
+          continue;
+        }
+        Q.push(index);
+        if (!m_bDinf)
+          continue;
+        best = 8;
+        smax = 0.;
+        double prop = 0.;
+        for (int k = 0; k < 8; k++) { // Facette entre les voisins k et k+1
+          int c = ((k % 2) == 0) ? k : (k + 1) % 8, d = ((k % 2) == 0) ? k + 1 : k;  // Cardinal, diagonal
+          if ((zn[c] <= m_NoData) || (zn[d] <= m_NoData))
+            continue;
+          double s1 = (z - zn[c]) / gsd, s2 = (zn[c] - zn[d]) / gsd, s;
+          double r = atan2(s2, s1);
+          if (r < 0.) {
+            r = 0.;
+            s = s1;
+          } else if (r > quarter) {
+            r = quarter;
+            s = (z - zn[d]) / dist[d];
+          } else
+            s = sqrt(s1 * s1 + s2 * s2);
+          if (s > smax) {
+            smax = s;
+            best = (uint8_t)k;
+            prop = ((k % 2) == 0) ? r / quarter : 1. - r / quarter;
           }
         }
-
-        thal[i * m_nW + j] = XMin((int)thal[i * m_nW + j] + (int)volume[i * m_nW + j], 65535);
-
-      } // endfor j
-    } // endfor i
-
-    bool no_water = true;
-    for (uint32_t i = 0; i < m_nH; i++){
-      for (uint32_t j = 0; j < m_nW; j++){
-        if (volume[i*m_nW + j] > 0) {
-          water[i*m_nW + j] = 1;
-          no_water = false;
-        } else
-          water[i*m_nW + j] = 0;
-        volume[i*m_nW + j] = 0;
+        D[index] = best;
+        P[index] = (float)prop;
       }
     }
-    if (no_water)
-      break;
-  } // endwhile
-
 
-  out.write((char*)thal, m_nW * m_nH * sizeof(uint16_t));
-  out.close();
-  delete[] mnt;
-  delete[] thal;
-  delete[] water;
+    // Plats : sorties vers les dalles voisines, puis parcours en largeur
+    for (size_t f = 0; f < T.Exit.size(); f++) {
+      uint32_t index = T.Exit[f] / 8;
+      if (flat[index] == 0)
+        continue;
+      uint8_t k = (uint8_t)(T.Exit[f] % 8);
+      flat[index] = 0;
+      D8[index] = k;
+      if (m_bDinf)
+        D[index] = k;
+      Q.push(index);
+    }
+    while (Q.size() > 0) {
+      uint32_t index = Q.front();
+      Q.pop();
+      uint32_t x = index % T.W, y = index / T.W;
+      for (int k = 0; k < 8; k++) {
+        int u = (int)x + HydroDx[k], v = (int)y + HydroDy[k];
+        if ((u < 0) || (v < 0) || (u >= (int)T.W) || (v >= (int)T.H))
+          continue;
+        uint32_t n = (uint32_t)v * T.W + u;
+        if ((flat[n] == 0) || (fill[n] != fill[index]))
+          continue;
+        flat[n] = 0;
+        D8[n] = (uint8_t)((k + 4) % 8);
+        if (m_bDinf)
+          D[n] = D8[n];
+        Q.push(n);
+      }
+    }
 
+    if (!m_bDinf)
+      D.swap(D8);
+    if (!WriteTile("dir", T, D.data(), sizeof(uint8_t)))
+      return false;
+    if (m_bDinf) {
+      if (!WriteTile("prop", T, P.data(), sizeof(float)))
+        return false;
+      if (!WriteTile("d8", T, D8.data(), sizeof(uint8_t)))
+        return false;
+    }
+    T.D.assign(T.NbBorder(), 255);
+    T.P.assign(T.NbBorder(), 0.f);
+    T.D8.assign(T.NbBorder(), 255);
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t b = T.Border(x, y);
+      size_t index = (size_t)y * T.W + x;
+      T.D[b] = D[index];
+      if (m_bDinf) {
+        T.P[b] = P[index];
+        T.D8[b] = D8[index];
+      }
+    });
+    return true;
+  });
+  if (!flag)
+    return false;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    std::vector<float>().swap(m_Tile[t].Fill);
+    std::vector<uint32_t>().swap(m_Tile[t].Exit);
+    if (!m_bDinf) {
+      std::vector<float>().swap(m_Tile[t].P);
+      std::vector<uint8_t>().swap(m_Tile[t].D8);
+    }
+  }
   return true;
 }
 
-/*
 //-----------------------------------------------------------------------------
-// Recherche des thalwegs
+// Noeuds aval d'un noeud de la dalle (index dans la dalle, -1 hors de la dalle) et part
+// de l'ecoulement qui leur revient
 //-----------------------------------------------------------------------------
-bool XGeoFDtm::FindThalweg(std::string filename)
+int XHydroChain::Receiver(const Tile& T, uint32_t index, uint8_t d, float p, int64_t* R, float* W)
 {
-  if (!m_bValid)
-    return false;
-
-  XPath P;
-  std::string xmlfile = P.PathName(filename.c_str()) + ".xml";
-  std::string tifffile = P.PathName(filename.c_str()) + ".tif";
-
-  // Ouverture du fichier de sortie
-  XTiffWriter tiff;
-  if (!tiff.Write(tifffile.c_str(), m_nW, m_nH, 1, 8))
-    return false;
-  std::ofstream out;
-  out.open(tifffile.c_str(), std::ios_base::out| std::ios_base::binary| std::ios_base::app);
-  if (!out.good())
-    return false;
-  out.seekp(0, std::ios_base::end);
-  uint32_t offset = out.tellp();
+  if (d > 7)
+    return 0;
+  int nb = 0;
+  int x = (int)(index % T.W), y = (int)(index / T.W);
+  for (int i = 0; i < 2; i++) {
+    float w = (i == 0) ? 1.f - p : p;
+    if (w <= 0.f)
+      continue;
+    int k = (d + i) % 8, u = x + HydroDx[k], v = y + HydroDy[k];
+    if ((u < 0) || (v < 0) || (u >= (int)T.W) || (v >= (int)T.H))
+      R[nb] = -1;
+    else
+      R[nb] = (int64_t)v * T.W + u;
+    W[nb++] = w;
+  }
+  return nb;
+}
 
-  // Ecriture des donnees
-  std::ifstream* in = m_In.IStream();
-  if (in == NULL)
-    return false;
-  in->seekg(m_nOffset, std::ios::beg);
-  float* mnt = new float[m_nW*m_nH];
-  if (mnt == NULL)
-    return false;
-  uint8_t* thal = new uint8_t[m_nW*m_nH];
-  if (thal == NULL) {
-    delete[] mnt;
-    return false;
+//-----------------------------------------------------------------------------
+// Ordre topologique des noeuds d'une dalle : un noeud vient apres tous ses noeuds amont
+//-----------------------------------------------------------------------------
+void XHydroChain::TopoOrder(const Tile& T, const std::vector<uint8_t>& D, const std::vector<float>& P, std::vector<uint32_t>& order)
+{
+  size_t nbNode = (size_t)T.W * T.H;
+  std::vector<uint8_t> nbUp(nbNode, 0);
+  int64_t R[2];
+  float W[2];
+  for (uint32_t i = 0; i < nbNode; i++) {
+    int nb = Receiver(T, i, D[i], m_bDinf ? P[i] : 0.f, R, W);
+    for (int k = 0; k < nb; k++)
+      if (R[k] >= 0)
+        nbUp[R[k]]++;
   }
-  bool* flag = new bool[m_nW*m_nH];
-  if (flag == NULL) {
-    delete[] mnt;
-    delete[] thal;
-    return false;
+  order.clear();
+  std::vector<uint32_t> stack;
+  for (uint32_t i = 0; i < nbNode; i++)
+    if ((D[i] != 255) && (nbUp[i] == 0))
+      stack.push_back(i);
+  while (stack.size() > 0) {
+    uint32_t index = stack.back();
+    stack.pop_back();
+    order.push_back(index);
+    int nb = Receiver(T, index, D[index], m_bDinf ? P[index] : 0.f, R, W);
+    for (int k = 0; k < nb; k++)
+      if ((R[k] >= 0) && (--nbUp[R[k]] == 0))
+        stack.push_back((uint32_t)R[k]);
   }
+}
 
-  for (uint32_t i = 0; i < m_nH; i++) {
-    for (uint32_t j = 0; j < m_nW; j++) {
-      thal[i*m_nW + j] = 0;
-      flag[i*m_nW + j] = false;
+//-----------------------------------------------------------------------------
+// Accumulation des ecoulements, en nombre de noeuds draines
+// L'accumulation est ecrite dans tifffile (flottants 32 bits, dalles de Tile x Tile noeuds)
+// et dans le fichier temporaire "acc", son bord dans Tile::A
+//-----------------------------------------------------------------------------
+bool XHydroChain::FlowAccumulation(std::string tifffile)
+{
+  // Accumulation dans chaque dalle seule, transferts des noeuds d'entree vers les noeuds de sortie
+  bool flag = ForEachTile([&](Tile& T) -> bool {
+    size_t nbNode = (size_t)T.W * T.H;
+    std::vector<uint8_t> D(nbNode), HD;
+    std::vector<float> P, HP;
+    if (!ReadTile("dir", T, D.data(), sizeof(uint8_t)))
+      return false;
+    if (m_bDinf) {
+      P.resize(nbNode);
+      if (!ReadTile("prop", T, P.data(), sizeof(float)))
+        return false;
+    }
+    std::vector<uint32_t> order, rank(nbNode, 0);
+    TopoOrder(T, D, P, order);
+    for (uint32_t i = 0; i < order.size(); i++)
+      rank[order[i]] = i;
+    int64_t R[2];
+    float W[2];
+    std::vector<double> A(nbNode, 0.);
+    for (uint32_t i = 0; i < order.size(); i++) {
+      uint32_t index = order[i];
+      A[index] += 1.;
+      int nb = Receiver(T, index, D[index], m_bDinf ? P[index] : 0.f, R, W);
+      for (int k = 0; k < nb; k++)
+        if (R[k] >= 0)
+          A[R[k]] += A[index] * W[k];
     }
-  }
-
-
-  in->read((char*)mnt, m_nW * m_nH * sizeof(float));
-
-  int u = (int)m_nW / 2, v = (int)m_nH / 2, sum, new_u, new_v;
-  uint32_t nb_node = 0;
-  float z11, z12, z13, z21, z22, z23, z31, z32, z33;
-  float dz11, dz12, dz13, dz21, dz23, dz31, dz32, dz33;
-  while(true) {
-    nb_node ++;
-    if (nb_node > m_nW * m_nH)
-      break;
-    flag[v * m_nW + u] = true;
-
-    if ((u == 0)||(v == 0))
-      z11 = m_dZmax;
-    else
-      z11 = mnt[(v-1)*m_nW + u - 1];
-
-    if (v == 0)
-      z12 = m_dZmax;
-    else
-      z12 = mnt[(v-1)*m_nW + u];
-
-    if ((u >= (m_nW - 1))||(v == 0))
-      z13 = m_dZmax;
-    else
-      z13 = mnt[(v-1)*m_nW + u + 1];
-
-    if (u == 0)
-      z21 = m_dZmax;
-    else
-      z21 = mnt[v*m_nW + u - 1];
-
-    z22 = mnt[v*m_nW + u];
-
-    if (u >= (m_nW - 1))
-      z23 = m_dZmax;
-    else
-      z23 = mnt[v*m_nW + u + 1];
-
-    if ((u == 0)||(v >= (m_nH - 1)))
-      z31 = m_dZmax;
-    else
-      z31 = mnt[(v+1)*m_nW + u - 1];
-
-    if (v >= (m_nH - 1))
-      z32 = m_dZmax;
-    else
-      z32 = mnt[(v+1)*m_nW + u];
 
-    if ((u >= (m_nW - 1))||(v >= (m_nH - 1)))
-      z33 = m_dZmax;
-    else
-      z33 = mnt[(v+1)*m_nW + u + 1];
+    T.Flow.assign(T.NbBorder(), 0);
+    T.Local.assign(T.NbBorder(), 0.);
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t index = y * T.W + x;
+      int nb = Receiver(T, index, D[index], m_bDinf ? P[index] : 0.f, R, W);
+      for (int k = 0; k < nb; k++) {
+        if (R[k] < 0) {
+          T.Flow[T.Border(x, y)] |= 2;
+          T.Local[T.Border(x, y)] = A[index];
+        }
+      }
+    });
+    Halo(T, &Tile::D, (uint8_t)255, HD);
+    if (m_bDinf)
+      Halo(T, &Tile::P, 0.f, HP);
+    T.ForRing([&](uint32_t j, uint32_t i) {
+      size_t index = (size_t)i * (T.W + 2) + j;
+      if (HD[index] > 7)
+        return;
+      for (int k = 0; k < 2; k++) {
+        float w = m_bDinf ? ((k == 0) ? 1.f - HP[index] : HP[index]) : ((k == 0) ? 1.f : 0.f);
+        if (w <= 0.f)
+          continue;
+        int d = (HD[index] + k) % 8, u = (int)j + HydroDx[d] - 1, v = (int)i + HydroDy[d] - 1;
+        if ((u >= 0) && (v >= 0) && (u < (int)T.W) && (v < (int)T.H))
+          T.Flow[T.Border(u, v)] |= 1;
+      }
+    });
+
+    // D8 : tout ce qui entre par un noeud sort par le dernier noeud de son chemin dans la dalle
+    T.Transfer.clear();
+    if (!m_bDinf) {
+      std::vector<uint32_t> last(nbNode, 0xFFFFFFFF);
+      for (size_t i = order.size(); i > 0; i--) {
+        uint32_t index = order[i - 1];
+        if (Receiver(T, index, D[index], 0.f, R, W) > 0)
+          last[index] = (R[0] < 0) ? index : last[R[0]];
+      }
+      T.ForBorder([&](uint32_t x, uint32_t y) {
+        uint32_t b = T.Border(x, y), q = y * T.W + x;
+        if (((T.Flow[b] & 1) == 0) || (last[q] == 0xFFFFFFFF))
+          return;
+        Link link = { b, T.Border(last[q] % T.W, last[q] / T.W), 1. };
+        T.Transfer.push_back(link);
+      });
+      return true;
+    }
 
-    dz11 = z22 - z11;
-    dz12 = z22 - z12;
-    dz13 = z22 - z13;
-    dz21 = z22 - z21;
-    dz23 = z22 - z23;
-    dz31 = z22 - z31;
-    dz32 = z22 - z32;
-    dz33 = z22 - z33;
-    new_u = 0;
-    new_v = 0;
+    // D-infini : transfert d'une unite entrant par chaque noeud d'entree, dans l'ordre topologique
+    typedef std::pair<uint32_t, uint32_t> HydroNode;  // Rang, noeud
+    std::priority_queue<HydroNode, std::vector<HydroNode>, std::greater<HydroNode> > open;
+    std::vector<double> amount(nbNode, 0.);
+    std::vector<uint8_t> queued(nbNode, 0);
+    std::vector<uint32_t> touched;
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t b = T.Border(x, y), q = y * T.W + x;
+      if ((T.Flow[b] & 1) == 0)
+        return;
+      amount[q] = 1.;
+      queued[q] = 1;
+      touched.push_back(q);
+      open.push(HydroNode(rank[q], q));
+      while (open.size() > 0) {
+        uint32_t index = open.top().second;
+        open.pop();
+        bool out = false;
+        int nb = Receiver(T, index, D[index], m_bDinf ? P[index] : 0.f, R, W);
+        for (int k = 0; k < nb; k++) {
+          if (R[k] < 0) {
+            out = true;
+            continue;
+          }
+          if (!queued[R[k]]) {
+            queued[R[k]] = 1;
+            touched.push_back((uint32_t)R[k]);
+            open.push(HydroNode(rank[R[k]], (uint32_t)R[k]));
+          }
+          amount[R[k]] += amount[index] * W[k];
+        }
+        if (out) {
+          Link link = { b, T.Border(index % T.W, index / T.W), amount[index] };
+          T.Transfer.push_back(link);
+        }
+      }
+      for (size_t i = 0; i < touched.size(); i++) {
+        amount[touched[i]] = 0.;
+        queued[touched[i]] = 0;
+      }
+      touched.clear();
+    });
+    return true;
+  });
+  if (!flag)
+    return false;
 
-    // Z11
-    if ((dz11 >= dz12) && (dz11 >= dz13) && (dz11 >= dz21) && (dz11 >= dz23) &&
-        (dz11 >= dz31) && (dz11 >= dz32) && (dz11 >= dz33) && (dz11 >= 0.)) {
-      new_u = -1;
-      new_v = -1;
+  // Graphe des bords : un noeud d'entree recoit des noeuds de sortie voisins, un noeud de
+  // sortie recoit son accumulation locale et les transferts des noeuds d'entree de sa dalle
+  std::vector<uint32_t> base(m_Tile.size() + 1, 0);
+  for (size_t t = 0; t < m_Tile.size(); t++)
+    base[t + 1] = base[t] + m_Tile[t].NbBorder();
+  uint32_t nbBorder = base.back();
+  std::vector<uint32_t> lfirst(nbBorder + 1, 0), degIn(nbBorder, 0), degOut(nbBorder, 0);
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    for (size_t i = 0; i < m_Tile[t].Transfer.size(); i++) {
+      lfirst[base[t] + m_Tile[t].Transfer[i].From + 1]++;
+      degOut[base[t] + m_Tile[t].Transfer[i].To]++;
     }
-
-    // Z12
-    if ((dz12 >= dz11) && (dz12 >= dz13) && (dz12 >= dz21) && (dz12 >= dz23) &&
-        (dz12 >= dz31) && (dz12 >= dz32) && (dz12 >= dz33) && (dz12 >= 0.)) {
-      new_u = 0;
-      new_v = -1;
+  }
+  for (uint32_t i = 0; i < nbBorder; i++)
+    lfirst[i + 1] += lfirst[i];
+  std::vector<std::pair<uint32_t, double> > link(lfirst[nbBorder]);
+  std::vector<uint32_t> lpos(lfirst.begin(), lfirst.end() - 1);
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    for (size_t i = 0; i < m_Tile[t].Transfer.size(); i++) {
+      const Link& l = m_Tile[t].Transfer[i];
+      link[lpos[base[t] + l.From]++] = std::pair<uint32_t, double>(base[t] + l.To, l.W);
     }
+    std::vector<Link>().swap(m_Tile[t].Transfer);
+  }
 
-    // Z13
-    if ((dz13 >= dz11) && (dz13 >= dz12) && (dz13 >= dz21) && (dz13 >= dz23) &&
-        (dz13 >= dz31) && (dz13 >= dz32) && (dz13 >= dz33) && (dz13 >= 0.)) {
-      new_u = +1;
-      new_v = -1;
+  // Noeuds d'entree voisins d'un noeud de sortie
+  auto forCross = [&](size_t t, uint32_t b, const std::function<void(uint32_t, float)>& f) {
+    const Tile& T = m_Tile[t];
+    uint32_t x, y;
+    T.BorderXY(b, x, y);
+    float p = m_bDinf ? T.P[b] : 0.f;
+    for (int k = 0; k < 2; k++) {
+      float w = (k == 0) ? 1.f - p : p;
+      if ((T.D[b] > 7) || (w <= 0.f))
+        continue;
+      int d = (T.D[b] + k) % 8;
+      int64_t u = (int64_t)T.X0 + x + HydroDx[d], v = (int64_t)T.Y0 + y + HydroDy[d];
+      if ((u < 0) || (v < 0) || (u >= m_nW) || (v >= m_nH))
+        continue;
+      const Tile& N = TileOf((uint32_t)u, (uint32_t)v);
+      if (&N == &T)
+        continue;
+      f(base[&N - m_Tile.data()] + N.Border((uint32_t)u - N.X0, (uint32_t)v - N.Y0), w);
     }
-
-    // Z21
-    if ((dz21 >= dz11) && (dz21 >= dz12) && (dz21 >= dz13) && (dz21 >= dz23) &&
-        (dz21 >= dz31) && (dz21 >= dz32) && (dz21 >= dz33) && (dz21 >= 0.)) {
-      new_u = -1;
-      new_v = 0;
+  };
+  std::vector<double> in(nbBorder, 0.), out(nbBorder, 0.);
+  std::vector<uint32_t> stack;   // Noeud * 2 (entree) ou noeud * 2 + 1 (sortie)
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    const Tile& T = m_Tile[t];
+    for (uint32_t b = 0; b < T.NbBorder(); b++) {
+      if ((T.Flow[b] & 2) == 0)
+        continue;
+      out[base[t] + b] = T.Local[b];
+      forCross(t, b, [&](uint32_t q, float) { degIn[q]++; });
     }
-
-    // Z23
-    if ((dz23 >= dz11) && (dz23 >= dz12) && (dz23 >= dz13) && (dz23 >= dz21) &&
-        (dz23 >= dz31) && (dz23 >= dz32) && (dz23 >= dz33) && (dz23 >= 0.)) {
-      new_u = +1;
-      new_v = 0;
+  }
+  for (size_t t = 0; t < m_Tile.size(); t++)
+    for (uint32_t b = 0; b < m_Tile[t].NbBorder(); b++)
+      if (((m_Tile[t].Flow[b] & 2) != 0) && (degOut[base[t] + b] == 0))
+        stack.push_back((base[t] + b) * 2 + 1);
+  while (stack.size() > 0) {
+    uint32_t node = stack.back() / 2;
+    bool exit = ((stack.back() % 2) == 1);
+    stack.pop_back();
+    if (exit) {
+      size_t t = std::upper_bound(base.begin(), base.end(), node) - base.begin() - 1;
+      forCross(t, node - base[t], [&](uint32_t q, float w) {
+        in[q] += out[node] * w;
+        if (--degIn[q] == 0)
+          stack.push_back(q * 2);
+      });
+    } else {
+      for (uint32_t i = lfirst[node]; i < lfirst[node + 1]; i++) {
+        uint32_t x = link[i].first;
+        out[x] += in[node] * link[i].second;
+        if (--degOut[x] == 0)
+          stack.push_back(x * 2 + 1);
+      }
     }
+  }
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    Tile& T = m_Tile[t];
+    T.In.assign(in.begin() + base[t], in.begin() + base[t + 1]);
+    std::vector<double>().swap(T.Local);
+  }
+  std::vector<double>().swap(in);
+  std::vector<double>().swap(out);
 
-    // Z31
-    if ((dz31 >= dz11) && (dz31 >= dz12) && (dz31 >= dz13) && (dz31 >= dz21) &&
-        (dz31 >= dz23) && (dz31 >= dz32) && (dz31 >= dz33) && (dz31 >= 0.)) {
-      new_u = -1;
-      new_v = +1;
+  // Accumulation de chaque dalle avec ses apports
+  XTiffWriter tiff;
+  std::mutex tiffMutex;
+  const double gsd = m_Dtm->m_dGSD;
+  tiff.SetGeoTiff(m_Dtm->m_Frame.Xmin - gsd * 0.5, m_Dtm->m_Frame.Ymax + gsd * 0.5, gsd);
+  if (!tiff.BeginTiled(tifffile.c_str(), m_nW, m_nH, 1, 32, 3, m_nTile, m_nTile, 8, 3))
+    return false;
+  if (!CreateTmp("acc"))
+    return false;
+  flag = ForEachTile([&](Tile& T) -> bool {
+    size_t nbNode = (size_t)T.W * T.H;
+    std::vector<uint8_t> D(nbNode);
+    std::vector<float> P;
+    if (!ReadTile("dir", T, D.data(), sizeof(uint8_t)))
+      return false;
+    if (m_bDinf) {
+      P.resize(nbNode);
+      if (!ReadTile("prop", T, P.data(), sizeof(float)))
+        return false;
     }
-
-    // Z32
-    if ((dz32 >= dz11) && (dz32 >= dz12) && (dz32 >= dz13) && (dz32 >= dz21) &&
-        (dz32 >= dz23) && (dz32 >= dz31) && (dz32 >= dz33) && (dz32 >= 0.)) {
-      new_u = 0;
-      new_v = +1;
+    std::vector<uint32_t> order;
+    TopoOrder(T, D, P, order);
+    std::vector<float> A(nbNode, 0.f);
+    for (size_t i = 0; i < nbNode; i++)
+      if (D[i] != 255)
+        A[i] = 1.f;
+    T.ForBorder([&](uint32_t x, uint32_t y) {
+      uint32_t b = T.Border(x, y);
+      if ((T.Flow[b] & 1) != 0)
+        A[(size_t)y * T.W + x] += (float)T.In[b];
+    });
+    int64_t R[2];
+    float W[2];
+    for (size_t i = 0; i < order.size(); i++) {
+      uint32_t index = order[i];
+      int nb = Receiver(T, index, D[index], m_bDinf ? P[index] : 0.f, R, W);
+      for (int k = 0; k < nb; k++)
+        if (R[k] >= 0)
+          A[R[k]] += A[index] * W[k];
     }
+    if (!WriteTile("acc", T, A.data(), sizeof(float)))
+      return false;
+    T.A.assign(T.NbBorder(), 0.f);
+    T.ForBorder([&](uint32_t x, uint32_t y) { T.A[T.Border(x, y)] = A[(size_t)y * T.W + x]; });
+
+    std::vector<float> tile((size_t)m_nTile * m_nTile, 0.f);
+    for (uint32_t i = 0; i < T.H; i++)
+      ::memcpy(&tile[(size_t)i * m_nTile], &A[(size_t)i * T.W], T.W * sizeof(float));
+    std::vector<uint8_t> data;
+    if (!tiff.EncodeTile((uint8_t*)tile.data(), data))
+      return false;
+    std::lock_guard<std::mutex> lock(tiffMutex);
+    return tiff.WriteEncodedTile((T.Y0 / m_nTile) * m_nTx + T.X0 / m_nTile, data);
+  });
+  if (!tiff.EndTiled())
+    return false;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    std::vector<uint8_t>().swap(m_Tile[t].Flow);
+    std::vector<double>().swap(m_Tile[t].In);
+  }
+  return flag;
+}
 
-    // Z33
-    if ((dz33 >= dz11) && (dz33 >= dz12) && (dz33 >= dz13) && (dz33 >= dz21) &&
-        (dz33 >= dz23) && (dz33 >= dz31) && (dz33 >= dz32) && (dz33 >= 0.)) {
-      new_u = +1;
-      new_v = +1;
+//-----------------------------------------------------------------------------
+// Thalwegs : noeuds drainant au moins threshold noeuds, suivis en D8
+// Troncons d'une source ou d'une confluence jusqu'a la confluence suivante ou l'exutoire,
+// avec la surface drainee a l'aval de chaque troncon. Chaque dalle produit des morceaux de
+// troncons ; un morceau qui sort de la dalle est prolonge par celui qui commence au noeud
+// suivant, dans la dalle voisine
+//-----------------------------------------------------------------------------
+bool XHydroChain::Thalweg(float threshold, std::vector<std::vector<XPt2D> >& thalweg, std::vector<double>& area)
+{
+  struct Piece {
+    uint64_t  Start, Next;            // Premier noeud, noeud suivant hors de la dalle
+    bool      Head;                   // Debut d'un troncon (source ou confluence)
+    float     A;                      // Accumulation au dernier noeud
+    std::vector<uint32_t> Node;       // x, y des noeuds
+  };
+  const uint64_t none = 0xFFFFFFFFFFFFFFFF;
+  std::vector<Piece> piece;
+  std::mutex mutex;
+  std::vector<uint8_t> Tile::* dir = m_bDinf ? &Tile::D8 : &Tile::D;
+  const char* dirName = m_bDinf ? "d8" : "dir";
+
+  bool flag = ForEachTile([&](Tile& T) -> bool {
+    size_t nbNode = (size_t)T.W * T.H;
+    uint32_t zw = T.W + 2, zh = T.H + 2;
+    std::vector<float> A(nbNode), HA;
+    std::vector<uint8_t> D(nbNode), HD;
+    if (!ReadTile("acc", T, A.data(), sizeof(float)))
+      return false;
+    if (!ReadTile(dirName, T, D.data(), sizeof(uint8_t)))
+      return false;
+    Halo(T, &Tile::A, 0.f, HA);
+    Halo(T, dir, (uint8_t)255, HD);
+    for (uint32_t i = 0; i < T.H; i++) {
+      ::memcpy(&HA[(size_t)(i + 1) * zw + 1], &A[(size_t)i * T.W], T.W * sizeof(float));
+      ::memcpy(&HD[(size_t)(i + 1) * zw + 1], &D[(size_t)i * T.W], T.W);
     }
-
-    if ((new_u != 0) && (new_v != 0)) {
-      sum = thal[v*m_nW + u] + thal[(v+new_v)*m_nW + u + new_u] + 1;
-      if (sum < 255)
-        thal[(v+new_v)*m_nW + u + new_u] = sum;
-      else
-        thal[(v+new_v)*m_nW + u + new_u] = 255;
-      if (flag[(v+new_v)*m_nW + u + new_u] == false) {
-        v = v + new_v;
-        u = u + new_u;
-        continue;
+    // Noeud aval dans le reseau, en coordonnees du tampon
+    auto downstream = [&](uint32_t x, uint32_t y, uint32_t& u, uint32_t& v) -> bool {
+      uint8_t k = HD[(size_t)y * zw + x];
+      if (k > 7)
+        return false;
+      int a = (int)x + HydroDx[k], b = (int)y + HydroDy[k];
+      if ((a < 0) || (b < 0) || (a >= (int)zw) || (b >= (int)zh))
+        return false;
+      u = (uint32_t)a;
+      v = (uint32_t)b;
+      return (HA[(size_t)v * zw + u] >= threshold);
+    };
+
+    // Nombre de noeuds amont dans le reseau, amont hors de la dalle
+    std::vector<uint8_t> nbUp(nbNode, 0), outside(nbNode, 0);
+    uint32_t u, v;
+    for (uint32_t i = 0; i < zh; i++) {
+      for (uint32_t j = 0; j < zw; j++) {
+        if ((HA[(size_t)i * zw + j] < threshold) || (!downstream(j, i, u, v)))
+          continue;
+        if ((u < 1) || (v < 1) || (u > T.W) || (v > T.H))
+          continue;
+        size_t n = (size_t)(v - 1) * T.W + u - 1;
+        nbUp[n]++;
+        if ((i < 1) || (j < 1) || (i > T.H) || (j > T.W))
+          outside[n] = 1;
       }
     }
 
-    // Recherche d'un nouveau noeud
-    bool found = false;
-    for (uint32_t i = 1; i < (m_nH - 1); i++) {
-      for (uint32_t j = 1; j < (m_nW - 1); j++) {
-        if (flag[i * m_nW + j] == false) {
-          u = j;
-          v = i;
-          found = true;
-          break;
+    std::vector<Piece> local;
+    for (uint32_t i = 0; i < T.H; i++) {
+      for (uint32_t j = 0; j < T.W; j++) {
+        size_t index = (size_t)i * T.W + j;
+        if (A[index] < threshold)
+          continue;
+        bool head = (nbUp[index] != 1);
+        if ((!head) && (!outside[index]))
+          continue;
+        Piece p;
+        p.Start = (uint64_t)(T.Y0 + i) * m_nW + T.X0 + j;
+        p.Next = none;
+        p.Head = head;
+        p.Node.push_back(T.X0 + j);
+        p.Node.push_back(T.Y0 + i);
+        uint32_t x = j + 1, y = i + 1;
+        while (downstream(x, y, u, v)) {
+          p.Node.push_back(T.X0 + u - 1);
+          p.Node.push_back(T.Y0 + v - 1);
+          x = u;
+          y = v;
+          if ((u < 1) || (v < 1) || (u > T.W) || (v > T.H)) {
+            p.Next = (uint64_t)(T.Y0 + v - 1) * m_nW + T.X0 + u - 1;
+            break;
+          }
+          if (nbUp[(size_t)(v - 1) * T.W + u - 1] != 1)
+            break;
         }
+        p.A = HA[(size_t)y * zw + x];
+        local.push_back(p);
       }
-      if (found)
-        break;
     }
-    if (!found) // Plus de noeuds
-      break;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < local.size(); i++)
+      piece.push_back(std::move(local[i]));
+    return true;
+  });
+  if (!flag)
+    return false;
+
+  // Raccord des morceaux, les troncons dans l'ordre des lignes du MNT
+  std::unordered_map<uint64_t, size_t> next;
+  std::vector<size_t> head;
+  for (size_t i = 0; i < piece.size(); i++) {
+    if (piece[i].Head)
+      head.push_back(i);
     else
+      next[piece[i].Start] = i;
+  }
+  std::sort(head.begin(), head.end(), [&](size_t a, size_t b) { return piece[a].Start < piece[b].Start; });
+  const XFrame& F = m_Dtm->m_Frame;
+  const double gsd = m_Dtm->m_dGSD;
+  for (size_t i = 0; i < head.size(); i++) {
+    std::vector<XPt2D> T;
+    const Piece* p = &piece[head[i]];
+    size_t first = 0;
+    while (true) {
+      for (size_t k = first; k < p->Node.size(); k += 2)
+        T.push_back(XPt2D(F.Xmin + p->Node[k] * gsd, F.Ymax - p->Node[k + 1] * gsd));
+      if (p->Next == none)
+        break;
+      auto iter = next.find(p->Next);
+      if (iter == next.end())
+        break;
+      p = &piece[iter->second];
+      first = 2;
+    }
+    if (T.size() < 2)
       continue;
+    thalweg.push_back(T);
+    area.push_back(p->A * gsd * gsd);
   }
+  return true;
+}
 
-  out.write((char*)thal, m_nW * m_nH * sizeof(uint8_t));
-  out.close();
-  delete[] mnt;
-  delete[] thal;
-  delete[] flag;
-
-  // Ecriture du fichier XML
-  std::string name = P.Name(filename.c_str(), false);
-  std::string oldname = m_strName;
-  std::string oldimage = m_strImageName;
-  m_strName = name;
-  m_strImageName = name + ".tif";
-  uint32_t old_offset = m_nOffset;
-  m_nOffset = offset;
+//-----------------------------------------------------------------------------
+// Recherche des thalwegs
+// Chaine hydrologique par dalles de tile x tile noeuds : comblement des cuvettes,
+// directions d'ecoulement, accumulation (voir XHydroChain)
+// filename.tif : accumulation en nombre de noeuds (flottants 32 bits)
+// filename.shp : thalwegs, noeuds drainant au moins minArea m2 (0 : 1000 noeuds), decoupes
+// aux confluences, avec la surface drainee a l'aval de chaque troncon.
+// dinf : accumulation en D-infini, les thalwegs suivent toujours la direction D8
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::FindThalweg(std::string filename, double minArea, bool dinf, int nbThread, uint32_t tile)
+{
+  if (!m_bValid)
+    return false;
 
-  std::ofstream xml;
-  xml.open(xmlfile.c_str());
-  if (xml.good())
-    XmlWrite(&xml);
+  XPath P;
+  std::string tifffile = P.PathName(filename.c_str()) + ".tif";
+  std::string shpfile = P.PathName(filename.c_str());
 
-  m_strName = oldname;
-  m_strImageName = oldimage;
-  m_nOffset = old_offset;
+  XHydroChain chain(this, tile, nbThread, dinf, shpfile + "_hydro");
+  if (!chain.FillDepressions())
+    return false;
+  if (!chain.FlowDirection())
+    return false;
+  if (!chain.FlowAccumulation(tifffile))
+    return false;
+  float threshold = (minArea > 0.) ? (float)(minArea / (m_dGSD * m_dGSD)) : 1000.f;
+  std::vector<std::vector<XPt2D> > thalweg;
+  std::vector<double> area;
+  if (!chain.Thalweg(threshold, thalweg, area))
+    return false;
 
-  return true;
+  std::vector<const std::vector<XPt2D>*> line;
+  for (size_t i = 0; i < thalweg.size(); i++)
+    line.push_back(&thalweg[i]);
+  return WritePolyLineShapefile(shpfile, line, "SURFACE", area);
 }
-*/
 
 bool XGeoFDtm::InjectVector(XGeoVector* V, uint8_t* area, uint8_t val)
+{
+  return InjectVector(V, [=](uint32_t u, uint32_t v) { area[(size_t)v * m_nW + u] = val; });
+}
+
+//-----------------------------------------------------------------------------
+// Parcours des noeuds traverses par un vecteur
+//-----------------------------------------------------------------------------
+bool XGeoFDtm::InjectVector(XGeoVector* V, const std::function<void(uint32_t, uint32_t)>& node)
 {
   if (!V->Frame().Intersect(m_Frame))
     return false;
@@ -2118,11 +4216,11 @@ bool XGeoFDtm::InjectVector(XGeoVector* V, uint8_t* area, uint8_t val)
     for (int k = 0; k < nb_step; k++) {
       u = XRint(((A.X - m_Frame.Xmin) + k * dx / nb_step)/m_dGSD);
       v = XRint(((m_Frame.Ymax - A.Y) - k * dy / nb_step)/m_dGSD);
-      if ((v >= 0)&&(u >=0)&&(v < m_nH)&&(u < m_nW))
-        area[v * m_nW + u] = val;
+      if ((v >= 0)&&(u >=0)&&(v < (int)m_nH)&&(u < (int)m_nW))
+        node(u, v);
       u++;
-      if ((v >= 0)&&(u >=0)&&(v < m_nH)&&(u < m_nW))
-        area[v * m_nW + u] = val;
+      if ((v >= 0)&&(u >=0)&&(v < (int)m_nH)&&(u < (int)m_nW))
+        node(u, v);
     }
   }
   return true;
@@ -12,12 +12,20 @@
 #ifndef _XGEOFDTM_H
 #define _XGEOFDTM_H
 
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
 #include "XGeoVector.h"
 #include "XFile.h"
 
 class XGeodConverter;
+class XDtmShader;
+struct XAscHeader;
+class XHydroChain;
 
 class XGeoFDtm : public XGeoVector {
+  friend class XHydroChain;
 protected:
 	std::string		m_strName;
 	std::string		m_strFilename;
@@ -36,12 +44,43 @@ protected:
   XFile         m_In;
   std::ifstream* m_ActiveStream;
 
+  // Cache LRU de blocs de noeuds, pour les acces aleatoires (Z, ZFrame)
+  struct DtmBlock { std::vector<float> data; std::list<uint64_t>::iterator lru; };
+  std::unordered_map<uint64_t, DtmBlock> m_Blocks;
+  std::list<uint64_t> m_BlockLru;   // Du plus recent au plus ancien
+  uint64_t      m_nLastBlock;
+  const float*  m_LastBlock;
+  size_t        m_nMaxBlock;
+  std::mutex    m_BlockMutex;
+
+  const float* Block(uint32_t bx, uint32_t by);
+  float Node(uint32_t x, uint32_t y);
+  bool Locate(const XPt2D& P, int& nbx, int& nby);
+  double Interpol(const XPt2D& P);
+  double Idw(const XPt2D& P, int nbx, int nby, const float* val);
+  void SetAscGeoref(const XAscHeader& H);
+  bool WriteCache(std::string file_tif, const std::function<bool(uint32_t, float*)>& reader, int nbThread = 0);
+
 public:
+  static const uint32_t BlockSize = 64;   // Taille des blocs du cache en noeuds
+  static constexpr float DiffNoData = -9999.f;  // Valeur des noeuds sans difference
+
+  // Statistiques d'une difference de MNT sur une zone
+  struct DiffStat {
+    double    Cut, Fill;          // Volumes de deblai (A < B) et de remblai (A > B)
+    double    DzMin, DzMax;
+    uint32_t  NbNode, NbNoData;   // Noeuds compares / noeuds sans valeur dans A ou B
+    std::vector<uint32_t> Histo;  // Nombre de noeuds par plage d'ecart
+    DiffStat(uint32_t nbClass = 0);
+  };
+
 	XGeoFDtm() {
 		m_dGSD = 0.; m_dZmin = m_dZmax = XGEO_NO_DATA; m_bValid = m_bTmpFile = false; m_ActiveStream = nullptr;
-							m_dNoData = -9999.; m_nOffset=0; m_nNbNoZ = m_nW = m_nH = 0;}
+							m_dNoData = -9999.; m_nOffset=0; m_nNbNoZ = m_nW = m_nH = 0;
+              m_nLastBlock = 0; m_LastBlock = nullptr; m_nMaxBlock = 256;}
   virtual ~XGeoFDtm() {Close();}
   bool OpenDtm(const char* filename, const char* tmpname);
+  bool OpenDtmCache(const char* filename, const char* cachefile, const char* tmpname, int nbThread = 0);
   virtual void Close();
 
 	virtual eTypeVector TypeVector () const { return DTM;}
@@ -83,29 +122,42 @@ public:
   virtual bool ReadLine(float* line, uint32_t numLine);
   virtual bool ReadNode(float* node, uint32_t x, uint32_t y);
   virtual bool ReadAll(float* area);
+  virtual bool ReadBlock(float* block, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+
+  void ClearCache();
+  void MaxCache(size_t nbBlock);  // Nombre de blocs de BlockSize x BlockSize noeuds
 
   virtual double Z(const XPt2D& P);
 	double Z(double x, double y) { XPt2D P(x, y); return Z(P);}
 	double Z(uint32_t x, uint32_t y);
+  bool Z(const XPt2D* P, double* Z, uint32_t nb);  // Z de nb points, XGEO_NO_DATA hors du MNT
+  bool ZGrid(const XPt2D& TL, double delta, uint32_t w, uint32_t h, float* T, int nbThread = 0);
   virtual uint32_t ZFrame(const XFrame& F, double* zmax, double* zmin, double* zmean);
   bool Ground2Pix(double x, double y, uint32_t& u, uint32_t& v);
   //bool Volume(uint32_t& nbLow, uint32_t& nbHigh, float Z0 = 0.);
   bool Volume(std::vector<double>& P, std::vector<uint32_t>& N, double& zmean);
   bool DeltaMax(double Dz, std::vector<XPt3D>& T);
   bool FindContourLine(double Z0, uint8_t* area);
-  bool FindThalweg(std::string filename);
+  // Hydrologie par dalles de tile x tile noeuds : la memoire est bornee par les dalles en cours
+  // de traitement et les bords de toutes les dalles
+  bool FindThalweg(std::string filename, double minArea = 0., bool dinf = false, int nbThread = 0, uint32_t tile = 1024);
 
 	virtual bool XmlRead(XParserXML* parser, uint32_t num = 0, XError* error = NULL);
 	virtual bool XmlWrite(std::ostream* out);
 
 	virtual bool Export(std::string filename);
   virtual bool ExportTiff16(std::string filename);
+  virtual bool ExportShading(std::string filename, const XDtmShader* shader);
   virtual bool ExportAsc(std::string filename);
 	virtual bool ExportXyz(std::string filename);
-  virtual bool ExportContour(std::string filename, double equi, double resol = 0.);
+  virtual bool ExportContour(std::string filename, double equi, double tolerance = 0., int nbSmooth = 0, int nbThread = 0);
   virtual int ExportFlood(std::string filename, double Z0, std::vector<XPt2D>& P,
                           int nb_seed = 0, std::vector<XGeoVector*>* V = NULL);
+  virtual int ExportFlood(std::string filename, std::vector<double> Z0, std::vector<XPt3D>& P,
+                          int nb_seed = 0, std::vector<XGeoVector*>* V = NULL);
   virtual bool ExportDiff(std::string filename, XGeoFDtm* dtm);
+  static bool ExportDiff(std::string filename, XGeoClass* A, XGeoClass* B, double gsd, const std::vector<double>& P,
+                         std::vector<DiffStat>& S, XGeoClass* zone = NULL, int nbThread = 0);
 
 	bool ImportAsc(std::string file_asc, std::string file_bin);
 	bool ImportDis(std::string file_asc, std::string file_bin);
@@ -123,6 +175,7 @@ public:
 
 public:
   bool InjectVector(XGeoVector* V, uint8_t* area, uint8_t val);
+  bool InjectVector(XGeoVector* V, const std::function<void(uint32_t, uint32_t)>& node);
   bool FindMinMax(XGeoVector* V, XPt3D* Pmin, XPt3D* Pmax, double* zmean, uint32_t* nbNoeud);
   bool FindMinMax(XGeoVector* V, XPt3D* Pmin, XPt3D* Pmax);
 
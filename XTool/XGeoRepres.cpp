@@ -129,6 +129,7 @@ bool XGeoRepres::XmlRead(XParserXML* parser, uint32_t num, XError* error)
 	} else {
 		m_nTrans = 50;
 	}
+	m_nRevision++;
 
 	return true;
 }
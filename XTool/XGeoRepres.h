@@ -28,12 +28,13 @@ protected:
   bool        m_bDeletable; // Indique si la representation peut etre detruite
   uint32_t      m_nMinScale;  // Echelle minimum d'affichage
   uint32_t      m_nMaxScale;  // Echelle minimum d'affichage
+  uint32_t      m_nRevision;  // Numero de version du style, incremente a chaque modification
 public:
   XGeoRepres();
   XGeoRepres(uint32_t color, uint32_t fill, uint32_t symbol, uint32_t zorder, uint8_t size, uint8_t font, uint8_t trans)
   { m_nColor = color; m_nFillColor = fill; m_nSymbol = symbol; m_nZOrder = zorder;
     m_nSize = size; m_nFontSize = font; m_nTrans = trans; m_bDeletable = false;
-    m_nMinScale = 0; m_nMaxScale = 0;}
+    m_nMinScale = 0; m_nMaxScale = 0; m_nRevision = 0;}
 
 	inline uint32_t Color() const { return m_nColor;}
 	inline uint32_t FillColor() const { return m_nFillColor;}
@@ -45,6 +46,7 @@ public:
   inline bool Deletable() const { return m_bDeletable;}
   inline uint32_t MinScale() const { return m_nMinScale;}
   inline uint32_t MaxScale() const { return m_nMaxScale;}
+  inline uint32_t Revision() const { return m_nRevision;}
 	std::string Name() { return m_strName;}
 	std::string Font() { return m_strFont;}
 	void Color(uint8_t& r, uint8_t& g, uint8_t& b);
@@ -64,19 +66,19 @@ public:
 	uint8_t Brush() { uint8_t* ptr = (uint8_t*)&m_nSymbol; return ptr[1];}
 	uint8_t Cell() { uint8_t* ptr = (uint8_t*)&m_nSymbol; return ptr[0];}
 
-	void Color(uint32_t c) { m_nColor = c;}
-	void Color(uint32_t r, uint32_t g, uint32_t b) { m_nColor = RGBColor(r, g, b);}
-	void FillColor(uint32_t c) { m_nFillColor = c;}
-	void FillColor(uint32_t r, uint32_t g, uint32_t b) { m_nFillColor = RGBColor(r, g, b);}
-	void Symbol(uint32_t s) { m_nSymbol = s;}
-	void Size(uint8_t s) { m_nSize = s;}
-	void FontSize(uint8_t s) { m_nFontSize = s;}
-	void ZOrder(uint32_t z) { m_nZOrder = z;}
+	void Color(uint32_t c) { m_nColor = c; m_nRevision++;}
+	void Color(uint32_t r, uint32_t g, uint32_t b) { m_nColor = RGBColor(r, g, b); m_nRevision++;}
+	void FillColor(uint32_t c) { m_nFillColor = c; m_nRevision++;}
+	void FillColor(uint32_t r, uint32_t g, uint32_t b) { m_nFillColor = RGBColor(r, g, b); m_nRevision++;}
+	void Symbol(uint32_t s) { m_nSymbol = s; m_nRevision++;}
+	void Size(uint8_t s) { m_nSize = s; m_nRevision++;}
+	void FontSize(uint8_t s) { m_nFontSize = s; m_nRevision++;}
+	void ZOrder(uint32_t z) { m_nZOrder = z; m_nRevision++;}
 	void Name(const char* name) { m_strName = name;}
-	void Font(const char* name) { m_strFont = name;}
-	void Transparency(uint8_t t) { if (t > 100) m_nTrans = 100; else m_nTrans = t;}
+	void Font(const char* name) { m_strFont = name; m_nRevision++;}
+	void Transparency(uint8_t t) { if (t > 100) m_nTrans = 100; else m_nTrans = t; m_nRevision++;}
   void Deletable(bool flag) { m_bDeletable = flag;}
-  void Scale(uint32_t min, uint32_t max) { m_nMinScale = min; m_nMaxScale = max;}
+  void Scale(uint32_t min, uint32_t max) { m_nMinScale = min; m_nMaxScale = max; m_nRevision++;}
 
 	bool XmlRead(XParserXML* parser, uint32_t num = 0, XError* error = NULL);
 	bool XmlWrite(std::ostream* out);
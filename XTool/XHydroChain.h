@@ -0,0 +1,134 @@
+//-----------------------------------------------------------------------------
+//								XHydroChain.h
+//								=============
+//
+// Chaine hydrologique par dalles sur un MNT XGeoFDtm
+//
+// Auteur : F.Becirspahic - IGN / DSI / SIMV
+// License : GNU AFFERO GENERAL PUBLIC LICENSE v3
+//-----------------------------------------------------------------------------
+
+#ifndef XHYDROCHAIN_H
+#define XHYDROCHAIN_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include "XGeoFDtm.h"
+
+//-----------------------------------------------------------------------------
+// Voisins d'un noeud, dans le sens trigonometrique a partir de l'Est
+// (les lignes du MNT vont du Nord au Sud)
+//-----------------------------------------------------------------------------
+static const int HydroDx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int HydroDy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+//-----------------------------------------------------------------------------
+// Chaine hydrologique par dalles de Tile x Tile noeuds
+// Seules les dalles en cours de traitement (une par thread) et les bords de toutes les
+// dalles sont en memoire. Les grilles intermediaires sont dans des fichiers temporaires,
+// une dalle par enregistrement.
+// 1. Comblement (Barnes 2016) : Priority-Flood etiquete dans chaque dalle a partir de ses
+//    bords et de ses exutoires, resolution globale du graphe des debordements entre
+//    etiquettes, puis chaque dalle est remontee au niveau de ses etiquettes
+// 2. Directions : un plat s'ecoule, en largeur, vers ses noeuds qui ont un voisin plus bas.
+//    Un plat sans tel noeud dans sa dalle sort par le bord, vers un plat de la dalle
+//    voisine choisi sur le graphe des plats de bord
+// 3. Accumulation (Barnes 2017, etendu au D-infini) : chaque dalle calcule le transfert de
+//    ses noeuds de bord d'entree vers ses noeuds de bord de sortie, le graphe des bords est
+//    resolu dans l'ordre topologique, puis chaque dalle est accumulee avec ses apports
+// 4. Thalwegs : troncons par dalle, raccordes d'une dalle a l'autre
+//-----------------------------------------------------------------------------
+class XHydroChain {
+public:
+  XHydroChain(XGeoFDtm* dtm, uint32_t tile, int nbThread, bool dinf, std::string tmp);
+  ~XHydroChain();
+
+  bool FillDepressions();
+  bool FlowDirection();
+  bool FlowAccumulation(std::string tifffile);
+  bool Thalweg(float threshold, std::vector<std::vector<XPt2D> >& thalweg, std::vector<double>& area);
+
+  // Grille intermediaire complete ("fill", "dir", "acc", ...), pour controler la chaine
+  template<class V> bool ReadGrid(std::string name, std::vector<V>& grid);
+
+protected:
+  struct Edge { uint32_t A, B; float Z; };      // Debordement entre deux etiquettes
+  struct Link { uint32_t From, To; double W; };  // Transfert d'un noeud d'entree vers un noeud de sortie
+
+  // Une dalle : les vecteurs sont indexes par les noeuds du bord (voir Border)
+  struct Tile {
+    uint32_t  X0, Y0, W, H;
+    uint32_t  NbLabel, FirstLabel;  // Etiquettes locales 2 a NbLabel (1 : exutoires), premiere etiquette globale
+    std::vector<float>    Z, Fill;  // Altitude, altitude comblee
+    std::vector<uint32_t> Label;    // Etiquette locale, 0 : pas de donnees
+    std::vector<Edge>     Spill;    // Debordements entre les etiquettes de la dalle
+    std::vector<int32_t>  Flat;     // Plat (noeuds voisins de meme altitude) du noeud
+    std::vector<uint8_t>  Drained;  // Par plat : un noeud du plat a un voisin plus bas
+    std::vector<uint32_t> Exit;     // Sorties des plats vers les dalles voisines : noeud * 8 + direction
+    std::vector<uint8_t>  D, D8;    // Directions (D8 : directions D8 en mode D-infini)
+    std::vector<float>    P, A;     // Part du voisin D + 1 en D-infini, accumulation
+    std::vector<uint8_t>  Flow;     // 1 : noeud d'entree, 2 : noeud de sortie de la dalle
+    std::vector<double>   Local, In;  // Accumulation dans la dalle seule, apports des dalles voisines
+    std::vector<Link>     Transfer;
+
+    uint32_t NbBorder() const { return 2 * W + 2 * H; }
+    uint32_t Border(uint32_t x, uint32_t y) const
+      { if (y == 0) return x; if (y == H - 1) return W + x; if (x == 0) return 2 * W + y; return 2 * W + H + y; }
+    void BorderXY(uint32_t b, uint32_t& x, uint32_t& y) const
+      { if (b < W) { x = b; y = 0; } else if (b < 2 * W) { x = b - W; y = H - 1; }
+        else if (b < 2 * W + H) { x = 0; y = b - 2 * W; } else { x = W - 1; y = b - 2 * W - H; } }
+    template<class F> void ForBorder(F f) const   // Noeuds du bord de la dalle
+      { for (uint32_t i = 0; i < H; i++)
+          for (uint32_t j = 0; j < W; j += ((i == 0) || (i == H - 1) || (W == 1)) ? 1 : W - 1)
+            f(j, i); }
+    template<class F> void ForRing(F f) const     // Noeuds autour de la dalle, dans un tampon de (W+2) x (H+2)
+      { for (uint32_t i = 0; i < H + 2; i++)
+          for (uint32_t j = 0; j < W + 2; j += ((i == 0) || (i == H + 1)) ? 1 : W + 1)
+            f(j, i); }
+  };
+
+  XGeoFDtm*   m_Dtm;
+  uint32_t    m_nW, m_nH, m_nTile, m_nTx, m_nTy;
+  int         m_nNbThread;
+  bool        m_bDinf;
+  float       m_NoData;
+  std::string m_strTmp;
+  std::vector<Tile>   m_Tile;
+  std::vector<float>  m_Level;    // Niveau de comblement de chaque etiquette globale (0 : exutoires)
+  std::vector<std::string> m_TmpFile;
+
+  bool ForEachTile(const std::function<bool(Tile&)>& f);
+  bool ReadZ(const Tile& T, std::vector<float>& Z);
+  bool CreateTmp(std::string name);
+  bool ReadTile(std::string name, const Tile& T, void* data, size_t size);
+  bool WriteTile(std::string name, const Tile& T, const void* data, size_t size);
+  template<class V> void Halo(const Tile& T, std::vector<V> Tile::* border, V outside, std::vector<V>& buf);
+  Tile& TileOf(uint32_t x, uint32_t y) { return m_Tile[(size_t)(y / m_nTile) * m_nTx + x / m_nTile]; }
+  uint32_t Global(const Tile& T, uint32_t label) const { return (label <= 1) ? 0 : T.FirstLabel + label - 2; }
+  void Flood(const Tile& T, const std::vector<float>& Z, std::vector<uint32_t>& label, std::vector<float>& fill,
+             std::map<std::pair<uint32_t, uint32_t>, float>* spill, uint32_t* nbLabel);
+  int Receiver(const Tile& T, uint32_t index, uint8_t d, float p, int64_t* R, float* W);
+  void TopoOrder(const Tile& T, const std::vector<uint8_t>& D, const std::vector<float>& P, std::vector<uint32_t>& order);
+};
+
+//-----------------------------------------------------------------------------
+// Lecture d'une grille intermediaire complete, dalle par dalle
+//-----------------------------------------------------------------------------
+template<class V> bool XHydroChain::ReadGrid(std::string name, std::vector<V>& grid)
+{
+  grid.assign((size_t)m_nW * m_nH, V());
+  std::vector<V> buf;
+  for (size_t t = 0; t < m_Tile.size(); t++) {
+    const Tile& T = m_Tile[t];
+    buf.resize((size_t)T.W * T.H);
+    if (!ReadTile(name, T, buf.data(), sizeof(V)))
+      return false;
+    for (uint32_t i = 0; i < T.H; i++)
+      std::copy(&buf[(size_t)i * T.W], &buf[(size_t)i * T.W] + T.W, &grid[(size_t)(T.Y0 + i) * m_nW + T.X0]);
+  }
+  return true;
+}
+
+#endif //XHYDROCHAIN_H
@@ -10,12 +10,246 @@
 //-----------------------------------------------------------------------------
 
 #include <cstring>
+#include <cstdio>
+#include <fstream>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <set>
+#include <ctime>
 #include "XLasFile.h"
 #include "../XTool/XFrame.h"
 #include "../XToolImage/XTiffWriter.h"
 
-int XLasFile::m_LasNbOpenFile = 0;
+std::list<XLasReaderPool::Item> XLasReaderPool::m_Items;
+std::unordered_map<XLasFile*, std::list<XLasReaderPool::Item>::iterator> XLasReaderPool::m_Index;
+std::mutex XLasReaderPool::m_Mutex;
+size_t XLasReaderPool::m_nMaxOpen = 64;
+
+std::list<XLasNodeCache::Item> XLasNodeCache::m_Items;
+std::unordered_map<std::string, std::list<XLasNodeCache::Item>::iterator> XLasNodeCache::m_Index;
+std::mutex XLasNodeCache::m_Mutex;
+size_t XLasNodeCache::m_nMemory = 0;
+size_t XLasNodeCache::m_nMaxMemory = (size_t)512 << 20;
+
+//==============================================================================
+// XLasNode : reservation memoire
+//==============================================================================
+void XLasNode::Reserve(size_t n)
+{
+  X.reserve(n); Y.reserve(n); Z.reserve(n);
+  Classification.reserve(n);
+  Intensity.reserve(n);
+  R.reserve(n); G.reserve(n); B.reserve(n); Nir.reserve(n);
+  ScanAngle.reserve(n);
+}
+
+//==============================================================================
+// XLasBlock : allocation des tableaux
+//==============================================================================
+void XLasBlock::Resize(uint32_t capacity)
+{
+  X.resize(capacity); Y.resize(capacity); Z.resize(capacity);
+  Classification.resize(capacity);
+  Intensity.resize(capacity);
+  R.resize(capacity); G.resize(capacity); B.resize(capacity); Nir.resize(capacity);
+  ScanAngle.resize(capacity);
+}
+
+//==============================================================================
+// XLasNodeCache : recherche d'un noeud, le noeud trouve devient le plus recent
+//==============================================================================
+std::shared_ptr<const XLasNode> XLasNodeCache::Find(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto iter = m_Index.find(key);
+  if (iter == m_Index.end())
+    return nullptr;
+  m_Items.splice(m_Items.begin(), m_Items, iter->second);
+  return iter->second->second;
+}
+
+//==============================================================================
+// XLasNodeCache : ajout d'un noeud
+// Les noeuds evinces restent valides tant qu'un thread les utilise (shared_ptr)
+//==============================================================================
+void XLasNodeCache::Insert(const std::string& key, std::shared_ptr<const XLasNode> node)
+{
+  if (node.get() == nullptr)
+    return;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  if (m_Index.find(key) != m_Index.end())  // Deja decode par un autre thread
+    return;
+  m_Items.push_front(Item(key, node));
+  m_Index[key] = m_Items.begin();
+  m_nMemory += node->MemorySize();
+  Evict();
+}
+
+//==============================================================================
+// XLasNodeCache : liberation des noeuds les plus anciens
+//==============================================================================
+void XLasNodeCache::Evict()
+{
+  while ((m_nMemory > m_nMaxMemory) && (m_Items.size() > 1)) {
+    m_nMemory -= m_Items.back().second->MemorySize();
+    m_Index.erase(m_Items.back().first);
+    m_Items.pop_back();
+  }
+}
+
+void XLasNodeCache::Clear()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_Items.clear();
+  m_Index.clear();
+  m_nMemory = 0;
+}
+
+void XLasNodeCache::MaxMemory(size_t size)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_nMaxMemory = size;
+  Evict();
+}
+
+size_t XLasNodeCache::Memory()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_nMemory;
+}
+
+//==============================================================================
+// XLasReaderPool : le fichier est retire de la liste des lecteurs inactifs
+//==============================================================================
+void XLasReaderPool::Acquire(XLasFile* file)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto iter = m_Index.find(file);
+  if (iter == m_Index.end())
+    return;
+  m_Items.erase(iter->second);
+  m_Index.erase(iter);
+}
+
+//==============================================================================
+// XLasReaderPool : le fichier devient le lecteur inactif le plus recent
+//==============================================================================
+void XLasReaderPool::Release(XLasFile* file)
+{
+  Insert(file, false);
+}
+
+void XLasReaderPool::Insert(XLasFile* file, bool owned)
+{
+  std::vector<XLasFile*> dead;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto iter = m_Index.find(file);
+    if (iter != m_Index.end())
+      m_Items.splice(m_Items.begin(), m_Items, iter->second);
+    else {
+      Item item = { file, owned };
+      m_Items.push_front(item);
+      m_Index[file] = m_Items.begin();
+    }
+    Evict(dead);
+  }
+  for (size_t i = 0; i < dead.size(); i++)
+    delete dead[i];
+}
+
+//==============================================================================
+// XLasReaderPool : fermeture des lecteurs inactifs les plus anciens
+// Les lecteurs crees par Take sont detruits par l'appelant, hors du verrou
+//==============================================================================
+void XLasReaderPool::Evict(std::vector<XLasFile*>& dead)
+{
+  while (m_Items.size() > m_nMaxOpen) {
+    Item item = m_Items.back();
+    m_Index.erase(item.file);
+    m_Items.pop_back();
+    item.file->CloseReader();
+    if (item.owned)
+      dead.push_back(item.file);
+  }
+}
+
+//==============================================================================
+// XLasReaderPool : lecteur ouvert sur un fichier, pour un thread de traitement
+// Un lecteur inactif sur le meme fichier est reutilise, sinon un nouveau lecteur est ouvert
+//==============================================================================
+std::shared_ptr<XLasFile> XLasReaderPool::Take(const std::string& filename)
+{
+  XLasFile* file = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (auto iter = m_Items.begin(); iter != m_Items.end(); ++iter) {
+      if ((iter->owned) && (iter->file->m_strFilename == filename)) {
+        file = iter->file;
+        m_Index.erase(file);
+        m_Items.erase(iter);
+        break;
+      }
+    }
+  }
+  if (file == nullptr) {
+    file = new XLasFile;
+    if (!file->Open(filename, false)) {
+      delete file;
+      return nullptr;
+    }
+  }
+  return std::shared_ptr<XLasFile>(file, [](XLasFile* las) {
+    las->SetClassifFilter(nullptr);
+    las->m_nNbUse = 0;
+    if (las->IsOpened())
+      XLasReaderPool::Insert(las, true);
+    else
+      delete las;
+    });
+}
+
+void XLasReaderPool::Remove(XLasFile* file)
+{
+  Acquire(file);
+}
+
+void XLasReaderPool::Clear()
+{
+  std::vector<XLasFile*> dead;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (auto iter = m_Items.begin(); iter != m_Items.end(); ++iter) {
+      iter->file->CloseReader();
+      if (iter->owned)
+        dead.push_back(iter->file);
+    }
+    m_Items.clear();
+    m_Index.clear();
+  }
+  for (size_t i = 0; i < dead.size(); i++)
+    delete dead[i];
+}
+
+void XLasReaderPool::MaxOpen(size_t nb)
+{
+  std::vector<XLasFile*> dead;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_nMaxOpen = nb;
+    Evict(dead);
+  }
+  for (size_t i = 0; i < dead.size(); i++)
+    delete dead[i];
+}
+
+size_t XLasReaderPool::NbOpen()
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Items.size();
+}
 
 //==============================================================================
 // Constructeur
@@ -25,17 +259,29 @@ XLasFile::XLasFile()
   m_Reader = nullptr; 
   m_Header = nullptr; 
   m_Point = nullptr; 
+  memset(&m_HeaderInfo, 0, sizeof(m_HeaderInfo));
+  m_nNbUse = 0;
   m_dXmin = m_dXmax = m_dYmin = m_dYmax = m_dZmin = m_dZmax = 0.;
   m_nNbPoint = m_nIndex = 0;
+  m_nRangeIndex = m_nRangeCount = 0;
   m_bCopc = false;
   m_dWorldGsd = 0.;
+  m_bIndex = false;
+  m_dIndexX0 = m_dIndexY0 = m_dIndexCell = 0.;
+  m_nIndexW = m_nIndexH = 0;
+  m_nWorldRange = 0;
+  m_bClassifFilter = false;
+  memset(m_ClassifVisibility, 1, sizeof(m_ClassifVisibility));
 }
 
 //==============================================================================
 // Ouverture d'un fichier LAS
+// copcInfo = false : la hierarchie COPC n'est pas lue (lecture par plages uniquement)
 //==============================================================================
-bool XLasFile::Open(std::string filename)
+bool XLasFile::Open(std::string filename, bool copcInfo)
 {
+  if (m_Reader != nullptr)
+    Close();
 	m_strFilename = "";
 	if (laszip_create(&m_Reader))
 		return false;
@@ -55,27 +301,53 @@ bool XLasFile::Open(std::string filename)
 	}
 
 	m_strFilename = filename;
-  m_LasNbOpenFile++;
-  m_bCopc = IsCopc();
+  m_HeaderInfo = *m_Header;
+  m_HeaderInfo.user_data_in_header = nullptr;
+  m_HeaderInfo.vlrs = nullptr;
+  m_HeaderInfo.user_data_after_header = nullptr;
+  m_bCopc = false;
+  if (copcInfo)
+    m_bCopc = IsCopc();
 	return true;
 }
 
 //==============================================================================
 // Reouverture d'un fichier LAS
+// Le fichier est retire du pool jusqu'au CloseIfNeeded correspondant. S'il a ete ferme par le pool,
+// seul le lecteur laszip est recree : la hierarchie COPC et l'index sont deja en memoire
 //==============================================================================
 bool XLasFile::ReOpen()
 {
   if (m_strFilename.empty())  // Le fichier n'a jamais ete ouvert
     return false;
+  XLasReaderPool::Acquire(this);
+  m_nNbUse++;
   if (m_Reader != nullptr)    // Le fichier est deja ouvert
     return true;
-  return Open(m_strFilename);
+  int nbUse = m_nNbUse;
+  if (!Open(m_strFilename, m_bCopc)) {
+    m_nNbUse = 0;
+    return false;
+  }
+  m_nNbUse = nbUse;
+  return true;
 }
 
 //==============================================================================
 // Fermerture d'un fichier LAS
 //==============================================================================
 bool XLasFile::Close()
+{
+  XLasReaderPool::Remove(this);
+  CloseReader();
+  m_nNbUse = 0;
+	return true;
+}
+
+//==============================================================================
+// Fermeture du lecteur laszip, l'entete et la hierarchie COPC sont conserves
+//==============================================================================
+void XLasFile::CloseReader()
 {
 	if (m_Reader != nullptr) {
 		laszip_close_reader(m_Reader);
@@ -84,18 +356,20 @@ bool XLasFile::Close()
   m_Reader = nullptr;
   m_Header = nullptr;
   m_Point = nullptr;
-  m_LasNbOpenFile--;
-	return true;
 }
 
 //==============================================================================
-// Fermerture eventuel d'un fichier LAS
+// Fin d'utilisation d'un fichier LAS : le lecteur est confie au pool, qui le fermera
+// si trop de lecteurs sont ouverts
 //==============================================================================
-bool XLasFile::CloseIfNeeded(int maxLasFile)
+bool XLasFile::CloseIfNeeded()
 {
-  if (m_LasNbOpenFile < maxLasFile)
+  if (m_nNbUse > 0)
+    m_nNbUse--;
+  if ((m_nNbUse > 0) || (m_Reader == nullptr))
     return true;
-  return Close();
+  XLasReaderPool::Release(this);
+  return true;
 }
 
 //==============================================================================
@@ -119,8 +393,13 @@ bool XLasFile::SetWorld(const XFrame& F, const double& zmin, const double& zmax,
   if (m_bCopc) {
     m_CopcReader.m_nActiveEntry = 0;
     m_CopcReader.m_bStarted = false;
-  } else
-    laszip_seek_point(m_Reader, 0);
+    return true;
+  }
+  if ((!m_bIndex) && (!m_strIndexFile.empty()))  // L'index a pu etre calcule depuis l'ouverture
+    LoadIndex();
+  if (m_bIndex)
+    return ComputeWorldRanges();
+  laszip_seek_point(m_Reader, 0);
   return true;
 }
 
@@ -129,6 +408,28 @@ bool XLasFile::SetWorld(const XFrame& F, const double& zmin, const double& zmax,
 //==============================================================================
 bool XLasFile::GetNextPoint(double* X, double* Y, double* Z)
 {
+  if (!NextPoint())
+    return false;
+  *X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
+  *Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
+  *Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+  return true;
+}
+
+//==============================================================================
+// Passage au prochain point de l'emprise a traiter
+//==============================================================================
+bool XLasFile::NextPoint()
+{
+  if ((!m_bCopc) && (m_bIndex)) { // Lecture des seules plages de l'index dans l'emprise
+    while (!NextRangePoint()) {
+      if (m_nWorldRange >= m_WorldRanges.size())
+        return false;
+      SetRange(m_WorldRanges[m_nWorldRange]);
+      m_nWorldRange++;
+    }
+    return true;
+  }
   if (!m_bCopc) {
     do {
       laszip_read_point(m_Reader);
@@ -140,9 +441,7 @@ bool XLasFile::GetNextPoint(double* X, double* Y, double* Z)
       if (m_Point->Y >= m_dYmax) continue;
       if (m_Point->Z < m_dZmin) continue;
       if (m_Point->Z > m_dZmax) continue;
-      *X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
-      *Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
-      *Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+      if (IsFiltered()) continue;
       return true;
     } while (m_nIndex < m_nNbPoint);
     laszip_seek_point(m_Reader, 0);
@@ -185,275 +484,1325 @@ bool XLasFile::GetNextPoint(double* X, double* Y, double* Z)
     if (m_Point->Y >= m_dYmax) continue;
     if (m_Point->Z < m_dZmin) continue;
     if (m_Point->Z > m_dZmax) continue;
-    *X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
-    *Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
-    *Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+    if (IsFiltered()) continue;
     return true;
   }
   m_CopcReader.m_bStarted = false;
   m_CopcReader.m_nActiveEntry++;
   if (m_CopcReader.m_nActiveEntry >= m_CopcReader.m_Entries.size())
     return false;
-  return GetNextPoint(X, Y, Z);
+  return NextPoint();
 }
 
-//-----------------------------------------------------------------------------
-// Calcul d'un MNT/MNS a parti d'un fichier LAS
-//-----------------------------------------------------------------------------
-bool XLasFile::ComputeDtm(std::string file_out, double gsd, AlgoDtm algo, bool classif_visibility[256], XError* error)
+//==============================================================================
+// Decoupage de l'emprise fixee par SetWorld en plages de points
+// En COPC, une plage correspond a un noeud de l'octree
+//==============================================================================
+bool XLasFile::GetRanges(std::vector<PointRange>& ranges, uint64_t maxCount)
 {
-	if (!ReOpen())	// Le fichier LAS n'a pas ete ouvert
-		return false;
-
-	XFrame F = XFrame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
-	F.Xmin = gsd * floor(F.Xmin / gsd);
-	F.Ymin = gsd * floor(F.Ymin / gsd);
-	F.Xmax = gsd * ceil(F.Xmax / gsd);
-	F.Ymax = gsd * ceil(F.Ymax / gsd);
-
-	uint32_t W = (uint32_t)ceil(F.Width() / gsd);
-	uint32_t H = (uint32_t)ceil(F.Height() / gsd);
-
-	// Allocation du tableau MNT
-	float* area = new float[W * H];
-	if (area == nullptr)
-		return XErrorError(error, "TLasFile::ComputeDtm", XError::eAllocation);
-	::memset(area, 0, W * H * sizeof(float));
-	uint16_t* count = new uint16_t[W * H];
-	if (count == nullptr) {
-		delete[] area;
-		return XErrorError(error, "TLasFile::ComputeDtm", XError::eAllocation);
-	}
-	::memset(count, 0, W * H * sizeof(uint16_t));
-  InlineStat* Stat = nullptr;
-  if (algo == StdDev) {
-    Stat = new InlineStat[W * H];
-    if (Stat == nullptr) {
-      delete[] area; delete[] count;
-      return XErrorError(error, "TLasFile::ComputeDtm", XError::eAllocation);
-    }
-  }
-
-	double X = 0., Y = 0., Z = 0.;
-	int u = 0, v = 0;
-	laszip_seek_point(m_Reader, 0);
-	for (uint64_t i = 0; i < NbLasPoints(); i++) {
-		laszip_read_point(m_Reader);
-		if (classif_visibility != nullptr)
-			if (!classif_visibility[m_Point->classification])
-				continue;
-		
-		X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
-		Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
-		Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
-
-		u = (int)XRint((X - F.Xmin) / gsd);
-		v = (int)XRint((F.Ymax - Y) / gsd);
-		if (((uint32_t)u >= W) || ((uint32_t)v >= H))	// Theoriquement cela ne devrait pas arrive si l'entete du LAS est correcte
-			continue;
-		if ((u < 0) || (v < 0))
-			continue;
-
-		if (count[v * W + u] == 0) {	// Premier Z dans la cellule
-			area[v * W + u] = (float)Z;
-			count[v * W + u] += 1;
-      if (Stat != nullptr) Stat[v * W + u].AddValue(Z);
-			continue;
-		}
-
-		switch (algo) {
-			case ZAverage: area[v * W + u] += (float)Z;
-				break;
-			case ZMinimum: if (area[v * W + u] > Z) area[v * W + u] = (float)Z;
-				break;
-			case ZMaximum: if (area[v * W + u] < Z) area[v * W + u] = (float)Z;
-				break;
-      case StdDev: Stat[v * W + u].AddValue(Z);
-        break;
-			}
-		count[v * W + u] += 1;
-	}
-
-	for (uint32_t i = 0; i < W * H; i++) {
-		if (count[i] > 0) {
-			if (algo == ZAverage)
-				area[i] = area[i] / count[i];
-      if (algo == StdDev)
-        area[i] = (float)Stat[i].StandardDeviation();
-		}
-		else
-			area[i] = -9999;
-	}
+  ranges.clear();
+  if (m_Header == nullptr)
+    return false;
+  if (maxCount < 1)
+    maxCount = 1;
+  if ((!m_bCopc) && (m_bIndex)) {
+    for (size_t i = 0; i < m_WorldRanges.size(); i++) {
+      for (uint64_t start = 0; start < m_WorldRanges[i].count; start += maxCount) {
+        PointRange range;
+        range.start = m_WorldRanges[i].start + start;
+        range.count = XMin(maxCount, m_WorldRanges[i].count - start);
+        ranges.push_back(range);
+      }
+    }
+    return true;
+  }
+  if (!m_bCopc) {
+    for (uint64_t start = 0; start < m_nNbPoint; start += maxCount) {
+      PointRange range;
+      range.start = start;
+      range.count = XMin(maxCount, m_nNbPoint - start);
+      ranges.push_back(range);
+    }
+    return true;
+  }
+  for (size_t i = 0; i < m_CopcReader.m_Entries.size(); i++) {
+    CopcReader::Entry entry = m_CopcReader.m_Entries[i];
+    if (m_CopcReader.m_dSpacing / pow(2, entry.key.level) < m_dWorldGsd)
+      break;  // Les entrees sont triees par profondeur
+    double cell_size = (m_CopcReader.m_dHalfSize * 2.) / pow(2, entry.key.level);
+    XFrame F;
+    F.Xmin = m_CopcReader.m_dXmin + entry.key.x * cell_size;
+    F.Xmax = m_CopcReader.m_dXmin + (entry.key.x + 1) * cell_size;
+    F.Ymin = m_CopcReader.m_dYmin + entry.key.y * cell_size;
+    F.Ymax = m_CopcReader.m_dYmin + (entry.key.y + 1) * cell_size;
+    if (!F.Intersect(m_WorldFrame))
+      continue;
+    PointRange range;
+    range.start = entry.offset;
+    range.count = (uint64_t)entry.pointCount;
+    ranges.push_back(range);
+  }
+  return true;
+}
 
-	XTiffWriter writer;
-	writer.SetGeoTiff(F.Xmin, F.Ymax, gsd);
-	writer.Write(file_out.c_str(), W, H, 1, 32, (uint8_t*)area, 3);
+//==============================================================================
+// Noeuds pour l'affichage par niveau de detail dans l'emprise F
+// En COPC, un noeud par entree de la hierarchie. Avec un index, un noeud par cellule.
+// Sinon, le fichier est decoupe en plages de maxCount points couvrant toute son emprise
+//==============================================================================
+bool XLasFile::GetLodNodes(std::vector<LodNode>& nodes, const XFrame& F, uint64_t maxCount)
+{
+  nodes.clear();
+  if (m_Header == nullptr)
+    return false;
+  if (maxCount < 1)
+    maxCount = 1;
+  XFrame header_frame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
+  if (m_bCopc) {
+    for (size_t i = 0; i < m_CopcReader.m_Entries.size(); i++) {
+      CopcReader::Entry entry = m_CopcReader.m_Entries[i];
+      if (entry.pointCount <= 0)
+        continue;
+      double cell_size = (m_CopcReader.m_dHalfSize * 2.) / pow(2, entry.key.level);
+      LodNode node;
+      node.frame.Xmin = m_CopcReader.m_dXmin + entry.key.x * cell_size;
+      node.frame.Xmax = node.frame.Xmin + cell_size;
+      node.frame.Ymin = m_CopcReader.m_dYmin + entry.key.y * cell_size;
+      node.frame.Ymax = node.frame.Ymin + cell_size;
+      if (!node.frame.Intersect(F))
+        continue;
+      node.zmin = XMax(m_CopcReader.m_dZmin + entry.key.z * cell_size, m_Header->min_z);
+      node.zmax = XMin(node.zmin + cell_size, m_Header->max_z);
+      node.spacing = m_CopcReader.m_dSpacing / pow(2, entry.key.level);
+      node.level = entry.key.level;
+      node.count = (uint64_t)entry.pointCount;
+      PointRange range;
+      range.start = entry.offset;
+      range.count = node.count;
+      node.ranges.push_back(range);
+      nodes.push_back(node);
+    }
+    return true;
+  }
 
-	delete[] area;
-	delete[] count;
-  if (Stat != nullptr) delete[] Stat;
-  CloseIfNeeded();
+  if ((!m_bIndex) && (!m_strIndexFile.empty()))
+    LoadIndex();
+  if (m_bIndex) {
+    for (uint32_t v = 0; v < m_nIndexH; v++) {
+      for (uint32_t u = 0; u < m_nIndexW; u++) {
+        size_t cell = (size_t)v * m_nIndexW + u;
+        if (m_IndexCell[cell] >= m_IndexCell[cell + 1])
+          continue;
+        LodNode node;
+        node.frame = XFrame(m_dIndexX0 + u * m_dIndexCell, m_dIndexY0 - (v + 1) * m_dIndexCell,
+                            m_dIndexX0 + (u + 1) * m_dIndexCell, m_dIndexY0 - v * m_dIndexCell);
+        if (!node.frame.Intersect(F))
+          continue;
+        node.count = 0;
+        for (uint32_t i = m_IndexCell[cell]; i < m_IndexCell[cell + 1]; i++) {
+          node.ranges.push_back(m_IndexRanges[i]);
+          node.count += m_IndexRanges[i].count;
+        }
+        node.zmin = m_Header->min_z;
+        node.zmax = m_Header->max_z;
+        node.spacing = m_dIndexCell / sqrt((double)XMax(node.count, (uint64_t)1));
+        node.level = 0;
+        nodes.push_back(node);
+      }
+    }
+    return true;
+  }
 
-	return true;
+  if (!header_frame.Intersect(F))
+    return true;
+  uint64_t nb_point = NbLasPoints();
+  for (uint64_t start = 0; start < nb_point; start += maxCount) {
+    LodNode node;
+    PointRange range;
+    range.start = start;
+    range.count = XMin(maxCount, nb_point - start);
+    node.ranges.push_back(range);
+    node.count = range.count;
+    node.frame = header_frame;
+    node.zmin = m_Header->min_z;
+    node.zmax = m_Header->max_z;
+    node.spacing = sqrt(header_frame.Width() * header_frame.Height() / (double)nb_point);  // Les plages couvrent tout le fichier
+    node.level = 0;
+    nodes.push_back(node);
+  }
+  return true;
 }
 
-//-----------------------------------------------------------------------------
-// Calcul des statistiques
-//-----------------------------------------------------------------------------
-bool XLasFile::StatLas(std::string file_out, std::ofstream* mif, std::ofstream* mid)
+//==============================================================================
+// Positionnement sur une plage de points
+//==============================================================================
+bool XLasFile::SetRange(const PointRange& range)
 {
-  if (!ReOpen())	// Le fichier LAS n'a pas ete ouvert
+  if (m_Reader == nullptr)
+    return false;
+  if (laszip_seek_point(m_Reader, range.start))
     return false;
+  m_nRangeIndex = 0;
+  m_nRangeCount = range.count;
+  return true;
+}
 
-  std::ofstream out;
-  out.open(file_out);
-  if (!out.good())
+//==============================================================================
+// Recuperation du prochain point de la plage courante dans l'emprise a traiter
+//==============================================================================
+bool XLasFile::GetNextRangePoint(double* X, double* Y, double* Z)
+{
+  if (!NextRangePoint())
     return false;
-  out.setf(std::ios::fixed);
-  out.precision(3);
-  out << "Statistiques fichier : " << m_strFilename << std::endl;
-  out << "===================================================================" << std::endl;
-  out << std::endl << "Donnees d'entete : " << std::endl;
-  out << "Software : " << m_Header->generating_software << std::endl;
-  out << "SystemID : " << m_Header->system_identifier << std::endl;
-  out << "Global encoding : " << m_Header->global_encoding << std::endl;
-  out << "Version : " << (int)m_Header->version_major << "." << (int)m_Header->version_minor << std::endl;
-  out << "Format des points : " << (int)m_Header->point_data_format << std::endl;
-  out << "Date : " << m_Header->file_creation_day << "/" << m_Header->file_creation_year << std::endl;
-  out << "XMin entete : " << m_Header->min_x << std::endl;
-  out << "XMax entete : " << m_Header->max_x << std::endl;
-  out << "YMin entete : " << m_Header->min_y << std::endl;
-  out << "YMax entete : " << m_Header->max_y << std::endl;
-  out << "ZMin entete : " << m_Header->min_z << std::endl;
-  out << "ZMax entete : " << m_Header->max_z << std::endl;
+  *X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
+  *Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
+  *Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+  return true;
+}
 
-  laszip_seek_point(m_Reader, 0);
-  laszip_I64 count = 0;
-  double X, Y, Z, zmin = 0., zmax = 0.;
-  laszip_F64 gps_time_min = 0., gps_time_max = 0., gps_time;
-  laszip_U8 classification;
-  unsigned int TClassif[256];
-  memset(TClassif, 0, 256 * sizeof(unsigned int));
-  double Xmin = 0., Xmax = 0., Ymin = 0., Ymax = 0.;
-  for (uint64_t i = 0; i < NbLasPoints(); i++) {
+//==============================================================================
+// Passage au prochain point de la plage courante dans l'emprise a traiter
+//==============================================================================
+bool XLasFile::NextRangePoint()
+{
+  while (m_nRangeIndex < m_nRangeCount) {
     laszip_read_point(m_Reader);
-    X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
-    Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
-    Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
-    classification = m_Point->classification;
-    if (m_Header->version_minor >= 4)
-      classification = m_Point->extended_classification;
-    gps_time = m_Point->gps_time;
+    m_nRangeIndex++;
+    if (m_Point->X <= m_dXmin) continue;
+    if (m_Point->X >= m_dXmax) continue;
+    if (m_Point->Y <= m_dYmin) continue;
+    if (m_Point->Y >= m_dYmax) continue;
+    if (m_Point->Z < m_dZmin) continue;
+    if (m_Point->Z > m_dZmax) continue;
+    if (IsFiltered()) continue;
+    return true;
+  }
+  return false;
+}
 
-    if (count == 0) { // Debut d'un nouveau lot
-      Xmin = Xmax = X;
-      Ymin = Ymax = Y;
-      zmin = zmax = Z;
-      gps_time_min = gps_time_max = gps_time;
-      TClassif[classification]++;
-      count++;
-      continue;
-    }
+//==============================================================================
+// Filtre sur la classification : visibility[256] ou nullptr pour lire toutes les classes
+//==============================================================================
+void XLasFile::SetClassifFilter(const bool* visibility)
+{
+  m_bClassifFilter = false;
+  if (visibility == nullptr) {
+    memset(m_ClassifVisibility, 1, sizeof(m_ClassifVisibility));
+    return;
+  }
+  for (int i = 0; i < 256; i++) {
+    m_ClassifVisibility[i] = visibility[i];
+    if (!visibility[i])
+      m_bClassifFilter = true;
+  }
+}
+
+//==============================================================================
+// Le point courant est-il exclu par le filtre sur la classification ?
+//==============================================================================
+bool XLasFile::IsFiltered() const
+{
+  if (!m_bClassifFilter)
+    return false;
+  if (m_Header->version_minor >= 4)
+    return !m_ClassifVisibility[m_Point->extended_classification];
+  return !m_ClassifVisibility[m_Point->classification];
+}
 
-    Xmin = XMin(Xmin, X);
-    Xmax = XMax(Xmax, X);
-    Ymin = XMin(Ymin, Y);
-    Ymax = XMax(Ymax, Y);
-    zmin = XMin(zmin, Z);
-    zmax = XMax(zmax, Z);
-    gps_time_min = XMin(gps_time_min, gps_time);
-    gps_time_max = XMax(gps_time_max, gps_time);
-    TClassif[classification]++;
+//==============================================================================
+// Copie du point courant a la position k d'un bloc
+//==============================================================================
+void XLasFile::StorePoint(XLasBlock* block, uint32_t k) const
+{
+  block->X[k] = (float)(m_Point->X * m_Header->x_scale_factor + m_Header->x_offset - block->X0);
+  block->Y[k] = (float)(m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset - block->Y0);
+  block->Z[k] = (float)(m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset - block->Z0);
+  block->Classification[k] = (m_Header->version_minor >= 4) ? m_Point->extended_classification : m_Point->classification;
+  block->Intensity[k] = m_Point->intensity;
+  block->R[k] = m_Point->rgb[0];
+  block->G[k] = m_Point->rgb[1];
+  block->B[k] = m_Point->rgb[2];
+  block->Nir[k] = m_Point->rgb[3];
+  block->ScanAngle[k] = m_Point->extended_scan_angle;
+}
+
+//==============================================================================
+// Lecture des prochains points de l'emprise dans un bloc
+// Renvoie le nombre de points lus, 0 a la fin de l'emprise
+//==============================================================================
+uint32_t XLasFile::GetNextBlock(XLasBlock* block)
+{
+  if (m_Point == nullptr)
+    return 0;
+  uint32_t count = 0;
+  while ((count < block->Capacity()) && (NextPoint())) {
+    StorePoint(block, count);
     count++;
   }
+  return count;
+}
 
-  out << std::endl;
-  out << "Lecture du fichier : " << m_strFilename << std::endl;
-  out << "===================================================================" << std::endl;
-  out << "Nombre de points dans le fichier : " << NbLasPoints() << std::endl;
-  out << "Nombre de points lus: " << count << std::endl;
-
-  out << "===================================================================" << std::endl;
-  out << "Xmin = " << Xmin << std::endl;
-  out << "Xmax = " << Xmax << std::endl;
-  out << "Ymin = " << Ymin << std::endl;
-  out << "Ymax = " << Ymax << std::endl;
-  out << "Zmin = " << zmin << std::endl;
-  out << "Zmax = " << zmax << std::endl;
-  out << "GPS Time Min = " << gps_time_min << std::endl;
-  out << "GPS Time Max = " << gps_time_max << std::endl;
-
-  out << "===================================================================" << std::endl;
-  out << "Classifications : " << std::endl;
-  out << "0 : Created, Never Classified : " << TClassif[0] << std::endl;
-  out << "1 : Unclassified : " << TClassif[1] << std::endl;
-  out << "2 : Ground : " << TClassif[2] << std::endl;
-  out << "3 : Low Vegetation : " << TClassif[3] << std::endl;
-  out << "4 : Medium Vegetation : " << TClassif[4] << std::endl;
-  out << "5 : High Vegetation : " << TClassif[5] << std::endl;
-  out << "6 : Building : " << TClassif[6] << std::endl;
-  out << "7 : Low Point (Noise) : " << TClassif[7] << std::endl;
-  out << "8 : Reserved : " << TClassif[8] << std::endl;
-  out << "9 : Water : " << TClassif[9] << std::endl;
-  out << "10 : Rail : " << TClassif[10] << std::endl;
-  out << "11 : Road Surface : " << TClassif[11] << std::endl;
-  out << "12 : " << TClassif[12] << std::endl;
-  out << "13 : Wire - Guard (Shield) : " << TClassif[13] << std::endl;
-  out << "14 : Wire - Conductor (Phase) : " << TClassif[14] << std::endl;
-  out << "15 : Transmission Tower : " << TClassif[15] << std::endl;
-  out << "16 : Wire-Structure Connector : " << TClassif[16] << std::endl;
-  out << "17 : Bridge Deck : " << TClassif[17] << std::endl;
-  out << "18 : High Noise : " << TClassif[18] << std::endl;
-  out << "19 : Overhead Structure : " << TClassif[19] << std::endl;
-  out << "20 : Ignored Ground : " << TClassif[20] << std::endl;
-  out << "21 : Snow : " << TClassif[21] << std::endl;
-  out << "22 : Temporal Exclusion : " << TClassif[22] << std::endl;
-
-  out << "===================================================================" << std::endl;
-  out << "Classifications etendues : " << std::endl;
-  for (int i = 23; i < 256; i++) {
-    if (TClassif[i] > 0)
-      out << i << " : " << TClassif[i] << std::endl;
+//==============================================================================
+// Lecture des prochains points de la plage courante dans un bloc
+//==============================================================================
+uint32_t XLasFile::GetNextRangeBlock(XLasBlock* block)
+{
+  if (m_Point == nullptr)
+    return 0;
+  uint32_t count = 0;
+  while ((count < block->Capacity()) && (NextRangePoint())) {
+    StorePoint(block, count);
+    count++;
   }
+  return count;
+}
 
-  if ((mif == nullptr) || (mid == nullptr))
-    return true;
-
-  *mif << "REGION 1" << std::endl;
-  *mif << "5" << std::endl;
-  *mif << Xmin << " " << Ymin << std::endl;
-  *mif << Xmin << " " << Ymax << std::endl;
-  *mif << Xmax << " " << Ymax << std::endl;
-  *mif << Xmax << " " << Ymin << std::endl;
-  *mif << Xmin << " " << Ymin << std::endl;
-
-  unsigned int classif_autre = TClassif[7] + TClassif[8];
-  for (unsigned int i = 10; i < 17; i++)
-    classif_autre += TClassif[i];
-  for (unsigned int i = 18; i < 64; i++)
-    classif_autre += TClassif[i];
-  for (unsigned int i = 68; i < 256; i++)
-    classif_autre += TClassif[i];
-  std::string name = m_strFilename.substr(m_strFilename.rfind('\\') + 1);
+//==============================================================================
+// Index spatial : format du fichier
+//==============================================================================
+static const char XLasIndexMagic[8] = { 'X', 'L', 'A', 'S', 'I', 'D', 'X', '1' };
+static const uint32_t XLasIndexMaxCell = 128;   // Nombre maximum de cellules sur la plus grande dimension
+static const uint64_t XLasIndexGap = 10000;     // Ecart en dessous duquel deux plages sont fusionnees
 
-  *mid << name << "\t" << zmin << "\t" << zmax << "\t"
-    << TClassif[0] << "\t" << TClassif[1] << "\t" << TClassif[2] << "\t"
-    << TClassif[3] << "\t" << TClassif[4] << "\t" << TClassif[5] << "\t"
-    << TClassif[6] << "\t" << TClassif[9] << "\t" << TClassif[17] << "\t"
-    << TClassif[64] << "\t" << TClassif[65] << "\t" << TClassif[66] << "\t"
-    << TClassif[67] << "\t" << classif_autre
-    << std::endl;
+//==============================================================================
+// Index spatial : calcul en une passe sur les points
+// Pour chaque cellule, on memorise les plages de points contigus ; les plages proches
+// sont fusionnees car un seek dans un LAZ decompresse de toute facon depuis le debut du chunk
+//==============================================================================
+bool XLasFile::BuildIndex(std::string filename, XError* error, XWait* wait)
+{
+  if (!ReOpen())
+    return false;
+  XFrame F = XFrame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
+  double cell = XMax(F.Width(), F.Height()) / XLasIndexMaxCell;
+  if (cell <= 0.)
+    cell = 1.;
+  uint32_t W = XMax((uint32_t)ceil(F.Width() / cell), (uint32_t)1);
+  uint32_t H = XMax((uint32_t)ceil(F.Height() / cell), (uint32_t)1);
+  std::vector<std::vector<PointRange> > cells;
+  cells.resize((size_t)W * H);
 
+  uint64_t nbPoint = NbLasPoints();
+  laszip_seek_point(m_Reader, 0);
+  for (uint64_t i = 0; i < nbPoint; i++) {
+    if ((i % 1000000) == 0)
+      if (XWaitCheckCancel(wait)) {
+        CloseIfNeeded();
+        return false;
+      }
+    if (laszip_read_point(m_Reader)) {
+      CloseIfNeeded();
+      return XErrorError(error, "XLasFile::BuildIndex", XError::eIORead);
+    }
+    double X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
+    double Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
+    uint32_t u = (uint32_t)XMax(0., floor((X - F.Xmin) / cell));
+    uint32_t v = (uint32_t)XMax(0., floor((F.Ymax - Y) / cell));
+    u = XMin(u, W - 1);
+    v = XMin(v, H - 1);
+    std::vector<PointRange>& ranges = cells[(size_t)v * W + u];
+    if ((ranges.size() > 0) && (i - (ranges.back().start + ranges.back().count) <= XLasIndexGap)) {
+      ranges.back().count = i + 1 - ranges.back().start;
+      continue;
+    }
+    PointRange range;
+    range.start = i;
+    range.count = 1;
+    ranges.push_back(range);
+  }
   CloseIfNeeded();
+
+  // Ecriture dans un fichier temporaire renomme ensuite : un index present est toujours complet
+  std::string tmpname = filename + ".tmp";
+  std::ofstream out;
+  out.open(tmpname, std::ios_base::out | std::ios_base::binary);
+  if (!out.good())
+    return XErrorError(error, "XLasFile::BuildIndex", XError::eIOOpen);
+  out.write(XLasIndexMagic, sizeof(XLasIndexMagic));
+  out.write((char*)&nbPoint, sizeof(nbPoint));
+  out.write((char*)&F.Xmin, sizeof(double));
+  out.write((char*)&F.Ymax, sizeof(double));
+  out.write((char*)&cell, sizeof(double));
+  out.write((char*)&W, sizeof(W));
+  out.write((char*)&H, sizeof(H));
+  for (size_t i = 0; i < cells.size(); i++) {
+    uint32_t nb = (uint32_t)cells[i].size();
+    out.write((char*)&nb, sizeof(nb));
+    if (nb > 0)
+      out.write((char*)cells[i].data(), nb * sizeof(PointRange));
+  }
+  bool flag = out.good();
+  out.close();
+  if (!flag)
+    return XErrorError(error, "XLasFile::BuildIndex", XError::eIOWrite);
+  std::remove(filename.c_str());
+  if (std::rename(tmpname.c_str(), filename.c_str()) != 0)
+    return XErrorError(error, "XLasFile::BuildIndex", XError::eIOWrite);
   return true;
 }
 
-//-----------------------------------------------------------------------------
-// Gestion du COPC
-//-----------------------------------------------------------------------------
-bool XLasFile::IsCopc()
+//==============================================================================
+// Index spatial : lecture du fichier fixe par SetIndexFile
+//==============================================================================
+bool XLasFile::LoadIndex()
 {
-  if (m_Header->number_of_extended_variable_length_records < 1)
+  m_bIndex = false;
+  if ((m_strIndexFile.empty()) || (m_Header == nullptr))
+    return false;
+  std::ifstream in;
+  in.open(m_strIndexFile, std::ios_base::in | std::ios_base::binary);
+  if (!in.good())
+    return false;
+  char magic[sizeof(XLasIndexMagic)];
+  uint64_t nbPoint = 0;
+  in.read(magic, sizeof(magic));
+  in.read((char*)&nbPoint, sizeof(nbPoint));
+  if ((!in.good()) || (memcmp(magic, XLasIndexMagic, sizeof(magic)) != 0) || (nbPoint != NbLasPoints()))
+    return false;
+  in.read((char*)&m_dIndexX0, sizeof(double));
+  in.read((char*)&m_dIndexY0, sizeof(double));
+  in.read((char*)&m_dIndexCell, sizeof(double));
+  in.read((char*)&m_nIndexW, sizeof(m_nIndexW));
+  in.read((char*)&m_nIndexH, sizeof(m_nIndexH));
+  if ((!in.good()) || (m_dIndexCell <= 0.) || (m_nIndexW > XLasIndexMaxCell) || (m_nIndexH > XLasIndexMaxCell))
+    return false;
+  m_IndexCell.resize((size_t)m_nIndexW * m_nIndexH + 1);
+  m_IndexRanges.clear();
+  for (size_t i = 0; i < (size_t)m_nIndexW * m_nIndexH; i++) {
+    uint32_t nb = 0;
+    in.read((char*)&nb, sizeof(nb));
+    if (!in.good())
+      return false;
+    m_IndexCell[i] = (uint32_t)m_IndexRanges.size();
+    m_IndexRanges.resize(m_IndexRanges.size() + nb);
+    if (nb > 0)
+      in.read((char*)&m_IndexRanges[m_IndexCell[i]], nb * sizeof(PointRange));
+  }
+  m_IndexCell[(size_t)m_nIndexW * m_nIndexH] = (uint32_t)m_IndexRanges.size();
+  if (!in.good())
+    return false;
+  m_bIndex = true;
+  return true;
+}
+
+//==============================================================================
+// Index spatial : plages des cellules intersectant l'emprise, triees et fusionnees
+//==============================================================================
+bool XLasFile::ComputeWorldRanges()
+{
+  m_WorldRanges.clear();
+  m_nWorldRange = 0;
+  m_nRangeIndex = m_nRangeCount = 0;
+  int u0 = (int)floor((m_WorldFrame.Xmin - m_dIndexX0) / m_dIndexCell);
+  int u1 = (int)floor((m_WorldFrame.Xmax - m_dIndexX0) / m_dIndexCell);
+  int v0 = (int)floor((m_dIndexY0 - m_WorldFrame.Ymax) / m_dIndexCell);
+  int v1 = (int)floor((m_dIndexY0 - m_WorldFrame.Ymin) / m_dIndexCell);
+  u0 = XMax(u0, 0); v0 = XMax(v0, 0);
+  u1 = XMin(u1, (int)m_nIndexW - 1); v1 = XMin(v1, (int)m_nIndexH - 1);
+  for (int v = v0; v <= v1; v++)
+    for (int u = u0; u <= u1; u++) {
+      size_t cell = (size_t)v * m_nIndexW + u;
+      for (uint32_t i = m_IndexCell[cell]; i < m_IndexCell[cell + 1]; i++)
+        m_WorldRanges.push_back(m_IndexRanges[i]);
+    }
+  std::sort(m_WorldRanges.begin(), m_WorldRanges.end(),
+            [](const PointRange& A, const PointRange& B) { return A.start < B.start; });
+  size_t nb = 0;
+  for (size_t i = 0; i < m_WorldRanges.size(); i++) {
+    if ((nb > 0) && (m_WorldRanges[i].start <= m_WorldRanges[nb - 1].start + m_WorldRanges[nb - 1].count + XLasIndexGap)) {
+      uint64_t end = XMax(m_WorldRanges[nb - 1].start + m_WorldRanges[nb - 1].count, m_WorldRanges[i].start + m_WorldRanges[i].count);
+      m_WorldRanges[nb - 1].count = end - m_WorldRanges[nb - 1].start;
+      continue;
+    }
+    m_WorldRanges[nb] = m_WorldRanges[i];
+    nb++;
+  }
+  m_WorldRanges.resize(nb);
+  return true;
+}
+
+//==============================================================================
+// Decodage de tous les points d'une plage dans un noeud
+//==============================================================================
+bool XLasFile::DecodeRange(const PointRange& range, XLasNode* node)
+{
+  if (!SetRange(range))
+    return false;
+  bool newClassif = IsNewClassification();
+  node->Reserve((size_t)range.count);
+  for (uint64_t i = 0; i < range.count; i++) {
+    if (laszip_read_point(m_Reader))
+      return false;
+    node->X.push_back(m_Point->X);
+    node->Y.push_back(m_Point->Y);
+    node->Z.push_back(m_Point->Z);
+    node->Classification.push_back(newClassif ? m_Point->extended_classification : m_Point->classification);
+    node->Intensity.push_back(m_Point->intensity);
+    node->R.push_back(m_Point->rgb[0]);
+    node->G.push_back(m_Point->rgb[1]);
+    node->B.push_back(m_Point->rgb[2]);
+    node->Nir.push_back(m_Point->rgb[3]);
+    node->ScanAngle.push_back(m_Point->extended_scan_angle);
+  }
+  m_nRangeIndex = m_nRangeCount;
+  return true;
+}
+
+//==============================================================================
+// Recuperation d'un noeud decode : cache d'abord, decodage sinon
+// Le fichier est ouvert uniquement si le noeud n'est pas dans le cache
+//==============================================================================
+std::shared_ptr<const XLasNode> XLasFile::GetNode(const PointRange& range, bool cache)
+{
+  std::string key;
+  if (cache) {
+    key = NodeKey(m_strFilename, range);
+    std::shared_ptr<const XLasNode> node = XLasNodeCache::Find(key);
+    if (node.get() != nullptr)
+      return node;
+  }
+  if (!ReOpen())
+    return nullptr;
+  std::shared_ptr<XLasNode> node = std::make_shared<XLasNode>();
+  bool flag = DecodeRange(range, node.get());
+  CloseIfNeeded();
+  if (!flag)
+    return nullptr;
+  if (cache)
+    XLasNodeCache::Insert(key, node);
+  return node;
+}
+
+//-----------------------------------------------------------------------------
+// Calcul d'un MNT/MNS a parti d'un fichier LAS
+//-----------------------------------------------------------------------------
+bool XLasFile::ComputeDtm(std::string file_out, double gsd, AlgoDtm algo, bool classif_visibility[256], XError* error)
+{
+	if (m_strFilename.empty())	// Le fichier LAS n'a pas ete ouvert
+		return false;
+	XLasDtmBuilder builder;
+	builder.AddFile(m_strFilename, m_strIndexFile);
+	return builder.Compute(file_out, gsd, algo, classif_visibility, error);
+}
+
+//-----------------------------------------------------------------------------
+// XLasDtmBuilder : ajout d'un fichier LAS, seule l'emprise est lue
+//-----------------------------------------------------------------------------
+void XLasDtmBuilder::AddFile(std::string filename, std::string indexfile)
+{
+  XLasFile las;
+  if (!las.Open(filename, false))
+    return;
+  laszip_header* header = las.GetHeader();
+  FileInfo info;
+  info.filename = filename;
+  info.indexfile = indexfile;
+  info.frame = XFrame(header->min_x, header->min_y, header->max_x, header->max_y);
+  m_Files.push_back(info);
+}
+
+//-----------------------------------------------------------------------------
+// XLasDtmBuilder : calcul du MNT/MNS
+// 1. Chaque fichier LAS est lu une seule fois : ses points sont repartis dans des fichiers
+//    temporaires par bloc (marge de bouchage comprise)
+// 2. Chaque bloc est calcule a partir de son fichier temporaire, puis decoupe en dalles
+//-----------------------------------------------------------------------------
+bool XLasDtmBuilder::Compute(std::string file_out, double gsd, XLasFile::AlgoDtm algo, bool classif_visibility[256],
+                             XError* error, XWait* wait)
+{
+  if ((m_Files.size() < 1) || (gsd <= 0.))
+    return XErrorError(error, "XLasDtmBuilder::Compute", XError::eBadData);
+  XFrame F;
+  for (size_t i = 0; i < m_Files.size(); i++)
+    F += m_Files[i].frame;
+  F.Xmin = gsd * floor(F.Xmin / gsd);
+  F.Ymin = gsd * floor(F.Ymin / gsd);
+  F.Xmax = gsd * ceil(F.Xmax / gsd);
+  F.Ymax = gsd * ceil(F.Ymax / gsd);
+  uint32_t W = XMax((uint32_t)ceil(F.Width() / gsd), (uint32_t)1);
+  uint32_t H = XMax((uint32_t)ceil(F.Height() / gsd), (uint32_t)1);
+
+  XTiffWriter writer(error);
+  writer.SetGeoTiff(F.Xmin, F.Ymax, gsd);
+  if (!writer.BeginTiled(file_out.c_str(), W, H, 1, 32, 3, TileSize(), TileSize(), 8, 3))
+    return false;
+
+  const uint32_t B = m_nBlockSize, R = m_nFillRadius, T = TileSize();
+  uint32_t nbBlockW = (W + B - 1) / B, nbBlockH = (H + B - 1) / B;
+  uint32_t nbTileW = (W + T - 1) / T;
+  uint32_t nbBlock = nbBlockW * nbBlockH;
+  int nbThread = m_nNbThread;
+  if (nbThread <= 0)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+  XWaitRange(wait, 0, (int)(m_Files.size() + nbBlock));
+  XWaitStep(wait, 0);
+
+  struct BucketPoint { int32_t u, v; float Z; };  // Pixel de l'image globale
+  auto floor_div = [&](int x) { return (x >= 0) ? x / (int)B : -((-x - 1) / (int)B) - 1; };
+  auto bucket_file = [&](uint32_t b) { return file_out + "_" + std::to_string(b) + ".tmp"; };
+  std::vector<std::mutex> bucket_mutex(nbBlock);
+  std::vector<bool> bucket_used(nbBlock, false);
+  std::atomic<uint32_t> next(0);
+  std::atomic<bool> failed(false);
+  std::mutex mutex;   // Protege writer, wait et bucket_used
+
+  // Premiere passe : repartition des points de chaque fichier dans les blocs
+  auto dispatch = [&]() {
+    std::map<uint32_t, std::vector<BucketPoint> > buffers;  // Points en attente, par bloc
+    auto flush = [&](uint32_t b, std::vector<BucketPoint>& P) {
+      if (P.size() == 0)
+        return;
+      std::lock_guard<std::mutex> lock(bucket_mutex[b]);
+      std::ofstream out(bucket_file(b), std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+      out.write((const char*)P.data(), P.size() * sizeof(BucketPoint));
+      if (!out.good())
+        failed = true;
+      P.clear();
+    };
+    XLasBlock block(65536, F.Xmin, F.Ymax, 0.);  // Coordonnees relatives au coin haut gauche de l'image
+    for (uint32_t f = next++; f < m_Files.size(); f = next++) {
+      if (failed)
+        return;
+      XLasFile las;
+      if (las.Open(m_Files[f].filename)) {
+        if (!m_Files[f].indexfile.empty())
+          las.SetIndexFile(m_Files[f].indexfile);
+        if (las.SetWorld(F, -1e30, 1e30)) {
+          las.SetClassifFilter(classif_visibility);
+          uint32_t nb;
+          while ((nb = las.GetNextBlock(&block)) > 0) {
+            for (uint32_t p = 0; p < nb; p++) {
+              BucketPoint P = { (int32_t)XRint(block.X[p] / gsd), (int32_t)XRint(-block.Y[p] / gsd), block.Z[p] };
+              // Blocs dont l'emprise [bx * B - R, (bx + 1) * B + R[ contient le pixel
+              int bx0 = XMax(floor_div(P.u - (int)R), 0), bx1 = XMin(floor_div(P.u + (int)R), (int)nbBlockW - 1);
+              int by0 = XMax(floor_div(P.v - (int)R), 0), by1 = XMin(floor_div(P.v + (int)R), (int)nbBlockH - 1);
+              for (int by = by0; by <= by1; by++)
+                for (int bx = bx0; bx <= bx1; bx++) {
+                  uint32_t b = (uint32_t)by * nbBlockW + (uint32_t)bx;
+                  std::vector<BucketPoint>& buffer = buffers[b];
+                  buffer.push_back(P);
+                  if (buffer.size() >= 65536)
+                    flush(b, buffer);
+                }
+            }
+          }
+        }
+      }
+      for (auto iter = buffers.begin(); iter != buffers.end(); ++iter) {
+        flush(iter->first, iter->second);
+        std::lock_guard<std::mutex> lock(mutex);
+        bucket_used[iter->first] = true;
+      }
+      buffers.clear();
+      std::lock_guard<std::mutex> lock(mutex);
+      XWaitStepIt(wait);
+      if (XWaitCheckCancel(wait))
+        failed = true;
+    }
+  };
+
+  // Seconde passe : calcul des blocs
+  auto worker = [&]() {
+    // Buffers propres au thread, reutilises d'un bloc a l'autre
+    uint32_t S = B + 2 * R;   // Cote du bloc avec la marge necessaire au bouchage
+    std::vector<float> area, value;
+    std::vector<uint32_t> count;
+    std::vector<InlineStat> stat;
+    std::vector<float> tile(T * T);
+    std::vector<uint8_t> encoded;
+    std::vector<BucketPoint> points(65536);
+    for (uint32_t b = next++; b < nbBlock; b = next++) {
+      if (failed)
+        return;
+      // Emprise du bloc avec sa marge, en pixels de l'image globale
+      int bx0 = (int)((b % nbBlockW) * B), by0 = (int)((b / nbBlockW) * B);
+      int x0 = bx0 - (int)R, y0 = by0 - (int)R;
+      area.assign((size_t)S * S, 0.f);
+      count.assign((size_t)S * S, 0);
+      if (algo == XLasFile::StdDev)
+        stat.assign((size_t)S * S, InlineStat());
+
+      // Accumulation des points du bloc
+      bool used;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        used = bucket_used[b];
+      }
+      std::ifstream in;
+      if (used)
+        in.open(bucket_file(b), std::ios_base::in | std::ios_base::binary);
+      while (in.is_open() && in.good()) {
+        in.read((char*)points.data(), points.size() * sizeof(BucketPoint));
+        size_t nb = (size_t)in.gcount() / sizeof(BucketPoint);
+        for (size_t p = 0; p < nb; p++) {
+          int u = points[p].u - x0;
+          int v = points[p].v - y0;
+          if ((u < 0) || (v < 0) || ((uint32_t)u >= S) || ((uint32_t)v >= S))
+            continue;
+          size_t k = (size_t)v * S + u;
+          float Z = points[p].Z;
+          if (algo == XLasFile::StdDev)
+            stat[k].AddValue(Z);
+          if (count[k] == 0)
+            area[k] = Z;
+          else {
+            switch (algo) {
+            case XLasFile::ZAverage: area[k] += Z; break;
+            case XLasFile::ZMinimum: if (area[k] > Z) area[k] = Z; break;
+            case XLasFile::ZMaximum: if (area[k] < Z) area[k] = Z; break;
+            default:;
+            }
+          }
+          count[k]++;
+        }
+      }
+      if (in.is_open()) {
+        in.close();
+        std::remove(bucket_file(b).c_str());
+      }
+      for (size_t k = 0; k < area.size(); k++) {
+        if (count[k] == 0)
+          area[k] = -9999.f;
+        else if (algo == XLasFile::ZAverage)
+          area[k] /= count[k];
+        else if (algo == XLasFile::StdDev)
+          area[k] = (float)stat[k].StandardDeviation();
+      }
+
+      // Bouchage des trous par ponderation inverse au carre de la distance
+      value = area;
+      if (R > 0) {
+        for (uint32_t v = R; v < S - R; v++) {
+          for (uint32_t u = R; u < S - R; u++) {
+            if (count[(size_t)v * S + u] > 0)
+              continue;
+            double sum = 0., sumW = 0.;
+            for (uint32_t j = v - R; j <= v + R; j++)
+              for (uint32_t i = u - R; i <= u + R; i++) {
+                if (count[(size_t)j * S + i] == 0)
+                  continue;
+                double d2 = ((double)i - u) * ((double)i - u) + ((double)j - v) * ((double)j - v);
+                if (d2 > (double)R * R)
+                  continue;
+                sum += area[(size_t)j * S + i] / d2;
+                sumW += 1. / d2;
+              }
+            if (sumW > 0.)
+              value[(size_t)v * S + u] = (float)(sum / sumW);
+          }
+        }
+      }
+
+      // Decoupage du bloc en dalles, codage dans le thread puis ecriture sequentielle
+      for (int ty = by0; ty < XMin(by0 + (int)B, (int)H); ty += T) {
+        for (int tx = bx0; tx < XMin(bx0 + (int)B, (int)W); tx += T) {
+          for (uint32_t j = 0; j < T; j++)
+            for (uint32_t i = 0; i < T; i++) {
+              int u = tx + (int)i, v = ty + (int)j;
+              if ((u >= (int)W) || (v >= (int)H))
+                tile[j * T + i] = -9999.f;
+              else
+                tile[j * T + i] = value[(size_t)(v - y0) * S + (u - x0)];
+            }
+          if (!writer.EncodeTile((uint8_t*)tile.data(), encoded)) {
+            failed = true;
+            return;
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!writer.WriteEncodedTile((ty / T) * nbTileW + (tx / T), encoded)) {
+            failed = true;
+            return;
+          }
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      XWaitStepIt(wait);
+      if (XWaitCheckCancel(wait))
+        failed = true;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  int nbDispatch = (int)XMin((size_t)nbThread, m_Files.size());
+  for (int i = 1; i < nbDispatch; i++)
+    threads.emplace_back(dispatch);
+  dispatch();
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  threads.clear();
+
+  if (!failed) {
+    next = 0;
+    int nbWorker = (int)XMin((uint32_t)nbThread, nbBlock);
+    for (int i = 1; i < nbWorker; i++)
+      threads.emplace_back(worker);
+    worker();
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+  }
+  for (uint32_t b = 0; b < nbBlock; b++)  // Fichiers temporaires restants en cas d'erreur
+    if (bucket_used[b])
+      std::remove(bucket_file(b).c_str());
+
+  bool flag = writer.EndTiled();
+  if (failed) {
+    std::remove(file_out.c_str());
+    return false;
+  }
+  return flag;
+}
+
+//-----------------------------------------------------------------------------
+// Cellule des rasters de synthese
+// Les LasOverviewNbClass classes les plus frequentes sont comptees (Space-Saving) :
+// les comptes sont exacts tant que la cellule n'a pas plus de LasOverviewNbClass classes
+//-----------------------------------------------------------------------------
+static const int LasOverviewNbClass = 8;
+
+struct LasOverviewCell {
+  uint32_t count;
+  uint8_t classif[LasOverviewNbClass];
+  uint32_t nbClassif[LasOverviewNbClass];  // 0 : emplacement libre, les emplacements sont remplis dans l'ordre
+  double sumZ, sumR, sumG, sumB, sumNir, sumI;
+};
+
+//-----------------------------------------------------------------------------
+// Ajout de nb points de la classe classif dans une cellule
+// Si tous les emplacements sont pris, la classe la moins frequente est remplacee
+//-----------------------------------------------------------------------------
+static void LasOverviewAddClass(LasOverviewCell& cell, uint8_t classif, uint32_t nb)
+{
+  int kmin = 0;
+  for (int k = 0; k < LasOverviewNbClass; k++) {
+    if (cell.nbClassif[k] == 0)
+      cell.classif[k] = classif;
+    if (cell.classif[k] == classif) {
+      cell.nbClassif[k] += nb;
+      return;
+    }
+    if (cell.nbClassif[k] < cell.nbClassif[kmin])
+      kmin = k;
+  }
+  cell.classif[kmin] = classif;
+  cell.nbClassif[kmin] += nb;
+}
+
+//-----------------------------------------------------------------------------
+// Classe la plus frequente d'une cellule, la plus petite classe en cas d'egalite
+//-----------------------------------------------------------------------------
+static uint8_t LasOverviewMode(const LasOverviewCell& cell)
+{
+  int kmax = 0;
+  for (int k = 1; k < LasOverviewNbClass; k++) {
+    if (cell.nbClassif[k] == 0)
+      break;
+    if ((cell.nbClassif[k] > cell.nbClassif[kmax]) ||
+        ((cell.nbClassif[k] == cell.nbClassif[kmax]) && (cell.classif[k] < cell.classif[kmax])))
+      kmax = k;
+  }
+  return cell.classif[kmax];
+}
+
+//-----------------------------------------------------------------------------
+// Calcul des rasters de synthese multi-resolution
+// Le niveau 0 a une resolution gsd, chaque niveau suivant divise la taille par 2.
+// Les fichiers sont ecrits sous le nom OverviewFilename(prefix, niveau)
+//-----------------------------------------------------------------------------
+bool XLasFile::ComputeOverviews(std::string prefix, double gsd, XError* error, XWait* wait)
+{
+  if (!ReOpen())	// Le fichier LAS n'a pas ete ouvert
+    return false;
+  if (gsd <= 0.) {
+    CloseIfNeeded();
+    return XErrorError(error, "XLasFile::ComputeOverviews", XError::eBadData);
+  }
+
+  XFrame F = XFrame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
+  F.Xmin = gsd * floor(F.Xmin / gsd);
+  F.Ymin = gsd * floor(F.Ymin / gsd);
+  F.Xmax = gsd * ceil(F.Xmax / gsd);
+  F.Ymax = gsd * ceil(F.Ymax / gsd);
+  uint32_t W = XMax((uint32_t)ceil(F.Width() / gsd), (uint32_t)1);
+  uint32_t H = XMax((uint32_t)ceil(F.Height() / gsd), (uint32_t)1);
+
+  std::vector<LasOverviewCell> cells;
+  cells.resize((size_t)W * H);
+  ::memset(cells.data(), 0, cells.size() * sizeof(LasOverviewCell));
+
+  bool newClassif = IsNewClassification();
+  uint64_t nbPoint = NbLasPoints();
+  laszip_seek_point(m_Reader, 0);
+  for (uint64_t i = 0; i < nbPoint; i++) {
+    if ((i % 1000000) == 0)
+      if (XWaitCheckCancel(wait)) {
+        CloseIfNeeded();
+        return false;
+      }
+    laszip_read_point(m_Reader);
+    double X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
+    double Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
+    int u = (int)floor((X - F.Xmin) / gsd);
+    int v = (int)floor((F.Ymax - Y) / gsd);
+    if ((u < 0) || (v < 0) || ((uint32_t)u >= W) || ((uint32_t)v >= H))
+      continue;
+    LasOverviewCell& cell = cells[(size_t)v * W + u];
+    uint8_t classif = m_Point->classification;
+    if (newClassif)
+      classif = m_Point->extended_classification;
+    LasOverviewAddClass(cell, classif, 1);
+    cell.count++;
+    cell.sumZ += m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+    cell.sumR += m_Point->rgb[0];
+    cell.sumG += m_Point->rgb[1];
+    cell.sumB += m_Point->rgb[2];
+    cell.sumNir += m_Point->rgb[3];
+    cell.sumI += m_Point->intensity;
+  }
+
+  std::vector<float> area;
+  int level = 0;
+  while (true) {
+    // Ecriture du niveau courant
+    area.assign((size_t)W * H * OverviewNbBand, 0.f);
+    for (size_t i = 0; i < (size_t)W * H; i++) {
+      const LasOverviewCell& cell = cells[i];
+      if (cell.count == 0)
+        continue;
+      float* pix = &area[i * OverviewNbBand];
+      pix[OverviewDensity] = (float)(cell.count / (gsd * gsd));
+      pix[OverviewZ] = (float)(cell.sumZ / cell.count);
+      pix[OverviewClass] = (float)LasOverviewMode(cell);
+      pix[OverviewR] = (float)(cell.sumR / cell.count / 256.);
+      pix[OverviewG] = (float)(cell.sumG / cell.count / 256.);
+      pix[OverviewB] = (float)(cell.sumB / cell.count / 256.);
+      pix[OverviewNir] = (float)(cell.sumNir / cell.count / 256.);
+      pix[OverviewIntensity] = (float)(cell.sumI / cell.count);
+    }
+    // Ecriture dans un fichier temporaire renomme ensuite : un niveau present est toujours complet
+    std::string filename = OverviewFilename(prefix, level);
+    std::string tmpname = filename + ".tmp";
+    XTiffWriter writer;
+    writer.SetGeoTiff(F.Xmin, F.Ymax, gsd);
+    if (!writer.Write(tmpname.c_str(), W, H, OverviewNbBand, 32, (uint8_t*)area.data(), 3)) {
+      CloseIfNeeded();
+      return XErrorError(error, "XLasFile::ComputeOverviews", XError::eIOWrite);
+    }
+    std::remove(filename.c_str());
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+      CloseIfNeeded();
+      return XErrorError(error, "XLasFile::ComputeOverviews", XError::eIOWrite);
+    }
+    if ((W <= 16) && (H <= 16))
+      break;
+    if (XWaitCheckCancel(wait)) {
+      CloseIfNeeded();
+      return false;
+    }
+
+    // Niveau suivant : regroupement par blocs de 2x2 cellules
+    uint32_t W2 = (W + 1) / 2, H2 = (H + 1) / 2;
+    std::vector<LasOverviewCell> next;
+    next.resize((size_t)W2 * H2);
+    ::memset(next.data(), 0, next.size() * sizeof(LasOverviewCell));
+    for (uint32_t v = 0; v < H; v++) {
+      for (uint32_t u = 0; u < W; u++) {
+        const LasOverviewCell& cell = cells[(size_t)v * W + u];
+        if (cell.count == 0)
+          continue;
+        LasOverviewCell& parent = next[(size_t)(v / 2) * W2 + (u / 2)];
+        for (int k = 0; (k < LasOverviewNbClass) && (cell.nbClassif[k] > 0); k++)  // Fusion des comptes par classe
+          LasOverviewAddClass(parent, cell.classif[k], cell.nbClassif[k]);
+        parent.count += cell.count;
+        parent.sumZ += cell.sumZ;
+        parent.sumR += cell.sumR;
+        parent.sumG += cell.sumG;
+        parent.sumB += cell.sumB;
+        parent.sumNir += cell.sumNir;
+        parent.sumI += cell.sumI;
+      }
+    }
+    cells.swap(next);
+    W = W2;
+    H = H2;
+    gsd *= 2.;
+    level++;
+  }
+  CloseIfNeeded();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Calcul des statistiques
+//-----------------------------------------------------------------------------
+bool XLasFile::StatLas(std::string file_out, std::ofstream* mif, std::ofstream* mid)
+{
+  XLasStat stat;
+  if (!ComputeStat(stat))
+    return false;
+  std::ofstream out;
+  out.open(file_out);
+  if (!out.good())
+    return false;
+  stat.WriteText(&out);
+  if ((mif != nullptr) && (mid != nullptr))
+    stat.WriteMifMid(mif, mid);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Calcul des statistiques en une passe : entete, emprise, classes, retours, temps GPS, densite
+//-----------------------------------------------------------------------------
+bool XLasFile::ComputeStat(XLasStat& stat, double densityCell, XWait* wait)
+{
+  if (!ReOpen())	// Le fichier LAS n'a pas ete ouvert
+    return false;
+  stat.Clear();
+  stat.filename = m_strFilename;
+  stat.software = m_Header->generating_software;
+  stat.systemId = m_Header->system_identifier;
+  stat.globalEncoding = m_Header->global_encoding;
+  stat.versionMajor = m_Header->version_major;
+  stat.versionMinor = m_Header->version_minor;
+  stat.pointFormat = m_Header->point_data_format;
+  stat.day = m_Header->file_creation_day;
+  stat.year = m_Header->file_creation_year;
+  stat.headerFrame = XFrame(m_Header->min_x, m_Header->min_y, m_Header->max_x, m_Header->max_y);
+  stat.headerZmin = m_Header->min_z;
+  stat.headerZmax = m_Header->max_z;
+  stat.headerNbPoint = NbLasPoints();
+  for (int i = 0; i < 15; i++) {
+    if (m_Header->number_of_point_records)
+      stat.headerByReturn[i] = (i < 5) ? m_Header->number_of_points_by_return[i] : 0;
+    else
+      stat.headerByReturn[i] = m_Header->extended_number_of_points_by_return[i];
+  }
+
+  // Grille de densite alignee sur la taille des cellules
+  if (densityCell > 0.) {
+    stat.densityCell = densityCell;
+    stat.densityX0 = densityCell * floor(stat.headerFrame.Xmin / densityCell);
+    stat.densityY0 = densityCell * ceil(stat.headerFrame.Ymax / densityCell);
+    stat.densityW = XMax((uint32_t)ceil((stat.headerFrame.Xmax - stat.densityX0) / densityCell), (uint32_t)1);
+    stat.densityH = XMax((uint32_t)ceil((stat.densityY0 - stat.headerFrame.Ymin) / densityCell), (uint32_t)1);
+    stat.density.assign((size_t)stat.densityW * stat.densityH, 0);
+  }
+
+  // Tolerance d'un pas de quantification sur l'emprise de l'entete
+  XFrame F = stat.headerFrame;
+  F.Xmin -= m_Header->x_scale_factor; F.Xmax += m_Header->x_scale_factor;
+  F.Ymin -= m_Header->y_scale_factor; F.Ymax += m_Header->y_scale_factor;
+  bool extended = (m_Header->point_data_format >= 6);
+  bool newClassif = IsNewClassification();
+  double X, Y, Z, gps_time;
+  laszip_seek_point(m_Reader, 0);
+  for (uint64_t i = 0; i < NbLasPoints(); i++) {
+    if ((i % 1000000) == 0)
+      if (XWaitCheckCancel(wait)) {
+        CloseIfNeeded();
+        return false;
+      }
+    if (laszip_read_point(m_Reader))
+      break;
+    X = m_Point->X * m_Header->x_scale_factor + m_Header->x_offset;
+    Y = m_Point->Y * m_Header->y_scale_factor + m_Header->y_offset;
+    Z = m_Point->Z * m_Header->z_scale_factor + m_Header->z_offset;
+    gps_time = m_Point->gps_time;
+    uint8_t classification = m_Point->classification;
+    if (newClassif)
+      classification = m_Point->extended_classification;
+    int ret = extended ? m_Point->extended_return_number : m_Point->return_number;
+    int nb_ret = extended ? m_Point->extended_number_of_returns : m_Point->number_of_returns;
+
+    if (stat.nbRead == 0) { // Premier point
+      stat.frame = XFrame(X, Y, X, Y);
+      stat.zmin = stat.zmax = Z;
+      stat.gpsTimeMin = stat.gpsTimeMax = gps_time;
+    }
+    stat.frame.Xmin = XMin(stat.frame.Xmin, X);
+    stat.frame.Xmax = XMax(stat.frame.Xmax, X);
+    stat.frame.Ymin = XMin(stat.frame.Ymin, Y);
+    stat.frame.Ymax = XMax(stat.frame.Ymax, Y);
+    stat.zmin = XMin(stat.zmin, Z);
+    stat.zmax = XMax(stat.zmax, Z);
+    stat.gpsTimeMin = XMin(stat.gpsTimeMin, gps_time);
+    stat.gpsTimeMax = XMax(stat.gpsTimeMax, gps_time);
+    stat.classif[classification]++;
+    stat.returns[ret][nb_ret]++;
+    if ((ret == 0) || (ret > nb_ret))
+      stat.nbBadReturn++;
+    if (!F.IsIn(XPt2D(X, Y)))
+      stat.nbOutside++;
+    if (stat.density.size() > 0) {
+      int u = (int)floor((X - stat.densityX0) / densityCell);
+      int v = (int)floor((stat.densityY0 - Y) / densityCell);
+      if ((u >= 0) && (v >= 0) && ((uint32_t)u < stat.densityW) && ((uint32_t)v < stat.densityH))
+        stat.density[(size_t)v * stat.densityW + u]++;
+    }
+    stat.nbRead++;
+  }
+  CloseIfNeeded();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : remise a zero
+//-----------------------------------------------------------------------------
+void XLasStat::Clear()
+{
+  filename = software = systemId = "";
+  globalEncoding = versionMajor = versionMinor = pointFormat = day = year = 0;
+  headerFrame = frame = XFrame();
+  headerZmin = headerZmax = zmin = zmax = gpsTimeMin = gpsTimeMax = 0.;
+  headerNbPoint = nbRead = nbOutside = nbBadReturn = 0;
+  memset(headerByReturn, 0, sizeof(headerByReturn));
+  memset(classif, 0, sizeof(classif));
+  memset(returns, 0, sizeof(returns));
+  densityCell = densityX0 = densityY0 = 0.;
+  densityW = densityH = 0;
+  density.clear();
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : nombre de points lus pour un numero de retour
+//-----------------------------------------------------------------------------
+uint64_t XLasStat::ByReturn(int num) const
+{
+  uint64_t count = 0;
+  for (int i = 0; i < 16; i++)
+    count += returns[num][i];
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : coherence entre l'entete et les points
+//-----------------------------------------------------------------------------
+bool XLasStat::IsConsistent() const
+{
+  if ((nbRead != headerNbPoint) || (nbOutside > 0) || (nbBadReturn > 0))
+    return false;
+  for (int i = 0; i < 15; i++)
+    if (headerByReturn[i] != ByReturn(i + 1))
+      return false;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : densite minimum, moyenne et maximum (points / m2) sur les cellules non vides
+// et proportion de cellules vides
+//-----------------------------------------------------------------------------
+void XLasStat::DensityStat(double& dmin, double& dmean, double& dmax, double& empty) const
+{
+  dmin = dmean = dmax = empty = 0.;
+  if (density.size() < 1)
+    return;
+  uint32_t cmin = 0xFFFFFFFF, cmax = 0;
+  uint64_t sum = 0, nb = 0;
+  for (size_t i = 0; i < density.size(); i++) {
+    if (density[i] == 0)
+      continue;
+    cmin = XMin(cmin, density[i]);
+    cmax = XMax(cmax, density[i]);
+    sum += density[i];
+    nb++;
+  }
+  double area = densityCell * densityCell;
+  empty = 1. - (double)nb / (double)density.size();
+  if (nb == 0)
+    return;
+  dmin = cmin / area;
+  dmax = cmax / area;
+  dmean = ((double)sum / nb) / area;
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : rapport texte
+//-----------------------------------------------------------------------------
+bool XLasStat::WriteText(std::ostream* out) const
+{
+  std::ostream& o = *out;
+  o.setf(std::ios::fixed);
+  o.precision(3);
+  o << "Statistiques fichier : " << filename << std::endl;
+  o << "===================================================================" << std::endl;
+  o << std::endl << "Donnees d'entete : " << std::endl;
+  o << "Software : " << software << std::endl;
+  o << "SystemID : " << systemId << std::endl;
+  o << "Global encoding : " << globalEncoding << std::endl;
+  o << "Version : " << versionMajor << "." << versionMinor << std::endl;
+  o << "Format des points : " << pointFormat << std::endl;
+  o << "Date : " << day << "/" << year << std::endl;
+  o << "XMin entete : " << headerFrame.Xmin << std::endl;
+  o << "XMax entete : " << headerFrame.Xmax << std::endl;
+  o << "YMin entete : " << headerFrame.Ymin << std::endl;
+  o << "YMax entete : " << headerFrame.Ymax << std::endl;
+  o << "ZMin entete : " << headerZmin << std::endl;
+  o << "ZMax entete : " << headerZmax << std::endl;
+
+  o << std::endl;
+  o << "Lecture du fichier : " << filename << std::endl;
+  o << "===================================================================" << std::endl;
+  o << "Nombre de points dans le fichier : " << headerNbPoint << std::endl;
+  o << "Nombre de points lus: " << nbRead << std::endl;
+
+  o << "===================================================================" << std::endl;
+  o << "Xmin = " << frame.Xmin << std::endl;
+  o << "Xmax = " << frame.Xmax << std::endl;
+  o << "Ymin = " << frame.Ymin << std::endl;
+  o << "Ymax = " << frame.Ymax << std::endl;
+  o << "Zmin = " << zmin << std::endl;
+  o << "Zmax = " << zmax << std::endl;
+  o << "GPS Time Min = " << gpsTimeMin << std::endl;
+  o << "GPS Time Max = " << gpsTimeMax << std::endl;
+
+  static const char* classif_name[23] = { "Created, Never Classified", "Unclassified", "Ground", "Low Vegetation",
+    "Medium Vegetation", "High Vegetation", "Building", "Low Point (Noise)", "Reserved", "Water", "Rail", "Road Surface",
+    "", "Wire - Guard (Shield)", "Wire - Conductor (Phase)", "Transmission Tower", "Wire-Structure Connector",
+    "Bridge Deck", "High Noise", "Overhead Structure", "Ignored Ground", "Snow", "Temporal Exclusion" };
+  o << "===================================================================" << std::endl;
+  o << "Classifications : " << std::endl;
+  for (int i = 0; i < 23; i++) {
+    o << i << " : ";
+    if (classif_name[i][0] != '\0')
+      o << classif_name[i] << " : ";
+    o << classif[i] << std::endl;
+  }
+
+  o << "===================================================================" << std::endl;
+  o << "Classifications etendues : " << std::endl;
+  for (int i = 23; i < 256; i++) {
+    if (classif[i] > 0)
+      o << i << " : " << classif[i] << std::endl;
+  }
+
+  o << "===================================================================" << std::endl;
+  o << "Retours (numero / nombre de retours : points) : " << std::endl;
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      if (returns[i][j] > 0)
+        o << i << " / " << j << " : " << returns[i][j] << std::endl;
+
+  double dmin, dmean, dmax, empty;
+  DensityStat(dmin, dmean, dmax, empty);
+  o << "===================================================================" << std::endl;
+  o << "Densite (points / m2, cellules de " << densityCell << " m) : " << std::endl;
+  o << "Minimum = " << dmin << std::endl;
+  o << "Moyenne = " << dmean << std::endl;
+  o << "Maximum = " << dmax << std::endl;
+  o << "Cellules vides = " << empty * 100. << " %" << std::endl;
+
+  o << "===================================================================" << std::endl;
+  o << "Coherence : " << (IsConsistent() ? "OK" : "ERREUR") << std::endl;
+  if (nbRead != headerNbPoint)
+    o << "Nombre de points lus different de l'entete" << std::endl;
+  if (nbOutside > 0)
+    o << "Points hors de l'emprise de l'entete : " << nbOutside << std::endl;
+  if (nbBadReturn > 0)
+    o << "Points avec un numero de retour invalide : " << nbBadReturn << std::endl;
+  for (int i = 0; i < 15; i++)
+    if (headerByReturn[i] != ByReturn(i + 1))
+      o << "Retour " << i + 1 << " : " << headerByReturn[i] << " dans l'entete, " << ByReturn(i + 1) << " lus" << std::endl;
+  return o.good();
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : emprise et comptage par classe au format MIF/MID
+//-----------------------------------------------------------------------------
+bool XLasStat::WriteMifMid(std::ostream* mif, std::ostream* mid) const
+{
+  *mif << "REGION 1" << std::endl;
+  *mif << "5" << std::endl;
+  *mif << frame.Xmin << " " << frame.Ymin << std::endl;
+  *mif << frame.Xmin << " " << frame.Ymax << std::endl;
+  *mif << frame.Xmax << " " << frame.Ymax << std::endl;
+  *mif << frame.Xmax << " " << frame.Ymin << std::endl;
+  *mif << frame.Xmin << " " << frame.Ymin << std::endl;
+
+  uint64_t classif_autre = classif[7] + classif[8];
+  for (unsigned int i = 10; i < 17; i++)
+    classif_autre += classif[i];
+  for (unsigned int i = 18; i < 64; i++)
+    classif_autre += classif[i];
+  for (unsigned int i = 68; i < 256; i++)
+    classif_autre += classif[i];
+  std::string name = filename.substr(filename.rfind('\\') + 1);
+
+  *mid << name << "\t" << zmin << "\t" << zmax << "\t"
+    << classif[0] << "\t" << classif[1] << "\t" << classif[2] << "\t"
+    << classif[3] << "\t" << classif[4] << "\t" << classif[5] << "\t"
+    << classif[6] << "\t" << classif[9] << "\t" << classif[17] << "\t"
+    << classif[64] << "\t" << classif[65] << "\t" << classif[66] << "\t"
+    << classif[67] << "\t" << classif_autre
+    << std::endl;
+  return mid->good();
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : objet JSON
+//-----------------------------------------------------------------------------
+bool XLasStat::WriteJson(std::ostream* out) const
+{
+  std::ostream& o = *out;
+  std::string name;
+  for (size_t i = 0; i < filename.size(); i++) {  // Echappement des separateurs Windows et des guillemets
+    if ((filename[i] == '\\') || (filename[i] == '"'))
+      name += '\\';
+    name += filename[i];
+  }
+  double dmin, dmean, dmax, empty;
+  DensityStat(dmin, dmean, dmax, empty);
+  o.setf(std::ios::fixed);
+  o.precision(3);
+  o << "{ \"file\": \"" << name << "\", \"version\": \"" << versionMajor << "." << versionMinor << "\""
+    << ", \"point_format\": " << pointFormat << ", \"consistent\": " << (IsConsistent() ? "true" : "false")
+    << ", \"header_points\": " << headerNbPoint << ", \"read_points\": " << nbRead
+    << ", \"outside_points\": " << nbOutside << ", \"bad_return_points\": " << nbBadReturn
+    << ", \"frame\": [" << frame.Xmin << ", " << frame.Ymin << ", " << frame.Xmax << ", " << frame.Ymax << "]"
+    << ", \"header_frame\": [" << headerFrame.Xmin << ", " << headerFrame.Ymin << ", " << headerFrame.Xmax << ", " << headerFrame.Ymax << "]"
+    << ", \"z\": [" << zmin << ", " << zmax << "], \"gps_time\": [" << gpsTimeMin << ", " << gpsTimeMax << "]"
+    << ", \"density\": { \"cell\": " << densityCell << ", \"min\": " << dmin << ", \"mean\": " << dmean
+    << ", \"max\": " << dmax << ", \"empty\": " << empty << " }";
+  o << ", \"classification\": {";
+  bool first = true;
+  for (int i = 0; i < 256; i++) {
+    if (classif[i] == 0)
+      continue;
+    o << (first ? " " : ", ") << "\"" << i << "\": " << classif[i];
+    first = false;
+  }
+  o << " }, \"returns\": [";
+  first = true;
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++) {
+      if (returns[i][j] == 0)
+        continue;
+      o << (first ? " " : ", ") << "[" << i << ", " << j << ", " << returns[i][j] << "]";
+      first = false;
+    }
+  o << " ] }";
+  return o.good();
+}
+
+//-----------------------------------------------------------------------------
+// XLasStat : grille de densite en GeoTIFF (points / m2)
+//-----------------------------------------------------------------------------
+bool XLasStat::WriteDensity(std::string file_out) const
+{
+  if (density.size() < 1)
+    return false;
+  std::vector<float> area(density.size());
+  for (size_t i = 0; i < density.size(); i++)
+    area[i] = (float)(density[i] / (densityCell * densityCell));
+  XTiffWriter writer;
+  writer.SetGeoTiff(densityX0, densityY0, densityCell);
+  return writer.Write(file_out.c_str(), densityW, densityH, 1, 32, (uint8_t*)area.data(), 3);
+}
+
+//-----------------------------------------------------------------------------
+// Gestion du COPC
+//-----------------------------------------------------------------------------
+bool XLasFile::IsCopc()
+{
+  if (m_Header->number_of_extended_variable_length_records < 1)
     return false;
   if (m_Header->vlrs[0].record_id != 1)
     return false;
@@ -492,6 +1841,7 @@ bool CopcReader::SetInfo(laszip_U8* data, std::string filename)
   m_dHalfSize = info->halfsize;
   m_dXmin = info->center_x - info->halfsize;
   m_dYmin = info->center_y - info->halfsize;
+  m_dZmin = info->center_z - info->halfsize;
   Entry* entries = new Entry[nb_entries];
   std::ifstream in;
   in.open(filename, std::ios_base::in | std::ios_base::binary);
@@ -506,7 +1856,7 @@ bool CopcReader::SetInfo(laszip_U8* data, std::string filename)
   std::sort(m_Entries.begin(), m_Entries.end(), PredEntriesOffset);
   uint64_t count = 0;
   for (int i = 0; i < m_Entries.size(); i++) {
-    m_Entries[i].offset = i + count;
+    m_Entries[i].offset = count;
     count += m_Entries[i].pointCount;
   }
   // Passage en ordre de profondeur
@@ -536,3 +1886,809 @@ bool CopcReader::ReadSubPages(std::ifstream* in, Entry* entries, int nb_entries)
   }
   return true;
 }
+
+//-----------------------------------------------------------------------------
+// Codage arithmetique de la table des chunks LAZ
+// Reprise du codeur de LASzip (ArithmeticEncoder, IntegerCompressor(32 bits, 2 contextes)),
+// necessaire pour ecrire une table de chunks de taille variable
+//-----------------------------------------------------------------------------
+namespace {
+  const uint32_t LazMinLength = 0x01000000U;
+  const uint32_t LazBitLengthShift = 13;
+  const uint32_t LazBitMaxCount = 1 << LazBitLengthShift;
+  const uint32_t LazSymbolLengthShift = 15;
+  const uint32_t LazSymbolMaxCount = 1 << LazSymbolLengthShift;
+
+  struct LazBitModel {
+    uint32_t bit0Prob, bit0Count, bitCount, updateCycle, bitsUntilUpdate;
+    LazBitModel() { bit0Count = 1; bitCount = 2; bit0Prob = 1U << (LazBitLengthShift - 1); updateCycle = bitsUntilUpdate = 4; }
+    void Update()
+    {
+      if ((bitCount += updateCycle) > LazBitMaxCount) {
+        bitCount = (bitCount + 1) >> 1;
+        bit0Count = (bit0Count + 1) >> 1;
+        if (bit0Count == bitCount) ++bitCount;
+      }
+      uint32_t scale = 0x80000000U / bitCount;
+      bit0Prob = (bit0Count * scale) >> (31 - LazBitLengthShift);
+      updateCycle = (5 * updateCycle) >> 2;
+      if (updateCycle > 64) updateCycle = 64;
+      bitsUntilUpdate = updateCycle;
+    }
+  };
+
+  struct LazSymbolModel {
+    uint32_t symbols, lastSymbol, totalCount, updateCycle, symbolsUntilUpdate;
+    std::vector<uint32_t> distribution, symbolCount;
+    LazSymbolModel(uint32_t n)
+    {
+      symbols = n;
+      lastSymbol = n - 1;
+      distribution.resize(n);
+      symbolCount.assign(n, 1);
+      totalCount = 0;
+      updateCycle = symbols;
+      Update();
+      symbolsUntilUpdate = updateCycle = (symbols + 6) >> 1;
+    }
+    void Update()
+    {
+      if ((totalCount += updateCycle) > LazSymbolMaxCount) {
+        totalCount = 0;
+        for (uint32_t n = 0; n < symbols; n++)
+          totalCount += (symbolCount[n] = (symbolCount[n] + 1) >> 1);
+      }
+      uint32_t sum = 0, scale = 0x80000000U / totalCount;
+      for (uint32_t k = 0; k < symbols; k++) {
+        distribution[k] = (scale * sum) >> (31 - LazSymbolLengthShift);
+        sum += symbolCount[k];
+      }
+      updateCycle = (5 * updateCycle) >> 2;
+      uint32_t maxCycle = (symbols + 6) << 3;
+      if (updateCycle > maxCycle) updateCycle = maxCycle;
+      symbolsUntilUpdate = updateCycle;
+    }
+  };
+
+  class LazEncoder {
+  public:
+    std::vector<uint8_t> out;
+    LazEncoder() { base = 0; length = 0xFFFFFFFFU; }
+
+    void EncodeBit(LazBitModel& m, uint32_t sym)
+    {
+      uint32_t x = m.bit0Prob * (length >> LazBitLengthShift);
+      if (sym == 0) {
+        length = x;
+        ++m.bit0Count;
+      }
+      else {
+        uint32_t init_base = base;
+        base += x;
+        length -= x;
+        if (init_base > base) PropagateCarry();
+      }
+      if (length < LazMinLength) Renorm();
+      if (--m.bitsUntilUpdate == 0) m.Update();
+    }
+    void EncodeSymbol(LazSymbolModel& m, uint32_t sym)
+    {
+      uint32_t x, init_base = base;
+      if (sym == m.lastSymbol) {
+        x = m.distribution[sym] * (length >> LazSymbolLengthShift);
+        base += x;
+        length -= x;
+      }
+      else {
+        x = m.distribution[sym] * (length >>= LazSymbolLengthShift);
+        base += x;
+        length = m.distribution[sym + 1] * length - x;
+      }
+      if (init_base > base) PropagateCarry();
+      if (length < LazMinLength) Renorm();
+      ++m.symbolCount[sym];
+      if (--m.symbolsUntilUpdate == 0) m.Update();
+    }
+    void WriteBits(uint32_t bits, uint32_t sym)
+    {
+      if (bits > 19) {
+        WriteShort((uint16_t)(sym & 0xFFFF));
+        sym = sym >> 16;
+        bits = bits - 16;
+      }
+      uint32_t init_base = base;
+      base += sym * (length >>= bits);
+      if (init_base > base) PropagateCarry();
+      if (length < LazMinLength) Renorm();
+    }
+    void Done()
+    {
+      uint32_t init_base = base;
+      bool another_byte = true;
+      if (length > 2 * LazMinLength) {
+        base += LazMinLength;
+        length = LazMinLength >> 1;
+      }
+      else {
+        base += LazMinLength >> 1;
+        length = LazMinLength >> 9;
+        another_byte = false;
+      }
+      if (init_base > base) PropagateCarry();
+      Renorm();
+      out.push_back(0);	// Octets nuls pour rester synchrone avec les lectures du decodeur
+      out.push_back(0);
+      if (another_byte) out.push_back(0);
+    }
+
+  protected:
+    uint32_t base, length;
+    void WriteShort(uint16_t sym)
+    {
+      uint32_t init_base = base;
+      base += sym * (length >>= 16);
+      if (init_base > base) PropagateCarry();
+      if (length < LazMinLength) Renorm();
+    }
+    void PropagateCarry()
+    {
+      size_t i = out.size();
+      while (i > 0) {
+        i--;
+        if (out[i] != 0xFFU) {
+          out[i]++;
+          return;
+        }
+        out[i] = 0;
+      }
+    }
+    void Renorm()
+    {
+      do {
+        out.push_back((uint8_t)(base >> 24));
+        base <<= 8;
+      } while ((length <<= 8) < LazMinLength);
+    }
+  };
+
+  // IntegerCompressor de LASzip sur 32 bits (pas de repliement du correcteur)
+  class LazIntegerCompressor {
+  public:
+    LazIntegerCompressor(LazEncoder* enc, uint32_t contexts) : m_Enc(enc)
+    {
+      for (uint32_t i = 0; i < contexts; i++)
+        m_Bits.push_back(LazSymbolModel(33));
+      for (uint32_t i = 1; i <= 32; i++)
+        m_Corrector.push_back(LazSymbolModel(1U << XMin(i, m_nBitsHigh)));
+    }
+    void Compress(int32_t pred, int32_t real, uint32_t context)
+    {
+      int32_t c = (int32_t)((uint32_t)real - (uint32_t)pred);
+      uint32_t c1 = (c <= 0 ? (uint32_t)0 - (uint32_t)c : (uint32_t)c - 1);
+      uint32_t k = 0;
+      while (c1) {
+        c1 = c1 >> 1;
+        k = k + 1;
+      }
+      m_Enc->EncodeSymbol(m_Bits[context], k);
+      if (k == 0) {
+        m_Enc->EncodeBit(m_Corrector0, (c ? 1 : 0));
+        return;
+      }
+      if (k >= 32)
+        return;
+      if (c < 0) c += ((1 << k) - 1);
+      else c -= 1;
+      if (k <= m_nBitsHigh) {
+        m_Enc->EncodeSymbol(m_Corrector[k - 1], (uint32_t)c);
+        return;
+      }
+      uint32_t k1 = k - m_nBitsHigh;
+      c1 = (uint32_t)c & ((1U << k1) - 1);
+      c = c >> k1;
+      m_Enc->EncodeSymbol(m_Corrector[k - 1], (uint32_t)c);
+      m_Enc->WriteBits(k1, c1);
+    }
+  protected:
+    LazEncoder* m_Enc;
+    const uint32_t m_nBitsHigh = 8;
+    std::vector<LazSymbolModel> m_Bits;
+    LazBitModel m_Corrector0;
+    std::vector<LazSymbolModel> m_Corrector;
+  };
+
+  // Cles des noeuds de l'octree : niveau sur 7 bits, x, y, z sur 19 bits
+  // Au niveau XCopcMaxLevel, les coordonnees des noeuds vont jusqu'a 2^XCopcMaxLevel - 1
+  const int XCopcMaxLevel = 19;               // Profondeur maximale de l'octree
+  const uint32_t XCopcGridBits = 7;           // Grille d'echantillonnage de 128^3 cellules par noeud
+  const size_t XCopcNodeSize = 100000;        // Un noeud plus petit n'est pas subdivise
+  const uint64_t XCopcBucketSize = 2000000;   // Nombre moyen de points vise par paquet
+  const int XCopcMaxBucketLevel = 4;
+  const size_t XCopcBucketBuffer = 16384;     // Points conserves en memoire par paquet avant ecriture
+
+  inline uint64_t XCopcKey(int level, uint32_t x, uint32_t y, uint32_t z)
+    { return ((uint64_t)level << 57) | ((uint64_t)x << 38) | ((uint64_t)y << 19) | (uint64_t)z; }
+  inline int XCopcLevel(uint64_t key) { return (int)(key >> 57); }
+  inline uint32_t XCopcX(uint64_t key) { return (uint32_t)((key >> 38) & 0x7FFFF); }
+  inline uint32_t XCopcY(uint64_t key) { return (uint32_t)((key >> 19) & 0x7FFFF); }
+  inline uint32_t XCopcZ(uint64_t key) { return (uint32_t)(key & 0x7FFFF); }
+  static_assert(XCopcMaxLevel <= 19, "Les coordonnees des noeuds sont codees sur 19 bits");
+  inline uint64_t XCopcParent(uint64_t key)
+    { return XCopcKey(XCopcLevel(key) - 1, XCopcX(key) >> 1, XCopcY(key) >> 1, XCopcZ(key) >> 1); }
+
+  template<class T> void XCopcPut(std::vector<char>& buf, size_t pos, T value) { memcpy(&buf[pos], &value, sizeof(T)); }
+  template<class T> T XCopcGet(const std::vector<char>& buf, size_t pos) { T value; memcpy(&value, &buf[pos], sizeof(T)); return value; }
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : constructeur
+//-----------------------------------------------------------------------------
+XCopcWriter::XCopcWriter()
+{
+  m_strSystem = "XCopcWriter";
+  m_strSoftware = "XCopcWriter";
+  m_dScale = 0.01;
+  m_dXOffset = m_dYOffset = m_dZOffset = 0.;
+  m_nXmin = m_nYmin = m_nZmin = m_nXmax = m_nYmax = m_nZmax = 0;
+  m_dGpsMin = m_dGpsMax = 0.;
+  m_nNbPoint = 0;
+  memset(m_nByReturn, 0, sizeof(m_nByReturn));
+  m_nNbThread = 0;
+  m_dX0 = m_dY0 = m_dZ0 = m_dUnit = 0.;
+  m_nCreationDay = m_nCreationYear = 0;
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : fermeture des flux et suppression du fichier temporaire des points
+//-----------------------------------------------------------------------------
+void XCopcWriter::Clear()
+{
+  if (m_Raw.is_open())
+    m_Raw.close();
+  if (m_Out.is_open())
+    m_Out.close();
+  if (!m_strPrefix.empty())
+    remove((m_strPrefix + "_raw.tmp").c_str());
+  m_strPrefix.clear();
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : ouverture, tmpfolder recoit les fichiers temporaires
+//-----------------------------------------------------------------------------
+bool XCopcWriter::Open(std::string filename, std::string tmpfolder, double xoffset, double yoffset, double zoffset, double scale)
+{
+  Clear();
+  m_strFilename = filename;
+  size_t pos = filename.find_last_of("/\\");
+  std::string name = (pos == std::string::npos) ? filename : filename.substr(pos + 1);
+  m_strPrefix = tmpfolder + "/" + name;
+  m_dXOffset = xoffset;
+  m_dYOffset = yoffset;
+  m_dZOffset = zoffset;
+  m_dScale = (scale > 0.) ? scale : 0.01;
+  m_nNbPoint = 0;
+  memset(m_nByReturn, 0, sizeof(m_nByReturn));
+  m_Raw.open(m_strPrefix + "_raw.tmp", std::ios::out | std::ios::binary | std::ios::trunc);
+  return m_Raw.good();
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : ajout d'un point, les attributs sont ceux d'un point LAS 1.4
+//-----------------------------------------------------------------------------
+bool XCopcWriter::AddPoint(const laszip_point* point, double X, double Y, double Z)
+{
+  Point P;
+  P.X = (int32_t)floor((X - m_dXOffset) / m_dScale + 0.5);
+  P.Y = (int32_t)floor((Y - m_dYOffset) / m_dScale + 0.5);
+  P.Z = (int32_t)floor((Z - m_dZOffset) / m_dScale + 0.5);
+  P.intensity = point->intensity;
+  P.returns = (uint8_t)(point->extended_return_number | (point->extended_number_of_returns << 4));
+  P.classification = point->classification;
+  P.extendedClassification = point->extended_classification;
+  P.flags = (uint8_t)(point->extended_classification_flags | (point->extended_scanner_channel << 4));
+  P.scanAngle = point->extended_scan_angle;
+  P.gpsTime = point->gps_time;
+  m_Raw.write((char*)&P, sizeof(Point));
+
+  if (m_nNbPoint == 0) {
+    m_nXmin = m_nXmax = P.X;
+    m_nYmin = m_nYmax = P.Y;
+    m_nZmin = m_nZmax = P.Z;
+    m_dGpsMin = m_dGpsMax = P.gpsTime;
+  }
+  m_nXmin = XMin(m_nXmin, P.X); m_nXmax = XMax(m_nXmax, P.X);
+  m_nYmin = XMin(m_nYmin, P.Y); m_nYmax = XMax(m_nYmax, P.Y);
+  m_nZmin = XMin(m_nZmin, P.Z); m_nZmax = XMax(m_nZmax, P.Z);
+  m_dGpsMin = XMin(m_dGpsMin, P.gpsTime); m_dGpsMax = XMax(m_dGpsMax, P.gpsTime);
+  if ((point->extended_return_number > 0) && (point->extended_return_number <= 15))
+    m_nByReturn[point->extended_return_number - 1]++;
+  m_nNbPoint++;
+  return m_Raw.good();
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : position d'un point dans la grille la plus fine de l'octree
+//-----------------------------------------------------------------------------
+void XCopcWriter::Cell(const Point& P, uint32_t* u) const
+{
+  const uint32_t max = (1U << (XCopcMaxLevel + XCopcGridBits)) - 1;
+  double coord[3] = { (P.X * m_dScale + m_dXOffset - m_dX0) / m_dUnit, (P.Y * m_dScale + m_dYOffset - m_dY0) / m_dUnit,
+                      (P.Z * m_dScale + m_dZOffset - m_dZ0) / m_dUnit };
+  for (int i = 0; i < 3; i++) {
+    if (coord[i] <= 0.)
+      u[i] = 0;
+    else
+      u[i] = (coord[i] >= max) ? max : (uint32_t)coord[i];
+  }
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : compression d'un noeud dans un fichier LAZ temporaire d'un seul chunk
+// On recupere l'entete, le VLR LASzip et le contenu du chunk
+//-----------------------------------------------------------------------------
+bool XCopcWriter::CompressNode(std::string tmpfile, const std::vector<Point>& P, std::vector<char>& header,
+                               std::vector<char>& laszipVlr, std::vector<char>& chunk) const
+{
+  laszip_POINTER writer;
+  laszip_header* lasheader;
+  laszip_point* point;
+  if (laszip_create(&writer))
+    return false;
+  bool flag = false;
+  while (true) {  // Pour sortir en detruisant le writer
+    if (laszip_get_header_pointer(writer, &lasheader))
+      break;
+    lasheader->file_source_ID = 0;
+    lasheader->global_encoding = (1 << 0);   // GPS time standard
+    if (!m_strWkt.empty())
+      lasheader->global_encoding |= (1 << 4);   // WKT
+    lasheader->version_major = 1;
+    lasheader->version_minor = 4;
+    strncpy(lasheader->system_identifier, m_strSystem.c_str(), 32);
+    strncpy(lasheader->generating_software, m_strSoftware.c_str(), 32);
+    lasheader->file_creation_day = m_nCreationDay;
+    lasheader->file_creation_year = m_nCreationYear;
+    lasheader->header_size = 375;
+    lasheader->offset_to_point_data = 375;
+    lasheader->point_data_format = 6;
+    lasheader->point_data_record_length = 30;
+    lasheader->x_scale_factor = lasheader->y_scale_factor = lasheader->z_scale_factor = m_dScale;
+    lasheader->x_offset = m_dXOffset;
+    lasheader->y_offset = m_dYOffset;
+    lasheader->z_offset = m_dZOffset;
+    if (laszip_set_chunk_size(writer, (laszip_U32)P.size()))
+      break;
+    laszip_preserve_generating_software(writer, 1);
+    if (laszip_open_writer(writer, tmpfile.c_str(), 1))
+      break;
+    if (laszip_get_point_pointer(writer, &point))
+      break;
+    size_t i;
+    for (i = 0; i < P.size(); i++) {
+      point->X = P[i].X;
+      point->Y = P[i].Y;
+      point->Z = P[i].Z;
+      point->intensity = P[i].intensity;
+      point->extended_return_number = P[i].returns & 0x0F;
+      point->extended_number_of_returns = P[i].returns >> 4;
+      point->classification = P[i].classification;
+      point->extended_classification = P[i].extendedClassification;
+      point->extended_classification_flags = P[i].flags & 0x0F;
+      point->extended_scanner_channel = (P[i].flags >> 4) & 0x03;
+      point->extended_scan_angle = P[i].scanAngle;
+      point->gps_time = P[i].gpsTime;
+      if (laszip_write_point(writer))
+        break;
+    }
+    if (laszip_close_writer(writer))
+      break;
+    flag = (i == P.size());
+    break;
+  }
+  laszip_destroy(writer);
+  if (!flag)
+    return false;
+
+  // Lecture du fichier temporaire
+  std::ifstream in;
+  in.open(tmpfile, std::ios::in | std::ios::binary);
+  header.resize(375);
+  in.read(header.data(), header.size());
+  if (!in.good())
+    return false;
+  uint16_t header_size = XCopcGet<uint16_t>(header, 94);
+  uint32_t offset_to_point_data = XCopcGet<uint32_t>(header, 96);
+  uint32_t nb_vlr = XCopcGet<uint32_t>(header, 100);
+  in.seekg(header_size);
+  std::vector<char> vlr(54);
+  for (uint32_t i = 0; i < nb_vlr; i++) {
+    in.read(vlr.data(), vlr.size());
+    uint16_t length = XCopcGet<uint16_t>(vlr, 20);
+    if ((XCopcGet<uint16_t>(vlr, 18) == 22204) && (strncmp(&vlr[2], "laszip encoded", 16) == 0)) {
+      laszipVlr.resize(length);
+      in.read(laszipVlr.data(), length);
+    }
+    else
+      in.seekg(length, std::ios::cur);
+  }
+  int64_t chunk_table = 0;
+  in.seekg(offset_to_point_data);
+  in.read((char*)&chunk_table, sizeof(int64_t));
+  if ((!in.good()) || (chunk_table < (int64_t)offset_to_point_data + 8) || (laszipVlr.size() < 34))
+    return false;
+  chunk.resize((size_t)(chunk_table - offset_to_point_data - 8));
+  in.read(chunk.data(), chunk.size());
+  return in.good();
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : compression d'un noeud et ajout de son chunk au fichier COPC
+//-----------------------------------------------------------------------------
+bool XCopcWriter::WriteNode(uint64_t key, const std::vector<Point>& P, std::string tmpfile)
+{
+  if (P.size() < 1)
+    return true;
+  std::vector<char> header, vlr, chunk;
+  if (!CompressNode(tmpfile, P, header, vlr, chunk))
+    return false;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  CopcReader::Entry entry;
+  entry.key.level = XCopcLevel(key);
+  entry.key.x = (int32_t)XCopcX(key);
+  entry.key.y = (int32_t)XCopcY(key);
+  entry.key.z = (int32_t)XCopcZ(key);
+  entry.offset = (uint64_t)m_Out.tellp();
+  entry.byteSize = (int32_t)chunk.size();
+  entry.pointCount = (int32_t)P.size();
+  m_Out.write(chunk.data(), chunk.size());
+  m_Entries.push_back(entry);
+  m_ChunkCount.push_back((uint32_t)P.size());
+  m_ChunkBytes.push_back((uint32_t)chunk.size());
+  return m_Out.good();
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : construction recursive d'un noeud
+// Le noeud conserve un point par cellule de sa grille d'echantillonnage, les autres
+// points sont repartis dans les 8 enfants
+//-----------------------------------------------------------------------------
+bool XCopcWriter::BuildNode(uint64_t key, std::vector<Point>& P, std::string tmpfile, XWait* wait)
+{
+  int level = XCopcLevel(key);
+  if ((P.size() <= XCopcNodeSize) || (level >= XCopcMaxLevel))
+    return WriteNode(key, P, tmpfile);
+  if (XWaitCheckCancel(wait))
+    return false;
+
+  std::vector<Point> keep, child[8];
+  std::vector<bool> used((size_t)1 << (3 * XCopcGridBits), false);
+  uint32_t shift = XCopcMaxLevel - level, mask = (1U << XCopcGridBits) - 1, u[3];
+  for (size_t i = 0; i < P.size(); i++) {
+    Cell(P[i], u);
+    uint32_t cx = (u[0] >> shift) & mask, cy = (u[1] >> shift) & mask, cz = (u[2] >> shift) & mask;
+    size_t cell = ((size_t)cz << (2 * XCopcGridBits)) | ((size_t)cy << XCopcGridBits) | cx;
+    if (!used[cell]) {
+      used[cell] = true;
+      keep.push_back(P[i]);
+      continue;
+    }
+    uint32_t half = XCopcGridBits - 1;
+    child[(cx >> half) | ((cy >> half) << 1) | ((cz >> half) << 2)].push_back(P[i]);
+  }
+  std::vector<Point>().swap(P);  // Liberation de la memoire avant la recursion
+  if (!WriteNode(key, keep, tmpfile))
+    return false;
+  std::vector<Point>().swap(keep);
+  for (uint32_t c = 0; c < 8; c++) {
+    if (child[c].size() < 1)
+      continue;
+    uint64_t child_key = XCopcKey(level + 1, 2 * XCopcX(key) + (c & 1), 2 * XCopcY(key) + ((c >> 1) & 1),
+                                  2 * XCopcZ(key) + ((c >> 2) & 1));
+    if (!BuildNode(child_key, child[c], tmpfile, wait))
+      return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : ecriture de la table des chunks (taille variable) et mise a jour de son adresse
+//-----------------------------------------------------------------------------
+bool XCopcWriter::WriteChunkTable()
+{
+  LazEncoder enc;
+  LazIntegerCompressor ic(&enc, 2);
+  for (size_t i = 0; i < m_ChunkCount.size(); i++) {
+    ic.Compress((i ? m_ChunkCount[i - 1] : 0), m_ChunkCount[i], 0);
+    ic.Compress((i ? m_ChunkBytes[i - 1] : 0), m_ChunkBytes[i], 1);
+  }
+  if (m_ChunkCount.size() > 0)
+    enc.Done();
+  int64_t position = (int64_t)m_Out.tellp();
+  uint32_t version = 0, nb_chunk = (uint32_t)m_ChunkCount.size();
+  m_Out.write((char*)&version, sizeof(uint32_t));
+  m_Out.write((char*)&nb_chunk, sizeof(uint32_t));
+  m_Out.write((char*)enc.out.data(), enc.out.size());
+  std::streampos end = m_Out.tellp();
+  return m_Out.good() && (position > 0) && (end > 0);
+}
+
+//-----------------------------------------------------------------------------
+// XCopcWriter : construction de l'octree et ecriture du fichier COPC
+//-----------------------------------------------------------------------------
+bool XCopcWriter::Close(XError* error, XWait* wait)
+{
+  if (!m_Raw.is_open())
+    return XErrorError(error, "XCopcWriter::Close", XError::eIOOpen);
+  m_Raw.close();
+  std::string rawfile = m_strPrefix + "_raw.tmp";
+  if (m_nNbPoint < 1) {
+    Clear();
+    return XErrorError(error, "XCopcWriter::Close", XError::eBadData);
+  }
+
+  // Cube englobant de l'octree
+  double xmin = m_nXmin * m_dScale + m_dXOffset, xmax = m_nXmax * m_dScale + m_dXOffset;
+  double ymin = m_nYmin * m_dScale + m_dYOffset, ymax = m_nYmax * m_dScale + m_dYOffset;
+  double zmin = m_nZmin * m_dScale + m_dZOffset, zmax = m_nZmax * m_dScale + m_dZOffset;
+  double halfsize = XMax(XMax(xmax - xmin, ymax - ymin), zmax - zmin) * 0.5 + m_dScale;
+  double center[3] = { (xmin + xmax) * 0.5, (ymin + ymax) * 0.5, (zmin + zmax) * 0.5 };
+  m_dX0 = center[0] - halfsize;
+  m_dY0 = center[1] - halfsize;
+  m_dZ0 = center[2] - halfsize;
+  m_dUnit = (2. * halfsize) / (double)(1U << (XCopcMaxLevel + XCopcGridBits));
+  m_Entries.clear();
+  m_ChunkCount.clear();
+  m_ChunkBytes.clear();
+
+  // Date de creation : localtime n'est pas reentrant, elle est calculee avant les threads de compression
+  time_t now = time(nullptr);
+  struct tm* date = localtime(&now);
+  m_nCreationDay = (uint16_t)(date->tm_yday + 1);
+  m_nCreationYear = (uint16_t)(date->tm_year + 1900);
+
+  // Niveau des paquets : les niveaux superieurs sont construits en memoire
+  int bucket_level = 0;
+  while ((bucket_level < XCopcMaxBucketLevel) && (m_nNbPoint > XCopcBucketSize * ((uint64_t)1 << (2 * bucket_level))))
+    bucket_level++;
+
+  // Repartition des points : echantillonnage des niveaux superieurs, puis paquets
+  struct TopNode {
+    std::vector<bool> used;
+    std::vector<Point> points;
+  };
+  std::map<uint64_t, TopNode> top;
+  std::map<uint64_t, std::vector<Point> > buffers;
+  std::map<uint64_t, uint64_t> buckets;   // Nombre de points par paquet
+  auto bucket_file = [&](uint64_t key) { return m_strPrefix + "_" + std::to_string(key) + ".tmp"; };
+  auto flush = [&](uint64_t key, std::vector<Point>& P) {
+    std::ofstream out;
+    out.open(bucket_file(key), std::ios::out | std::ios::binary | std::ios::app);
+    out.write((char*)P.data(), P.size() * sizeof(Point));
+    P.clear();
+    return out.good();
+    };
+
+  std::ifstream raw;
+  raw.open(rawfile, std::ios::in | std::ios::binary);
+  std::vector<Point> block(65536);
+  uint32_t u[3], mask = (1U << XCopcGridBits) - 1;
+  bool flag = raw.good();
+  XWaitRange(wait, 0, 100);
+  for (uint64_t done = 0; (done < m_nNbPoint) && flag; ) {
+    size_t nb = (size_t)XMin((uint64_t)block.size(), m_nNbPoint - done);
+    raw.read((char*)block.data(), nb * sizeof(Point));
+    if (!raw.good()) {
+      flag = false;
+      break;
+    }
+    for (size_t i = 0; i < nb; i++) {
+      Cell(block[i], u);
+      int level;
+      for (level = 0; level < bucket_level; level++) {
+        uint32_t shift = XCopcMaxLevel - level;
+        uint64_t key = XCopcKey(level, u[0] >> (shift + XCopcGridBits), u[1] >> (shift + XCopcGridBits), u[2] >> (shift + XCopcGridBits));
+        TopNode& node = top[key];
+        if (node.used.size() < 1)
+          node.used.assign((size_t)1 << (3 * XCopcGridBits), false);
+        size_t cell = ((size_t)((u[2] >> shift) & mask) << (2 * XCopcGridBits)) | ((size_t)((u[1] >> shift) & mask) << XCopcGridBits) |
+          ((u[0] >> shift) & mask);
+        if (!node.used[cell]) {
+          node.used[cell] = true;
+          node.points.push_back(block[i]);
+          break;
+        }
+      }
+      if (level < bucket_level)
+        continue;
+      uint32_t shift = XCopcMaxLevel - bucket_level + XCopcGridBits;
+      uint64_t key = XCopcKey(bucket_level, u[0] >> shift, u[1] >> shift, u[2] >> shift);
+      std::vector<Point>& buffer = buffers[key];
+      buffer.push_back(block[i]);
+      buckets[key]++;
+      if (buffer.size() >= XCopcBucketBuffer)
+        flag &= flush(key, buffer);
+    }
+    done += nb;
+    XWaitStep(wait, (int)(done * 10 / m_nNbPoint));
+    if (XWaitCheckCancel(wait))
+      flag = false;
+  }
+  raw.close();
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++)
+    if (iter->second.size() > 0)
+      flag &= flush(iter->first, iter->second);
+  buffers.clear();
+  for (auto iter = top.begin(); iter != top.end(); iter++)
+    std::vector<bool>().swap(iter->second.used);
+
+  // Entete, VLRs et modele de compression obtenus sur un noeud d'un point
+  std::vector<char> header, laszipVlr, chunk;
+  if (flag)
+    flag = CompressNode(m_strPrefix + "_node.laz", std::vector<Point>(1, block[0]), header, laszipVlr, chunk);
+  std::vector<Point>().swap(block);
+  std::vector<char> wkt(m_strWkt.begin(), m_strWkt.end());
+  if (wkt.size() > 0)
+    wkt.push_back('\0');
+  uint32_t nb_vlr = (wkt.size() > 0) ? 3 : 2;
+  uint32_t offset_to_point_data = (uint32_t)(375 + 54 + 160 + 54 + laszipVlr.size() + ((wkt.size() > 0) ? 54 + wkt.size() : 0));
+  if (flag) {
+    m_Out.open(m_strFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+    flag = m_Out.good();
+  }
+  auto write_vlr = [&](const char* user, uint16_t id, const char* description, const std::vector<char>& data) {
+    std::vector<char> vlr(54, 0);
+    strncpy(&vlr[2], user, 16);
+    XCopcPut<uint16_t>(vlr, 18, id);
+    XCopcPut<uint16_t>(vlr, 20, (uint16_t)data.size());
+    strncpy(&vlr[22], description, 32);
+    m_Out.write(vlr.data(), vlr.size());
+    m_Out.write(data.data(), data.size());
+    };
+  if (flag) {
+    XCopcPut<uint32_t>(laszipVlr, 12, 0xFFFFFFFFU);   // Chunks de taille variable
+    m_Out.write(header.data(), header.size());
+    write_vlr("copc", 1, "COPC info", std::vector<char>(160, 0));
+    write_vlr("laszip encoded", 22204, "LASzip compression", laszipVlr);
+    if (wkt.size() > 0)
+      write_vlr("LASF_Projection", 2112, "OGC WKT", wkt);
+    int64_t chunk_table = -1;
+    m_Out.write((char*)&chunk_table, sizeof(int64_t));
+    flag = m_Out.good() && ((uint64_t)m_Out.tellp() == (uint64_t)offset_to_point_data + 8);
+  }
+
+  // Compression des noeuds en parallele : noeuds des niveaux superieurs, puis paquets
+  std::vector<uint64_t> jobs;
+  for (auto iter = top.begin(); iter != top.end(); iter++)
+    jobs.push_back(iter->first);
+  size_t nb_top = jobs.size();
+  for (auto iter = buckets.begin(); iter != buckets.end(); iter++)
+    jobs.push_back(iter->first);
+  int nbThread = m_nNbThread;
+  if (nbThread < 1)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+  nbThread = (int)XMin((size_t)nbThread, XMax(jobs.size(), (size_t)1));
+  std::atomic<size_t> next(0), nb_done(0);
+  std::atomic<bool> failed(!flag);
+  auto worker = [&](int t) {
+    std::string tmpfile = m_strPrefix + "_node" + std::to_string(t) + ".laz";
+    for (size_t i = next++; i < jobs.size(); i = next++) {
+      if (failed || XWaitCheckCancel(wait))
+        break;
+      bool ok;
+      if (i < nb_top)
+        ok = WriteNode(jobs[i], top.at(jobs[i]).points, tmpfile);
+      else {
+        std::vector<Point> P((size_t)buckets.at(jobs[i]));
+        std::ifstream in;
+        in.open(bucket_file(jobs[i]), std::ios::in | std::ios::binary);
+        in.read((char*)P.data(), P.size() * sizeof(Point));
+        ok = in.good();
+        in.close();
+        remove(bucket_file(jobs[i]).c_str());
+        if (ok)
+          ok = BuildNode(jobs[i], P, tmpfile, wait);
+      }
+      if (!ok)
+        failed = true;
+      nb_done++;
+      if (t == 0)   // Seul le thread appelant met a jour la progression
+        XWaitStep(wait, (int)(10 + (nb_done * 80) / jobs.size()));
+    }
+    remove(tmpfile.c_str());
+    };
+  if (!failed) {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nbThread; t++)
+      threads.push_back(std::thread(worker, t));
+    worker(0);
+    for (size_t t = 0; t < threads.size(); t++)
+      threads[t].join();
+    XWaitStep(wait, 90);
+  }
+  flag = !failed;
+  for (size_t i = nb_top; i < jobs.size(); i++)  // Paquets non traites en cas d'erreur ou d'annulation
+    remove(bucket_file(jobs[i]).c_str());
+  remove((m_strPrefix + "_node.laz").c_str());
+
+  // Table des chunks
+  int64_t chunk_table = (int64_t)m_Out.tellp();
+  if (flag)
+    flag = WriteChunkTable();
+
+  // Hierarchie : une seule page, avec les ancetres vides des noeuds
+  std::set<uint64_t> keys, parents;
+  for (size_t i = 0; i < m_Entries.size(); i++)
+    keys.insert(XCopcKey(m_Entries[i].key.level, m_Entries[i].key.x, m_Entries[i].key.y, m_Entries[i].key.z));
+  for (auto iter = keys.begin(); iter != keys.end(); iter++)
+    for (uint64_t key = *iter; XCopcLevel(key) > 0; ) {
+      key = XCopcParent(key);
+      if (keys.count(key) == 0)
+        parents.insert(key);
+    }
+  for (auto iter = parents.begin(); iter != parents.end(); iter++) {
+    CopcReader::Entry entry;
+    entry.key.level = XCopcLevel(*iter);
+    entry.key.x = (int32_t)XCopcX(*iter);
+    entry.key.y = (int32_t)XCopcY(*iter);
+    entry.key.z = (int32_t)XCopcZ(*iter);
+    entry.offset = 0;
+    entry.byteSize = 0;
+    entry.pointCount = 0;
+    m_Entries.push_back(entry);
+  }
+  std::sort(m_Entries.begin(), m_Entries.end(), PredEntriesDepth);
+  uint64_t evlr = (uint64_t)m_Out.tellp();
+  uint64_t hier_size = m_Entries.size() * sizeof(CopcReader::Entry);
+  if (flag) {
+    std::vector<char> evlr_header(60, 0);
+    strncpy(&evlr_header[2], "copc", 16);
+    XCopcPut<uint16_t>(evlr_header, 18, 1000);
+    XCopcPut<uint64_t>(evlr_header, 20, hier_size);
+    strncpy(&evlr_header[28], "EPT hierarchy", 32);
+    m_Out.write(evlr_header.data(), evlr_header.size());
+    m_Out.write((char*)m_Entries.data(), hier_size);
+  }
+
+  // Mise a jour de l'entete, de l'adresse de la table des chunks et des informations COPC
+  if (flag) {
+    XCopcPut<uint32_t>(header, 96, offset_to_point_data);
+    XCopcPut<uint32_t>(header, 100, nb_vlr);
+    memset(&header[107], 0, 24);  // Compteurs 32 bits non utilises pour le format 6
+    double bounds[6] = { xmax, xmin, ymax, ymin, zmax, zmin };
+    memcpy(&header[179], bounds, sizeof(bounds));
+    XCopcPut<uint64_t>(header, 227, 0);
+    XCopcPut<uint64_t>(header, 235, evlr);
+    XCopcPut<uint32_t>(header, 243, 1);
+    XCopcPut<uint64_t>(header, 247, m_nNbPoint);
+    memcpy(&header[255], m_nByReturn, sizeof(m_nByReturn));
+    m_Out.seekp(0);
+    m_Out.write(header.data(), header.size());
+
+    CopcReader::CopcInfo info;
+    memset(&info, 0, sizeof(info));
+    info.center_x = center[0];
+    info.center_y = center[1];
+    info.center_z = center[2];
+    info.halfsize = halfsize;
+    info.spacing = (2. * halfsize) / (1U << XCopcGridBits);
+    info.root_hier_offset = evlr + 60;
+    info.root_hier_size = hier_size;
+    info.gpstime_minimum = m_dGpsMin;
+    info.gpstime_maximum = m_dGpsMax;
+    m_Out.seekp(375 + 54);
+    m_Out.write((char*)&info, sizeof(info));
+    m_Out.seekp(offset_to_point_data);
+    m_Out.write((char*)&chunk_table, sizeof(int64_t));
+    flag = m_Out.good();
+  }
+  m_Out.close();
+  Clear();
+  XWaitStep(wait, 100);
+  if (!flag) {
+    remove(m_strFilename.c_str());
+    if (XWaitCheckCancel(wait))
+      return false;
+    return XErrorError(error, "XCopcWriter::Close", XError::eIOWrite);
+  }
+  return true;
+}
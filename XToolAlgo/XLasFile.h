@@ -14,6 +14,17 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <type_traits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <fstream>
+#include <cmath>
 #include "../XTool/XBase.h"
 #include "../XTool/XFrame.h"
 #include "../LASzip/dll/laszip_api.h"
@@ -54,7 +65,7 @@ public:
 		int32_t pointCount;
 	};
 
-	CopcReader() { m_dSpacing = m_dHalfSize = 0.; m_nActiveEntry = 0; m_nIndex = m_nIndexMax = 0; m_bStarted = false; m_dXmin = m_dYmin = 0.; }
+	CopcReader() { m_dSpacing = m_dHalfSize = 0.; m_nActiveEntry = 0; m_nIndex = m_nIndexMax = 0; m_bStarted = false; m_dXmin = m_dYmin = m_dZmin = 0.; }
 	bool SetInfo(laszip_U8* data, std::string filename);
 	bool ReadSubPages(std::ifstream* in, Entry* entries, int nb_entries);
 	int MaxLevel() { if (m_Entries.size() == 0) return -1; return m_Entries[m_Entries.size() - 1].key.level; }
@@ -62,56 +73,578 @@ public:
 	std::vector<Entry> m_Entries;
 	double m_dSpacing;
 	double m_dHalfSize;
-	double m_dXmin, m_dYmin;
+	double m_dXmin, m_dYmin, m_dZmin;
 	int m_nActiveEntry;
 	int32_t m_nIndex, m_nIndexMax;
 	bool m_bStarted;
 };
 
+//-----------------------------------------------------------------------------
+// Points d'une plage (noeud COPC) decodes et stockes par composante
+// Les coordonnees sont les entiers LAS : echelle et offset sont ceux de l'entete
+//-----------------------------------------------------------------------------
+class XLasNode {
+public:
+	std::vector<int32_t>	X, Y, Z;
+	std::vector<uint8_t>	Classification;
+	std::vector<uint16_t> Intensity;
+	std::vector<uint16_t> R, G, B, Nir;
+	std::vector<int16_t>	ScanAngle;
+
+	size_t Size() const { return X.size(); }
+	size_t MemorySize() const { return Size() * (3 * sizeof(int32_t) + sizeof(uint8_t) + 5 * sizeof(uint16_t) + sizeof(int16_t)); }
+	void Reserve(size_t n);
+};
+
+//-----------------------------------------------------------------------------
+// Bloc de points filtres, fourni par l'appelant et rempli par XLasFile::GetNextBlock
+// Les coordonnees sont en float, relatives a l'origine (X0, Y0, Z0)
+//-----------------------------------------------------------------------------
+class XLasBlock {
+public:
+	double X0, Y0, Z0;
+	std::vector<float>		X, Y, Z;
+	std::vector<uint8_t>	Classification;
+	std::vector<uint16_t> Intensity;
+	std::vector<uint16_t> R, G, B, Nir;
+	std::vector<int16_t>	ScanAngle;
+
+	XLasBlock(uint32_t capacity = 65536, double x0 = 0., double y0 = 0., double z0 = 0.)
+		{ X0 = x0; Y0 = y0; Z0 = z0; Resize(capacity); }
+	uint32_t Capacity() const { return (uint32_t)X.size(); }
+	void Resize(uint32_t capacity);
+	void Origin(double x0, double y0, double z0) { X0 = x0; Y0 = y0; Z0 = z0; }
+};
+
+//-----------------------------------------------------------------------------
+// Cache LRU des noeuds decodes, partage par tous les fichiers et tous les threads
+//-----------------------------------------------------------------------------
+class XLasNodeCache {
+public:
+	static std::shared_ptr<const XLasNode> Find(const std::string& key);
+	static void Insert(const std::string& key, std::shared_ptr<const XLasNode> node);
+	static void Clear();
+	static size_t MaxMemory() { return m_nMaxMemory; }
+	static void MaxMemory(size_t size);
+	static size_t Memory();
+
+protected:
+	typedef std::pair<std::string, std::shared_ptr<const XLasNode> > Item;
+	static std::list<Item> m_Items;	// Du plus recent au plus ancien
+	static std::unordered_map<std::string, std::list<Item>::iterator> m_Index;
+	static std::mutex m_Mutex;
+	static size_t m_nMemory;
+	static size_t m_nMaxMemory;
+
+	static void Evict();
+};
+
+//-----------------------------------------------------------------------------
+// Pool des lecteurs LAS inactifs, partage par tous les fichiers et tous les threads
+// Un fichier libere par CloseIfNeeded reste ouvert ; au-dela de MaxOpen, les lecteurs
+// les plus anciens sont fermes. L'entete et la hierarchie COPC restent en memoire
+// Take fournit aux threads un lecteur ouvert sur un fichier, rendu au pool a la liberation du shared_ptr
+//-----------------------------------------------------------------------------
+class XLasFile;
+
+class XLasReaderPool {
+public:
+	static void Acquire(XLasFile* file);	// Le fichier est utilise : il ne peut plus etre ferme par le pool
+	static void Release(XLasFile* file);	// Le fichier n'est plus utilise : il devient le plus recent
+	static void Remove(XLasFile* file);
+	static std::shared_ptr<XLasFile> Take(const std::string& filename);
+	static void Clear();
+	static size_t MaxOpen() { return m_nMaxOpen; }
+	static void MaxOpen(size_t nb);
+	static size_t NbOpen();
+
+protected:
+	struct Item { XLasFile* file; bool owned; };	// owned : lecteur cree par Take, detruit a l'eviction
+	static std::list<Item> m_Items;	// Du plus recent au plus ancien
+	static std::unordered_map<XLasFile*, std::list<Item>::iterator> m_Index;
+	static std::mutex m_Mutex;
+	static size_t m_nMaxOpen;
+
+	static void Insert(XLasFile* file, bool owned);
+	static void Evict(std::vector<XLasFile*>& dead);
+};
+
+//-----------------------------------------------------------------------------
+// Statistiques d'un fichier LAS, calculees en une seule passe sur les points
+//-----------------------------------------------------------------------------
+struct XLasStat {
+	std::string filename;
+	// Donnees d'entete
+	std::string software, systemId;
+	int globalEncoding, versionMajor, versionMinor, pointFormat, day, year;
+	XFrame headerFrame;
+	double headerZmin, headerZmax;
+	uint64_t headerNbPoint;
+	uint64_t headerByReturn[15];
+	// Donnees lues dans les points
+	uint64_t nbRead;
+	XFrame frame;
+	double zmin, zmax, gpsTimeMin, gpsTimeMax;
+	uint64_t classif[256];
+	uint64_t returns[16][16];		// [numero du retour][nombre de retours]
+	uint64_t nbOutside;					// Points hors de l'emprise de l'entete
+	uint64_t nbBadReturn;				// Numero de retour nul ou superieur au nombre de retours
+	// Grille de densite (nombre de points par cellule)
+	double densityCell, densityX0, densityY0;
+	uint32_t densityW, densityH;
+	std::vector<uint32_t> density;
+
+	XLasStat() { Clear(); }
+	void Clear();
+	uint64_t ByReturn(int num) const;
+	bool IsConsistent() const;
+	void DensityStat(double& dmin, double& dmean, double& dmax, double& empty) const;
+
+	bool WriteText(std::ostream* out) const;
+	bool WriteMifMid(std::ostream* mif, std::ostream* mid) const;
+	bool WriteJson(std::ostream* out) const;
+	bool WriteDensity(std::string filename) const;
+};
+
 class XLasFile {
 public:
 	XLasFile();
 	~XLasFile() { Close(); }
 
 	typedef enum { ZMinimum = 1, ZAverage = 2, ZMaximum = 3, StdDev = 4 } AlgoDtm;
+	struct PointRange { uint64_t start; uint64_t count; };	// Plage de points contigus dans le fichier
 
-	bool Open(std::string filename);
+	bool Open(std::string filename, bool copcInfo = true);
 	bool ReOpen();
 	bool Close();
-	bool CloseIfNeeded(int maxLasFile = 10);
-	bool IsNewClassification() { if (m_Header == nullptr) return false; if (m_Header->version_minor < 4) return false; return true; }
+	bool CloseIfNeeded();
+	bool IsOpened() const { return (m_Reader != nullptr); }
+	bool IsNewClassification() { if (m_strFilename.empty()) return false; if (m_HeaderInfo.version_minor < 4) return false; return true; }
 	laszip_POINTER GetReader() { return m_Reader; }
 	laszip_header* GetHeader() { return m_Header; }
+	const laszip_header* HeaderInfo() const { if (m_strFilename.empty()) return nullptr; return &m_HeaderInfo; }	// Valide meme ferme, sans les VLR
 	laszip_point* GetPoint() { return m_Point; }
 	uint64_t NbLasPoints() {
-		if (m_Header == nullptr) return 0;
-		return (m_Header->number_of_point_records ? m_Header->number_of_point_records : m_Header->extended_number_of_point_records);
+		if (m_strFilename.empty()) return 0;
+		return (m_HeaderInfo.number_of_point_records ? m_HeaderInfo.number_of_point_records : m_HeaderInfo.extended_number_of_point_records);
 	}
 
 	bool SetWorld(const XFrame& F, const double& zmin, const double& zmax, const double& gsd = 0.);
 	bool GetNextPoint(double* X, double* Y, double* Z);
 
+	// Lecture par plages de points, chaque plage pouvant etre lue par un XLasFile different
+	bool GetRanges(std::vector<PointRange>& ranges, uint64_t maxCount = 1000000);
+	bool SetRange(const PointRange& range);
+	bool GetNextRangePoint(double* X, double* Y, double* Z);
+
+	// Lecture par blocs : les filtres d'emprise, de Z (SetWorld) et de classification sont appliques a la lecture
+	void SetClassifFilter(const bool* visibility = nullptr);
+	uint32_t GetNextBlock(XLasBlock* block);
+	uint32_t GetNextRangeBlock(XLasBlock* block);
+
+	// Noeuds pour l'affichage par niveau de detail : noeuds COPC, cellules de l'index ou plages du fichier
+	struct LodNode {
+		std::vector<PointRange> ranges;
+		XFrame frame;
+		double zmin, zmax;
+		double spacing;		// Espacement moyen des points du noeud
+		int level;				// Profondeur dans l'octree COPC (les points completent ceux des ancetres), 0 sinon
+		uint64_t count;
+	};
+	bool GetLodNodes(std::vector<LodNode>& nodes, const XFrame& F, uint64_t maxCount = 1000000);
+
+	// Decodage complet d'une plage, avec passage par le cache des noeuds si cache = true
+	bool IsCopcFile() const { return m_bCopc; }
+	bool DecodeRange(const PointRange& range, XLasNode* node);
+	std::shared_ptr<const XLasNode> GetNode(const PointRange& range, bool cache = true);
+	static std::string NodeKey(const std::string& filename, const PointRange& range)
+		{ return filename + "#" + std::to_string(range.start) + "#" + std::to_string(range.count); }
+
+	// Index spatial des fichiers non COPC : grille de cellules donnant les plages de points de chaque cellule
+	void SetIndexFile(std::string filename) { m_strIndexFile = filename; m_bIndex = false; }
+	std::string IndexFile() const { return m_strIndexFile; }
+	bool HasIndex() const { return m_bIndex; }
+	bool BuildIndex(std::string filename, XError* error = nullptr, XWait* wait = nullptr);
+	bool LoadIndex();
+
 	bool ComputeDtm(std::string file_out, double gsd, AlgoDtm algo = ZMinimum, bool classif_visibility[256] = nullptr, XError* error = nullptr);
 	bool StatLas(std::string file_out, std::ofstream* mif = nullptr, std::ofstream* mid = nullptr);
+	bool ComputeStat(XLasStat& stat, double densityCell = 5., XWait* wait = nullptr);
+
+	// Rasters de synthese multi-resolution : densite, Z moyen, classe majoritaire, RGB, PIR et intensite moyens
+	enum { OverviewDensity = 0, OverviewZ = 1, OverviewClass = 2, OverviewR = 3, OverviewG = 4, OverviewB = 5,
+		OverviewNir = 6, OverviewIntensity = 7, OverviewNbBand = 8 };
+	bool ComputeOverviews(std::string prefix, double gsd, XError* error = nullptr, XWait* wait = nullptr);
+	static std::string OverviewFilename(std::string prefix, int level) { return prefix + "_" + std::to_string(level) + ".tif"; }
 
 protected:
 	std::string m_strFilename;
 	laszip_POINTER m_Reader;
 	laszip_header* m_Header;
 	laszip_point* m_Point;
+	laszip_header m_HeaderInfo;		// Copie de l'entete conservee a la fermeture du lecteur
+	int m_nNbUse;									// Nombre de ReOpen sans CloseIfNeeded
 
 	double m_dXmin, m_dXmax, m_dYmin, m_dYmax, m_dZmin, m_dZmax;
 	uint64_t m_nNbPoint, m_nIndex;
+	uint64_t m_nRangeIndex, m_nRangeCount;
 	XFrame m_WorldFrame;
 	double m_dWorldGsd;
 	CopcReader m_CopcReader;
 	bool m_bCopc;
 
-	static int m_LasNbOpenFile;		// Nombre de fichiers LAS ouverts
+	std::string m_strIndexFile;
+	bool m_bIndex;
+	double m_dIndexX0, m_dIndexY0, m_dIndexCell;		// Origine (coin haut gauche) et taille des cellules de l'index
+	uint32_t m_nIndexW, m_nIndexH;
+	std::vector<uint32_t> m_IndexCell;							// Premiere plage de chaque cellule dans m_IndexRanges
+	std::vector<PointRange> m_IndexRanges;
+	std::vector<PointRange> m_WorldRanges;					// Plages a lire pour l'emprise fixee par SetWorld
+	size_t m_nWorldRange;
+	bool m_bClassifFilter;
+	bool m_ClassifVisibility[256];
+
+	bool ComputeWorldRanges();
+	bool NextPoint();				// Prochain point de l'emprise, lu dans m_Point
+	bool NextRangePoint();	// Prochain point de la plage courante, lu dans m_Point
+	bool IsFiltered() const;
+	void StorePoint(XLasBlock* block, uint32_t k) const;
+
+	friend class XLasReaderPool;
+	void CloseReader();
 
 	bool IsCopc();
 };
 
+//-----------------------------------------------------------------------------
+// Calcul d'un MNT/MNS unique sur un ensemble de fichiers LAS
+// Chaque fichier est lu une seule fois, ses points sont repartis dans des fichiers temporaires
+// par bloc de dalles. Chaque bloc est ensuite calcule par un thread, puis ecrit dans un GeoTIFF
+// dalle compresse
+//-----------------------------------------------------------------------------
+class XLasDtmBuilder {
+public:
+	XLasDtmBuilder() { m_nBlockSize = 2048; m_nFillRadius = 0; m_nNbThread = 0; }
+
+	void AddFile(std::string filename, std::string indexfile = "");
+	void BlockSize(uint32_t size) { m_nBlockSize = XMax((uint32_t)1, size / TileSize()) * TileSize(); }
+	void FillRadius(uint32_t radius) { m_nFillRadius = radius; }	// Bouchage des trous par IDW, rayon en pixels (0 : pas de bouchage)
+	void NbThread(int nb) { m_nNbThread = nb; }										// 0 : nombre de coeurs
+	static uint32_t TileSize() { return 256; }
 
+	bool Compute(std::string file_out, double gsd, XLasFile::AlgoDtm algo = XLasFile::ZMinimum, bool classif_visibility[256] = nullptr,
+							 XError* error = nullptr, XWait* wait = nullptr);
+
+protected:
+	struct FileInfo {
+		std::string filename;
+		std::string indexfile;
+		XFrame frame;
+	};
+	std::vector<FileInfo> m_Files;
+	uint32_t m_nBlockSize;
+	uint32_t m_nFillRadius;
+	int m_nNbThread;
+};
+
+//-----------------------------------------------------------------------------
+// Ecriture d'un fichier COPC (LAZ 1.4, format de point 6, organise en octree)
+// AddPoint stocke les points dans un fichier temporaire. Close repartit les points dans des
+// paquets temporaires, construit l'octree de chaque paquet et compresse les noeuds en parallele,
+// chaque noeud formant un chunk LAZ
+//-----------------------------------------------------------------------------
+class XCopcWriter {
+public:
+	XCopcWriter();
+	~XCopcWriter() { Clear(); }
+
+	bool Open(std::string filename, std::string tmpfolder, double xoffset, double yoffset, double zoffset, double scale = 0.01);
+	void SetSoftware(std::string system, std::string software) { m_strSystem = system; m_strSoftware = software; }
+	void SetWkt(std::string wkt) { m_strWkt = wkt; }
+	void NbThread(int nb) { m_nNbThread = nb; }	// 0 : nombre de coeurs
+	bool AddPoint(const laszip_point* point, double X, double Y, double Z);
+	uint64_t NbPoint() const { return m_nNbPoint; }
+	bool Close(XError* error = nullptr, XWait* wait = nullptr);
+	void Cancel() { Clear(); }	// Abandon de l'export : les fichiers temporaires sont supprimes
+
+	struct Point {	// Point stocke dans les fichiers temporaires
+		int32_t X, Y, Z;
+		uint16_t intensity;
+		uint8_t returns;				// Numero de retour + 16 * nombre de retours
+		uint8_t classification, extendedClassification;
+		uint8_t flags;					// Drapeaux de classification + 16 * canal du scanner
+		int16_t scanAngle;
+		double gpsTime;
+	};
+
+protected:
+	std::string m_strFilename, m_strPrefix;	// Fichier COPC, prefixe des fichiers temporaires
+	std::string m_strSystem, m_strSoftware, m_strWkt;
+	std::ofstream m_Raw;										// Points bruts
+	std::ofstream m_Out;										// Fichier COPC
+	std::mutex m_Mutex;
+	double m_dScale, m_dXOffset, m_dYOffset, m_dZOffset;
+	int32_t m_nXmin, m_nXmax, m_nYmin, m_nYmax, m_nZmin, m_nZmax;
+	double m_dGpsMin, m_dGpsMax;
+	uint64_t m_nNbPoint, m_nByReturn[15];
+	int m_nNbThread;
+	// Octree
+	double m_dX0, m_dY0, m_dZ0, m_dUnit;		// Coin de l'octree et taille des cellules les plus fines
+	std::vector<CopcReader::Entry> m_Entries;
+	std::vector<uint32_t> m_ChunkCount, m_ChunkBytes;
+	uint16_t m_nCreationDay, m_nCreationYear;	// Date de creation, fixee au debut de Close
+
+	void Clear();
+	void Cell(const Point& P, uint32_t* u) const;
+	bool CompressNode(std::string tmpfile, const std::vector<Point>& P, std::vector<char>& header, std::vector<char>& laszipVlr,
+										std::vector<char>& chunk) const;
+	bool WriteNode(uint64_t key, const std::vector<Point>& P, std::string tmpfile);
+	bool BuildNode(uint64_t key, std::vector<Point>& P, std::string tmpfile, XWait* wait);
+	bool WriteChunkTable();
+};
+
+//-----------------------------------------------------------------------------
+// Sous-echantillonnage incremental d'un flux de points
+// Random decide point par point (Keep). GridMinZ, VoxelCentroid et Poisson repartissent les points
+// par dalles de TileCells x TileCells cellules : au-dela de MaxPoint points en memoire, les dalles
+// sont deversees dans des fichiers temporaires. Les dalles sont traitees dans l'ordre (ligne, colonne)
+// et leurs points tries par coordonnees : le resultat ne depend pas de l'ordre d'arrivee des points.
+// T est la charge utile du point (attributs, indice, ...), copiee telle quelle dans les fichiers
+//-----------------------------------------------------------------------------
+template<class T> class XLasThinner {
+public:
+	typedef enum { NoThinning = 0, Random = 1, GridMinZ = 2, VoxelCentroid = 3, Poisson = 4 } Mode;
+	struct Item { T point; double X, Y, Z; };
+	static const int64_t TileCells = 256;
+
+	XLasThinner(Mode mode = NoThinning, double step = 1., double rate = 1., size_t maxPoint = 1 << 20)
+		{ Init(mode, step, rate, maxPoint); }
+	~XLasThinner() { Reset(); }
+
+	void Init(Mode mode, double step, double rate = 1., size_t maxPoint = 1 << 20)
+		{ Reset(); m_Mode = mode; m_dStep = (step > 0.) ? step : 1.; m_dRate = rate; m_nMaxPoint = maxPoint; m_nSeed = 0x9E3779B97F4A7C15ULL; }
+	void Reset();
+	void Seed(uint64_t seed) { m_nSeed = (seed * 0x9E3779B97F4A7C15ULL) | 1; }
+	void SetTmpPrefix(std::string prefix) { m_strTmpPrefix = prefix; }	// Sans prefixe, tout reste en memoire
+	Mode GetMode() const { return m_Mode; }
+	bool Deferred() const { return (m_Mode == GridMinZ) || (m_Mode == VoxelCentroid) || (m_Mode == Poisson); }
+	uint64_t NbIn() const { return m_nNbIn; }
+	uint64_t NbOut() const { return m_nNbOut; }
+	bool Error() const { return m_bError; }
+
+	// Mode Random : le point est-il conserve ?
+	bool Keep(double X, double Y, double Z);
+	// Tous modes : les points conserves sont ajoutes a out (modes differes : par FlushTile)
+	void Add(const T& point, double X, double Y, double Z, std::vector<Item>& out);
+	bool FlushTile(std::vector<Item>& out);	// Une dalle par appel, false quand il n'en reste plus
+	void Flush(std::vector<Item>& out) { while (FlushTile(out)) ; }
+
+protected:
+	struct Cell { T point; double X, Y, Z; uint32_t count; };
+	typedef std::pair<int64_t, int64_t> TileKey;	// (ligne, colonne)
+	struct Tile { std::vector<Item> items; bool spilled = false; };
+	Mode m_Mode = NoThinning;
+	double m_dStep = 1., m_dRate = 1.;
+	size_t m_nMaxPoint = 0, m_nNbPending = 0;
+	uint64_t m_nSeed = 0, m_nNbIn = 0, m_nNbOut = 0;
+	bool m_bError = false;
+	std::string m_strTmpPrefix;
+	std::map<TileKey, Tile> m_Tiles;
+	std::unordered_map<uint64_t, std::vector<float> > m_Disk;	// Points retenus par Poisson, par cellule
+	std::map<int64_t, std::vector<uint64_t> > m_DiskRows;				// Cellules de m_Disk par ligne de dalles
+
+	int64_t Index(double x) const { return (int64_t)floor(x / m_dStep); }
+	static int64_t TileIndex(int64_t u) { return (u >= 0) ? u / TileCells : -((-u - 1) / TileCells) - 1; }
+	static uint64_t Key(int64_t u, int64_t v, int64_t w)
+		{ return (((uint64_t)u & 0x1FFFFF) << 42) | (((uint64_t)v & 0x1FFFFF) << 21) | ((uint64_t)w & 0x1FFFFF); }
+	std::string TileFilename(const TileKey& key) const
+		{ return m_strTmpPrefix + "_" + std::to_string(key.first) + "_" + std::to_string(key.second) + ".tmp"; }
+	void Spill();
+	bool KeepPoisson(double X, double Y, double Z, int64_t row);
+	static bool Less(const Item& A, const Item& B)
+		{ if (A.X != B.X) return A.X < B.X; if (A.Y != B.Y) return A.Y < B.Y; return A.Z < B.Z; }
+};
+
+//-----------------------------------------------------------------------------
+// Remise a zero : les fichiers temporaires sont supprimes
+//-----------------------------------------------------------------------------
+template<class T> void XLasThinner<T>::Reset()
+{
+	for (auto iter = m_Tiles.begin(); iter != m_Tiles.end(); ++iter)
+		if (iter->second.spilled)
+			std::remove(TileFilename(iter->first).c_str());
+	m_Tiles.clear();
+	m_Disk.clear();
+	m_DiskRows.clear();
+	m_nNbPending = 0;
+	m_nNbIn = m_nNbOut = 0;
+	m_bError = false;
+}
+
+//-----------------------------------------------------------------------------
+// Tirage aleatoire (xorshift)
+//-----------------------------------------------------------------------------
+template<class T> bool XLasThinner<T>::Keep(double X, double Y, double Z)
+{
+	m_nNbIn++;
+	if (m_Mode == Random) {
+		m_nSeed ^= m_nSeed << 13;
+		m_nSeed ^= m_nSeed >> 7;
+		m_nSeed ^= m_nSeed << 17;
+		if ((double)(m_nSeed >> 11) * (1. / 9007199254740992.) >= m_dRate)
+			return false;
+	}
+	m_nNbOut++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Disque de Poisson : un point est rejete s'il est a moins d'un pas d'un point deja retenu.
+// Les dalles etant traitees par lignes, seules les cellules de la ligne courante et de la
+// precedente sont conservees
+//-----------------------------------------------------------------------------
+template<class T> bool XLasThinner<T>::KeepPoisson(double X, double Y, double Z, int64_t row)
+{
+	int64_t u = Index(X), v = Index(Y), w = Index(Z);
+	double d2 = m_dStep * m_dStep;
+	for (int64_t i = u - 1; i <= u + 1; i++)
+		for (int64_t j = v - 1; j <= v + 1; j++)
+			for (int64_t k = w - 1; k <= w + 1; k++) {
+				auto iter = m_Disk.find(Key(i, j, k));
+				if (iter == m_Disk.end())
+					continue;
+				const std::vector<float>& P = iter->second;
+				for (size_t n = 0; n < P.size(); n += 3) {
+					double dx = X - i * m_dStep - P[n], dy = Y - j * m_dStep - P[n + 1], dz = Z - k * m_dStep - P[n + 2];
+					if (dx * dx + dy * dy + dz * dz < d2)
+						return false;
+				}
+			}
+	uint64_t key = Key(u, v, w);
+	std::vector<float>& P = m_Disk[key];	// Coordonnees relatives a la cellule
+	if (P.size() == 0)
+		m_DiskRows[row].push_back(key);
+	P.push_back((float)(X - u * m_dStep));
+	P.push_back((float)(Y - v * m_dStep));
+	P.push_back((float)(Z - w * m_dStep));
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Ajout d'un point : les modes differes le rangent dans sa dalle
+//-----------------------------------------------------------------------------
+template<class T> void XLasThinner<T>::Add(const T& point, double X, double Y, double Z, std::vector<Item>& out)
+{
+	if (!Deferred()) {
+		if ((m_Mode == NoThinning) || Keep(X, Y, Z)) {
+			Item item = { point, X, Y, Z };
+			out.push_back(item);
+		}
+		if (m_Mode == NoThinning) { m_nNbIn++; m_nNbOut++; }
+		return;
+	}
+	m_nNbIn++;
+	Item item = { point, X, Y, Z };
+	m_Tiles[TileKey(TileIndex(Index(Y)), TileIndex(Index(X)))].items.push_back(item);
+	m_nNbPending++;
+	if ((m_nNbPending >= m_nMaxPoint) && (!m_strTmpPrefix.empty()))
+		Spill();
+}
+
+//-----------------------------------------------------------------------------
+// Ecriture des points en memoire a la fin des fichiers temporaires des dalles
+//-----------------------------------------------------------------------------
+template<class T> void XLasThinner<T>::Spill()
+{
+	static_assert(std::is_trivially_copyable<T>::value, "XLasThinner : T doit pouvoir etre copie octet par octet");
+	for (auto iter = m_Tiles.begin(); iter != m_Tiles.end(); ++iter) {
+		Tile& tile = iter->second;
+		if (tile.items.size() == 0)
+			continue;
+		std::ofstream out(TileFilename(iter->first), std::ios::out | std::ios::binary | std::ios::app);
+		out.write((const char*)tile.items.data(), tile.items.size() * sizeof(Item));
+		if (!out.good())
+			m_bError = true;
+		tile.spilled = true;
+		std::vector<Item>().swap(tile.items);
+	}
+	m_nNbPending = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Traitement de la premiere dalle restante : les points sont relus, tries, puis GridMinZ garde
+// le point le plus bas de chaque cellule, VoxelCentroid remplace les points d'un voxel par leur
+// barycentre (attributs du premier point) et Poisson applique la contrainte de distance
+//-----------------------------------------------------------------------------
+template<class T> bool XLasThinner<T>::FlushTile(std::vector<Item>& out)
+{
+	if (m_Tiles.empty())
+		return false;
+	auto first = m_Tiles.begin();
+	TileKey tile_key = first->first;
+	std::vector<Item> items;
+	items.swap(first->second.items);
+	m_nNbPending -= items.size();
+	if (first->second.spilled) {
+		std::string filename = TileFilename(tile_key);
+		std::ifstream in(filename, std::ios::in | std::ios::binary | std::ios::ate);
+		size_t nb = in.good() ? (size_t)in.tellg() / sizeof(Item) : 0, nb_mem = items.size();
+		items.resize(nb_mem + nb);
+		in.seekg(0);
+		in.read((char*)&items[nb_mem], nb * sizeof(Item));
+		if (!in.good())
+			m_bError = true;
+		in.close();
+		std::remove(filename.c_str());
+	}
+	m_Tiles.erase(first);
+	std::sort(items.begin(), items.end(), Less);
+
+	if (m_Mode == Poisson) {
+		auto last = m_DiskRows.lower_bound(tile_key.first - 1);	// Lignes de dalles qui ne seront plus voisines
+		for (auto iter = m_DiskRows.begin(); iter != last; ++iter)
+			for (size_t i = 0; i < iter->second.size(); i++)
+				m_Disk.erase(iter->second[i]);
+		m_DiskRows.erase(m_DiskRows.begin(), last);
+		for (size_t i = 0; i < items.size(); i++) {
+			if (!KeepPoisson(items[i].X, items[i].Y, items[i].Z, tile_key.first))
+				continue;
+			out.push_back(items[i]);
+			m_nNbOut++;
+		}
+		return true;
+	}
+
+	std::vector<Cell> cells;	// Dans l'ordre de premiere occurrence
+	std::unordered_map<uint64_t, size_t> index;
+	for (size_t i = 0; i < items.size(); i++) {
+		const Item& P = items[i];
+		uint64_t key = Key(Index(P.X), Index(P.Y), (m_Mode == VoxelCentroid) ? Index(P.Z) : 0);
+		auto iter = index.find(key);
+		if (iter == index.end()) {
+			index[key] = cells.size();
+			Cell cell = { P.point, P.X, P.Y, P.Z, 1 };
+			cells.push_back(cell);
+			continue;
+		}
+		Cell& cell = cells[iter->second];
+		if (m_Mode == GridMinZ) {
+			if (P.Z < cell.Z) {
+				cell.point = P.point;
+				cell.X = P.X; cell.Y = P.Y; cell.Z = P.Z;
+			}
+			continue;
+		}
+		cell.X += P.X; cell.Y += P.Y; cell.Z += P.Z;
+		cell.count++;
+	}
+	for (size_t i = 0; i < cells.size(); i++) {
+		const Cell& cell = cells[i];
+		Item item = { cell.point, cell.X / cell.count, cell.Y / cell.count, cell.Z / cell.count };
+		out.push_back(item);
+	}
+	m_nNbOut += cells.size();
+	return true;
+}
 
-#endif //XLASFILE_H
\ No newline at end of file
+#endif //XLASFILE_H
@@ -12,52 +12,115 @@
 #include "XDtmShader.h"
 #include <cmath>
 #include <cstring>
+#include <thread>
 
-// Preferences d'affichage
-int XDtmShader::m_Mode = XDtmShader::Shading;
-double XDtmShader::m_dIsoStep = 25.;
-double XDtmShader::m_dSolarAzimuth = 135.;
-double XDtmShader::m_dSolarZenith = 45.;
-std::vector<double> XDtmShader::m_Z;
-std::vector<XARGBColor> XDtmShader::m_Color;
+//==============================================================================
+// Parametres par defaut
+//==============================================================================
+XDtmShader::Param::Param()
+{
+  Mode = XDtmShader::Shading;
+  IsoStep = 25.;
+  SolarAzimuth = 135.;
+  SolarZenith = 45.;
+  GSD = 25.;
+  Z.push_back(-999.); // No data
+  Z.push_back(0.);
+  Z.push_back(200.);
+  Z.push_back(400.);
+  Z.push_back(600.);
+  Z.push_back(5500.);
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)0, (uint8_t)0));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)3, (uint8_t)34, (uint8_t)76));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)64, (uint8_t)128, (uint8_t)128));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)255, (uint8_t)0));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)128, (uint8_t)0));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)128, (uint8_t)64, (uint8_t)0));
+  Color.push_back(XARGBColor((uint8_t)255, (uint8_t)240, (uint8_t)240, (uint8_t)240));
+}
 
 //==============================================================================
-// Constructeur
+// Constructeurs
 //==============================================================================
+XDtmShader::XDtmShader(const Param& param, bool bgrOrder, bool alphaMode) : m_Param(param)
+{
+  m_bBGRorder = bgrOrder;
+  m_bAlphaMode = alphaMode;
+  Prepare();
+}
+
 XDtmShader::XDtmShader(double gsd,  bool bgrOrder, bool alphaMode)
 {
-  m_dGSD = gsd;
+  m_Param.GSD = gsd;
   m_bBGRorder = bgrOrder;
   m_bAlphaMode = alphaMode;
-  if (m_Z.size() < 1) { // Premier shader : on initialise
-    m_Z.push_back(-999.); // No data
-    m_Z.push_back(0.);
-    m_Z.push_back(200.);
-    m_Z.push_back(400.);
-    m_Z.push_back(600.);
-    m_Z.push_back(5500.);
-    m_Color.clear();
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)0, (uint8_t)0));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)3, (uint8_t)34, (uint8_t)76));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)64, (uint8_t)128, (uint8_t)128));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)255, (uint8_t)0));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)255, (uint8_t)128, (uint8_t)0));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)128, (uint8_t)64, (uint8_t)0));
-    m_Color.push_back(XARGBColor((uint8_t)255, (uint8_t)240, (uint8_t)240, (uint8_t)240));
+  Prepare();
+}
+
+//-----------------------------------------------------------------------------
+// Direction de la lumiere en representation cartesienne et carre de sa norme
+//-----------------------------------------------------------------------------
+static void DirectionLumiere(float angleH, float angleV, double* dirLum)
+{
+  dirLum[0] = cos(XPI / 180 * angleV * -1) * sin(XPI / 180 * angleH);
+  dirLum[1] = cos(XPI / 180 * angleV * -1) * cos(XPI / 180 * angleH);
+  dirLum[2] = sin(XPI / 180 * angleV * -1);
+  dirLum[3] = (dirLum[0] * dirLum[0]) + (dirLum[1] * dirLum[1]) + (dirLum[2] * dirLum[2]);
+}
+
+//-----------------------------------------------------------------------------
+// Arrondi identique a round() (demi-entiers eloignes de zero), sans appel a la libm
+//-----------------------------------------------------------------------------
+static inline double Arrondi(double x)
+{
+  double y = fabs(x);
+  if (y >= 4503599627370496.)  // 2^52 : x est deja entier
+    return x;
+  double t = (double)(int64_t)y;
+  t += ((y - t) >= 0.5) ? 1. : 0.;
+  return (x < 0.) ? -t : t;
+}
+
+//-----------------------------------------------------------------------------
+// Parametres constants pour tout le calcul : pas terrain, directions de la lumiere
+// et composantes des couleurs
+//-----------------------------------------------------------------------------
+void XDtmShader::Prepare()
+{
+  m_dDelta = m_Param.GSD;
+  if (m_Param.GSD <= 0.)
+    m_dDelta = 25.;
+  if ((m_Param.GSD > 0.) && (m_Param.GSD < 0.1))    // Donnees en geographiques
+    m_dDelta = m_Param.GSD * 111319.49;  // 1 degre a l'Equateur
+
+  float angleH = (float)m_Param.SolarAzimuth, angleV = (float)m_Param.SolarZenith;
+  if (m_Param.Mode == Shading) {
+    angleH = 135.; angleV = 45.;
+  }
+  if (m_Param.Mode == Light_Shading) {
+    angleH = 135.; angleV = 65.;
+  }
+  DirectionLumiere(angleH, angleV, m_DirLum);
+  DirectionLumiere(135.f, 45.f, m_DirLumDefaut);
+
+  // Une couleur par plage plus celle du dessus : les couleurs manquantes sont transparentes
+  m_RGBA.assign(XMax(m_Param.Color.size(), m_Param.Z.size() + 1) * 4, 0.);
+  for (size_t i = 0; i < m_Param.Color.size(); i++) {
+    m_RGBA[4 * i] = m_Param.Color[i].R();
+    m_RGBA[4 * i + 1] = m_Param.Color[i].G();
+    m_RGBA[4 * i + 2] = m_Param.Color[i].B();
+    m_RGBA[4 * i + 3] = m_Param.Color[i].A();
   }
 }
 
 //-----------------------------------------------------------------------------
 // Fonction d'estompage d'un pixel  partir de l'altitude du pixel, de l'altitude du pixel juste au dessus,
 // de l'altitude du pixel juste  sa droite
+// dirLum : direction de la lumiere et carre de sa norme, calcules par Prepare
 //-----------------------------------------------------------------------------
-double XDtmShader::CoefEstompage(float altC, float altH, float altD, float angleH, float angleV)
+double XDtmShader::CoefEstompage(float altC, float altH, float altD, const double* dirLum) const
 {
-  double deltaX = m_dGSD, deltaY = m_dGSD; // angleH = 135, angleV = 45;
-  if (m_dGSD <= 0.)
-    deltaX = deltaY = 25.;
-  if ((m_dGSD > 0.) && (m_dGSD < 0.1))    // Donnees en geographiques
-    deltaX = deltaY = m_dGSD * 111319.49;  // 1 degre a l'Equateur
+  double deltaX = m_dDelta, deltaY = m_dDelta;
 
   // Recherche de la direction de la normale a la surface du mnt
   double dY[3], dX[3], normale[3];
@@ -79,24 +142,16 @@ double XDtmShader::CoefEstompage(float altC, float altH, float altD, float angle
   // Determination de l'angle entre la normale et la direction de la lumire
   // Modification des teintes en fonction de cet angle
   double correction;
-  double DirLum[3];
-
-  // Passage d'une reprsentation angulaire de la direction de la lumiere en reprsentation cartsienne
-  DirLum[0] = cos(XPI / 180 * angleV * -1) * sin(XPI / 180 * angleH);
-  DirLum[1] = cos(XPI / 180 * angleV * -1) * cos(XPI / 180 * angleH);
-  DirLum[2] = sin(XPI / 180 * angleV * -1);
 
   // Correction correspond au cosinus entre la normale et la lumiere
   double scalaire;
-  scalaire = (normale[0] * DirLum[0]) + (normale[1] * DirLum[1]) + (normale[2] * DirLum[2]);
+  scalaire = (normale[0] * dirLum[0]) + (normale[1] * dirLum[1]) + (normale[2] * dirLum[2]);
 
   double normenormale;
-  double normeDirLum;
   normenormale = (normale[0] * normale[0]) + (normale[1] * normale[1]) + (normale[2] * normale[2]);
 
-  normeDirLum = (DirLum[0] * DirLum[0]) + (DirLum[1] * DirLum[1]) + (DirLum[2] * DirLum[2]);
-  if (normenormale * normeDirLum > 0)
-    correction = scalaire / sqrt(normenormale * normeDirLum);
+  if (normenormale * dirLum[3] > 0)
+    correction = scalaire / sqrt(normenormale * dirLum[3]);
   else correction = 0;
 
   // Traduction de cette correction en correction finale
@@ -110,9 +165,9 @@ double XDtmShader::CoefEstompage(float altC, float altH, float altD, float angle
 //-----------------------------------------------------------------------------
 // Calcul de la pente
 //-----------------------------------------------------------------------------
-double XDtmShader::CoefPente(float altC, float altH, float altD)
+double XDtmShader::CoefPente(float altC, float altH, float altD) const
 {
-  double d = m_dGSD;
+  double d = m_Param.GSD;
   if (d <= 0.) d = 25;
   double costheta = d / sqrt((altD - altC) * (altD - altC) + (altH - altC) * (altH - altC) + d * d);
   return costheta;
@@ -121,13 +176,13 @@ double XDtmShader::CoefPente(float altC, float altH, float altD)
 //-----------------------------------------------------------------------------
 // Indique si l'on a une isohypse
 //-----------------------------------------------------------------------------
-int XDtmShader::Isohypse(float altC, float altH, float altD)
+int XDtmShader::Isohypse(float altC, float altH, float altD) const
 {
-  double step = m_dIsoStep;
+  double step = m_Param.IsoStep;
   int nb_isoC = (int)ceil(altC / step);
   int nb_isoH = (int)ceil(altH / step);
   int nb_isoD = (int)ceil(altD / step);
-  int nb_iso = XRint(altC / step);
+  int nb_iso = (int)Arrondi(altC / step);
 
   if (nb_isoC != nb_isoH)
     return nb_iso;
@@ -139,63 +194,62 @@ int XDtmShader::Isohypse(float altC, float altH, float altD)
 
 //-----------------------------------------------------------------------------
 // Calcul de l'estompage sur une ligne
+// lineR : ligne precedente, lineS : ligne courante, lineT : ligne suivante, num : numero de la ligne
 //-----------------------------------------------------------------------------
-bool XDtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W, uint8_t* rgba, uint32_t num)
+bool XDtmShader::EstompLine(const float* lineR, const float* lineS, const float* lineT, uint32_t W, uint8_t* rgba, uint32_t num) const
 {
-  float* ptr = lineS;
+  if ((m_Param.Z.size() < 2) || (m_Param.Color.size() < 1))
+    return false;
+  const float* ptr = lineS;
   double coef = 1., r, g, b, a;
   float val;
   int index = 0, nb_iso;
-  uint32_t nbByte = 3;
-  if (m_bAlphaMode) nbByte = 4;
-  float angleH = (float)m_dSolarAzimuth, angleV = (float)m_dSolarZenith;
-  if (m_Mode == Shading) {
-    angleH = 135.; angleV = 45.;
-  }
-  if (m_Mode == Light_Shading) {
-    angleH = 135.; angleV = 65.;
-  }
+  uint32_t nbByte = NbByte();
+  const double* col = m_RGBA.data();
+  const double* Z = m_Param.Z.data();
+  const int nbZ = (int)m_Param.Z.size();
+  const int mode = m_Param.Mode;
+  XARGBColor noData = m_Param.Color[0], pix_col;
 
   for (uint32_t i = 0; i < W; i++) {
     val = *ptr;
     r = g = b = a = 255;
-    XARGBColor pix_col = m_Color[0];
     uint8_t* ptr_rgb = &rgba[nbByte * i];
 
-    if (val <= m_Z[0]) { // No data
-      pix_col.Copy(ptr_rgb, m_bBGRorder, m_bAlphaMode);
+    if (val <= Z[0]) { // No data
+      noData.Copy(ptr_rgb, m_bBGRorder, m_bAlphaMode);
       ptr++;
       continue;
     }
-    if (val <= m_Z[1]) { // Sous la mer
-      coef = (m_Z[1] - val);
+    if (val <= Z[1]) { // Sous la mer
+      coef = (Z[1] - val);
       index = 1;
-      r = m_Color[index].R();
-      g = m_Color[index].G();
-      b = m_Color[index].B();
-      a = m_Color[index].A();
+      r = col[4];
+      g = col[5];
+      b = col[6];
+      a = col[7];
     }
 
-    for (int j = 2; j < m_Z.size(); j++) {
-      if ((val > m_Z[j - 1]) && (val <= m_Z[j])) {
-        coef = (m_Z[j] - val) / (m_Z[j] - m_Z[j-1]);
+    for (int j = 2; j < nbZ; j++) {
+      if ((val > Z[j - 1]) && (val <= Z[j])) {
+        coef = (Z[j] - val) / (Z[j] - Z[j-1]);
         index = j;
-        r = m_Color[j].R() * coef + m_Color[j+1].R() * (1 - coef);
-        g = m_Color[j].G() * coef + m_Color[j+1].G() * (1 - coef);
-        b = m_Color[j].B() * coef + m_Color[j+1].B() * (1 - coef);
-        a = m_Color[j].A() * coef + m_Color[j+1].A() * (1 - coef);
+        r = col[4 * j] * coef + col[4 * (j + 1)] * (1 - coef);
+        g = col[4 * j + 1] * coef + col[4 * (j + 1) + 1] * (1 - coef);
+        b = col[4 * j + 2] * coef + col[4 * (j + 1) + 2] * (1 - coef);
+        a = col[4 * j + 3] * coef + col[4 * (j + 1) + 3] * (1 - coef);
       }
     }
 
-    if (val > m_Z[m_Z.size() - 1]) {
-      index = (int)m_Z.size();
-      r = m_Color[index].R();
-      g = m_Color[index].G();
-      b = m_Color[index].B();
-      a = m_Color[index].A();
+    if (val > Z[nbZ - 1]) {
+      index = nbZ;
+      r = col[4 * index];
+      g = col[4 * index + 1];
+      b = col[4 * index + 2];
+      a = col[4 * index + 3];
     }
 
-    switch (m_Mode) {
+    switch (mode) {
     case Altitude: coef = 1.;
       break;
 
@@ -204,15 +258,15 @@ bool XDtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W
     case Free_Shading: // Estompage Libre
       if (num == 0) {
         if (i < (W - 1))
-          coef = CoefEstompage(lineT[i], val, lineT[i + 1], angleH, angleV);
+          coef = CoefEstompage(lineT[i], val, lineT[i + 1], m_DirLum);
         else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, angleH, angleV);
+          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, m_DirLum);
       }
       else {
         if (i < (W - 1))
-          coef = CoefEstompage(val, lineR[i], lineS[i + 1], angleH, angleV);
+          coef = CoefEstompage(val, lineR[i], lineS[i + 1], m_DirLum);
         else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, angleH, angleV);
+          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, m_DirLum);
       }
       break;
 
@@ -233,30 +287,30 @@ bool XDtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W
 
     case Colour: // Aplat de couleurs
       coef = 1.;
-      r = m_Color[index].R();
-      g = m_Color[index].G();
-      b = m_Color[index].B();
-      a = m_Color[index].A();
+      r = col[4 * index];
+      g = col[4 * index + 1];
+      b = col[4 * index + 2];
+      a = col[4 * index + 3];
       break;
 
     case Shading_Colour: // Aplat + estompage
       if (num == 0) {
         if (i < (W - 1))
-          coef = CoefEstompage(lineT[i], val, lineT[i + 1]);
+          coef = CoefEstompage(lineT[i], val, lineT[i + 1], m_DirLumDefaut);
         else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val);
+          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, m_DirLumDefaut);
       }
       else {
         if (i < (W - 1))
-          coef = CoefEstompage(val, lineR[i], lineS[i + 1]);
+          coef = CoefEstompage(val, lineR[i], lineS[i + 1], m_DirLumDefaut);
         else
-          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val);
+          coef = CoefEstompage(lineS[i - 1], lineR[i - 1], val, m_DirLumDefaut);
       }
       if (index > 0) {
-        r = m_Color[index].R();
-        g = m_Color[index].G();
-        b = m_Color[index].B();
-        a = m_Color[index].A();
+        r = col[4 * index];
+        g = col[4 * index + 1];
+        b = col[4 * index + 2];
+        a = col[4 * index + 3];
       }
       break;
 
@@ -277,22 +331,22 @@ bool XDtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W
       }
 
       if (nb_iso > -9999) {
-        double cote = nb_iso * m_dIsoStep;
-        for (int j = 0; j < m_Z.size(); j++) {
+        double cote = nb_iso * m_Param.IsoStep;
+        for (int j = 0; j < nbZ; j++) {
           index = j;
-          if (cote < m_Z[j])
+          if (cote < Z[j])
             break;
         }
-        r = m_Color[index].R();
-        g = m_Color[index].G();
-        b = m_Color[index].B();
-        a = m_Color[index].A();
+        r = col[4 * index];
+        g = col[4 * index + 1];
+        b = col[4 * index + 2];
+        a = col[4 * index + 3];
       }
       break;
 
     }
 
-    pix_col = XARGBColor(round(a), round(r* coef), round(g* coef), round(b* coef));
+    pix_col = XARGBColor((uint8_t)Arrondi(a), (uint8_t)Arrondi(r * coef), (uint8_t)Arrondi(g * coef), (uint8_t)Arrondi(b * coef));
     pix_col.Copy(ptr_rgb, m_bBGRorder, m_bAlphaMode);
     ptr++;
   }
@@ -301,18 +355,83 @@ bool XDtmShader::EstompLine(float* lineR, float* lineS, float* lineT, uint32_t W
 }
 
 //-----------------------------------------------------------------------------
-// Calcul de l'estompage
+// Repartition des lignes [first; last[ en bandes contigues sur nbThread threads
 //-----------------------------------------------------------------------------
-bool XDtmShader::ConvertArea(float* area, uint32_t w, uint32_t h, uint8_t* rgb, uint32_t area_off, uint32_t rgb_off)
+static void ParallelLines(uint32_t first, uint32_t last, int nbThread, const std::function<void(uint32_t, uint32_t)>& f)
 {
-  uint32_t areaW = w, rgbW = w * 3L + rgb_off;
-  if (m_bAlphaMode)
-    rgbW = w * 4L + rgb_off;
+  if (nbThread < 1)
+    nbThread = XMax((int)std::thread::hardware_concurrency(), 1);
+  uint32_t nb = last - first;
+  nbThread = (int)XMin((uint32_t)nbThread, XMax(nb / 64, (uint32_t)1));  // Au moins 64 lignes par bande
+  uint32_t nbLine = (nb + nbThread - 1) / nbThread;
+  std::vector<std::thread> threads;
+  for (int i = 1; i < nbThread; i++)
+    threads.emplace_back(f, first + XMin(i * nbLine, nb), first + XMin((i + 1) * nbLine, nb));
+  f(first, first + XMin(nbLine, nb));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
 
-  EstompLine(area, area, &area[areaW], w, rgb, 0);
-  for (uint32_t i = 1; i < h - 1; i++) {
-    EstompLine(&area[(i - 1) * areaW], &area[i * areaW], &area[(i + 1) * areaW], w, &rgb[i * rgbW], i);
+//-----------------------------------------------------------------------------
+// Calcul de l'estompage d'une zone en memoire
+// area_off : nombre de flottants en fin de ligne de area, rgb_off : nombre d'octets en fin de ligne de rgb
+//-----------------------------------------------------------------------------
+bool XDtmShader::ConvertArea(float* area, uint32_t w, uint32_t h, uint8_t* rgb, uint32_t area_off, uint32_t rgb_off,
+                             int nbThread) const
+{
+  if ((w == 0) || (h == 0))
+    return false;
+  size_t areaW = (size_t)w + area_off, rgbW = (size_t)w * NbByte() + rgb_off;
+  ParallelLines(0, h, nbThread, [&](uint32_t first, uint32_t last) {
+    for (uint32_t i = first; i < last; i++) {
+      uint32_t prev = (i > 0) ? i - 1 : 0, next = XMin(i + 1, h - 1);
+      EstompLine(&area[prev * areaW], &area[i * areaW], &area[next * areaW], w, &rgb[i * rgbW], i);
+    }
+  });
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Calcul de l'estompage en flux : les lignes du MNT sont lues par bandes de nbLine lignes,
+// seules une bande de MNT (plus une ligne de chaque cote) et une bande de pixels
+// sont en memoire. Les lignes de pixels sont ecrites dans l'ordre.
+//-----------------------------------------------------------------------------
+bool XDtmShader::ConvertStream(uint32_t w, uint32_t h, LineReader reader, LineWriter writer, uint32_t nbLine,
+                               int nbThread) const
+{
+  if ((w == 0) || (h == 0) || (nbLine == 0))
+    return false;
+  std::vector<float> area((size_t)(nbLine + 2) * w);
+  std::vector<uint8_t> rgb((size_t)nbLine * w * NbByte());
+  uint32_t bufFirst = 0, bufCount = 0;  // Lignes du MNT presentes dans area
+
+  for (uint32_t r0 = 0; r0 < h; r0 += nbLine) {
+    uint32_t r1 = XMin(r0 + nbLine, h);   // Bande [r0; r1[
+    uint32_t first = (r0 > 0) ? r0 - 1 : 0, last = XMin(r1, h - 1);
+    // Les lignes deja lues sont ramenees en debut de buffer, les autres sont lues
+    for (uint32_t k = first; k <= last; k++) {
+      float* dst = &area[(size_t)(k - first) * w];
+      if ((k >= bufFirst) && (k < bufFirst + bufCount)) {
+        if (k != first + (k - bufFirst))
+          ::memmove(dst, &area[(size_t)(k - bufFirst) * w], w * sizeof(float));
+        continue;
+      }
+      if (!reader(k, dst))
+        return false;
+    }
+    bufFirst = first;
+    bufCount = last - first + 1;
+
+    ParallelLines(r0, r1, nbThread, [&](uint32_t a, uint32_t b) {
+      for (uint32_t i = a; i < b; i++) {
+        uint32_t prev = (i > 0) ? i - 1 : 0, next = XMin(i + 1, h - 1);
+        EstompLine(&area[(size_t)(prev - first) * w], &area[(size_t)(i - first) * w], &area[(size_t)(next - first) * w],
+                   w, &rgb[(size_t)(i - r0) * w * NbByte()], i);
+      }
+    });
+    for (uint32_t i = r0; i < r1; i++)
+      if (!writer(i, &rgb[(size_t)(i - r0) * w * NbByte()]))
+        return false;
   }
-  EstompLine(&area[(h - 2) * areaW], &area[(h - 1) * areaW], &area[(h - 1) * areaW], w, &rgb[(h-1) * rgbW], h-1);
   return true;
 }
@@ -13,6 +13,7 @@
 #define XDTMSHADER_H
 
 #include <vector>
+#include <functional>
 #include "../XTool/XBase.h"
 #include "../XToolAlgo/XColor.h"
 
@@ -20,27 +21,49 @@ class XDtmShader {
 public :
   enum ShaderMode { Altitude = 0, Shading, Light_Shading, Free_Shading, Slope, Colour, Shading_Colour, Contour};
 
-protected:
-  double CoefEstompage(float altC, float altH, float altD, float angleH = 135., float angleV = 45.);
-  double CoefPente(float altC, float altH, float altD);
-  int Isohypse(float altC, float altH, float altD);
+  // Parametres du shader : chaque shader en garde une copie, il n'y a pas d'etat global
+  struct Param {
+    std::vector<double> Z;            // Plages d'altitude
+    std::vector<XARGBColor> Color;    // Plages de couleur (Z.size() + 1 couleurs)
+    int    Mode;                      // Mode d'affichage
+    double IsoStep;                   // Pas des isohypses
+    double SolarAzimuth;              // Angle azimuthal en degres
+    double SolarZenith;               // Angle zenithal en degres
+    double GSD;                       // Pas terrain du MNT
+    Param();
+  };
 
-  bool EstompLine(float* lineR, float* lineS, float* lineT, uint32_t w, uint8_t* rgb, uint32_t num);
+  // Lecture d'une ligne du MNT / ecriture d'une ligne de pixels pour ConvertStream
+  typedef std::function<bool(uint32_t num, float* line)> LineReader;
+  typedef std::function<bool(uint32_t num, const uint8_t* pixels)> LineWriter;
 
-  double  m_dGSD;       // Pas terrain du MNT
+protected:
+  Param   m_Param;
+  double  m_dDelta;           // Pas terrain utilise pour les normales
+  double  m_DirLum[4];        // Direction de la lumiere et carre de sa norme, selon le mode
+  double  m_DirLumDefaut[4];  // Direction de la lumiere par defaut (135, 45)
+  std::vector<double> m_RGBA; // Composantes des couleurs, 4 par couleur
   bool    m_bBGRorder;  // Ordre BGR
   bool    m_bAlphaMode; // Pixel avec 4 composants
 
-public:
-  static std::vector<double> m_Z;           // Plages d'altitude
-  static std::vector<XARGBColor> m_Color;   // Plages de couleur
-  static int    m_Mode;           // Mode d'affichage
-  static double m_dIsoStep;       // Pas des isohypses
-  static double m_dSolarAzimuth;  // Angle azimuthal en degres
-  static double m_dSolarZenith;   // Angle zenithal en degres
+  void Prepare();
+  double CoefEstompage(float altC, float altH, float altD, const double* dirLum) const;
+  double CoefPente(float altC, float altH, float altD) const;
+  int Isohypse(float altC, float altH, float altD) const;
 
+public:
+  XDtmShader(const Param& param, bool bgrOrder = false, bool alphaMode = false);
   XDtmShader(double gsd = 25., bool bgrOrder = false, bool alphaMode = false);
-  bool ConvertArea(float* area, uint32_t w, uint32_t h, uint8_t* rgb, uint32_t area_off = 0, uint32_t rgb_off = 0);
+
+  const Param& GetParam() const { return m_Param; }
+  uint32_t NbByte() const { return m_bAlphaMode ? 4 : 3; }
+
+  // Le shader n'est pas modifie par le calcul : un meme shader peut etre utilise par plusieurs threads
+  bool EstompLine(const float* lineR, const float* lineS, const float* lineT, uint32_t w, uint8_t* rgb, uint32_t num) const;
+  bool ConvertArea(float* area, uint32_t w, uint32_t h, uint8_t* rgb, uint32_t area_off = 0, uint32_t rgb_off = 0,
+                   int nbThread = 1) const;
+  bool ConvertStream(uint32_t w, uint32_t h, LineReader reader, LineWriter writer, uint32_t nbLine = 256,
+                     int nbThread = 0) const;
 };
 
 #endif // XDTMSHADER_H
@@ -63,3 +63,31 @@ bool XPredictor::Decode(uint8_t* Pix, uint32_t W, uint32_t H, uint32_t pixSize,
   }
   return false;
 }
+
+//-----------------------------------------------------------------------------
+// Codage : operation inverse de Decode
+// Seul PREDICTOR_FLOATINGPOINT sur des flottants 32 bits est gere en plus de l'absence de predicteur
+//-----------------------------------------------------------------------------
+bool XPredictor::Encode(uint8_t* Pix, uint32_t W, uint32_t H, uint32_t pixSize, uint32_t nbBits, uint32_t num_algo)
+{
+  if (num_algo == 1) return true;
+  if ((num_algo == 3) && (nbBits == 32) && (pixSize == 4)) { // PREDICTOR_FLOATINGPOINT
+    uint32_t lineW = W * pixSize;
+    uint8_t* buf = new uint8_t[lineW];
+    for (uint32_t i = 0; i < H; i++) {
+      uint8_t* line = &Pix[i * lineW];
+      for (uint32_t j = 0; j < W; j++) {  // Octets de poids fort en premier
+        buf[j] = line[4 * j + 3];
+        buf[W + j] = line[4 * j + 2];
+        buf[2 * W + j] = line[4 * j + 1];
+        buf[3 * W + j] = line[4 * j];
+      }
+      for (uint32_t j = lineW - 1; j > 0; j--)
+        buf[j] -= buf[j - 1];
+      std::memcpy(line, buf, lineW);
+    }
+    delete[] buf;
+    return true;
+  }
+  return false;
+}
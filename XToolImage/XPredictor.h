@@ -17,6 +17,7 @@ public:
   XPredictor() {;}
 
   bool Decode(uint8_t* Pix, uint32_t W, uint32_t H, uint32_t pixSize, uint32_t nbBits, uint32_t num_algo);
+  bool Encode(uint8_t* Pix, uint32_t W, uint32_t H, uint32_t pixSize, uint32_t nbBits, uint32_t num_algo);
 };
 
 #endif // XPREDICTOR_H
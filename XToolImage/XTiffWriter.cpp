@@ -8,6 +8,8 @@
 //-----------------------------------------------------------------------------
 
 #include "XTiffWriter.h"
+#include "XZlibCodec.h"
+#include "XPredictor.h"
 
 
 //-----------------------------------------------------------------------------
@@ -216,19 +218,81 @@ bool XTiffWriter::Write(const char* filename, uint32_t w, uint32_t h, uint16_t n
 }
 
 //-----------------------------------------------------------------------------
-// Ecriture de l'entete Tiff en image dallee
+// Ecriture d'une image dallee non compressee
 //-----------------------------------------------------------------------------
 bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint16_t nbSample,
 														uint16_t nbBits, uint8_t* buf, uint16_t format, uint32_t tileW, uint32_t tileH)
 {
+	if (!BeginTiled(filename, w, h, nbSample, nbBits, format, tileW, tileH))
+		return false;
+	if (buf != NULL) {
+		uint32_t bytecount = tileH * tileW * nbSample * (nbBits / 8);
+		for (uint32_t i = 0; i < NbTile(); i++)
+			if (!WriteTile(i, &buf[(size_t)i * bytecount]))
+				return false;
+	}
+	return EndTiled();
+}
+
+//-----------------------------------------------------------------------------
+// Ecriture de l'entete Tiff en image dallee
+// Les dalles sont ensuite ecrites dans n'importe quel ordre par WriteTile ou WriteEncodedTile,
+// les tableaux TileOffsets et TileByteCounts sont remplis par EndTiled
+// compression : 1 (aucune) ou 8 (Deflate), predictor : 1 (aucun) ou 3 (flottant)
+//-----------------------------------------------------------------------------
+bool XTiffWriter::BeginTiled(const char* filename, uint32_t w, uint32_t h, uint16_t nbSample, uint16_t nbBits,
+														 uint16_t format, uint32_t tileW, uint32_t tileH, uint16_t compression, uint16_t predictor)
+{
+	if ((compression != 1) && (compression != 8))
+		return XErrorError(m_Error, "XTiffWriter::BeginTiled", XError::eUnsupported);
+	if ((predictor == 3) && ((nbBits != 32) || (nbSample != 1)))
+		return XErrorError(m_Error, "XTiffWriter::BeginTiled", XError::eUnsupported);
 	m_Out.open(filename, std::ios::out | std::ios::binary);
 	if (!m_Out.good())
 		return XErrorError(m_Error, "Impossible de creer le fichier Tiff", XError::eIOOpen);
+	m_nTileW = tileW;
+	m_nTileH = tileH;
+	m_nTileNbSample = nbSample;
+	m_nTileNbBits = nbBits;
+	m_nTileFormat = format;
+	m_nCompression = compression;
+	m_nPredictor = predictor;
+	m_Levels.clear();
 
 	WriteHeader();
+	return WriteTiledIFD(w, h, false);
+}
 
+//-----------------------------------------------------------------------------
+// Ajout d'une sous-resolution : un IFD chaine au precedent, comme dans un COG
+// Les IFD sont ainsi tous en tete de fichier, avant les dalles
+//-----------------------------------------------------------------------------
+bool XTiffWriter::AddSubResolution(uint32_t w, uint32_t h)
+{
+	if (m_Levels.size() < 1)
+		return XErrorError(m_Error, "XTiffWriter::AddSubResolution", XError::eBadData);
+	for (size_t i = 0; i < m_Levels.size(); i++)
+		for (size_t j = 0; j < m_Levels[i].Counts.size(); j++)
+			if (m_Levels[i].Counts[j] > 0)  // Des dalles ont deja ete ecrites
+				return XErrorError(m_Error, "XTiffWriter::AddSubResolution", XError::eBadData);
+	m_Out.seekp(0, std::ios::end);
+	if ((m_Out.tellp() % 2) != 0)
+		m_Out.put(0);			// Les IFD commencent sur un mot
+	uint32_t pos = (uint32_t)m_Out.tellp();
+	m_Out.seekp(m_Levels.back().NextIFDPos, std::ios::beg);
+	m_Out.write((char*)&pos, sizeof(uint32_t));
+	m_Out.seekp(pos, std::ios::beg);
+	return WriteTiledIFD(w, h, true);
+}
+
+//-----------------------------------------------------------------------------
+// Ecriture d'un IFD d'image dallee a la position courante
+//-----------------------------------------------------------------------------
+bool XTiffWriter::WriteTiledIFD(uint32_t w, uint32_t h, bool subResolution)
+{
 	bool geotiff = false;
-	if (m_dGsd > 0) geotiff = true;
+	if ((m_dGsd > 0) && (!subResolution)) geotiff = true;
+	uint16_t nbSample = m_nTileNbSample, nbBits = m_nTileNbBits, format = m_nTileFormat;
 
 	uint16_t nbtag = 15;
 	if (geotiff) {
@@ -237,11 +301,12 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 	}
 	if (m_ColorMap != NULL) nbtag++;
 	if (format > 1) nbtag++;
+	if (m_nPredictor > 1) nbtag++;
 	m_Out.write((char*)&nbtag, sizeof(uint16_t));
 	uint32_t sizetag = 12L;
 	uint32_t offset = (uint32_t)m_Out.tellp() + nbtag * sizetag + sizeof(uint32_t);
 	// Ecriture des tags
-	WriteTag32(254, 0);			// NewSubfileType 
+	WriteTag32(254, subResolution ? 1 : 0);			// NewSubfileType : 1 pour une sous-resolution
 	WriteTag32(256, w);			// ImageWidth	
 	WriteTag32(257, h);			// ImageLength
 
@@ -252,7 +317,7 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 		offset += nbSample * sizeof(uint16_t);
 	}
 
-	WriteTag16(259, 1);			// Compression
+	WriteTag16(259, m_nCompression);			// Compression
 	// Photo. Interpretation
 	if (nbSample == 1) {
 		if (m_ColorMap != NULL)
@@ -272,20 +337,35 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 
 	WriteTag16(284, 1);			// PlanarConfiguration
 	WriteTag16(296, 3);			// ResolutionUnit
+	if (m_nPredictor > 1)
+		WriteTag16(317, m_nPredictor);	// Predictor
 
-	WriteTag32(322, tileW);	// TileWidth
-	WriteTag32(323, tileH);	// TileLength
+	WriteTag32(322, m_nTileW);	// TileWidth
+	WriteTag32(323, m_nTileH);	// TileLength
 
-	uint32_t nbTileW = w / tileW;
-	if ((w % tileW) != 0) nbTileW++;
-	uint32_t nbTileH = h / tileH;
-	if ((h % tileH) != 0) nbTileH++;
+	uint32_t nbTileW = w / m_nTileW;
+	if ((w % m_nTileW) != 0) nbTileW++;
+	uint32_t nbTileH = h / m_nTileH;
+	if ((h % m_nTileH) != 0) nbTileH++;
 	uint32_t nbTile = nbTileW * nbTileH;
+	m_Levels.push_back(TiledLevel());
+	TiledLevel& level = m_Levels.back();
+	level.Offsets.assign(nbTile, 0);
+	level.Counts.assign(nbTile, 0);
 
+	// Avec une seule dalle, les valeurs sont directement dans les tags
+	level.OffsetsPos = (uint32_t)m_Out.tellp() + 8;
 	WriteTag(324, LONG, nbTile, offset);				// TileOffsets
-	offset += nbTile * sizeof(uint32_t);
+	if (nbTile > 1) {
+		level.OffsetsPos = offset;
+		offset += nbTile * sizeof(uint32_t);
+	}
+	level.CountsPos = (uint32_t)m_Out.tellp() + 8;
 	WriteTag(325, LONG, nbTile, offset);				// TileByteCounts	
-	offset += nbTile * sizeof(uint32_t);
+	if (nbTile > 1) {
+		level.CountsPos = offset;
+		offset += nbTile * sizeof(uint32_t);
+	}
 
 	if (format > 1) {       // Format 1 : non-signe, 2 : signe, 3 : flottant, 4 : undefined
 		if (nbSample == 1)
@@ -314,6 +394,7 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 	}
 
 	uint32_t nextIFD = 0;
+	level.NextIFDPos = (uint32_t)m_Out.tellp();
 	m_Out.write((char*)&nextIFD, sizeof(uint32_t));
 
 	// Ecriture des tableaux de donnees
@@ -325,16 +406,11 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 	m_Out.write((char*)resol, 2 * sizeof(uint32_t));		// XResolution
 	m_Out.write((char*)resol, 2 * sizeof(uint32_t));		// YResolution
 
-	uint32_t bytecount = tileH * tileW * nbSample * (nbBits / 8);
-	for (uint32_t i = 0; i < nbTile; i++) {						// TileOffsets
-		m_Out.write((char*)&offset, sizeof(uint32_t));
-		offset += bytecount;
+	if (nbTile > 1) {	// TileOffsets et TileByteCounts, remplis par EndTiled
+		m_Out.write((char*)level.Offsets.data(), nbTile * sizeof(uint32_t));
+		m_Out.write((char*)level.Counts.data(), nbTile * sizeof(uint32_t));
 	}
 
-	for (uint32_t i = 0; i < nbTile; i++)						// TileByteCounts
-		m_Out.write((char*)&bytecount, sizeof(uint32_t));
-
-
 	if ((format > 1) && (nbSample > 1))
 		for (uint32_t i = 0; i < nbSample; i++)
 			m_Out.write((char*)&format, sizeof(uint16_t));	// Format
@@ -365,19 +441,79 @@ bool XTiffWriter::WriteTiled(const char* filename, uint32_t w, uint32_t h, uint1
 			// GTRasterTypeGeoKey : RasterPixelIsArea -> 1
 			geokey[0] = 1025; geokey[1] = 0; geokey[2] = 1; geokey[3] = 1;
 			m_Out.write((char*)geokey, 4 * sizeof(uint16_t));
-			//geokey[0] = 2054; geokey[1] = 0; geokey[2] =  1; geokey[3] =  9102;
-			//m_Out.write((char*)geokey, 4 * sizeof(uint16_t));
 			// ProjectedCSTypeGeoKey :
 			geokey[0] = 3072; geokey[1] = 0; geokey[2] = 1; geokey[3] = m_nEpsg;
 			m_Out.write((char*)geokey, 4 * sizeof(uint16_t));
-			//geokey[0] = 3076; geokey[1] = 0; geokey[2] =  1; geokey[3] =  9103;
-			//m_Out.write((char*)geokey, 4 * sizeof(uint16_t));
 		}
 	}
+	return m_Out.good();
+}
 
-	if (buf != NULL)
-		m_Out.write((char*)buf, nbTile * bytecount);
+//-----------------------------------------------------------------------------
+// Codage d'une dalle (predicteur puis compression). La dalle est modifiee par le predicteur
+// Cette methode ne modifie pas l'objet et peut etre appelee depuis plusieurs threads
+//-----------------------------------------------------------------------------
+bool XTiffWriter::EncodeTile(uint8_t* tile, std::vector<uint8_t>& out) const
+{
+	uint32_t pixSize = m_nTileNbSample * (m_nTileNbBits / 8);
+	uint32_t bytecount = m_nTileW * m_nTileH * pixSize;
+	if (m_nPredictor > 1) {
+		XPredictor predictor;
+		if (!predictor.Encode(tile, m_nTileW, m_nTileH, pixSize, m_nTileNbBits, m_nPredictor))
+			return false;
+	}
+	if (m_nCompression == 8) {
+		XZlibCodec codec;
+		return codec.Compress(tile, bytecount, out);
+	}
+	out.assign(tile, tile + bytecount);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Ecriture d'une dalle deja codee
+//-----------------------------------------------------------------------------
+bool XTiffWriter::WriteEncodedTile(uint32_t index, const std::vector<uint8_t>& data, uint32_t level)
+{
+	if ((level >= m_Levels.size()) || (index >= m_Levels[level].Offsets.size()))
+		return XErrorError(m_Error, "XTiffWriter::WriteEncodedTile", XError::eRange);
+	m_Out.seekp(0, std::ios::end);
+	uint64_t pos = (uint64_t)m_Out.tellp();
+	if (pos + data.size() > 0xFFFFFFFF)	// Tiff classique : offsets sur 32 bits
+		return XErrorError(m_Error, "XTiffWriter::WriteEncodedTile", XError::eIOWrite);
+	m_Levels[level].Offsets[index] = (uint32_t)pos;
+	m_Levels[level].Counts[index] = (uint32_t)data.size();
+	m_Out.write((char*)data.data(), data.size());
+	return m_Out.good();
+}
+
+//-----------------------------------------------------------------------------
+// Codage et ecriture d'une dalle
+//-----------------------------------------------------------------------------
+bool XTiffWriter::WriteTile(uint32_t index, uint8_t* tile, uint32_t level)
+{
+	std::vector<uint8_t> data;
+	if (!EncodeTile(tile, data))
+		return XErrorError(m_Error, "XTiffWriter::WriteTile", XError::eBadData);
+	return WriteEncodedTile(index, data, level);
+}
+
+//-----------------------------------------------------------------------------
+// Fin de l'ecriture d'une image dallee : mise a jour des offsets des dalles
+//-----------------------------------------------------------------------------
+bool XTiffWriter::EndTiled()
+{
+	for (size_t i = 0; i < m_Levels.size(); i++) {
+		m_Out.seekp(m_Levels[i].OffsetsPos, std::ios::beg);
+		m_Out.write((char*)m_Levels[i].Offsets.data(), m_Levels[i].Offsets.size() * sizeof(uint32_t));
+		m_Out.seekp(m_Levels[i].CountsPos, std::ios::beg);
+		m_Out.write((char*)m_Levels[i].Counts.data(), m_Levels[i].Counts.size() * sizeof(uint32_t));
+	}
+	bool flag = m_Out.good();
 	m_Out.close();
+	m_Levels.clear();
+	if (!flag)
+		return XErrorError(m_Error, "XTiffWriter::EndTiled", XError::eIOWrite);
 	return true;
 }
 
@@ -11,6 +11,7 @@
 #define _XTIFFWRITER_H
 
 #include <fstream>
+#include <vector>
 #include "../XTool/XBase.h"
 
 class XTiffWriter {
@@ -28,14 +29,27 @@ protected:
   uint16_t        m_nEpsg;
 	uint16_t*				m_ColorMap;
 
+	// Ecriture dallee en flux : un IFD par niveau, le premier en pleine resolution
+	struct TiledLevel {
+		uint32_t	OffsetsPos, CountsPos;	// Position des tableaux TileOffsets et TileByteCounts
+		uint32_t	NextIFDPos;							// Position du pointeur vers l'IFD suivant
+		std::vector<uint32_t> Offsets;
+		std::vector<uint32_t> Counts;
+	};
+	uint32_t				m_nTileW, m_nTileH;
+	uint16_t				m_nTileNbSample, m_nTileNbBits, m_nTileFormat, m_nCompression, m_nPredictor;
+	std::vector<TiledLevel> m_Levels;
+
 	uint16_t CheckByteOrder();
 	bool WriteHeader();
 	bool WriteTag(uint16_t id, uint16_t type, uint32_t count, uint32_t offset);
 	bool WriteTag16(uint16_t id, uint16_t value);
 	bool WriteTag32(uint16_t id, uint32_t value);
+	bool WriteTiledIFD(uint32_t w, uint32_t h, bool subResolution);
 
 public:
-	XTiffWriter(XError* error = NULL) { m_Error = error; m_dGsd = -1e38; m_dXmin = m_dYmax = 0.; m_nEpsg = 0; m_ColorMap = NULL; }
+	XTiffWriter(XError* error = NULL) { m_Error = error; m_dGsd = -1e38; m_dXmin = m_dYmax = 0.; m_nEpsg = 0; m_ColorMap = NULL;
+		m_nTileW = m_nTileH = 256; m_nTileNbSample = 1; m_nTileNbBits = 8; m_nTileFormat = 0; m_nCompression = m_nPredictor = 1; }
 	virtual ~XTiffWriter() { if (m_ColorMap != NULL) delete[] m_ColorMap;}
 
   void SetGeoTiff(double xmin, double ymax, double gsd, uint16_t epsg = 0)
@@ -47,6 +61,18 @@ public:
              uint16_t nbBits = 8, uint8_t* buf = NULL, uint16_t format = 0);
 	bool WriteTiled(const char* filename, uint32_t w, uint32_t h, uint16_t nbSample = 1,
 		uint16_t nbBits = 8, uint8_t* buf = NULL, uint16_t format = 0, uint32_t tileW = 256, uint32_t tileH = 256);
+
+	// Ecriture dallee en flux, avec compression Deflate optionnelle
+	bool BeginTiled(const char* filename, uint32_t w, uint32_t h, uint16_t nbSample = 1, uint16_t nbBits = 8, uint16_t format = 0,
+		uint32_t tileW = 256, uint32_t tileH = 256, uint16_t compression = 1, uint16_t predictor = 1);
+	// Sous-resolutions (niveaux 1, 2 ...) a declarer avant l'ecriture des dalles
+	bool AddSubResolution(uint32_t w, uint32_t h);
+	uint32_t NbLevel() const { return (uint32_t)m_Levels.size(); }
+	uint32_t NbTile(uint32_t level = 0) const { return (level < m_Levels.size()) ? (uint32_t)m_Levels[level].Offsets.size() : 0; }
+	bool EncodeTile(uint8_t* tile, std::vector<uint8_t>& out) const;
+	bool WriteEncodedTile(uint32_t index, const std::vector<uint8_t>& data, uint32_t level = 0);
+	bool WriteTile(uint32_t index, uint8_t* tile, uint32_t level = 0);
+	bool EndTiled();
 };
 
 
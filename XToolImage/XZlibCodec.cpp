@@ -37,4 +37,14 @@ bool XZlibCodec::Decompress(uint8_t* lzw, uint32_t size_in, uint8_t* out, uint32
   (void)inflateEnd(&strm);
 
   return true;
-}
\ No newline at end of file
+}
+
+bool XZlibCodec::Compress(const uint8_t* in, uint32_t size_in, std::vector<uint8_t>& out, int level)
+{
+  uLongf size_out = compressBound(size_in);
+  out.resize(size_out);
+  if (compress2(out.data(), &size_out, in, size_in, level) != Z_OK)
+    return false;
+  out.resize(size_out);
+  return true;
+}
@@ -10,6 +10,7 @@
 #ifndef XZLIBCODEC_H
 #define XZLIBCODEC_H
 
+#include <vector>
 #include "../XTool/XBase.h"
 
 class XZlibCodec {
@@ -18,6 +19,7 @@ public:
 	virtual ~XZlibCodec() { ; }
 
 	bool Decompress(uint8_t* lzw, uint32_t size_in, uint8_t* out, uint32_t size_out);
+	bool Compress(const uint8_t* in, uint32_t size_in, std::vector<uint8_t>& out, int level = 6);
 };
 
 #endif //XZLIBCODEC_H
\ No newline at end of file